@@ -0,0 +1,1192 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ *
+ * Microbenchmarks for the libval verification paths.
+ *
+ * Keys are generated once at startup and used to sign fixed RRsets, so
+ * every run exercises the same code paths with the same input sizes.
+ * Each case is run for a fixed wall-clock period and reported as
+ * ops/sec and ns/op.
+ *
+ * With -t, query throughput is timed instead, with each listed number
+ * of threads (or each doubling in a range, e.g. 1-16): first the libsres
+ * transaction path alone, each query sent and cancelled, then the
+ * synchronous val_resolve_and_check() path, then the same number of
+ * threads submitting requests concurrently to an async engine with that
+ * many workers. Scaling is the throughput against that of one thread.
+ * Every query is for a new name, so each one goes to the name server in
+ * the resolv.conf given with -r; point it at a fast local server.
+ *
+ * With -p, the cost of a res_poller_wait() wakeup is timed for each
+ * poller backend, with one or all of the given number of loopback
+ * sockets ready, and then query round trips through each backend to a
+ * stand-in server thread that answers every datagram on loopback.
+ */
+#include "validator-internal.h"
+
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <openssl/objects.h>
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#endif
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "val_support.h"
+#include "val_verify.h"
+#include "val_parse.h"
+#include "val_assertion.h"
+
+#define BENCH_OWNER      "\005bench\007example\003com"
+#define BENCH_SIGNER     "\007example\003com"
+#define BENCH_TTL        3600
+#define BENCH_MAX_KEY    1024
+#define BENCH_MAX_SIG    1024
+#define BENCH_DEF_MSEC   500
+
+static int      bench_msec = BENCH_DEF_MSEC;
+static const char *bench_filter = NULL;
+
+#define BENCH_MAX_THREADS   64
+#define BENCH_DEF_DOMAIN    "bench.example.com"
+#define BENCH_WINDOW        64      /* engine requests outstanding per thread */
+
+struct bench_key {
+    const char     *name;
+    u_char          alg;
+    int             bits;
+    u_char          dnskey[BENCH_MAX_KEY]; /* DNSKEY rdata */
+    size_t          dnskey_len;
+    RSA            *rsa;
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+    EC_KEY         *ec;
+#endif
+};
+
+/*
+ * a signed RRset ready for val_sigverify()
+ */
+struct bench_rrset {
+    struct rrset_rec set;
+    struct rrset_rr *sig;
+    u_char         *field;
+    size_t          field_len;
+    val_dnskey_rdata_t dnskey;
+    val_rrsig_rdata_t rrsig;
+};
+
+static double
+now_ns(void)
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec * 1e9 + (double) tv.tv_usec * 1e3;
+}
+
+static void
+report(const char *what, long ops, double elapsed_ns)
+{
+    if (ops <= 0 || elapsed_ns <= 0) {
+        printf("%-40s %12s %12s\n", what, "-", "-");
+        return;
+    }
+    printf("%-40s %12.0f %12.0f\n", what,
+           ops * 1e9 / elapsed_ns, elapsed_ns / ops);
+}
+
+static int
+skip_case(const char *what)
+{
+    return (bench_filter != NULL && strstr(what, bench_filter) == NULL);
+}
+
+/*
+ * run fn until bench_msec has elapsed; returns number of operations
+ */
+#define BENCH_LOOP(what, body) do {                                     \
+        long   _ops = 0;                                                \
+        double _start, _end, _limit;                                    \
+        if (skip_case(what))                                            \
+            break;                                                      \
+        _start = now_ns();                                              \
+        _limit = _start + (double) bench_msec * 1e6;                    \
+        do {                                                            \
+            int _i;                                                     \
+            for (_i = 0; _i < 16; _i++) {                               \
+                body;                                                   \
+            }                                                           \
+            _ops += 16;                                                 \
+            _end = now_ns();                                            \
+        } while (_end < _limit);                                        \
+        report(what, _ops, _end - _start);                              \
+    } while (0)
+
+static size_t
+put_bn(const BIGNUM *bn, u_char *buf, size_t len)
+{
+    return BN_bn2binpad(bn, buf, len);
+}
+
+static int
+gen_rsa_key(struct bench_key *k)
+{
+    BIGNUM         *e;
+    const BIGNUM   *n, *pe;
+    u_char         *cp;
+    int             elen, nlen;
+
+    e = BN_new();
+    k->rsa = RSA_new();
+    if (!e || !k->rsa || !BN_set_word(e, RSA_F4) ||
+        !RSA_generate_key_ex(k->rsa, k->bits, e, NULL)) {
+        BN_free(e);
+        return -1;
+    }
+    BN_free(e);
+    RSA_get0_key(k->rsa, &n, &pe, NULL);
+
+    /* flags, protocol, algorithm, then RFC 3110 public key */
+    cp = k->dnskey;
+    *cp++ = 0x01;
+    *cp++ = 0x01;
+    *cp++ = 3;
+    *cp++ = k->alg;
+    elen = BN_num_bytes(pe);
+    nlen = BN_num_bytes(n);
+    if (6 + elen + nlen > BENCH_MAX_KEY)
+        return -1;
+    *cp++ = (u_char) elen;
+    cp += put_bn(pe, cp, elen);
+    cp += put_bn(n, cp, nlen);
+    k->dnskey_len = cp - k->dnskey;
+    return 0;
+}
+
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+static int
+gen_ec_key(struct bench_key *k)
+{
+    int             nid, plen;
+    BIGNUM         *x, *y;
+    u_char         *cp;
+
+    nid = (k->alg == ALG_ECDSAP256SHA256) ?
+        NID_X9_62_prime256v1 : NID_secp384r1;
+    plen = (k->alg == ALG_ECDSAP256SHA256) ? 32 : 48;
+
+    k->ec = EC_KEY_new_by_curve_name(nid);
+    if (!k->ec || !EC_KEY_generate_key(k->ec))
+        return -1;
+
+    x = BN_new();
+    y = BN_new();
+    if (!x || !y ||
+        !EC_POINT_get_affine_coordinates_GFp(EC_KEY_get0_group(k->ec),
+                                             EC_KEY_get0_public_key(k->ec),
+                                             x, y, NULL)) {
+        BN_free(x);
+        BN_free(y);
+        return -1;
+    }
+
+    cp = k->dnskey;
+    *cp++ = 0x01;
+    *cp++ = 0x01;
+    *cp++ = 3;
+    *cp++ = k->alg;
+    cp += put_bn(x, cp, plen);
+    cp += put_bn(y, cp, plen);
+    k->dnskey_len = cp - k->dnskey;
+    BN_free(x);
+    BN_free(y);
+    return 0;
+}
+#endif
+
+static int
+sign_field(struct bench_key *k, const u_char *data, size_t len,
+           u_char *sig, size_t *siglen)
+{
+    u_char          md[EVP_MAX_MD_SIZE];
+    unsigned int    mdlen = 0, slen = 0;
+    const EVP_MD   *evp;
+    int             nid;
+
+    switch (k->alg) {
+    case ALG_RSASHA1:
+        evp = EVP_sha1();
+        nid = NID_sha1;
+        break;
+    case ALG_RSASHA512:
+        evp = EVP_sha512();
+        nid = NID_sha512;
+        break;
+    case ALG_ECDSAP384SHA384:
+        evp = EVP_sha384();
+        nid = NID_sha384;
+        break;
+    default:
+        evp = EVP_sha256();
+        nid = NID_sha256;
+        break;
+    }
+    if (!EVP_Digest(data, len, md, &mdlen, evp, NULL))
+        return -1;
+
+    if (k->rsa) {
+        if (RSA_size(k->rsa) > BENCH_MAX_SIG ||
+            !RSA_sign(nid, md, mdlen, sig, &slen, k->rsa))
+            return -1;
+        *siglen = slen;
+        return 0;
+    }
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+    if (k->ec) {
+        ECDSA_SIG      *es;
+        const BIGNUM   *r, *s;
+
+        if (NULL == (es = ECDSA_do_sign(md, mdlen, k->ec)))
+            return -1;
+        ECDSA_SIG_get0(es, &r, &s);
+        put_bn(r, sig, mdlen);
+        put_bn(s, sig + mdlen, mdlen);
+        ECDSA_SIG_free(es);
+        *siglen = 2 * mdlen;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+static u_int16_t
+key_tag(const u_char *key, size_t len)
+{
+    u_int32_t       ac = 0;
+    size_t          i;
+
+    for (i = 0; i < len; i++)
+        ac += (i & 1) ? key[i] : key[i] << 8;
+    ac += (ac >> 16) & 0xFFFF;
+    return ac & 0xFFFF;
+}
+
+static void
+free_bench_rrset(struct bench_rrset *b)
+{
+    if (b->set.rrs_data)
+        res_sq_free_rr_recs(&b->set.rrs_data);
+    if (b->sig)
+        res_sq_free_rr_recs(&b->sig);
+    if (b->field)
+        FREE(b->field);
+    if (b->dnskey.public_key)
+        FREE(b->dnskey.public_key);
+    if (b->rrsig.signature)
+        FREE(b->rrsig.signature);
+    memset(b, 0, sizeof(*b));
+}
+
+/*
+ * build an RRset of count A records and sign it with the given key
+ */
+static int
+make_bench_rrset(struct bench_key *k, int count, struct bench_rrset *b)
+{
+    u_char          rdata[4];
+    u_char          sigrd[SIGNBY + NS_MAXCDNAME + BENCH_MAX_SIG];
+    u_char          sigbuf[BENCH_MAX_SIG];
+    u_char         *cp;
+    size_t          siglen, signer_len, hdr_len;
+    u_int32_t       now = (u_int32_t) time(NULL);
+    u_int16_t       tag;
+    int             i;
+
+    memset(b, 0, sizeof(*b));
+    b->set.rrs_name_n = (u_char *) BENCH_OWNER;
+    b->set.rrs_class_h = ns_c_in;
+    b->set.rrs_type_h = ns_t_a;
+    b->set.rrs_ttl_h = BENCH_TTL;
+
+    for (i = 0; i < count; i++) {
+        rdata[0] = 192;
+        rdata[1] = 0;
+        rdata[2] = (u_char) (i >> 8);
+        rdata[3] = (u_char) i;
+        if (VAL_NO_ERROR != add_to_set(&b->set, sizeof(rdata), rdata))
+            goto err;
+    }
+
+    /* RRSIG rdata up to and including the signer name */
+    tag = key_tag(k->dnskey, k->dnskey_len);
+    signer_len = wire_name_length((const u_char *) BENCH_SIGNER);
+    cp = sigrd;
+    NS_PUT16(ns_t_a, cp);
+    *cp++ = k->alg;
+    *cp++ = 3;
+    NS_PUT32(BENCH_TTL, cp);
+    NS_PUT32(now + 86400, cp);
+    NS_PUT32(now - 3600, cp);
+    NS_PUT16(tag, cp);
+    memcpy(cp, BENCH_SIGNER, signer_len);
+    cp += signer_len;
+    hdr_len = cp - sigrd;
+
+    if (VAL_NO_ERROR != add_as_sig(&b->set, hdr_len, sigrd))
+        goto err;
+    b->sig = b->set.rrs_sig;
+
+    if (VAL_NO_ERROR != make_sigfield(&b->field, &b->field_len, &b->set,
+                                      b->sig, 0))
+        goto err;
+    if (0 != sign_field(k, b->field, b->field_len, sigbuf, &siglen))
+        goto err;
+
+    /* replace the placeholder signature with the real one */
+    memcpy(cp, sigbuf, siglen);
+    res_sq_free_rr_recs(&b->set.rrs_sig);
+    b->sig = NULL;
+    if (VAL_NO_ERROR != add_as_sig(&b->set, hdr_len + siglen, sigrd))
+        goto err;
+    b->sig = b->set.rrs_sig;
+
+    if (VAL_NO_ERROR != val_parse_dnskey_rdata(k->dnskey, k->dnskey_len,
+                                               &b->dnskey) ||
+        VAL_NO_ERROR != val_parse_rrsig_rdata(b->sig->rr_rdata,
+                                              b->sig->rr_rdata_length,
+                                              &b->rrsig))
+        goto err;
+    return 0;
+
+  err:
+    free_bench_rrset(b);
+    return -1;
+}
+
+static void
+bench_sigverify(struct bench_key *keys, int nkeys)
+{
+    static const int sizes[] = { 1, 8, 32 };
+    struct bench_rrset b;
+    val_astatus_t   kstat, sstat;
+    char            what[64];
+    int             i, j;
+
+    printf("\n%-40s %12s %12s\n", "val_sigverify", "ops/sec", "ns/op");
+    for (i = 0; i < nkeys; i++) {
+        for (j = 0; j < (int) (sizeof(sizes) / sizeof(sizes[0])); j++) {
+            snprintf(what, sizeof(what), "  %s/%d %d RRs", keys[i].name,
+                     keys[i].bits, sizes[j]);
+            if (skip_case(what))
+                continue;
+            if (0 != make_bench_rrset(&keys[i], sizes[j], &b)) {
+                printf("%-40s could not build test vector\n", what);
+                continue;
+            }
+            kstat = sstat = VAL_AC_UNSET;
+            if (!val_sigverify(NULL, 0, b.field, b.field_len, &b.dnskey,
+                               &b.rrsig, &kstat, &sstat, 0)) {
+                printf("%-40s self-check FAILED (%d/%d)\n", what,
+                       kstat, sstat);
+                free_bench_rrset(&b);
+                continue;
+            }
+            BENCH_LOOP(what,
+                       val_sigverify(NULL, 0, b.field, b.field_len,
+                                     &b.dnskey, &b.rrsig, &kstat, &sstat,
+                                     0));
+            free_bench_rrset(&b);
+        }
+    }
+}
+
+static void
+bench_sigfield(struct bench_key *key)
+{
+    static const int sizes[] = { 1, 8, 32, 128 };
+    struct bench_rrset b;
+    u_char         *field;
+    size_t          field_len;
+    char            what[64];
+    int             j;
+
+    printf("\n%-40s %12s %12s\n", "make_sigfield", "ops/sec", "ns/op");
+    for (j = 0; j < (int) (sizeof(sizes) / sizeof(sizes[0])); j++) {
+        snprintf(what, sizeof(what), "  %d RRs", sizes[j]);
+        if (skip_case(what))
+            continue;
+        if (0 != make_bench_rrset(key, sizes[j], &b)) {
+            printf("%-40s could not build test vector\n", what);
+            continue;
+        }
+        BENCH_LOOP(what, {
+                   field = NULL;
+                   if (VAL_NO_ERROR ==
+                       make_sigfield(&field, &field_len, &b.set, b.sig, 0))
+                       FREE(field);
+                   });
+        free_bench_rrset(&b);
+    }
+}
+
+static void
+bench_ds(struct bench_key *key)
+{
+    static const struct {
+        const char *name;
+        u_char      type;
+        const EVP_MD *(*md)(void);
+    } ds_types[] = {
+        { "  DS SHA-1", ALG_DS_HASH_SHA1, EVP_sha1 },
+#ifdef HAVE_SHA_2
+        { "  DS SHA-256", ALG_DS_HASH_SHA256, EVP_sha256 },
+        { "  DS SHA-384", ALG_DS_HASH_SHA384, EVP_sha384 },
+#endif
+    };
+    struct rrset_rr rr;
+    EVP_MD_CTX     *mdctx;
+    u_char          digest[EVP_MAX_MD_SIZE];
+    unsigned int    dlen;
+    val_astatus_t   status;
+    size_t          owner_len;
+    int             i;
+
+    printf("\n%-40s %12s %12s\n", "ds_hash_is_equal", "ops/sec", "ns/op");
+
+    memset(&rr, 0, sizeof(rr));
+    rr.rr_rdata = key->dnskey;
+    rr.rr_rdata_length = key->dnskey_len;
+    owner_len = wire_name_length((const u_char *) BENCH_SIGNER);
+
+    for (i = 0; i < (int) (sizeof(ds_types) / sizeof(ds_types[0])); i++) {
+        if (skip_case(ds_types[i].name))
+            continue;
+        mdctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(mdctx, ds_types[i].md(), NULL);
+        EVP_DigestUpdate(mdctx, BENCH_SIGNER, owner_len);
+        EVP_DigestUpdate(mdctx, key->dnskey, key->dnskey_len);
+        EVP_DigestFinal_ex(mdctx, digest, &dlen);
+        EVP_MD_CTX_free(mdctx);
+
+        if (!ds_hash_is_equal(NULL, ds_types[i].type, digest, dlen,
+                              (u_char *) BENCH_SIGNER, &rr, &status)) {
+            printf("%-40s self-check FAILED\n", ds_types[i].name);
+            continue;
+        }
+        BENCH_LOOP(ds_types[i].name,
+                   ds_hash_is_equal(NULL, ds_types[i].type, digest, dlen,
+                                    (u_char *) BENCH_SIGNER, &rr, &status));
+    }
+}
+
+#ifdef LIBVAL_NSEC3
+static void
+bench_nsec3(void)
+{
+    static const int iters[] = { 0, 1, 10, 100, 150, 500 };
+    u_char          salt[] = { 0xaa, 0xbb, 0xcc, 0xdd };
+    u_char         *hash;
+    size_t          hashlen;
+    char            what[64];
+    int             i;
+
+    printf("\n%-40s %12s %12s\n", "compute_nsec3_hash", "ops/sec", "ns/op");
+    for (i = 0; i < (int) (sizeof(iters) / sizeof(iters[0])); i++) {
+        snprintf(what, sizeof(what), "  %d iterations", iters[i]);
+        BENCH_LOOP(what, {
+                   hash = NULL;
+                   if (compute_nsec3_hash(NULL, (u_char *) BENCH_OWNER,
+                                          NULL, ALG_NSEC3_HASH_SHA1,
+                                          iters[i], sizeof(salt), salt,
+                                          &hashlen, &hash, NULL))
+                       FREE(hash);
+                   });
+    }
+}
+#endif
+
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+/* query paths timed by bench_resolve_run */
+#define BENCH_RAW       0       /* libsres send/cancel only */
+#define BENCH_SYNC      1       /* val_resolve_and_check */
+#define BENCH_ENGINE    2       /* val_async_engine_submit */
+
+struct bench_thread {
+    val_context_t  *ctx;
+    val_async_engine_t *engine;
+    int             id;
+    int             mode;
+    const char     *domain;
+    double          deadline;
+    long            ops;
+    long            failed;
+    /* engine requests sent and completed */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    long            sent;
+};
+
+/*
+ * engine callback, on a worker thread
+ */
+static int
+engine_done(val_async_status *as, int event, val_context_t *ctx,
+            void *cb_data, val_cb_params_t *cbp)
+{
+    struct bench_thread *bt = (struct bench_thread *) cb_data;
+
+    pthread_mutex_lock(&bt->lock);
+    if ((VAL_AS_EVENT_COMPLETED != event) || (NULL == cbp) ||
+        (VAL_NO_ERROR != cbp->retval))
+        ++bt->failed;
+    ++bt->ops;
+    pthread_cond_signal(&bt->cond);
+    pthread_mutex_unlock(&bt->lock);
+    return 0;
+}
+
+/*
+ * submit requests to the engine until the deadline, keeping up to
+ * BENCH_WINDOW outstanding, then wait for the rest to complete
+ */
+static void
+engine_submit(struct bench_thread *bt)
+{
+    char            name[NS_MAXDNAME];
+    long            i;
+
+    pthread_mutex_lock(&bt->lock);
+    for (i = 0; now_ns() < bt->deadline; i++) {
+        while ((bt->sent - bt->ops) >= BENCH_WINDOW)
+            pthread_cond_wait(&bt->cond, &bt->lock);
+        pthread_mutex_unlock(&bt->lock);
+
+        snprintf(name, sizeof(name), "q%ld-%d.%s", i, bt->id, bt->domain);
+        if (VAL_NO_ERROR !=
+            val_async_engine_submit(bt->engine, name, ns_c_in, ns_t_a, 0,
+                                    engine_done, bt)) {
+            pthread_mutex_lock(&bt->lock);
+            ++bt->failed;
+            ++bt->ops;
+        } else
+            pthread_mutex_lock(&bt->lock);
+        ++bt->sent;
+    }
+    while (bt->ops < bt->sent)
+        pthread_cond_wait(&bt->cond, &bt->lock);
+    pthread_mutex_unlock(&bt->lock);
+}
+
+static void    *
+resolve_thread(void *arg)
+{
+    struct bench_thread *bt = (struct bench_thread *) arg;
+    struct val_result_chain *results;
+    char            name[NS_MAXDNAME];
+    long            i;
+    int             tid;
+
+    if (BENCH_ENGINE == bt->mode) {
+        engine_submit(bt);
+        return NULL;
+    }
+
+    for (i = 0; now_ns() < bt->deadline; i++) {
+        snprintf(name, sizeof(name), "q%ld-%d.%s", i, bt->id, bt->domain);
+        if (BENCH_RAW == bt->mode) {
+            tid = -1;
+            if (SR_UNSET != query_send(name, ns_t_a, ns_c_in,
+                                       bt->ctx->nslist, &tid))
+                ++bt->failed;
+            res_cancel(&tid);
+        } else {
+            results = NULL;
+            if (VAL_NO_ERROR != val_resolve_and_check(bt->ctx, name,
+                                                      ns_c_in, ns_t_a, 0,
+                                                      &results))
+                ++bt->failed;
+            val_free_result_chain(results);
+        }
+        ++bt->ops;
+    }
+    return NULL;
+}
+
+/*
+ * parse a list of thread counts: single counts, or ranges a-b which
+ * double from a up to b. Returns the number of counts, or -1.
+ */
+static int
+bench_thread_counts(const char *spec, int *counts, int max)
+{
+    const char     *cp = spec;
+    char           *end;
+    long            lo, hi;
+    int             n = 0;
+
+    while (*cp) {
+        lo = hi = strtol(cp, &end, 10);
+        if ('-' == *end)
+            hi = strtol(end + 1, &end, 10);
+        if ((end == cp) || (lo < 1) || (hi < lo) ||
+            (hi > BENCH_MAX_THREADS) || ((',' != *end) && ('\0' != *end)))
+            return -1;
+        for (; lo <= hi; lo = (lo < hi && lo * 2 > hi) ? hi : lo * 2) {
+            if (n == max)
+                return -1;
+            counts[n++] = (int) lo;
+            if (lo == hi)
+                break;
+        }
+        cp = ('\0' == *end) ? end : end + 1;
+    }
+    return n;
+}
+
+/*
+ * run one case with n threads, each with its own context, or for the
+ * engine, submitting to an engine with n workers. *base is the
+ * per-thread rate of the first run, against which scaling is reported.
+ */
+static int
+bench_resolve_run(int n, int mode, const char *dnsval_conf,
+                  const char *resolv_conf, const char *root_hints,
+                  const char *domain, double *base)
+{
+    static const char *modes[] = {
+        "query_send/res_cancel", "val_resolve_and_check",
+        "val_async_engine_submit"
+    };
+    struct bench_thread bt[BENCH_MAX_THREADS];
+    pthread_t       tids[BENCH_MAX_THREADS];
+    val_async_engine_t *engine = NULL;
+    val_context_opt_t opt;
+    char            what[64];
+    double          start, end, rate;
+    long            ops = 0, failed = 0;
+    int             i, started, err, rc = 0;
+
+    if (BENCH_ENGINE == mode) {
+        memset(&opt, 0, sizeof(opt));
+        opt.vc_val_conf = (char *) dnsval_conf;
+        opt.vc_res_conf = (char *) resolv_conf;
+        opt.vc_root_conf = (char *) root_hints;
+        if (VAL_NO_ERROR !=
+            val_async_engine_create("bench", &opt, n, 0, &engine)) {
+            fprintf(stderr, "could not create async engine\n");
+            return 1;
+        }
+    }
+
+    memset(bt, 0, sizeof(bt));
+    for (i = 0; i < n; i++) {
+        bt[i].id = i;
+        bt[i].mode = mode;
+        bt[i].domain = domain;
+        if (BENCH_ENGINE == mode) {
+            bt[i].engine = engine;
+            pthread_mutex_init(&bt[i].lock, NULL);
+            pthread_cond_init(&bt[i].cond, NULL);
+            continue;
+        }
+        if (VAL_NO_ERROR !=
+            val_create_context_with_conf("bench", (char *) dnsval_conf,
+                                         (char *) resolv_conf,
+                                         (char *) root_hints, &bt[i].ctx)) {
+            fprintf(stderr, "could not create validator context\n");
+            rc = 1;
+            break;
+        }
+        if ((BENCH_RAW == mode) && (NULL == bt[i].ctx->nslist)) {
+            fprintf(stderr, "no name servers in resolv.conf\n");
+            rc = 1;
+            break;
+        }
+    }
+
+    if (!rc) {
+        start = now_ns();
+        for (started = 0; started < n; started++) {
+            bt[started].deadline = start + (double) bench_msec * 1e6;
+            err = pthread_create(&tids[started], NULL, resolve_thread,
+                                 &bt[started]);
+            if (0 != err) {
+                fprintf(stderr, "could not start thread %d: %s\n",
+                        started, strerror(err));
+                rc = 1;
+                break;
+            }
+        }
+        for (i = 0; i < started; i++) {
+            pthread_join(tids[i], NULL);
+            ops += bt[i].ops;
+            failed += bt[i].failed;
+        }
+        end = now_ns();
+    }
+
+    if (!rc) {
+        rate = ops * 1e9 / (end - start);
+        if (*base <= 0)
+            *base = rate / n;
+        snprintf(what, sizeof(what), "%s, %d thread%s", modes[mode],
+                 n, (n == 1) ? "" : "s");
+        printf("%-40s %12.0f %12.0f %8.2f\n", what, rate,
+               ops ? (end - start) / ops : 0, *base > 0 ? rate / *base : 0);
+        if (failed)
+            printf("  (%ld queries failed)\n", failed);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (bt[i].ctx)
+            val_free_context(bt[i].ctx);
+        if (bt[i].engine) {
+            pthread_cond_destroy(&bt[i].cond);
+            pthread_mutex_destroy(&bt[i].lock);
+        }
+    }
+    if (engine)
+        val_async_engine_free(engine);
+    return rc;
+}
+
+/*
+ * throughput with each number of threads in the list: the libsres
+ * transaction path on its own (a query sent and cancelled), the full
+ * val_resolve_and_check(), and concurrent submissions to an engine
+ */
+static int
+bench_resolve(const char *threads, const char *dnsval_conf,
+              const char *resolv_conf, const char *root_hints,
+              const char *domain)
+{
+    int             counts[BENCH_MAX_THREADS];
+    double          base;
+    int             ncounts, mode, i, rc = 0;
+
+    ncounts = bench_thread_counts(threads, counts, BENCH_MAX_THREADS);
+    if (ncounts <= 0) {
+        fprintf(stderr, "thread counts must be 1-%d\n", BENCH_MAX_THREADS);
+        return 1;
+    }
+
+    printf("%-40s %12s %12s %8s\n", "", "queries/s", "ns/query", "scaling");
+    for (mode = BENCH_RAW; mode <= BENCH_ENGINE && !rc; mode++) {
+        base = 0;
+        for (i = 0; i < ncounts && !rc; i++)
+            rc = bench_resolve_run(counts[i], mode, dnsval_conf, resolv_conf,
+                                   root_hints, domain, &base);
+    }
+
+    return rc;
+}
+#else
+static int
+bench_resolve(const char *threads, const char *dnsval_conf,
+              const char *resolv_conf, const char *root_hints,
+              const char *domain)
+{
+    fprintf(stderr, "Thread support not available\n");
+    return 1;
+}
+#endif /* defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS) */
+
+/*
+ * res_poller wakeups: each round sends a datagram to nready of the
+ * nsocks registered loopback sockets, waits for them, and reads them.
+ * With threads, a query round instead sends from each socket to the
+ * stand-in server and waits for all the answers, as the resolver would.
+ */
+struct bench_poll {
+    struct res_poller *p;
+    struct res_poll_event *ev;
+    int            *socks;
+    struct sockaddr_in *addrs;
+    int             nsocks;
+    int             sender;
+    int             next;
+    int             server;
+    struct sockaddr_in srv_addr;
+};
+
+#define BENCH_QUERY_LEN  32         /* about a header and a short question */
+
+static void
+poll_round(struct bench_poll *bp, int nready)
+{
+    struct timeval  tv = { 1, 0 };
+    char            buf[16];
+    int             i, got = 0, n, fd;
+
+    for (i = 0; i < nready; i++) {
+        fd = (bp->next + i) % bp->nsocks;
+        sendto(bp->sender, "x", 1, 0, (struct sockaddr *) &bp->addrs[fd],
+               sizeof(bp->addrs[fd]));
+    }
+    bp->next = (bp->next + nready) % bp->nsocks;
+
+    while (got < nready) {
+        n = res_poller_wait(bp->p, &tv, bp->ev, bp->nsocks);
+        if (n <= 0)
+            break;
+        for (i = 0; i < n; i++) {
+            fd = bp->ev[i].pe_fd;
+            while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+                ++got;
+            res_poller_clear(bp->p, fd);
+        }
+    }
+}
+
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+/*
+ * Stand-in name server: echo every query back to its sender until an
+ * empty datagram arrives.
+ */
+static void    *
+poll_server(void *arg)
+{
+    struct bench_poll *bp = (struct bench_poll *) arg;
+    struct sockaddr_in from;
+    socklen_t       len;
+    char            buf[512];
+    ssize_t         n;
+
+    for (;;) {
+        len = sizeof(from);
+        n = recvfrom(bp->server, buf, sizeof(buf), 0,
+                     (struct sockaddr *) &from, &len);
+        if (n == 0)
+            break;
+        if (n > 0)
+            sendto(bp->server, buf, n, 0, (struct sockaddr *) &from, len);
+    }
+    return NULL;
+}
+
+static void
+poll_query_round(struct bench_poll *bp, int nquery)
+{
+    struct timeval  tv = { 1, 0 };
+    char            buf[512];
+    int             i, got = 0, n, fd;
+
+    memset(buf, 0, BENCH_QUERY_LEN);
+    for (i = 0; i < nquery; i++) {
+        fd = (bp->next + i) % bp->nsocks;
+        sendto(bp->socks[fd], buf, BENCH_QUERY_LEN, 0,
+               (struct sockaddr *) &bp->srv_addr, sizeof(bp->srv_addr));
+    }
+    bp->next = (bp->next + nquery) % bp->nsocks;
+
+    while (got < nquery) {
+        n = res_poller_wait(bp->p, &tv, bp->ev, bp->nsocks);
+        if (n <= 0)
+            break;
+        for (i = 0; i < n; i++) {
+            fd = bp->ev[i].pe_fd;
+            while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+                ++got;
+            res_poller_clear(bp->p, fd);
+        }
+    }
+}
+
+static int
+poll_server_start(struct bench_poll *bp, pthread_t *tid)
+{
+    socklen_t       len = sizeof(bp->srv_addr);
+
+    bp->srv_addr.sin_family = AF_INET;
+    bp->srv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bp->server = socket(AF_INET, SOCK_DGRAM, 0);
+    if (bp->server < 0 ||
+        bind(bp->server, (struct sockaddr *) &bp->srv_addr, len) < 0 ||
+        getsockname(bp->server, (struct sockaddr *) &bp->srv_addr,
+                    &len) < 0 ||
+        pthread_create(tid, NULL, poll_server, bp) != 0) {
+        fprintf(stderr, "could not start the stand-in server: %s\n",
+                strerror(errno));
+        if (bp->server >= 0)
+            close(bp->server);
+        bp->server = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+poll_server_stop(struct bench_poll *bp, pthread_t tid)
+{
+    if (bp->server < 0)
+        return;
+    sendto(bp->sender, "", 0, 0, (struct sockaddr *) &bp->srv_addr,
+           sizeof(bp->srv_addr));
+    pthread_join(tid, NULL);
+    close(bp->server);
+    bp->server = -1;
+}
+#endif /* defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS) */
+
+static int
+bench_poller(int nsocks)
+{
+    int             backends[] = { RES_POLLER_SELECT, RES_POLLER_EPOLL,
+                                   RES_POLLER_IO_URING };
+    struct bench_poll bp;
+    socklen_t       len;
+    char            what[64];
+    int             b, i, rc = 0;
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+    pthread_t       tid;
+#endif
+
+    memset(&bp, 0, sizeof(bp));
+    bp.sender = -1;
+    bp.server = -1;
+    bp.nsocks = nsocks;
+    bp.socks = (int *) calloc(nsocks, sizeof(int));
+    bp.addrs = (struct sockaddr_in *) calloc(nsocks,
+                                             sizeof(struct sockaddr_in));
+    bp.ev = (struct res_poll_event *) calloc(nsocks,
+                                             sizeof(struct res_poll_event));
+    if (!bp.socks || !bp.addrs || !bp.ev) {
+        fprintf(stderr, "out of memory\n");
+        rc = 1;
+        goto done;
+    }
+    for (i = 0; i < nsocks; i++)
+        bp.socks[i] = -1;
+    bp.sender = socket(AF_INET, SOCK_DGRAM, 0);
+    if (bp.sender < 0) {
+        fprintf(stderr, "could not open socket: %s\n", strerror(errno));
+        rc = 1;
+        goto done;
+    }
+
+    for (i = 0; i < nsocks; i++) {
+        bp.addrs[i].sin_family = AF_INET;
+        bp.addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        len = sizeof(bp.addrs[i]);
+        bp.socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (bp.socks[i] < 0 ||
+            bind(bp.socks[i], (struct sockaddr *) &bp.addrs[i], len) < 0 ||
+            getsockname(bp.socks[i], (struct sockaddr *) &bp.addrs[i],
+                        &len) < 0) {
+            fprintf(stderr, "could not open socket %d: %s\n", i,
+                    strerror(errno));
+            rc = 1;
+            goto done;
+        }
+    }
+
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+    if (poll_server_start(&bp, &tid) < 0) {
+        rc = 1;
+        goto done;
+    }
+#endif
+
+    printf("%-40s %12s %12s\n", "", "rounds/s", "ns/round");
+    for (b = 0; b < (int) (sizeof(backends) / sizeof(backends[0])); b++) {
+        bp.p = res_poller_create(backends[b]);
+        if (NULL == bp.p)
+            continue;
+        for (i = 0; i < nsocks; i++)
+            if (0 != res_poller_add(bp.p, bp.socks[i], NULL))
+                break;
+        if (i == nsocks) {
+            snprintf(what, sizeof(what), "%s, 1 of %d ready",
+                     res_poller_backend_name(bp.p), nsocks);
+            BENCH_LOOP(what, poll_round(&bp, 1));
+            snprintf(what, sizeof(what), "%s, %d of %d ready",
+                     res_poller_backend_name(bp.p), nsocks, nsocks);
+            BENCH_LOOP(what, poll_round(&bp, nsocks));
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+            snprintf(what, sizeof(what), "%s, 1 query answered",
+                     res_poller_backend_name(bp.p));
+            BENCH_LOOP(what, poll_query_round(&bp, 1));
+            snprintf(what, sizeof(what), "%s, %d queries answered",
+                     res_poller_backend_name(bp.p), nsocks);
+            BENCH_LOOP(what, poll_query_round(&bp, nsocks));
+#endif
+        } else
+            printf("%-40s %12s %12s\n", res_poller_backend_name(bp.p),
+                   "-", "-");
+        res_poller_free(bp.p);
+    }
+
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+    poll_server_stop(&bp, tid);
+#endif
+
+  done:
+    for (i = 0; bp.socks && i < nsocks; i++)
+        if (bp.socks[i] >= 0)
+            close(bp.socks[i]);
+    if (bp.sender >= 0)
+        close(bp.sender);
+    free(bp.socks);
+    free(bp.addrs);
+    free(bp.ev);
+    return rc;
+}
+
+void
+usage(char *progname)
+{
+    fprintf(stderr, "Usage: %s [options]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr,
+            "\t-h             display usage and exit\n");
+    fprintf(stderr,
+            "\t-m <msec>      run each case for <msec> milliseconds "
+            "(default %d)\n", BENCH_DEF_MSEC);
+    fprintf(stderr,
+            "\t-f <substring> only run cases whose name contains <substring>\n");
+    fprintf(stderr,
+            "\t-o <debug-level>:<dest-type>[:<dest-options>]\n"
+            "\t               log output (see dt-validate)\n");
+    fprintf(stderr,
+            "\t-t <n>[,<n>..] time query throughput with each number of\n"
+            "\t               threads (<a>-<b> doubles from a to b), instead\n"
+            "\t               of the verification cases\n");
+    fprintf(stderr,
+            "\t-v <file>      dnsval.conf for -t\n");
+    fprintf(stderr,
+            "\t-r <file>      resolv.conf for -t\n");
+    fprintf(stderr,
+            "\t-i <file>      root.hints for -t\n");
+    fprintf(stderr,
+            "\t-q <domain>    query names under <domain> for -t "
+            "(default %s)\n", BENCH_DEF_DOMAIN);
+    fprintf(stderr,
+            "\t-p <n>         time res_poller_wait() on <n> sockets with\n"
+            "\t               each poller backend, and query round trips\n"
+            "\t               to a loopback stand-in server, instead of\n"
+            "\t               the verification cases\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct bench_key keys[] = {
+        { "RSASHA1", ALG_RSASHA1, 1024 },
+        { "RSASHA1", ALG_RSASHA1, 2048 },
+#ifdef HAVE_SHA_2
+        { "RSASHA256", ALG_RSASHA256, 1024 },
+        { "RSASHA256", ALG_RSASHA256, 2048 },
+        { "RSASHA512", ALG_RSASHA512, 2048 },
+#endif
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+        { "ECDSAP256SHA256", ALG_ECDSAP256SHA256, 256 },
+        { "ECDSAP384SHA384", ALG_ECDSAP384SHA384, 384 },
+#endif
+    };
+    int             nkeys = sizeof(keys) / sizeof(keys[0]);
+    int             c, i, ok = 0;
+    const char     *threads = NULL, *dnsval_conf = NULL;
+    const char     *resolv_conf = NULL, *root_hints = NULL;
+    const char     *domain = BENCH_DEF_DOMAIN;
+    int             nsocks = 0;
+
+    while ((c = getopt(argc, argv, "hm:f:o:t:v:r:i:q:p:")) != -1) {
+        switch (c) {
+        case 'm':
+            bench_msec = atoi(optarg);
+            if (bench_msec <= 0)
+                bench_msec = BENCH_DEF_MSEC;
+            break;
+        case 'f':
+            bench_filter = optarg;
+            break;
+        case 'o':
+            if (NULL == val_log_add_optarg(optarg, 1)) {
+                fprintf(stderr, "Invalid argument for -o\n");
+                return 1;
+            }
+            break;
+        case 't':
+            threads = optarg;
+            break;
+        case 'v':
+            dnsval_conf = optarg;
+            break;
+        case 'r':
+            resolv_conf = optarg;
+            break;
+        case 'i':
+            root_hints = optarg;
+            break;
+        case 'q':
+            domain = optarg;
+            break;
+        case 'p':
+            nsocks = atoi(optarg);
+            if (nsocks <= 0) {
+                fprintf(stderr, "Invalid argument for -p\n");
+                return 1;
+            }
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return (c == 'h') ? 0 : 1;
+        }
+    }
+
+    if (threads) {
+        printf("libval resolver throughput (%d ms per case)\n", bench_msec);
+        return bench_resolve(threads, dnsval_conf, resolv_conf, root_hints,
+                             domain);
+    }
+
+    if (nsocks) {
+        printf("libsres poller wakeups (%d ms per case)\n", bench_msec);
+        return bench_poller(nsocks);
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        int             rc;
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+        if (keys[i].alg == ALG_ECDSAP256SHA256 ||
+            keys[i].alg == ALG_ECDSAP384SHA384)
+            rc = gen_ec_key(&keys[i]);
+        else
+#endif
+            rc = gen_rsa_key(&keys[i]);
+        if (rc != 0) {
+            fprintf(stderr, "could not generate %s key\n", keys[i].name);
+            return 1;
+        }
+    }
+
+    printf("libval verification microbenchmarks (%d ms per case)\n",
+           bench_msec);
+
+    bench_sigverify(keys, nkeys);
+    for (i = 0; i < nkeys; i++)
+        if (keys[i].alg == ALG_RSASHA1 && !ok++)
+            bench_sigfield(&keys[i]);
+    bench_ds(&keys[nkeys - 1]);
+#ifdef LIBVAL_NSEC3
+    bench_nsec3();
+#endif
+
+    for (i = 0; i < nkeys; i++) {
+        if (keys[i].rsa)
+            RSA_free(keys[i].rsa);
+#if defined(HAVE_ECDSA) && defined(HAVE_OPENSSL_ECDSA_H)
+        if (keys[i].ec)
+            EC_KEY_free(keys[i].ec);
+#endif
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+
+/*
+ * Program to compile dnsval.conf files into the binary policy
+ * images that libval loads in place of the text
+ *
+ */
+#include "validator/validator-config.h"
+#include <validator/validator.h>
+
+#ifdef HAVE_LIBGEN_H
+#include <libgen.h>
+#endif
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#ifdef HAVE_GETOPT_LONG
+static struct option prog_options[] = {
+    {"help", 0, 0, 'h'},
+    {"dnsval-conf", 1, 0, 'd'},
+    {"output", 1, 0, 'o'},
+    {"verbose", 0, 0, 'v'},
+    {0, 0, 0, 0}
+};
+#endif
+
+void usage(char *progname)
+{
+    printf("Usage: %s [options] [included-file ...]\n", progname);
+    printf("Compile dnsval.conf, and any files it includes that are listed,\n");
+    printf("into binary policy images (<file>.bin).\n");
+    printf("Primary Options:\n");
+    printf("        -h, --help                        Display this help and exit\n");
+    printf("        -d, --dnsval-conf=<dnsval.conf>   Specify the dnsval.conf file\n");
+    printf("        -o, --output=<image>              Write the dnsval.conf image to <image>\n");
+    printf("        -v, --verbose                     Enable verbose mode\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int             retval;
+    int             c;
+    const char     *args = "hvd:o:";
+    char           *progname;
+    val_log_t      *logp;
+    char           *dnsval_conf = NULL;
+    char           *output = NULL;
+    int            debug = 0;
+    int            failed = 0;
+
+    progname = basename(argv[0]);
+
+    while (1) {
+
+#ifdef HAVE_GETOPT_LONG
+        int             opt_index = 0;
+#ifdef HAVE_GETOPT_LONG_ONLY
+        c = getopt_long_only(argc, argv, args, prog_options, &opt_index);
+#else
+        c = getopt_long(argc, argv, args, prog_options, &opt_index);
+#endif
+#else                           /* only have getopt */
+        c = getopt(argc, argv, args);
+#endif
+
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+            case 'h':
+                usage(progname);
+                return (0);
+
+            case 'v':
+                debug=1;
+                logp = val_log_add_optarg("7:stdout", 1);
+                if (NULL == logp) { /* err msg already logged */
+                    usage(progname);
+                    return (-1);
+                }
+                break;
+
+            case 'd':
+                dnsval_conf = optarg;
+                break;
+
+            case 'o':
+                output = optarg;
+                break;
+
+            default:
+                fprintf(stderr, "Unknown option %s (c = %d [%c])\n",
+                        argv[optind - 1], c, (char) c);
+                usage(progname);
+                return (-1);
+        }
+    }
+
+    if (debug == 0) {
+        logp = val_log_add_optarg("5:stdout", 1);
+    }
+
+    if (dnsval_conf == NULL && debug) {
+        fprintf(stdout, "dnsval.conf is not specified. Using system defined dnsval.conf for libval.\n");
+    }
+
+    retval = val_policy_compile(dnsval_conf, output);
+    if (retval != VAL_NO_ERROR) {
+        fprintf(stdout, "Result: FAILED. %s \n", p_val_err(retval));
+        return (-1);
+    }
+
+    /* included files, each into its own image */
+    for (; optind < argc; optind++) {
+        retval = val_policy_compile(argv[optind], NULL);
+        if (retval != VAL_NO_ERROR) {
+            fprintf(stdout, "%s: FAILED. %s \n", argv[optind],
+                    p_val_err(retval));
+            failed = 1;
+        }
+    }
+    if (failed)
+        return (-1);
+
+    fprintf(stdout, "Result : OK. \n");
+    return 0;
+}
+
@@ -0,0 +1,359 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ *
+ * Regression tests for the C++20 coroutine interface in val_coro.hpp,
+ * run by "make test-coro". They need no network access: the context's
+ * name server is a thread on loopback which answers A queries for
+ * names under answer.test and drops those under drop.test.
+ *
+ *  - a coroutine awaits a query and gets its answer
+ *  - a stop request cancels the query, and the await sees canceled()
+ *  - destroying a coroutine waiting for a query cancels the query
+ *    (val_async_cancel), and the coroutine is never resumed
+ */
+#include <validator/val_coro.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define TEST_ANSWER     "www.answer.test"
+#define TEST_DROP       "www.drop.test"
+#define TEST_LOOPS      200         /* run_once() rounds before giving up */
+#define TEST_ROUND_MS   50
+
+static int      verbose = 0;
+static int      failures = 0;
+
+#define CHECK(cond, ...) do {                                       \
+    if (!(cond)) {                                                  \
+        printf("FAILED: ");                                         \
+        printf(__VA_ARGS__);                                        \
+        printf("\n");                                               \
+        ++failures;                                                 \
+    } else if (verbose) {                                           \
+        printf("ok: ");                                             \
+        printf(__VA_ARGS__);                                        \
+        printf("\n");                                               \
+    }                                                               \
+} while (0)
+
+static const char *test_root_hints =
+    ".                        3600000  IN  NS    A.ROOT-SERVERS.NET.\n"
+    "A.ROOT-SERVERS.NET.      3600000      A     198.41.0.4\n";
+
+/*
+ * stand-in name server
+ */
+struct test_server {
+    int                 fd = -1;
+    unsigned short      port = 0;
+    std::atomic<int>    answered{0};
+    std::atomic<int>    dropped{0};
+    std::thread         thread;
+};
+
+/* whether the second label of the query name in msg is label */
+static bool
+qname_under(const unsigned char *msg, size_t len, const char *label)
+{
+    size_t          i = 12 + msg[12] + 1, llen = strlen(label);
+
+    return i + llen < len && msg[i] == llen &&
+        0 == memcmp(msg + i + 1, label, llen);
+}
+
+static void
+serve(test_server *srv)
+{
+    unsigned char       buf[512];
+    struct sockaddr_in  from;
+    socklen_t           flen;
+    ssize_t             n;
+    size_t              q;
+
+    for (;;) {
+        flen = sizeof(from);
+        n = recvfrom(srv->fd, buf, sizeof(buf) - 16, 0,
+                     (struct sockaddr *) &from, &flen);
+        if (n == 0)
+            break;
+        if (n < 17)
+            continue;
+        if (qname_under(buf, n, "drop")) {
+            ++srv->dropped;
+            continue;
+        }
+
+        /* header and question, then an A record if it was asked for */
+        for (q = 12; q < (size_t) n && buf[q]; q += buf[q] + 1)
+            ;
+        q += 5;
+        if (q > (size_t) n)
+            continue;
+        buf[2] = 0x84;                              /* QR AA */
+        buf[3] = 0x00;
+        memset(buf + 6, 0, 6);
+        if (buf[q - 4] == 0 && buf[q - 3] == ns_t_a) {
+            static const unsigned char a[] = {
+                0xc0, 0x0c, 0, ns_t_a, 0, ns_c_in, 0, 0, 0x0e, 0x10,
+                0, 4, 10, 0, 0, 1
+            };
+            buf[7] = 1;
+            memcpy(buf + q, a, sizeof(a));
+            q += sizeof(a);
+        }
+        sendto(srv->fd, buf, q, 0, (struct sockaddr *) &from, flen);
+        ++srv->answered;
+    }
+}
+
+static bool
+server_start(test_server *srv)
+{
+    struct sockaddr_in  sin;
+    socklen_t           len = sizeof(sin);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    srv->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (srv->fd < 0 ||
+        bind(srv->fd, (struct sockaddr *) &sin, len) < 0 ||
+        getsockname(srv->fd, (struct sockaddr *) &sin, &len) < 0)
+        return false;
+    srv->port = ntohs(sin.sin_port);
+    srv->thread = std::thread(serve, srv);
+    return true;
+}
+
+static void
+server_stop(test_server *srv)
+{
+    struct sockaddr_in  sin;
+
+    if (srv->thread.joinable()) {
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(srv->port);
+        sendto(srv->fd, "", 0, 0, (struct sockaddr *) &sin, sizeof(sin));
+        srv->thread.join();
+    }
+    if (srv->fd >= 0)
+        close(srv->fd);
+}
+
+static int
+write_file(const char *path, const char *data)
+{
+    FILE           *fp;
+    int             rc;
+
+    if (NULL == (fp = fopen(path, "w")))
+        return -1;
+    rc = (fputs(data, fp) < 0) ? -1 : 0;
+    if (0 != fclose(fp))
+        rc = -1;
+    return rc;
+}
+
+/*
+ * a coroutine that starts at once and stays suspended at its end, so
+ * the test decides when its frame (and any pending await) is destroyed
+ */
+struct held {
+    struct promise_type {
+        held get_return_object() {
+            return held{std::coroutine_handle<promise_type>::from_promise(
+                *this)};
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> h;
+};
+
+static held
+await_query(val::executor &ex, const char *name, std::stop_token st,
+            bool *resumed, val::result *out)
+{
+    *out = co_await ex.resolve(name, ns_t_a, st);
+    *resumed = true;
+}
+
+/* run the executor until done() or TEST_LOOPS rounds */
+template <class F>
+static bool
+run_until(val::executor &ex, F done)
+{
+    for (int i = 0; i < TEST_LOOPS; i++) {
+        if (done())
+            return true;
+        ex.run_once(TEST_ROUND_MS);
+    }
+    return done();
+}
+
+static void
+test_answer(val::executor &ex, test_server *srv)
+{
+    val::result     res;
+    bool            resumed = false;
+    held            co;
+
+    co = await_query(ex, TEST_ANSWER, {}, &resumed, &res);
+    CHECK(run_until(ex, [&] { return resumed; }), "%s: awaited",
+          TEST_ANSWER);
+    CHECK(srv->answered > 0, "%s: server answered", TEST_ANSWER);
+    CHECK(!res.canceled(), "%s: not canceled", TEST_ANSWER);
+    CHECK(VAL_NO_ERROR == res.retval, "%s: retval %d", TEST_ANSWER,
+          res.retval);
+    CHECK(NULL != res.results(), "%s: has a result", TEST_ANSWER);
+    CHECK(!ex.busy(), "%s: executor idle", TEST_ANSWER);
+    co.h.destroy();
+}
+
+static void
+test_stop(val::executor &ex, test_server *srv)
+{
+    std::stop_source ss;
+    val::result     res;
+    bool            resumed = false;
+    int             seen = srv->dropped;
+    held            co;
+
+    co = await_query(ex, TEST_DROP, ss.get_token(), &resumed, &res);
+    CHECK(run_until(ex, [&] { return srv->dropped > seen; }),
+          "stop: query sent");
+    CHECK(!resumed && ex.busy(), "stop: query pending");
+    ss.request_stop();
+    CHECK(run_until(ex, [&] { return resumed; }), "stop: awaited");
+    CHECK(res.canceled(), "stop: canceled");
+    CHECK(!ex.busy(), "stop: executor idle");
+    co.h.destroy();
+}
+
+static void
+test_destroy(val::executor &ex, test_server *srv)
+{
+    val::result     res;
+    bool            resumed = false;
+    int             seen = srv->dropped;
+    held            co;
+
+    co = await_query(ex, TEST_DROP, {}, &resumed, &res);
+    CHECK(run_until(ex, [&] { return srv->dropped > seen; }),
+          "destroy: query sent");
+    CHECK(!resumed && ex.busy(), "destroy: query pending");
+
+    /*
+     * the only way the executor's count of running operations drops
+     * without a resume is the cancel callback from val_async_cancel()
+     */
+    co.h.destroy();
+    CHECK(!ex.busy(), "destroy: query canceled");
+    ex.run_once(TEST_ROUND_MS);
+    CHECK(!resumed, "destroy: coroutine not resumed");
+}
+
+static void
+usage(char *progname)
+{
+    fprintf(stderr, "Usage: %s [options]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr,
+            "\t-h             display usage and exit\n");
+    fprintf(stderr,
+            "\t-v             report each check, not just failures\n");
+    fprintf(stderr,
+            "\t-o <debug-level>:<dest-type>[:<dest-options>]\n"
+            "\t               log output (see dt-validate)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    char            dir[] = "/tmp/libval_coro_test.XXXXXX";
+    char            conf[PATH_MAX], resolv[PATH_MAX], hints[PATH_MAX];
+    char            buf[64];
+    val_context_t  *ctx = NULL;
+    test_server     srv;
+    int             c;
+
+    while ((c = getopt(argc, argv, "hvo:")) != -1) {
+        switch (c) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'o':
+            if (NULL == val_log_add_optarg(optarg, 1)) {
+                fprintf(stderr, "Invalid argument for -o\n");
+                return 1;
+            }
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return (c == 'h') ? 0 : 1;
+        }
+    }
+
+    if (NULL == mkdtemp(dir)) {
+        fprintf(stderr, "could not create a directory for the test files\n");
+        return 1;
+    }
+    if (!server_start(&srv)) {
+        fprintf(stderr, "could not start the test name server\n");
+        rmdir(dir);
+        return 1;
+    }
+
+    /* no trust anchors: answers come back untrusted, but they come back */
+    snprintf(conf, sizeof(conf), "%s/dnsval.conf", dir);
+    snprintf(resolv, sizeof(resolv), "%s/resolv.conf", dir);
+    snprintf(hints, sizeof(hints), "%s/root.hints", dir);
+    snprintf(buf, sizeof(buf), "nameserver [127.0.0.1]:%u\n", srv.port);
+    if (write_file(conf, ": clock-skew\n    . 0\n;\n") ||
+        write_file(resolv, buf) || write_file(hints, test_root_hints)) {
+        CHECK(0, "write test files in %s", dir);
+    } else if (VAL_NO_ERROR !=
+               val_create_context_with_conf((char *) "coro-test", conf,
+                                            resolv, hints, &ctx)) {
+        CHECK(0, "create context from %s", conf);
+    } else {
+        try {
+            val::executor   ex(ctx);
+
+            test_answer(ex, &srv);
+            test_stop(ex, &srv);
+            test_destroy(ex, &srv);
+        } catch (const std::exception &e) {
+            CHECK(0, "executor: %s", e.what());
+        }
+        val_free_context(ctx);
+    }
+
+    server_stop(&srv);
+    unlink(conf);
+    unlink(resolv);
+    unlink(hints);
+    rmdir(dir);
+
+    if (failures) {
+        printf("Result: FAILED. %d check%s failed\n", failures,
+               (failures == 1) ? "" : "s");
+        return 1;
+    }
+    printf("Result : OK. \n");
+    return 0;
+}
@@ -0,0 +1,484 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ *
+ * Regression tests for the validator policy store, run by "make test".
+ * They need no network access.
+ *
+ *  - per-zone policy lookups through the label trie (find_zone_policy)
+ *  - trust anchor key tags, for a key whose two flag octets differ
+ *  - compiled policy images: an up to date image is used in place of
+ *    the text, and a stale or damaged one is ignored
+ *  - an async engine created with a NULL label leaves the default
+ *    context alone
+ */
+#include "validator-internal.h"
+
+#include <utime.h>
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "val_parse.h"
+#include "val_policy.h"
+#include "val_context.h"
+
+/*
+ * the example key from RFC 4034 section 5.4: flags 256, algorithm 5,
+ * key tag 60485
+ */
+#define TEST_KEY_FLAGS  256
+#define TEST_KEY_ALG    5
+#define TEST_KEY_TAG    60485
+#define TEST_KEY \
+    "AQOeiiR0GOMYkDshWoSKz9XzfwJr1AYtsmx3TGkJaNXVbfi/2pHm822aJ5iI9BMz" \
+    "NXxeYCmZDRD99WYwYqUSdjMmmAphXdvxegXd/M5+X7OrzKBaMbCVdFLUUh6DhweJ" \
+    "BjEVv5f2wwjM9XzcnOf+EPbtG9DMBmADjFDc2w/rljwvFw=="
+
+#define TEST_ROOT_DS_TAG    19036
+#define TEST_ROOT_DS_ALG    8
+
+/*
+ * the example.com clock-skew is written as TEST_SKEW_FMT so that it can
+ * be changed without changing the size of the file
+ */
+#define TEST_SKEW_FMT   "%3d"
+#define TEST_SKEW_TEXT  10
+#define TEST_SKEW_EDIT  30
+
+static const char *test_conf_fmt =
+    ": trust-anchor\n"
+    "    example.com DNSKEY 256 3 5 " TEST_KEY "\n"
+    "    . DS 19036 8 2 "
+    "49AAC11D7B6F6446702E54A1607371607A1A41855200FD2CE1CDDE32F24E8FB5\n"
+    ";\n"
+    ": clock-skew\n"
+    "    . 0\n"
+    "    example.com " TEST_SKEW_FMT "\n"
+    "    sub.example.com 20\n"
+    "    other.org -1\n"
+    ";\n";
+
+static const char *test_root_hints =
+    ".                        3600000  IN  NS    A.ROOT-SERVERS.NET.\n"
+    "A.ROOT-SERVERS.NET.      3600000      A     198.41.0.4\n";
+
+/*
+ * expected clock-skew lookups. skew of TEST_SKEW_TEXT is whatever the
+ * example.com entry is expected to hold.
+ */
+static const struct {
+    const char *name;
+    const char *zone;
+    int         skew;
+} skew_tests[] = {
+    { "example.net.",           ".",                0 },
+    { "com.",                   ".",                0 },
+    { "example.com.",           "example.com.",     TEST_SKEW_TEXT },
+    { "EXAMPLE.Com.",           "example.com.",     TEST_SKEW_TEXT },
+    { "a.example.com.",         "example.com.",     TEST_SKEW_TEXT },
+    { "xsub.example.com.",      "example.com.",     TEST_SKEW_TEXT },
+    { "sub.example.com.",       "sub.example.com.", 20 },
+    { "a.b.sub.example.com.",   "sub.example.com.", 20 },
+    { "other.org.",             "other.org.",       -1 },
+    { "www.other.org.",         "other.org.",       -1 },
+};
+
+static int      verbose = 0;
+static int      failures = 0;
+
+#define CHECK(cond, ...) do {                                       \
+    if (!(cond)) {                                                  \
+        printf("FAILED: ");                                         \
+        printf(__VA_ARGS__);                                        \
+        printf("\n");                                               \
+        ++failures;                                                 \
+    } else if (verbose) {                                           \
+        printf("ok: ");                                             \
+        printf(__VA_ARGS__);                                        \
+        printf("\n");                                               \
+    }                                                               \
+} while (0)
+
+static int
+write_file(const char *path, const char *data)
+{
+    FILE           *fp;
+    int             rc;
+
+    if (NULL == (fp = fopen(path, "w")))
+        return -1;
+    rc = (fputs(data, fp) < 0) ? -1 : 0;
+    if (0 != fclose(fp))
+        rc = -1;
+    return rc;
+}
+
+static int
+write_conf(const char *path, int skew)
+{
+    char            buf[2048];
+
+    snprintf(buf, sizeof(buf), test_conf_fmt, skew);
+    return write_file(path, buf);
+}
+
+static int
+set_mtime(const char *path, time_t when)
+{
+    struct utimbuf  ut;
+
+    ut.actime = when;
+    ut.modtime = when;
+    return utime(path, &ut);
+}
+
+/*
+ * check each clock-skew lookup against the table, with expect in
+ * place of TEST_SKEW_TEXT
+ */
+static void
+check_skew(val_context_t *ctx, const char *what, int expect)
+{
+    u_char          name_n[NS_MAXCDNAME], zone_n[NS_MAXCDNAME];
+    u_char         *matched;
+    policy_entry_t *pe;
+    int             i, want, skew;
+
+    CTX_LOCK_POL_SH(ctx);
+    for (i = 0; i < (int) (sizeof(skew_tests) / sizeof(skew_tests[0]));
+         i++) {
+        want = (TEST_SKEW_TEXT == skew_tests[i].skew) ? expect :
+            skew_tests[i].skew;
+        if (ns_name_pton(skew_tests[i].name, name_n, sizeof(name_n)) < 0 ||
+            ns_name_pton(skew_tests[i].zone, zone_n, sizeof(zone_n)) < 0) {
+            CHECK(0, "%s: bad test name %s", what, skew_tests[i].name);
+            continue;
+        }
+        matched = NULL;
+        pe = find_zone_policy(ctx, P_CLOCK_SKEW, name_n, &matched);
+        if (NULL == pe || NULL == pe->pol) {
+            CHECK(0, "%s: no clock-skew policy for %s", what,
+                  skew_tests[i].name);
+            continue;
+        }
+        skew = ((struct clock_skew_policy *) pe->pol)->clock_skew;
+        CHECK(matched && !namecmp(matched, zone_n) && skew == want,
+              "%s: clock-skew for %s is %d from %s (expected %d from %s)",
+              what, skew_tests[i].name, skew,
+              (matched && !namecmp(matched, zone_n)) ?
+              skew_tests[i].zone : "another zone", want,
+              skew_tests[i].zone);
+    }
+    CTX_UNLOCK_POL(ctx);
+}
+
+/*
+ * key tags computed from a parsed key string and from the wire rdata
+ */
+static void
+test_keytag(void)
+{
+    char            keystr[] = "256 3 5 " TEST_KEY;
+    val_dnskey_rdata_t *dnskey = NULL;
+    u_char          rdata[512];
+    size_t          len;
+
+    CHECK(VAL_NO_ERROR ==
+          val_parse_dnskey_string(keystr, strlen(keystr), &dnskey),
+          "parse DNSKEY string");
+    if (NULL == dnskey)
+        return;
+
+    CHECK(TEST_KEY_TAG == dnskey->key_tag,
+          "key tag of parsed DNSKEY string is %d (expected %d)",
+          dnskey->key_tag, TEST_KEY_TAG);
+
+    len = 4 + dnskey->public_key_len;
+    if (len <= sizeof(rdata)) {
+        rdata[0] = (TEST_KEY_FLAGS >> 8) & 0xff;
+        rdata[1] = TEST_KEY_FLAGS & 0xff;
+        rdata[2] = 3;
+        rdata[3] = TEST_KEY_ALG;
+        memcpy(&rdata[4], dnskey->public_key, dnskey->public_key_len);
+        CHECK(TEST_KEY_TAG == val_dnskey_rdata_keytag(rdata, len),
+              "key tag of DNSKEY rdata is %d (expected %d)",
+              val_dnskey_rdata_keytag(rdata, len), TEST_KEY_TAG);
+    }
+
+    FREE(dnskey->public_key);
+    FREE(dnskey);
+}
+
+/*
+ * the closest trust anchor, and what was pre-digested for it
+ */
+static void
+check_anchor(val_context_t *ctx, const char *what, const char *name,
+             const char *zone, int tag, int alg, int is_key)
+{
+    u_char          name_n[NS_MAXCDNAME], zone_n[NS_MAXCDNAME];
+    u_char         *matched = NULL;
+    policy_entry_t *pe;
+    struct trust_anchor_policy *ta;
+
+    if (ns_name_pton(name, name_n, sizeof(name_n)) < 0 ||
+        ns_name_pton(zone, zone_n, sizeof(zone_n)) < 0) {
+        CHECK(0, "%s: bad test name %s", what, name);
+        return;
+    }
+
+    CTX_LOCK_POL_SH(ctx);
+    pe = find_zone_policy(ctx, P_TRUST_ANCHOR, name_n, &matched);
+    ta = pe ? (struct trust_anchor_policy *) pe->pol : NULL;
+    CHECK(ta && matched && !namecmp(matched, zone_n),
+          "%s: trust anchor for %s is at %s", what, name, zone);
+    if (ta) {
+        CHECK(ta->key_tag == tag && ta->algorithm == alg,
+              "%s: trust anchor for %s has key tag %d algorithm %d "
+              "(expected %d %d)", what, name, ta->key_tag, ta->algorithm,
+              tag, alg);
+        if (is_key)
+            CHECK(ta->publickey && ta->rdata && ta->rdata_len > 4 &&
+                  val_dnskey_rdata_keytag(ta->rdata, ta->rdata_len) == tag,
+                  "%s: trust anchor rdata for %s has key tag %d", what,
+                  name, tag);
+        else
+            CHECK(ta->ds && NULL == ta->publickey,
+                  "%s: trust anchor for %s is a DS", what, name);
+    }
+    CTX_UNLOCK_POL(ctx);
+}
+
+static val_context_t *
+make_context(const char *conf, const char *resolv, const char *hints)
+{
+    val_context_t  *ctx = NULL;
+
+    if (VAL_NO_ERROR !=
+        val_create_context_with_conf(NULL, (char *) conf, (char *) resolv,
+                                     (char *) hints, &ctx)) {
+        CHECK(0, "create context from %s", conf);
+        return NULL;
+    }
+    return ctx;
+}
+
+/*
+ * policy from the text, then from a compiled image, then from the text
+ * again once the image is stale or damaged
+ */
+static void
+test_policy(const char *dir)
+{
+    char            conf[PATH_MAX], image[PATH_MAX];
+    char            resolv[PATH_MAX], hints[PATH_MAX];
+    val_context_t  *ctx;
+    struct stat     sb;
+    time_t          mtime;
+    FILE           *fp;
+    long            off;
+    int             c;
+
+    snprintf(conf, sizeof(conf), "%s/dnsval.conf", dir);
+    snprintf(image, sizeof(image), "%s/dnsval.conf" POL_IMAGE_SUFFIX, dir);
+    snprintf(resolv, sizeof(resolv), "%s/resolv.conf", dir);
+    snprintf(hints, sizeof(hints), "%s/root.hints", dir);
+
+    if (write_conf(conf, TEST_SKEW_TEXT) ||
+        write_file(resolv, "nameserver 127.0.0.1\n") ||
+        write_file(hints, test_root_hints)) {
+        CHECK(0, "write test files in %s", dir);
+        return;
+    }
+
+    /* from the text */
+    if (NULL != (ctx = make_context(conf, resolv, hints))) {
+        check_skew(ctx, "text", TEST_SKEW_TEXT);
+        check_anchor(ctx, "text", "www.example.com.", "example.com.",
+                     TEST_KEY_TAG, TEST_KEY_ALG, 1);
+        check_anchor(ctx, "text", "example.net.", ".",
+                     TEST_ROOT_DS_TAG, TEST_ROOT_DS_ALG, 0);
+        val_free_context(ctx);
+    }
+
+    CHECK(VAL_NO_ERROR == val_policy_compile(conf, NULL),
+          "compile %s", conf);
+    CHECK(0 == stat(image, &sb), "image %s written", image);
+
+    /*
+     * change the text without changing its size or mtime; the image
+     * still matches, so its (old) value must be the one used
+     */
+    if (0 != stat(conf, &sb)) {
+        CHECK(0, "stat %s", conf);
+        return;
+    }
+    mtime = sb.st_mtime;
+    if (write_conf(conf, TEST_SKEW_EDIT) || set_mtime(conf, mtime)) {
+        CHECK(0, "rewrite %s", conf);
+        return;
+    }
+    if (NULL != (ctx = make_context(conf, resolv, hints))) {
+        check_skew(ctx, "image", TEST_SKEW_TEXT);
+        check_anchor(ctx, "image", "www.example.com.", "example.com.",
+                     TEST_KEY_TAG, TEST_KEY_ALG, 1);
+        check_anchor(ctx, "image", "example.net.", ".",
+                     TEST_ROOT_DS_TAG, TEST_ROOT_DS_ALG, 0);
+        val_free_context(ctx);
+    }
+
+    /* a newer text makes the image stale */
+    if (set_mtime(conf, mtime + 2)) {
+        CHECK(0, "touch %s", conf);
+        return;
+    }
+    if (NULL != (ctx = make_context(conf, resolv, hints))) {
+        check_skew(ctx, "stale image", TEST_SKEW_EDIT);
+        val_free_context(ctx);
+    }
+
+    /* an image that fails its checksum is ignored */
+    CHECK(VAL_NO_ERROR == val_policy_compile(conf, NULL),
+          "recompile %s", conf);
+    if (write_conf(conf, TEST_SKEW_TEXT) || set_mtime(conf, mtime + 2)) {
+        CHECK(0, "rewrite %s", conf);
+        return;
+    }
+    if (NULL == (fp = fopen(image, "r+b")) ||
+        0 != fseek(fp, 0, SEEK_END) || (off = ftell(fp)) <= 0 ||
+        0 != fseek(fp, off - 1, SEEK_SET) || EOF == (c = fgetc(fp)) ||
+        0 != fseek(fp, off - 1, SEEK_SET) || EOF == fputc(c ^ 0xff, fp)) {
+        CHECK(0, "damage %s", image);
+        if (fp)
+            fclose(fp);
+        return;
+    }
+    fclose(fp);
+    if (NULL != (ctx = make_context(conf, resolv, hints))) {
+        check_skew(ctx, "damaged image", TEST_SKEW_TEXT);
+        val_free_context(ctx);
+    }
+}
+
+/*
+ * engine workers get contexts of their own even with a NULL label, so
+ * freeing the engine must not free (or replace) the default context
+ */
+static void
+test_engine(const char *dir)
+{
+    char            conf[PATH_MAX], resolv[PATH_MAX], hints[PATH_MAX];
+    val_context_opt_t opt;
+    val_async_engine_t *engine = NULL;
+    val_context_t  *ctx, *again = NULL;
+    int             rc;
+
+    snprintf(conf, sizeof(conf), "%s/dnsval.conf", dir);
+    snprintf(resolv, sizeof(resolv), "%s/resolv.conf", dir);
+    snprintf(hints, sizeof(hints), "%s/root.hints", dir);
+
+    if (write_conf(conf, TEST_SKEW_TEXT)) {
+        CHECK(0, "rewrite %s", conf);
+        return;
+    }
+    if (NULL == (ctx = make_context(conf, resolv, hints)))
+        return;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.vc_val_conf = conf;
+    opt.vc_res_conf = resolv;
+    opt.vc_root_conf = hints;
+    rc = val_async_engine_create(NULL, &opt, 3, 0, &engine);
+    if (VAL_NOT_IMPLEMENTED == rc) {
+        val_free_context(ctx);
+        return;
+    }
+    CHECK(VAL_NO_ERROR == rc && engine, "engine with a NULL label");
+    if (engine)
+        val_async_engine_free(engine);
+
+    CHECK(VAL_NO_ERROR == val_create_context(NULL, &again) && again == ctx,
+          "default context kept after the engine is freed");
+    check_skew(ctx, "after engine", TEST_SKEW_TEXT);
+    if (again && again != ctx)
+        val_free_context(again);
+    val_free_context(ctx);
+}
+
+void
+usage(char *progname)
+{
+    fprintf(stderr, "Usage: %s [options]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr,
+            "\t-h             display usage and exit\n");
+    fprintf(stderr,
+            "\t-v             report each check, not just failures\n");
+    fprintf(stderr,
+            "\t-k             keep the test files\n");
+    fprintf(stderr,
+            "\t-o <debug-level>:<dest-type>[:<dest-options>]\n"
+            "\t               log output (see dt-validate)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    char            dir[] = "/tmp/libval_policy_test.XXXXXX";
+    char            path[PATH_MAX];
+    const char     *files[] = {
+        "dnsval.conf", "dnsval.conf" POL_IMAGE_SUFFIX, "resolv.conf",
+        "root.hints"
+    };
+    int             c, i, keep = 0;
+
+    while ((c = getopt(argc, argv, "hvko:")) != -1) {
+        switch (c) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'o':
+            if (NULL == val_log_add_optarg(optarg, 1)) {
+                fprintf(stderr, "Invalid argument for -o\n");
+                return 1;
+            }
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return (c == 'h') ? 0 : 1;
+        }
+    }
+
+    if (NULL == mkdtemp(dir)) {
+        fprintf(stderr, "could not create a directory for the test files\n");
+        return 1;
+    }
+
+    test_keytag();
+    test_policy(dir);
+    test_engine(dir);
+
+    if (keep) {
+        printf("test files kept in %s\n", dir);
+    } else {
+        for (i = 0; i < (int) (sizeof(files) / sizeof(files[0])); i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+            unlink(path);
+        }
+        rmdir(dir);
+    }
+
+    if (failures) {
+        printf("Result: FAILED. %d check%s failed\n", failures,
+               (failures == 1) ? "" : "s");
+        return 1;
+    }
+    printf("Result : OK. \n");
+    return 0;
+}
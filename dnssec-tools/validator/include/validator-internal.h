@@ -404,8 +404,14 @@ extern          "C" {
         char   *base_dnsval_conf;
         struct dnsval_list *dnsval_l;
         policy_entry_t **e_pol;
+        /* label tries over e_pol, see find_zone_policies() */
+        struct policy_trie **e_pol_trie;
+        struct policy_trie *e_pol_retired;
+        long e_pol_expiry;
         val_global_opt_t *g_opt;
         struct val_log *val_log_targets;
+        /* configuration watcher, if any (see val_context_watch_config) */
+        struct val_conf_watch *ctx_watch;
         
         /* Query cache */
         struct val_query_chain *q_list;
@@ -413,6 +419,27 @@ extern          "C" {
 #ifndef VAL_NO_ASYNC
         /* in flight async queries */
         val_async_status       *as_list;
+        /* sockets for in flight async queries */
+        struct res_poller      *as_poller;
+        /* retransmit/cancel deadlines for in flight async queries */
+        struct res_timers      *as_timers;
+        /* application event loop, and the last wakeup asked of it */
+        val_async_event_loop_t  as_loop;
+        struct timeval          as_loop_next;
+        /* bumped when answers arrive, so waiting requests look again */
+        u_int32_t               as_gen;
+        /*
+         * completed requests for val_async_dequeue. Pushed onto as_cq
+         * without locks; consumers move them to as_cq_ready (oldest
+         * first) under as_cq_lock.
+         */
+        val_async_status       *as_cq;
+        val_async_status       *as_cq_ready;
+        /* queue requests submitted from now on */
+        int                     as_cq_on;
+#ifndef VAL_NO_THREADS
+        pthread_mutex_t         as_cq_lock;
+#endif
 #endif
 
         /* default flags that the context applies automatically */
@@ -458,6 +485,22 @@ extern          "C" {
         val_async_event_cb             val_as_result_cb;
         void                          *val_as_cb_user_ctx;
 
+        /* as_gen when last found waiting for answers only */
+        u_int32_t                      val_as_gen;
+
+        /* give up at this time, if set */
+        struct timeval                 val_as_deadline;
+
+        /*
+         * identical requests in flight at the same time share one
+         * validation: the first (the primary) does the work and the
+         * others wait on it.
+         */
+        u_int32_t                      val_as_qflags;
+        struct val_async_status_s     *val_as_primary;
+        struct val_async_status_s     *val_as_waiters;
+        struct val_async_status_s     *val_as_next_waiter;
+
         struct val_async_status_s     *val_as_next;
     };
 #endif
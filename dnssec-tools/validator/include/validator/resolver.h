@@ -162,10 +162,16 @@ struct name_server {
 #define SR_QUERY_NOREC              0x00000010
 #define SR_QUERY_IPV4_ONLY          0x00000020
 #define SR_QUERY_IPV6_ONLY          0x00000040
+#define SR_QUERY_NO_EDNS0_FALLBACK  0x00000080  /* ignore cached EDNS0 limits */
 #define SR_QUERY_VALIDATING_STUB_FLAGS  (SR_QUERY_SET_DO | SR_QUERY_SET_CD) 
 #define SR_QUERY_DEFAULT                (SR_QUERY_RECURSE) 
 
 
+struct res_poller;
+struct res_timers;
+struct res_tcp_conn;
+struct res_inflight;
+
 struct expected_arrival {
     SOCKET          ea_socket;
     char           *ea_name;
@@ -182,6 +188,16 @@ struct expected_arrival {
     struct timeval  ea_next_try;
     struct timeval  ea_cancel_time;
     struct expected_arrival *ea_next;
+    struct res_poller *ea_poller;   /* poller ea_socket is registered with */
+    int             ea_sock_uses;   /* queries sent on a pooled udp socket */
+    time_t          ea_sock_born;   /* when a pooled udp socket was bound */
+    struct res_tcp_conn *ea_tcp_conn; /* shared tcp connection */
+    struct timeval  ea_sent;        /* when the query was last sent */
+    int             ea_sends;       /* transmissions to current address */
+    struct res_inflight *ea_inflight; /* coalesced query (list head only) */
+    struct res_timers *ea_timers;   /* deadline queue ea is registered with */
+    int             ea_timer_slot;  /* heap position + 1, 0 if not queued */
+    struct timeval  ea_timer_key;   /* deadline as queued */
 };
 
 /*
@@ -316,6 +332,226 @@ res_async_ea_isset(struct expected_arrival *ea, fd_set *fds);
 
 void res_switch_all_to_tcp_tid(int trans_id);
 
+/*
+ * limit the number of synchronous transactions which may be in progress
+ * at once (0 means no limit other than available memory). Returns the
+ * previous limit, or -1 if max is invalid.
+ */
+int res_io_set_max_transactions(int max);
+int res_io_get_max_transactions(void);
+int res_io_get_active_transactions(void);
+
+/*
+ * UDP sockets can be kept in a pool after use, so that new queries don't
+ * need to create and bind a socket. A socket's random source port is
+ * retired after it has been used for max_uses queries or is max_age
+ * seconds old. Reusing a port makes spoofed answers easier to land, so
+ * by default each port serves one query, and max_uses and max_age are
+ * capped at 4 queries and 10 seconds. max_idle is the number of unused
+ * sockets kept per address family; 0 disables the pool. Negative values
+ * leave a setting unchanged.
+ */
+void res_io_set_udp_pool(int max_idle, int max_uses, int max_age);
+void res_io_udp_pool_flush(void);
+
+/*
+ * TCP connections to a server are shared by concurrent queries, which
+ * are pipelined and matched to responses by message id. A new
+ * connection is opened once each existing one has max_pipeline queries
+ * outstanding, up to max_conns per server address; 0 disables reuse.
+ * Unused connections are closed after idle_timeout seconds. Negative
+ * (or, for max_pipeline, zero) values leave a setting unchanged.
+ */
+void res_io_set_tcp_reuse(int max_conns, int max_pipeline, int idle_timeout);
+void res_io_tcp_flush(void);
+
+/*
+ * UDP i/o counters. When the first datagram read from a socket is not
+ * the expected answer, the rest of its queue is read with recvmmsg(), up
+ * to batch datagrams per call (where supported); uio_calls_saved counts
+ * the recvfrom() calls this avoided. res_io_set_udp_batch() returns the
+ * previous batch size, or -1 if batch is invalid.
+ */
+struct res_udp_io_stats {
+    unsigned long   uio_send_calls;     /* udp send() calls */
+    unsigned long   uio_recv_calls;     /* recvfrom() calls */
+    unsigned long   uio_batch_calls;    /* recvmmsg() calls */
+    unsigned long   uio_datagrams;      /* datagrams received */
+    unsigned long   uio_calls_saved;
+};
+
+int  res_io_set_udp_batch(int batch);
+void res_io_get_udp_stats(struct res_udp_io_stats *stats);
+void res_io_reset_udp_stats(void);
+
+/*
+ * free the pooled UDP receive buffers
+ */
+void res_io_rbuf_flush(void);
+
+/*
+ * A smoothed round trip time (srtt) and its mean deviation (rttvar) are
+ * kept for each server address, in microseconds. Servers are tried
+ * fastest first, and UDP retransmits use the server's timeout estimate,
+ * bounded by ns_retrans, instead of waiting ns_retrans every time.
+ * res_rtt_get() returns 0 if the address is known, -1 otherwise.
+ * res_rtt_enable() returns the previous setting.
+ */
+int  res_rtt_get(struct sockaddr_storage *addr, long *srtt, long *rttvar);
+int  res_rtt_enable(int on);
+void res_rtt_flush(void);
+
+/*
+ * What earlier queries found out about each server address is cached
+ * for a while, so later queries start with settings that work: the
+ * largest EDNS0 payload size answered (0 if only queries without EDNS0
+ * were answered, -1 if unknown) and the smallest that went unanswered
+ * (-1 if none), whether udp answers are mostly truncated so queries go
+ * straight to tcp, and whether the address has been marked lame, in
+ * which case it is tried after other servers. res_caps_get() returns 0
+ * if the address is known, -1 otherwise. res_caps_enable() returns the
+ * previous setting.
+ */
+struct res_server_caps {
+    int             sc_edns0_size;
+    int             sc_edns0_failed;
+    int             sc_use_tcp;
+    int             sc_lame;
+};
+
+int  res_caps_get(struct sockaddr_storage *addr, struct res_server_caps *caps);
+void res_caps_set_lame(struct sockaddr_storage *addr);
+int  res_caps_enable(int on);
+void res_caps_flush(void);
+
+/*
+ * Each address of the first max_servers servers for a query is tried in
+ * parallel, stagger_ms apart and alternating address families, instead
+ * of one after another; the first answer cancels the other attempts.
+ * 0 servers restores sequential tries. Negative values leave a setting
+ * unchanged.
+ */
+void res_io_set_parallel(int max_servers, int stagger_ms);
+
+/*
+ * A query identical to one already in flight (same name, type, class,
+ * flags and servers) waits for that query's answer instead of sending
+ * its own. res_io_set_coalesce() turns this on or off and returns the
+ * previous setting; res_io_get_coalesced() counts the queries which
+ * have waited on another.
+ */
+int  res_io_set_coalesce(int on);
+unsigned long res_io_get_coalesced(void);
+
+/*
+ * socket poller
+ *
+ * A poller keeps a persistent set of sockets and reports the ones that
+ * have become readable. Unlike an fd_set it has no FD_SETSIZE limit, and
+ * with the epoll and io_uring backends the cost of a wakeup depends on
+ * the number of ready sockets, not on the highest descriptor in use.
+ * RES_POLLER_DEFAULT uses io_uring if it was configured and the kernel
+ * supports it, then epoll, then select.
+ */
+#define RES_POLLER_DEFAULT  0   /* best backend available */
+#define RES_POLLER_SELECT   1
+#define RES_POLLER_EPOLL    2
+#define RES_POLLER_IO_URING 3   /* if configured --with-io-uring */
+
+struct res_poll_event {
+    SOCKET          pe_fd;
+    void           *pe_data;
+};
+
+struct res_poller *res_poller_create(int backend);
+void            res_poller_free(struct res_poller *p);
+int             res_poller_backend(struct res_poller *p);
+const char     *res_poller_backend_name(struct res_poller *p);
+/*
+ * descriptor which becomes readable whenever a registered socket is
+ * readable (so the poller can be nested in an application event loop),
+ * or -1 if the backend has no such descriptor.
+ */
+int             res_poller_fd(struct res_poller *p);
+int             res_poller_count(struct res_poller *p);
+/*
+ * register fd, with data returned in its events. A socket already
+ * registered with the same data gains a reference, and needs one
+ * res_poller_del per add; registering it with other data fails. Once
+ * the last reference is deleted, readiness not yet read and events
+ * still in flight for it are dropped.
+ */
+int             res_poller_add(struct res_poller *p, SOCKET fd, void *data);
+int             res_poller_del(struct res_poller *p, SOCKET fd);
+/*
+ * also report a registered socket as ready while it is writable (on = 1),
+ * or stop doing so (on = 0). Used while a tcp connection has queued
+ * output. Not passed on to a watch callback, so applications watching
+ * sockets themselves only see them flushed when they are next read or
+ * sent on. Returns -1 if fd isn't registered.
+ */
+int             res_poller_want_write(struct res_poller *p, SOCKET fd,
+                                      int on);
+/*
+ * wait up to timeout (NULL = forever) for registered sockets to become
+ * readable (or writable, see res_poller_want_write). Ready sockets are remembered until read (see
+ * res_poller_is_ready), and up to max_events of them are also returned in
+ * events, which may be NULL. Returns the number of ready sockets, 0 on
+ * timeout or -1 on error.
+ */
+int             res_poller_wait(struct res_poller *p, struct timeval *timeout,
+                                struct res_poll_event *events, int max_events);
+int             res_poller_is_ready(struct res_poller *p, SOCKET fd);
+void            res_poller_clear(struct res_poller *p, SOCKET fd);
+/*
+ * mark a registered socket readable, for applications which watch the
+ * sockets themselves rather than calling res_poller_wait. Returns -1
+ * if fd isn't registered.
+ */
+int             res_poller_set_ready(struct res_poller *p, SOCKET fd);
+/*
+ * cb is called with on = 1 when a socket is registered and on = 0 when
+ * it is deregistered (and, when set, for each socket already
+ * registered), so an application can watch the sockets in its own event
+ * loop. It is called after the poller is unlocked, so it may call back
+ * into the poller; calls for one socket from different threads may
+ * arrive out of order. A NULL cb stops the calls.
+ */
+typedef void    (*res_poller_watch_cb)(SOCKET fd, int on, void *data);
+void            res_poller_set_watch(struct res_poller *p,
+                                     res_poller_watch_cb cb, void *data);
+
+/*
+ * register all current and future sockets for the ea list with the
+ * given poller (NULL to deregister).
+ */
+void
+res_async_query_set_poller(struct expected_arrival *ea,
+                           struct res_poller *poller);
+
+/*
+ * Deadline queue. The next deadline of each ea registered with a queue
+ * (retransmit, cancel, or now if an answer is waiting to be collected)
+ * is kept up to date as it changes, so the closest event for all
+ * registered queries is found without walking their ea lists.
+ */
+struct res_timers *res_timers_create(void);
+void            res_timers_free(struct res_timers *t);
+int             res_timers_count(struct res_timers *t);
+/*
+ * earliest deadline (absolute time) in when. Returns 0, or -1 if no
+ * deadlines are queued.
+ */
+int             res_timers_next(struct res_timers *t, struct timeval *when);
+
+/*
+ * register all current and future eas in the list with the given
+ * deadline queue (NULL to deregister).
+ */
+void
+res_async_query_set_timers(struct expected_arrival *ea,
+                           struct res_timers *timers);
+
 /*
  * TSIG interface
  */
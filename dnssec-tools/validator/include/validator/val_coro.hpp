@@ -0,0 +1,713 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * C++20 coroutine interface to the libval async API (header only).
+ *
+ *     val::executor ex;                       // default context
+ *
+ *     val::task<void> lookup(val::executor &ex) {
+ *         val::result r = co_await ex.resolve("www.example.com", ns_t_a);
+ *         if (r.validated()) ...
+ *     }
+ *
+ *     ex.spawn(lookup(ex));
+ *     ex.run();                               // until nothing is pending
+ *
+ * The executor drives one context through the event loop interface
+ * (val_async_set_event_loop) with its own poll() loop, or can be fed by
+ * another loop through fds(), timeout_ms(), process_fd() and
+ * process_timer(). Coroutines are resumed from the executor, never from
+ * inside a library callback.
+ *
+ * An executor, its context and its coroutines belong to the thread that
+ * runs it; only post_remote() and std::stop_source::request_stop() may
+ * be used from other threads. A query is cancelled (val_async_cancel,
+ * val_getaddrinfo_cancel) when its stop_token is triggered, in which
+ * case the operation completes with canceled() set, or when the
+ * coroutine waiting for it is destroyed.
+ */
+#ifndef VAL_CORO_HPP
+#define VAL_CORO_HPP
+
+#include <validator/validator-config.h>
+#include <validator/validator.h>
+#include <validator/val_dane.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace val {
+
+class executor;
+class resolve_op;
+class getaddrinfo_op;
+class dane_op;
+
+/*
+ * task<T>: a lazily started coroutine which can be co_awaited, or run
+ * detached with executor::spawn.
+ */
+template <class T> class task;
+
+namespace detail {
+
+struct task_promise_base {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr      error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template <class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h)
+            noexcept {
+            if (h.promise().continuation)
+                return h.promise().continuation;
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <class T>
+struct task_promise : task_promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+    template <class U> void return_value(U &&v) {
+        value.emplace(std::forward<U>(v));
+    }
+    T take() {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct task_promise<void> : task_promise_base {
+    task<void> get_return_object();
+    void return_void() {}
+    void take() {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+/* fire and forget wrapper for executor::spawn */
+struct detached {
+    struct promise_type {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+} // namespace detail
+
+template <class T = void>
+class task {
+public:
+    using promise_type = detail::task_promise<T>;
+
+    task() = default;
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    task(task &&o) noexcept : h_(std::exchange(o.h_, {})) {}
+    task &operator=(task &&o) noexcept {
+        if (this != &o) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(o.h_, {});
+        }
+        return *this;
+    }
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task() { if (h_) h_.destroy(); }
+
+    bool await_ready() const noexcept { return !h_ || h_.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+        h_.promise().continuation = c;
+        return h_;
+    }
+    T await_resume() { return h_.promise().take(); }
+
+private:
+    std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+template <class T>
+task<T> task_promise<T>::get_return_object() {
+    return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+inline task<void> task_promise<void>::get_return_object() {
+    return task<void>(
+        std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+} // namespace detail
+
+/*
+ * results
+ */
+struct result_chain_deleter {
+    void operator()(struct val_result_chain *r) const {
+        val_free_result_chain(r);
+    }
+};
+struct answer_chain_deleter {
+    void operator()(struct val_answer_chain *a) const {
+        val_free_answer_chain(a);
+    }
+};
+struct addrinfo_deleter {
+    void operator()(struct addrinfo *a) const { val_freeaddrinfo(a); }
+};
+struct dane_deleter {
+    void operator()(struct val_danestatus *d) const { val_free_dane(d); }
+};
+
+/* val_async_submit: as passed to a val_async_event_cb */
+class result {
+public:
+    int          retval = VAL_NO_ERROR;
+    val_status_t status = VAL_DONT_KNOW;
+
+    bool canceled() const { return canceled_; }
+    bool validated() const { return val_isvalidated(status); }
+    bool trusted() const { return val_istrusted(status); }
+    struct val_result_chain *results() const { return results_.get(); }
+    struct val_answer_chain *answers() const { return answers_.get(); }
+
+private:
+    friend class resolve_op;
+    bool canceled_ = false;
+    std::unique_ptr<struct val_result_chain, result_chain_deleter> results_;
+    std::unique_ptr<struct val_answer_chain, answer_chain_deleter> answers_;
+};
+
+/* val_getaddrinfo_submit */
+class addrinfo_result {
+public:
+    int          eai = EAI_FAIL;
+    val_status_t status = VAL_DONT_KNOW;
+
+    bool canceled() const { return canceled_; }
+    bool validated() const { return val_isvalidated(status); }
+    struct addrinfo *get() const { return res_.get(); }
+
+private:
+    friend class getaddrinfo_op;
+    bool canceled_ = false;
+    std::unique_ptr<struct addrinfo, addrinfo_deleter> res_;
+};
+
+/* val_dane_submit */
+class dane_result {
+public:
+    int retval = VAL_DANE_INTERNAL_ERROR;
+
+    bool canceled() const { return retval == VAL_DANE_CANCELLED; }
+    struct val_danestatus *get() const { return res_.get(); }
+
+private:
+    friend class dane_op;
+    std::unique_ptr<struct val_danestatus, dane_deleter> res_;
+};
+
+/*
+ * executor
+ */
+class executor {
+public:
+    /* ctx NULL uses the default context */
+    explicit executor(val_context_t *ctx = NULL)
+        : ctx_(ctx), owner_(std::this_thread::get_id()) {
+        if (0 != pipe(wake_))
+            throw std::runtime_error("val::executor: no wake pipe");
+        fcntl(wake_[0], F_SETFL, O_NONBLOCK);
+        fcntl(wake_[1], F_SETFL, O_NONBLOCK);
+
+        val_async_event_loop_t loop;
+        loop.val_el_watch = &executor::on_watch;
+        loop.val_el_unwatch = &executor::on_unwatch;
+        loop.val_el_timer = &executor::on_timer;
+        loop.val_el_data = this;
+        if (VAL_NO_ERROR != val_async_set_event_loop(ctx_, &loop)) {
+            close(wake_[0]);
+            close(wake_[1]);
+            throw std::runtime_error("val::executor: no event loop support");
+        }
+    }
+    ~executor() {
+        val_async_set_event_loop(ctx_, NULL);
+        close(wake_[0]);
+        close(wake_[1]);
+    }
+    executor(const executor &) = delete;
+    executor &operator=(const executor &) = delete;
+
+    val_context_t *context() const { return ctx_; }
+
+    /* awaitable operations, see below */
+    inline resolve_op resolve(std::string name, int type,
+                              int class_h = ns_c_in, unsigned int flags = 0,
+                              std::stop_token st = {});
+    inline resolve_op resolve(std::string name, int type,
+                              std::stop_token st);
+    inline getaddrinfo_op getaddrinfo(std::string node,
+                                      std::string serv = "",
+                                      const struct addrinfo *hints = NULL,
+                                      std::stop_token st = {});
+    inline dane_op dane(std::string name, struct val_daneparams params,
+                        std::stop_token st = {});
+
+    /*
+     * run a task to completion in the background. An exception leaving
+     * it terminates the program.
+     */
+    template <class T> void spawn(task<T> t) {
+        ++spawned_;
+        [](executor *ex, task<T> t) -> detail::detached {
+            co_await std::move(t);
+            --ex->spawned_;
+        }(this, std::move(t));
+    }
+
+    /* resume h from the executor loop */
+    void post(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+    /* run fn on the executor thread; may be called from any thread */
+    void post_remote(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lk(remote_lock_);
+            remote_.push_back(std::move(fn));
+        }
+        char c = 0;
+        (void) !write(wake_[1], &c, 1);
+    }
+
+    /* run fn now if on the executor thread, else post_remote */
+    void dispatch(std::function<void()> fn) {
+        if (std::this_thread::get_id() == owner_)
+            fn();
+        else
+            post_remote(std::move(fn));
+    }
+
+    /* whether anything is still to be done */
+    bool busy() const {
+        return pending_ || spawned_ || !ready_.empty() || has_remote();
+    }
+
+    /*
+     * for another event loop: watch fds() for input and call
+     * process_fd(); call process_timer() after timeout_ms() (-1 = no
+     * timeout); then call drain().
+     */
+    const std::vector<int> &fds() const { return watched_; }
+    int wake_fd() const { return wake_[0]; }
+    int timeout_ms() const {
+        if (!have_deadline_)
+            return -1;
+        struct timeval now, left;
+        gettimeofday(&now, NULL);
+        if (!timercmp(&now, &deadline_, <))
+            return 0;
+        timersub(&deadline_, &now, &left);
+        return (int) (left.tv_sec * 1000 + (left.tv_usec + 999) / 1000);
+    }
+    void process_fd(int fd) { val_async_process_fd(ctx_, fd, 0); }
+    void process_timer() { val_async_process_timer(ctx_, 0); }
+    void drain() {
+        char buf[64];
+        while (read(wake_[0], buf, sizeof(buf)) > 0)
+            ;
+        std::deque<std::function<void()>> remote;
+        {
+            std::lock_guard<std::mutex> lk(remote_lock_);
+            remote.swap(remote_);
+        }
+        for (auto &fn : remote)
+            fn();
+        while (!ready_.empty()) {
+            std::coroutine_handle<> h = ready_.front();
+            ready_.pop_front();
+            h.resume();
+        }
+    }
+
+    /* wait up to timeout_ms (-1 = until something happens) and process */
+    void run_once(int timeout_ms = -1) {
+        if (!ready_.empty())
+            timeout_ms = 0;
+        int t = this->timeout_ms();
+        if (t >= 0 && (timeout_ms < 0 || t < timeout_ms))
+            timeout_ms = t;
+
+        std::vector<struct pollfd> pfds(watched_.size() + 1);
+        pfds[0].fd = wake_[0];
+        pfds[0].events = POLLIN;
+        for (size_t i = 0; i < watched_.size(); ++i) {
+            pfds[i + 1].fd = watched_[i];
+            pfds[i + 1].events = POLLIN;
+        }
+        int n = poll(pfds.data(), pfds.size(), timeout_ms);
+        for (size_t i = 1; n > 0 && i < pfds.size(); ++i) {
+            if (pfds[i].revents)
+                process_fd(pfds[i].fd);
+        }
+        if (have_deadline_ && 0 == this->timeout_ms())
+            process_timer();
+        drain();
+    }
+
+    /* run until all spawned tasks and queries are done */
+    void run() {
+        while (busy())
+            run_once();
+    }
+
+    /* bookkeeping for operations, used by the awaitables */
+    void op_started() { ++pending_; }
+    void op_finished() { --pending_; }
+    void forget(std::coroutine_handle<> h) {
+        for (auto it = ready_.begin(); it != ready_.end(); ++it) {
+            if (*it == h) {
+                ready_.erase(it);
+                return;
+            }
+        }
+    }
+
+private:
+    bool has_remote() const {
+        std::lock_guard<std::mutex> lk(remote_lock_);
+        return !remote_.empty();
+    }
+
+    /* event loop callbacks; called with the context locked */
+    static void on_watch(val_context_t *, int fd, void *data) {
+        static_cast<executor *>(data)->watched_.push_back(fd);
+    }
+    static void on_unwatch(val_context_t *, int fd, void *data) {
+        std::vector<int> &w = static_cast<executor *>(data)->watched_;
+        for (size_t i = 0; i < w.size(); ++i) {
+            if (w[i] == fd) {
+                w[i] = w.back();
+                w.pop_back();
+                break;
+            }
+        }
+    }
+    static void on_timer(val_context_t *, struct timeval *timeout,
+                         void *data) {
+        executor *ex = static_cast<executor *>(data);
+        ex->have_deadline_ = (NULL != timeout);
+        if (timeout) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            timeradd(&now, timeout, &ex->deadline_);
+        }
+    }
+
+    val_context_t                          *ctx_ = NULL;
+    std::thread::id                         owner_;
+    int                                     wake_[2] = { -1, -1 };
+    std::vector<int>                        watched_;
+    struct timeval                          deadline_ = { 0, 0 };
+    bool                                    have_deadline_ = false;
+    std::deque<std::coroutine_handle<>>     ready_;
+    mutable std::mutex                      remote_lock_;
+    std::deque<std::function<void()>>       remote_;
+    long                                    pending_ = 0;
+    long                                    spawned_ = 0;
+};
+
+namespace detail {
+
+/*
+ * state shared by an awaitable, the library callback and stop
+ * requests. The library callback data points at it, and it outlives
+ * the query: the awaitable cancels the query before letting go.
+ */
+template <class Result>
+struct op_state {
+    executor                *ex;
+    std::coroutine_handle<>  waiter;    /* NULL once not waiting */
+    bool                     running = false;
+    Result                   res;
+
+    void complete() {
+        if (running) {
+            running = false;
+            ex->op_finished();
+        }
+        if (waiter)
+            ex->post(std::exchange(waiter, nullptr));
+    }
+};
+
+/*
+ * common awaitable shape: submit in await_suspend, cancel on stop or
+ * destruction
+ */
+template <class Derived, class Result>
+class op_base {
+public:
+    op_base(executor &ex, std::stop_token st)
+        : state_(std::make_shared<op_state<Result>>()), st_(std::move(st)) {
+        state_->ex = &ex;
+    }
+    op_base(op_base &&) = default;
+    ~op_base() {
+        if (!state_)
+            return;
+        stop_.reset();
+        if (state_->waiter) {
+            state_->ex->forget(state_->waiter);
+            state_->waiter = nullptr;
+        }
+        if (state_->running)
+            static_cast<Derived *>(this)->cancel();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        state_->waiter = h;
+        state_->running = true;
+        state_->ex->op_started();
+        if (!static_cast<Derived *>(this)->submit()) {
+            /* not submitted; carry on with the error */
+            state_->waiter = nullptr;
+            if (state_->running) {
+                state_->running = false;
+                state_->ex->op_finished();
+            }
+            return false;
+        }
+        /*
+         * if it was answered inside submit, the resume is already
+         * posted
+         */
+        if (state_->running && st_.stop_possible()) {
+            std::weak_ptr<op_state<Result>> weak = state_;
+            Derived *self = static_cast<Derived *>(this);
+            stop_.emplace(st_, [weak, self] {
+                if (auto s = weak.lock())
+                    s->ex->dispatch([weak, self] {
+                        auto s = weak.lock();
+                        if (s && s->running)
+                            self->cancel();
+                    });
+            });
+        }
+        return true;
+    }
+    Result await_resume() {
+        stop_.reset();
+        return std::move(state_->res);
+    }
+
+protected:
+    std::shared_ptr<op_state<Result>> state_;
+    std::stop_token                   st_;
+    std::optional<std::stop_callback<std::function<void()>>> stop_;
+};
+
+} // namespace detail
+
+/*
+ * co_await ex.resolve(name, type): val_async_submit
+ */
+class resolve_op : public detail::op_base<resolve_op, result> {
+public:
+    resolve_op(executor &ex, std::string name, int type, int class_h,
+               unsigned int flags, std::stop_token st)
+        : op_base(ex, std::move(st)), name_(std::move(name)), type_(type),
+          class_(class_h), flags_(flags) {}
+    resolve_op(resolve_op &&) = default;
+
+    bool submit() {
+        int rc = val_async_submit(state_->ex->context(), name_.c_str(),
+                                  class_, type_, flags_, &callback,
+                                  state_.get(), &as_);
+        if (VAL_NO_ERROR != rc) {
+            state_->res.retval = rc;
+            return false;
+        }
+        return true;
+    }
+    void cancel() {
+        /* the callback sees VAL_AS_EVENT_CANCELED */
+        val_async_cancel(state_->ex->context(), as_, 0);
+    }
+
+private:
+    static int callback(val_async_status *, int event, val_context_t *,
+                        void *data, val_cb_params_t *cbp) {
+        auto *s = static_cast<detail::op_state<result> *>(data);
+        s->res.retval = cbp->retval;
+        s->res.status = cbp->val_status;
+        s->res.canceled_ = (VAL_AS_EVENT_CANCELED == event);
+        /* keep the results; the library won't free them */
+        s->res.results_.reset(cbp->results);
+        s->res.answers_.reset(cbp->answers);
+        cbp->results = NULL;
+        cbp->answers = NULL;
+        s->complete();
+        return 0;
+    }
+
+    std::string       name_;
+    int               type_, class_;
+    unsigned int      flags_;
+    val_async_status *as_ = NULL;
+};
+
+/*
+ * co_await ex.getaddrinfo(node, serv, hints): val_getaddrinfo_submit
+ */
+class getaddrinfo_op : public detail::op_base<getaddrinfo_op,
+                                              addrinfo_result> {
+public:
+    getaddrinfo_op(executor &ex, std::string node, std::string serv,
+                   const struct addrinfo *hints, std::stop_token st)
+        : op_base(ex, std::move(st)), node_(std::move(node)),
+          serv_(std::move(serv)), have_hints_(NULL != hints) {
+        if (hints)
+            hints_ = *hints;
+    }
+    getaddrinfo_op(getaddrinfo_op &&) = default;
+
+    bool submit() {
+        int rc = val_getaddrinfo_submit(state_->ex->context(),
+                                        node_.empty() ? NULL : node_.c_str(),
+                                        serv_.empty() ? NULL : serv_.c_str(),
+                                        have_hints_ ? &hints_ : NULL,
+                                        &callback, state_.get(), 0,
+                                        &status_);
+        if (VAL_NO_ERROR != rc) {
+            state_->res.eai = EAI_FAIL;
+            return false;
+        }
+        /* local answers come back before submit returns */
+        return true;
+    }
+    void cancel() {
+        val_getaddrinfo_cancel(status_, 0);
+    }
+
+private:
+    static int callback(void *data, int eai, struct addrinfo *res,
+                        val_status_t status) {
+        auto *s = static_cast<detail::op_state<addrinfo_result> *>(data);
+        s->res.eai = eai;
+        s->res.status = status;
+        s->res.canceled_ = (VAL_AS_EVENT_CANCELED == eai);
+        s->res.res_.reset(res);
+        s->complete();
+        return 0;
+    }
+
+    std::string      node_, serv_;
+    struct addrinfo  hints_ = {};
+    bool             have_hints_;
+    val_gai_status  *status_ = NULL;
+};
+
+/*
+ * co_await ex.dane(name, params): val_dane_submit
+ */
+class dane_op : public detail::op_base<dane_op, dane_result> {
+public:
+    dane_op(executor &ex, std::string name, struct val_daneparams params,
+            std::stop_token st)
+        : op_base(ex, std::move(st)), name_(std::move(name)),
+          params_(params) {}
+    dane_op(dane_op &&) = default;
+
+    bool submit() {
+        int rc = val_dane_submit(state_->ex->context(), name_.c_str(),
+                                 &params_, &callback, state_.get(), &as_);
+        if (VAL_NO_ERROR != rc) {
+            state_->res.retval = VAL_DANE_INTERNAL_ERROR;
+            return false;
+        }
+        return true;
+    }
+    void cancel() {
+        /* the callback gets VAL_DANE_CANCELLED */
+        val_async_cancel(state_->ex->context(), as_, 0);
+    }
+
+private:
+    static int callback(void *data, int retval,
+                        struct val_danestatus **res) {
+        auto *s = static_cast<detail::op_state<dane_result> *>(data);
+        s->res.retval = retval;
+        s->res.res_.reset(res ? *res : NULL);
+        s->complete();
+        return 0;
+    }
+
+    std::string            name_;
+    struct val_daneparams  params_;
+    val_async_status      *as_ = NULL;
+};
+
+inline resolve_op
+executor::resolve(std::string name, int type, int class_h,
+                  unsigned int flags, std::stop_token st)
+{
+    return resolve_op(*this, std::move(name), type, class_h, flags,
+                      std::move(st));
+}
+
+inline resolve_op
+executor::resolve(std::string name, int type, std::stop_token st)
+{
+    return resolve(std::move(name), type, ns_c_in, 0, std::move(st));
+}
+
+inline getaddrinfo_op
+executor::getaddrinfo(std::string node, std::string serv,
+                      const struct addrinfo *hints, std::stop_token st)
+{
+    return getaddrinfo_op(*this, std::move(node), std::move(serv), hints,
+                          std::move(st));
+}
+
+inline dane_op
+executor::dane(std::string name, struct val_daneparams params,
+               std::stop_token st)
+{
+    return dane_op(*this, std::move(name), params, std::move(st));
+}
+
+} // namespace val
+
+#endif /* VAL_CORO_HPP */
@@ -393,6 +393,8 @@ typedef struct val_context_opt {
 #define VAL_AS_DONE                  0x01000000 /* have results/answers */
 #define VAL_AS_CALLBACK_CALLED       0x02000000 /* called user callbacks */
 #define VAL_AS_INFLIGHT              0x04000000 /* called user callbacks */
+#define VAL_AS_COMPLETION_QUEUE      0x08000000 /* queue, don't call cb */
+#define VAL_AS_QUEUED                0x10000000 /* on completion queue */
 
     /*
      * asynchronous events
@@ -422,6 +424,14 @@ typedef struct val_context_opt {
                                      int type_h, unsigned int flags,
                                      val_async_event_cb callback, void *cb_data,
                                      val_async_status **async_status);
+    int             val_async_submit_ex(val_context_t * ctx,
+                                        const char * domain_name,
+                                        int class_h, int type_h,
+                                        unsigned int flags,
+                                        const struct timeval *budget,
+                                        val_async_event_cb callback,
+                                        void *cb_data,
+                                        val_async_status **async_status);
     int             val_async_check_wait(val_context_t *context,
                                          fd_set *pending_desc, int *nfds,
                                          struct timeval *tv, unsigned int flags);
@@ -432,6 +442,34 @@ typedef struct val_context_opt {
                                     fd_set *fds,
                                     int *num_fds,
                                     struct timeval *timeout);
+    /*
+     * fd_set free interface
+     */
+    int             val_async_poll_info(val_context_t *context,
+                                        int *pollfd, struct timeval *timeout);
+    int             val_async_check_poll(val_context_t *context,
+                                         struct timeval *timeout,
+                                         unsigned int flags);
+
+    /*
+     * event loop interface
+     */
+    typedef struct val_async_event_loop_s {
+        /** start/stop watching fd for read */
+        void      (*val_el_watch)(val_context_t *ctx, int fd, void *data);
+        void      (*val_el_unwatch)(val_context_t *ctx, int fd, void *data);
+        /** call val_async_process_timer after timeout; NULL = no timer */
+        void      (*val_el_timer)(val_context_t *ctx,
+                                  struct timeval *timeout, void *data);
+        void       *val_el_data;
+    } val_async_event_loop_t;
+
+    int             val_async_set_event_loop(val_context_t *context,
+                                             val_async_event_loop_t *loop);
+    int             val_async_process_fd(val_context_t *context, int fd,
+                                         unsigned int flags);
+    int             val_async_process_timer(val_context_t *context,
+                                            unsigned int flags);
 
     /*
      * cancellation flags
@@ -445,6 +483,47 @@ typedef struct val_context_opt {
     int             val_async_cancel_all(val_context_t *context, unsigned int flags);
     unsigned int    val_async_getflags(val_async_status *as);
 
+    /*
+     * completion queue interface
+     */
+    int             val_async_set_completion_queue(val_context_t *context,
+                                                   int on);
+    int             val_async_dequeue(val_context_t *context,
+                                      val_async_status **batch, int max);
+    int             val_async_get_params(val_async_status *as,
+                                         val_cb_params_t *cbp);
+    int             val_async_release(val_async_status *as);
+
+    /*
+     * multi-threaded engine
+     */
+#define VAL_ENGINE_COMPLETION_QUEUE    0x00000001 /* don't call callbacks */
+
+    /** opaque engine, owning a pool of worker threads */
+    typedef struct val_async_engine_s val_async_engine_t;
+
+    int             val_async_engine_create(const char *label,
+                                            val_context_opt_t *opt,
+                                            int nthreads, unsigned int flags,
+                                            val_async_engine_t **engine);
+    int             val_async_engine_submit(val_async_engine_t *engine,
+                                            const char *domain_name,
+                                            int class_h, int type_h,
+                                            unsigned int flags,
+                                            val_async_event_cb callback,
+                                            void *cb_data);
+    int             val_async_engine_submit_ex(val_async_engine_t *engine,
+                                               const char *domain_name,
+                                               int class_h, int type_h,
+                                               unsigned int flags,
+                                               const struct timeval *budget,
+                                               val_async_event_cb callback,
+                                               void *cb_data);
+    int             val_async_engine_dequeue(val_async_engine_t *engine,
+                                             val_async_status **batch,
+                                             int max);
+    void            val_async_engine_free(val_async_engine_t *engine);
+
     /*
      * backwards compatibility
      */
@@ -475,6 +554,14 @@ typedef struct val_context_opt {
                                           unsigned int flags,
                                           struct val_result_chain
                                           **results);
+    int             val_resolve_and_check_ex(val_context_t * context,
+                                             const char * domain_name,
+                                             int class_h,
+                                             int type_h,
+                                             unsigned int flags,
+                                             const struct timeval *budget,
+                                             struct val_result_chain
+                                             **results);
 
 
     /*
@@ -499,6 +586,9 @@ typedef struct val_context_opt {
                                           unsigned char action,
                                           unsigned int flags);
 
+    int             val_context_watch_config(val_context_t *context,
+                                             int interval);
+
     int             val_context_store_ns_for_zone(val_context_t *context, 
                                                   char * zone, char *resp_server,
                                                   int recursive);
@@ -516,6 +606,8 @@ typedef struct val_context_opt {
                                       val_policy_handle_t **pol);
     int             val_remove_valpolicy(val_context_t *context, 
                                       val_policy_handle_t *pol);
+    int             val_policy_compile(const char *dnsval_conf,
+                                       const char *image);
     struct name_server *val_get_nameservers(val_context_t *ctx);
     /*
      * from val_x_query.c 
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * DESCRIPTION
+ * Hash tables of per-server entries, keyed on the server's address and
+ * port, with entries that expire a fixed time after they were last
+ * updated. The round trip time cache (res_rtt.c) and the capability
+ * cache (res_caps.c) each keep one. A validator can talk to any number
+ * of servers, so each table is capped at ac_max entries, with the least
+ * recently used entry making way for a new one.
+ */
+#include "validator-internal.h"
+
+#include "res_support.h"
+#include "res_addr_cache.h"
+
+/*
+ * address bytes used as the cache key
+ */
+static const u_char *
+_addr_key(struct sockaddr_storage *addr, size_t *len, u_int16_t *port)
+{
+    if (AF_INET == addr->ss_family) {
+        struct sockaddr_in *sa = (struct sockaddr_in *) addr;
+        *len = sizeof(sa->sin_addr);
+        *port = sa->sin_port;
+        return (const u_char *) &sa->sin_addr;
+    }
+#ifdef VAL_IPV6
+    if (AF_INET6 == addr->ss_family) {
+        struct sockaddr_in6 *sa = (struct sockaddr_in6 *) addr;
+        *len = sizeof(sa->sin6_addr);
+        *port = sa->sin6_port;
+        return (const u_char *) &sa->sin6_addr;
+    }
+#endif
+    *len = 0;
+    *port = 0;
+    return NULL;
+}
+
+static int
+_addr_same(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+    const u_char   *ka, *kb;
+    size_t          la, lb;
+    u_int16_t       pa, pb;
+
+    if (a->ss_family != b->ss_family)
+        return 0;
+    ka = _addr_key(a, &la, &pa);
+    kb = _addr_key(b, &lb, &pb);
+    if ((NULL == ka) || (NULL == kb))
+        return 0;
+    return (la == lb) && (pa == pb) && !memcmp(ka, kb, la);
+}
+
+static int
+_addr_bucket(struct sockaddr_storage *addr)
+{
+    const u_char   *key;
+    size_t          len, i;
+    u_int16_t       port;
+    u_int32_t       h = 2166136261U;    /* FNV-1a */
+
+    key = _addr_key(addr, &len, &port);
+    if (NULL == key)
+        return -1;
+    for (i = 0; i < len; ++i)
+        h = (h ^ key[i]) * 16777619U;
+    h = (h ^ (port & 0xff)) * 16777619U;
+    h = (h ^ (port >> 8)) * 16777619U;
+
+    return h % RES_ADDR_BUCKETS;
+}
+
+static void
+_lru_unlink(struct res_addr_cache *c, struct res_addr_entry *e)
+{
+    if (e->ae_lru_prev)
+        e->ae_lru_prev->ae_lru_next = e->ae_lru_next;
+    else
+        c->ac_lru_head = e->ae_lru_next;
+    if (e->ae_lru_next)
+        e->ae_lru_next->ae_lru_prev = e->ae_lru_prev;
+    else
+        c->ac_lru_tail = e->ae_lru_prev;
+    e->ae_lru_prev = NULL;
+    e->ae_lru_next = NULL;
+}
+
+static void
+_lru_push(struct res_addr_cache *c, struct res_addr_entry *e)
+{
+    e->ae_lru_prev = NULL;
+    e->ae_lru_next = c->ac_lru_head;
+    if (c->ac_lru_head)
+        c->ac_lru_head->ae_lru_prev = e;
+    else
+        c->ac_lru_tail = e;
+    c->ac_lru_head = e;
+}
+
+/*
+ * unlink an entry from its bucket and the use list, and free it
+ */
+static void
+_entry_drop(struct res_addr_cache *c, struct res_addr_entry **prev)
+{
+    struct res_addr_entry *e = *prev;
+
+    *prev = e->ae_next;
+    _lru_unlink(c, e);
+    --c->ac_count;
+    FREE(e);
+}
+
+/*
+ * drop the least recently used entry
+ */
+static void
+_entry_evict(struct res_addr_cache *c)
+{
+    struct res_addr_entry **prev, *e = c->ac_lru_tail;
+    int             b;
+
+    if ((NULL == e) || ((b = _addr_bucket(&e->ae_addr)) < 0))
+        return;
+    for (prev = &c->ac_table[b]; *prev; prev = &(*prev)->ae_next) {
+        if (*prev == e) {
+            _entry_drop(c, prev);
+            return;
+        }
+    }
+}
+
+struct res_addr_entry *
+res_addr_cache_find(struct res_addr_cache *c, struct sockaddr_storage *addr,
+                    int create, time_t now)
+{
+    struct res_addr_entry **prev, *e;
+    int             b;
+
+    if ((NULL == c) || (NULL == addr) || ((b = _addr_bucket(addr)) < 0))
+        return NULL;
+
+    for (prev = &c->ac_table[b]; *prev; prev = &(*prev)->ae_next) {
+        if (!_addr_same(&(*prev)->ae_addr, addr))
+            continue;
+        e = *prev;
+        if ((now - e->ae_updated) < c->ac_ttl) {
+            if (e != c->ac_lru_head) {
+                _lru_unlink(c, e);
+                _lru_push(c, e);
+            }
+            return e;
+        }
+        _entry_drop(c, prev);
+        break;
+    }
+
+    if (!create)
+        return NULL;
+
+    if ((c->ac_max > 0) && (c->ac_count >= c->ac_max))
+        _entry_evict(c);
+
+    e = (struct res_addr_entry *) MALLOC(c->ac_entry_size);
+    if (NULL == e)
+        return NULL;
+    memset(e, 0, c->ac_entry_size);
+    memcpy(&e->ae_addr, addr, sizeof(e->ae_addr));
+    if (c->ac_init)
+        c->ac_init(e, now);
+    e->ae_next = c->ac_table[b];
+    c->ac_table[b] = e;
+    _lru_push(c, e);
+    ++c->ac_count;
+
+    return e;
+}
+
+void
+res_addr_cache_flush(struct res_addr_cache *c)
+{
+    struct res_addr_entry *e;
+    int             i;
+
+    if (NULL == c)
+        return;
+
+    for (i = 0; i < RES_ADDR_BUCKETS; ++i) {
+        while (c->ac_table[i]) {
+            e = c->ac_table[i];
+            c->ac_table[i] = e->ae_next;
+            FREE(e);
+        }
+    }
+    c->ac_lru_head = NULL;
+    c->ac_lru_tail = NULL;
+    c->ac_count = 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+#ifndef __RES_ADDR_CACHE_H__
+#define __RES_ADDR_CACHE_H__
+
+#define RES_ADDR_BUCKETS    256
+#define RES_ADDR_MAX        1024    /* entries kept per cache */
+
+/*
+ * common head of an entry keyed on a server address (and port). Each
+ * cache embeds this as the first member of its own entry structure.
+ */
+struct res_addr_entry {
+    struct sockaddr_storage ae_addr;
+    time_t          ae_updated;     /* entry expires ttl after this */
+    struct res_addr_entry *ae_next;
+    struct res_addr_entry *ae_lru_prev;  /* more recently used */
+    struct res_addr_entry *ae_lru_next;  /* less recently used */
+};
+
+/*
+ * hash table of entries of ac_entry_size bytes. ac_init, if set, fills
+ * in a new entry (already zeroed, with its address set). Entries are
+ * also kept in order of use, so that once the table holds ac_max of
+ * them, adding another drops the one least recently looked up. Locking
+ * is up to the owner of the table.
+ */
+struct res_addr_cache {
+    struct res_addr_entry *ac_table[RES_ADDR_BUCKETS];
+    size_t          ac_entry_size;
+    time_t          ac_ttl;
+    void            (*ac_init)(struct res_addr_entry *e, time_t now);
+    int             ac_max;
+    int             ac_count;
+    struct res_addr_entry *ac_lru_head;
+    struct res_addr_entry *ac_lru_tail;
+};
+
+#define RES_ADDR_CACHE_INIT(type, ttl, init) \
+    { { NULL }, sizeof(type), (ttl), (init), RES_ADDR_MAX, 0, NULL, NULL }
+
+/*
+ * find the entry for addr, dropping it if it has expired. If create is
+ * set, a missing entry is added.
+ */
+struct res_addr_entry *res_addr_cache_find(struct res_addr_cache *c,
+                                           struct sockaddr_storage *addr,
+                                           int create, time_t now);
+/*
+ * drop every entry
+ */
+void            res_addr_cache_flush(struct res_addr_cache *c);
+
+#endif                          /* __RES_ADDR_CACHE_H__ */
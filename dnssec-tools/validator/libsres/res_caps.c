@@ -0,0 +1,340 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * DESCRIPTION
+ * Server capability cache. For each server address we remember what
+ * earlier queries found out about it, so later queries can start with
+ * settings that work instead of discovering them again through retries:
+ *
+ *  - EDNS0: the largest payload size that has been answered, and the
+ *    smallest that went unanswered and had to be retried smaller (see
+ *    res_nsfallback_ea). Once a smaller size has been answered, new
+ *    queries start at that size, or without EDNS0 if only plain queries
+ *    get through. A failure at a size already known to work is taken
+ *    to be packet loss and ignored.
+ *  - truncation: if most udp answers come back truncated, new queries
+ *    go straight to tcp instead of paying a udp round trip first.
+ *  - lameness: libval marks addresses whose answers lead to a lame
+ *    delegation. These are tried after the other servers.
+ *
+ * Findings expire after RES_CAPS_TTL (RES_CAPS_LAME_TTL for lameness)
+ * seconds, so a server that is fixed gets probed again.
+ */
+#include "validator-internal.h"
+
+#include "res_support.h"
+#include "res_addr_cache.h"
+#include "res_caps.h"
+
+#ifdef VAL_NO_THREADS
+#define pthread_mutex_lock(x)
+#define pthread_mutex_unlock(x)
+#endif
+
+#define RES_CAPS_TTL        900     /* seconds */
+#define RES_CAPS_LAME_TTL   600     /* seconds */
+#define RES_CAPS_TC_MIN     3       /* truncated answers before using tcp */
+
+struct res_caps_entry {
+    struct res_addr_entry ce_head;  /* must be first */
+    int             ce_edns0_ok;    /* largest size answered, -1 unknown */
+    int             ce_edns0_bad;   /* smallest size unanswered, -1 none */
+    time_t          ce_edns0_time;  /* when the EDNS0 findings started */
+    int             ce_udp_answers;
+    int             ce_udp_truncated;
+    time_t          ce_udp_time;    /* when the udp counts started */
+    time_t          ce_lame_until;
+};
+
+static void     _caps_init(struct res_addr_entry *e, time_t now);
+
+static struct res_addr_cache _caps_cache =
+    RES_ADDR_CACHE_INIT(struct res_caps_entry, RES_CAPS_TTL, _caps_init);
+static int      _caps_enabled = 1;
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t caps_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+_caps_init(struct res_addr_entry *e, time_t now)
+{
+    struct res_caps_entry *ce = (struct res_caps_entry *) e;
+
+    ce->ce_edns0_ok = -1;
+    ce->ce_edns0_bad = -1;
+    ce->ce_edns0_time = now;
+    ce->ce_udp_time = now;
+}
+
+/*
+ * forget findings that have expired. caller has lock.
+ */
+static void
+_caps_age(struct res_caps_entry *e, time_t now)
+{
+    if ((now - e->ce_edns0_time) >= RES_CAPS_TTL) {
+        e->ce_edns0_ok = -1;
+        e->ce_edns0_bad = -1;
+        e->ce_edns0_time = now;
+    }
+    if ((now - e->ce_udp_time) >= RES_CAPS_TTL) {
+        e->ce_udp_answers = 0;
+        e->ce_udp_truncated = 0;
+        e->ce_udp_time = now;
+    }
+}
+
+/*
+ * find the entry for addr, adding it if create is set. caller has lock.
+ */
+static struct res_caps_entry *
+_caps_find(struct sockaddr_storage *addr, int create, time_t now)
+{
+    struct res_caps_entry *e = (struct res_caps_entry *)
+        res_addr_cache_find(&_caps_cache, addr, create, now);
+
+    if (e)
+        _caps_age(e, now);
+    return e;
+}
+
+/*
+ * truncation is common enough that udp isn't worth trying first.
+ * caller has lock.
+ */
+static int
+_caps_tcp(struct res_caps_entry *e)
+{
+    return (e->ce_udp_truncated >= RES_CAPS_TC_MIN) &&
+        ((2 * e->ce_udp_truncated) > e->ce_udp_answers);
+}
+
+void
+res_caps_answer(struct sockaddr_storage *addr, int edns0_size,
+                int truncated, int stream)
+{
+    struct res_caps_entry *e;
+    struct timeval  now;
+
+    if (!_caps_enabled || !addr || stream)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&caps_mutex);
+    e = _caps_find(addr, 1, now.tv_sec);
+    if (e) {
+        if (edns0_size > e->ce_edns0_ok) {
+            e->ce_edns0_ok = edns0_size;
+            if ((e->ce_edns0_bad >= 0) && (e->ce_edns0_bad <= edns0_size))
+                e->ce_edns0_bad = -1;
+        }
+        ++e->ce_udp_answers;
+        if (truncated)
+            ++e->ce_udp_truncated;
+        e->ce_head.ae_updated = now.tv_sec;
+    }
+    pthread_mutex_unlock(&caps_mutex);
+}
+
+void
+res_caps_fallback(struct sockaddr_storage *addr, int edns0_size)
+{
+    struct res_caps_entry *e;
+    struct timeval  now;
+
+    if (!_caps_enabled || !addr || edns0_size <= 0)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&caps_mutex);
+    e = _caps_find(addr, 1, now.tv_sec);
+    if (e && (edns0_size > e->ce_edns0_ok) &&
+        ((e->ce_edns0_bad < 0) || (edns0_size < e->ce_edns0_bad))) {
+        e->ce_edns0_bad = edns0_size;
+        e->ce_head.ae_updated = now.tv_sec;
+        res_log(NULL, LOG_DEBUG, "libsres: ""caps: edns0 size %d failed",
+                edns0_size);
+    }
+    pthread_mutex_unlock(&caps_mutex);
+}
+
+/*
+ * 1 if addr has been marked lame. caller has lock.
+ */
+static int
+_caps_lame(struct sockaddr_storage *addr, time_t now)
+{
+    struct res_caps_entry *e = _caps_find(addr, 0, now);
+
+    return (e && (e->ce_lame_until > now)) ? 1 : 0;
+}
+
+void
+res_caps_order(struct name_server **ns_list)
+{
+    struct name_server *ns, *good = NULL, *lame = NULL;
+    struct name_server **gtail = &good, **ltail = &lame;
+    struct sockaddr_storage *addr;
+    struct timeval  now;
+    int             i, j, nlame = 0;
+
+    if (!_caps_enabled || !ns_list || !*ns_list)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&caps_mutex);
+    for (ns = *ns_list; ns; ns = ns->ns_next) {
+        /* lame addresses last, otherwise keeping the order */
+        for (i = 0, j = 0; i < ns->ns_number_of_addresses; ++i) {
+            addr = ns->ns_address[i];
+            if (_caps_lame(addr, now.tv_sec))
+                continue;
+            memmove(&ns->ns_address[j + 1], &ns->ns_address[j],
+                    (i - j) * sizeof(ns->ns_address[0]));
+            ns->ns_address[j++] = addr;
+        }
+    }
+    /* then servers whose best address is lame */
+    for (ns = *ns_list; ns; ns = ns->ns_next) {
+        if ((ns->ns_number_of_addresses > 0) &&
+            _caps_lame(ns->ns_address[0], now.tv_sec)) {
+            *ltail = ns;
+            ltail = &ns->ns_next;
+            ++nlame;
+        } else {
+            *gtail = ns;
+            gtail = &ns->ns_next;
+        }
+    }
+    pthread_mutex_unlock(&caps_mutex);
+
+    *ltail = NULL;
+    *gtail = lame;
+    *ns_list = good;
+
+    if (nlame)
+        res_log(NULL, LOG_DEBUG, "libsres: ""caps: %d lame server(s) last",
+                nlame);
+}
+
+int
+res_caps_edns0(struct name_server *ns)
+{
+    struct res_caps_entry *e;
+    struct timeval  now;
+    int             size = -1;
+
+    if (!_caps_enabled || !ns || ns->ns_number_of_addresses < 1 ||
+        !(ns->ns_options & SR_QUERY_SET_DO) ||
+        (ns->ns_options & SR_QUERY_NO_EDNS0_FALLBACK))
+        return 0;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&caps_mutex);
+    e = _caps_find(ns->ns_address[0], 0, now.tv_sec);
+    /* only once a smaller size is known to get through */
+    if (e && (e->ce_edns0_bad >= 0) && (e->ce_edns0_ok >= 0) &&
+        (e->ce_edns0_ok < ns->ns_edns0_size))
+        size = e->ce_edns0_ok;
+    pthread_mutex_unlock(&caps_mutex);
+
+    if (size < 0)
+        return 0;
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""caps: edns0 size %d > %d",
+            ns->ns_edns0_size, size);
+    ns->ns_edns0_size = size;
+    if (0 == size)
+        ns->ns_options &= ~SR_QUERY_VALIDATING_STUB_FLAGS;
+    return 1;
+}
+
+int
+res_caps_use_tcp(struct sockaddr_storage *addr)
+{
+    struct res_caps_entry *e;
+    struct timeval  now;
+    int             rc = 0;
+
+    if (!_caps_enabled || !addr)
+        return 0;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&caps_mutex);
+    e = _caps_find(addr, 0, now.tv_sec);
+    if (e)
+        rc = _caps_tcp(e);
+    pthread_mutex_unlock(&caps_mutex);
+
+    return rc;
+}
+
+void
+res_caps_set_lame(struct sockaddr_storage *addr)
+{
+    struct res_caps_entry *e;
+    struct timeval  now;
+
+    if (!_caps_enabled || !addr)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&caps_mutex);
+    e = _caps_find(addr, 1, now.tv_sec);
+    if (e) {
+        e->ce_lame_until = now.tv_sec + RES_CAPS_LAME_TTL;
+        e->ce_head.ae_updated = now.tv_sec;
+    }
+    pthread_mutex_unlock(&caps_mutex);
+}
+
+int
+res_caps_get(struct sockaddr_storage *addr, struct res_server_caps *caps)
+{
+    struct res_caps_entry *e;
+    struct timeval  now;
+    int             rc = -1;
+
+    if (NULL == addr || NULL == caps)
+        return -1;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&caps_mutex);
+    e = _caps_find(addr, 0, now.tv_sec);
+    if (e) {
+        caps->sc_edns0_size = e->ce_edns0_ok;
+        caps->sc_edns0_failed = e->ce_edns0_bad;
+        caps->sc_use_tcp = _caps_tcp(e);
+        caps->sc_lame = (e->ce_lame_until > now.tv_sec) ? 1 : 0;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&caps_mutex);
+
+    return rc;
+}
+
+int
+res_caps_enable(int on)
+{
+    int old = _caps_enabled;
+
+    _caps_enabled = on ? 1 : 0;
+    return old;
+}
+
+void
+res_caps_flush(void)
+{
+    pthread_mutex_lock(&caps_mutex);
+    res_addr_cache_flush(&_caps_cache);
+    pthread_mutex_unlock(&caps_mutex);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+#ifndef __RES_CAPS_H__
+#define __RES_CAPS_H__
+
+/*
+ * record an answer from a server address. edns0_size is the payload
+ * size the query advertised, or 0 if it was sent without EDNS0.
+ */
+void            res_caps_answer(struct sockaddr_storage *addr,
+                                int edns0_size, int truncated, int stream);
+/*
+ * record that a query advertising edns0_size went unanswered and is
+ * being retried with a smaller size (or without EDNS0).
+ */
+void            res_caps_fallback(struct sockaddr_storage *addr,
+                                  int edns0_size);
+/*
+ * move lame servers (and addresses) to the back of a name server list
+ */
+void            res_caps_order(struct name_server **ns_list);
+/*
+ * start a server's queries at the EDNS0 size known to work for its
+ * first address. Returns 1 if the settings were changed.
+ */
+int             res_caps_edns0(struct name_server *ns);
+/*
+ * whether queries to a server address should go straight to tcp
+ */
+int             res_caps_use_tcp(struct sockaddr_storage *addr);
+
+#endif                          /* __RES_CAPS_H__ */
@@ -15,11 +15,19 @@
  * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
  * WITH THE USE OR PERFORMANCE OF THE SOFTWARE.
  */
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* recvmmsg */
+#endif
+#endif
 #include "validator-internal.h"
 
 #include "res_support.h"
 #include "res_mkquery.h"
 #include "res_io_manager.h"
+#include "res_rtt.h"
+#include "res_caps.h"
+#include "res_timer.h"
 
 #ifndef TRUE
 #define TRUE 1
@@ -47,28 +55,116 @@
             memcpy (a, &b, sizeof(struct timeval));                     \
     } while(0)
 
+/*
+ * Atomic counters, for the limits and statistics shared by all threads.
+ * RES_ATOMIC_ADD returns the new value. RES_ATOMIC_GET and RES_ATOMIC_SET
+ * are an acquire load and a release store, for values published to
+ * readers which don't take a lock.
+ */
+#if defined(VAL_NO_THREADS)
+#define RES_ATOMIC_ADD(p, n)    (*(p) += (n))
+#define RES_ATOMIC_CAS(p, o, n) ((*(p) == (o)) ? (*(p) = (n), 1) : 0)
+#define RES_ATOMIC_GET(p)       (*(p))
+#define RES_ATOMIC_SET(p, v)    (*(p) = (v))
+#elif defined(__GNUC__)
+#define RES_ATOMIC_ADD(p, n)    __sync_add_and_fetch((p), (n))
+#define RES_ATOMIC_CAS(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define RES_ATOMIC_GET(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RES_ATOMIC_SET(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#elif defined(WIN32)
+#define RES_ATOMIC_ADD(p, n)                                            \
+    (InterlockedExchangeAdd((volatile LONG *)(p), (n)) + (n))
+#define RES_ATOMIC_CAS(p, o, n)                                         \
+    (InterlockedCompareExchange((volatile LONG *)(p), (n), (o)) == (o))
+#define RES_ATOMIC_GET(p)                                               \
+    InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define RES_ATOMIC_SET(p, v)                                            \
+    ((void) InterlockedExchange((volatile LONG *)(p), (v)))
+#else
+static pthread_mutex_t atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long
+_res_atomic_add(long *p, long n)
+{
+    long v;
+
+    pthread_mutex_lock(&atomic_mutex);
+    v = (*p += n);
+    pthread_mutex_unlock(&atomic_mutex);
+    return v;
+}
+
+static int
+_res_atomic_cas(long *p, long o, long n)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&atomic_mutex);
+    if (*p == o) {
+        *p = n;
+        rc = 1;
+    }
+    pthread_mutex_unlock(&atomic_mutex);
+    return rc;
+}
+
+static void
+_res_atomic_set(long *p, long v)
+{
+    pthread_mutex_lock(&atomic_mutex);
+    *p = v;
+    pthread_mutex_unlock(&atomic_mutex);
+}
+#define RES_ATOMIC_ADD(p, n)    _res_atomic_add((long *)(p), (n))
+#define RES_ATOMIC_CAS(p, o, n) _res_atomic_cas((long *)(p), (o), (n))
+#define RES_ATOMIC_GET(p)       _res_atomic_add((long *)(p), 0)
+#define RES_ATOMIC_SET(p, v)    _res_atomic_set((long *)(p), (v))
+#endif
 
 static long     _max_fd = 0;
-static long     _open_sockets = 0;
-
-#define MAX_TRANSACTIONS    128
-static struct expected_arrival *transactions[MAX_TRANSACTIONS] = {
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+static long     _open_sockets = 0;  /* atomic */
+
+/*
+ * Transaction table
+ *
+ * Synchronous transactions are kept in a table which grows on demand, in
+ * chunks of RES_TR_CHUNK_SIZE slots. Chunks are never moved or freed, so
+ * a slot can be found from its tid without taking the table lock: a new
+ * chunk is stored before the slot count is raised (with release
+ * semantics), and readers load the count (with acquire semantics)
+ * before looking at the chunks it covers. Each
+ * slot has its own lock, protecting the ea list for that transaction;
+ * the table lock is only needed to allocate or release a tid.
+ *
+ * Released tids go to the end of a FIFO free list, so a tid is not
+ * reused until every other free slot has been handed out.
+ *
+ * So that threads don't all queue on the table lock, each thread takes
+ * free tids from the head of the list RES_TR_BATCH at a time, and saves
+ * up the tids it releases to append them RES_TR_BATCH at a time. The
+ * count of tids in use, which the configured limit is checked against,
+ * is kept with atomic operations.
+ */
+#define RES_TR_CHUNK_SIZE   256
+#define RES_TR_MAX_CHUNKS   4096
+#define RES_TR_BATCH        16
+
+struct res_transaction {
+    struct expected_arrival *rt_ea;
+    long                     rt_in_use;     /* atomic */
+    int                      rt_next_free;
+#ifndef VAL_NO_THREADS
+    pthread_mutex_t          rt_lock;
+#endif
 };
 
-static int      next_transaction = 0;
+static struct res_transaction *_tr_chunks[RES_TR_MAX_CHUNKS];
+static long     _tr_count = 0;      /* number of slots allocated (atomic) */
+static long     _tr_active = 0;     /* number of tids in use (atomic) */
+static int      _tr_max = 0;        /* limit on tids in use, 0 = none */
+static int      _tr_free_head = -1;
+static int      _tr_free_tail = -1;
+
 #ifdef VAL_NO_THREADS
 #define pthread_mutex_lock(x)
 #define pthread_mutex_unlock(x)
@@ -76,6 +172,293 @@ static int      next_transaction = 0;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+#define TR_LOCK(t)      pthread_mutex_lock(&(t)->rt_lock)
+#define TR_UNLOCK(t)    pthread_mutex_unlock(&(t)->rt_lock)
+
+/*
+ * number of slots in the table; all of their chunks are in place
+ */
+static int
+_tr_size(void)
+{
+    return (int) RES_ATOMIC_GET(&_tr_count);
+}
+
+/*
+ * return the slot for a tid, or NULL if tid is out of range
+ */
+static struct res_transaction *
+_tr_slot(int tid)
+{
+    struct res_transaction *chunk;
+
+    if ((tid < 0) || (tid >= _tr_size()))
+        return NULL;
+
+    chunk = _tr_chunks[tid / RES_TR_CHUNK_SIZE];
+    if (NULL == chunk)
+        return NULL;
+
+    return &chunk[tid % RES_TR_CHUNK_SIZE];
+}
+
+/*
+ * add a chunk of slots to the table. caller has table lock.
+ */
+static int
+_tr_grow(void)
+{
+    struct res_transaction *chunk;
+    int                     i, c = _tr_count / RES_TR_CHUNK_SIZE;
+
+    if (c >= RES_TR_MAX_CHUNKS)
+        return -1;
+
+    chunk = (struct res_transaction *)
+        MALLOC(RES_TR_CHUNK_SIZE * sizeof(struct res_transaction));
+    if (NULL == chunk)
+        return -1;
+    memset(chunk, 0, RES_TR_CHUNK_SIZE * sizeof(struct res_transaction));
+
+    for (i = 0; i < RES_TR_CHUNK_SIZE; ++i) {
+#ifndef VAL_NO_THREADS
+        if (0 != pthread_mutex_init(&chunk[i].rt_lock, NULL)) {
+            while (--i >= 0)
+                pthread_mutex_destroy(&chunk[i].rt_lock);
+            FREE(chunk);
+            return -1;
+        }
+#endif
+        chunk[i].rt_next_free = (i + 1 < RES_TR_CHUNK_SIZE) ?
+            _tr_count + i + 1 : -1;
+    }
+
+    _tr_chunks[c] = chunk;
+
+    /* append new slots to the free list */
+    if (_tr_free_tail >= 0)
+        _tr_slot(_tr_free_tail)->rt_next_free = _tr_count;
+    else
+        _tr_free_head = _tr_count;
+    _tr_free_tail = _tr_count + RES_TR_CHUNK_SIZE - 1;
+    /* publish the slots, now that their chunk is in place */
+    RES_ATOMIC_SET(&_tr_count, _tr_count + RES_TR_CHUNK_SIZE);
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""transaction table grown to %ld",
+            _tr_count);
+
+    return 0;
+}
+
+/*
+ * per-thread batches of free and released tids
+ */
+struct res_tr_cache {
+    int             tc_nfree;
+    int             tc_free[RES_TR_BATCH];  /* handed out from the end */
+    int             tc_nreleased;
+    int             tc_released[RES_TR_BATCH];
+};
+
+/*
+ * append tids to the free list. caller has table lock.
+ */
+static void
+_tr_append(int *tids, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        _tr_slot(tids[i])->rt_next_free = -1;
+        if (_tr_free_tail >= 0)
+            _tr_slot(_tr_free_tail)->rt_next_free = tids[i];
+        else
+            _tr_free_head = tids[i];
+        _tr_free_tail = tids[i];
+    }
+}
+
+/*
+ * take up to n tids from the head of the free list, growing the table
+ * if it is empty. caller has table lock.
+ */
+static int
+_tr_take(int *tids, int n)
+{
+    struct res_transaction *t;
+    int i;
+
+    if ((_tr_free_head < 0) && (0 != _tr_grow()))
+        return 0;
+
+    /* stored in reverse, so they are handed out in list order */
+    for (i = n - 1; i >= 0 && _tr_free_head >= 0; --i) {
+        tids[i] = _tr_free_head;
+        t = _tr_slot(_tr_free_head);
+        _tr_free_head = t->rt_next_free;
+        t->rt_next_free = -1;
+    }
+    if (_tr_free_head < 0)
+        _tr_free_tail = -1;
+
+    if (i >= 0)
+        memmove(tids, &tids[i + 1], (n - i - 1) * sizeof(int));
+    return n - i - 1;
+}
+
+#ifndef VAL_NO_THREADS
+static pthread_key_t _tr_cache_key;
+static pthread_once_t _tr_cache_once = PTHREAD_ONCE_INIT;
+static int      _tr_cache_ok = 0;
+
+/*
+ * a thread is exiting; give its tids back
+ */
+static void
+_tr_cache_free(void *arg)
+{
+    struct res_tr_cache *c = (struct res_tr_cache *) arg;
+
+    pthread_mutex_lock(&mutex);
+    _tr_append(c->tc_released, c->tc_nreleased);
+    _tr_append(c->tc_free, c->tc_nfree);
+    pthread_mutex_unlock(&mutex);
+    FREE(c);
+}
+
+static void
+_tr_cache_init(void)
+{
+    _tr_cache_ok = (0 == pthread_key_create(&_tr_cache_key, _tr_cache_free));
+}
+
+static struct res_tr_cache *
+_tr_cache(void)
+{
+    struct res_tr_cache *c;
+
+    pthread_once(&_tr_cache_once, _tr_cache_init);
+    if (!_tr_cache_ok)
+        return NULL;
+
+    c = (struct res_tr_cache *) pthread_getspecific(_tr_cache_key);
+    if (NULL == c) {
+        c = (struct res_tr_cache *) MALLOC(sizeof(struct res_tr_cache));
+        if (NULL == c)
+            return NULL;
+        memset(c, 0, sizeof(*c));
+        if (0 != pthread_setspecific(_tr_cache_key, c)) {
+            FREE(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+#else
+static struct res_tr_cache *
+_tr_cache(void)
+{
+    return NULL;
+}
+#endif /* VAL_NO_THREADS */
+
+/*
+ * allocate a tid. returns -1 if the configured limit has been reached or
+ * no memory is available.
+ */
+static int
+_tr_alloc(void)
+{
+    struct res_tr_cache *c;
+    int                     tid = -1;
+
+    if ((RES_ATOMIC_ADD(&_tr_active, 1) > _tr_max) && (_tr_max > 0)) {
+        RES_ATOMIC_ADD(&_tr_active, -1);
+        return -1;
+    }
+
+    c = _tr_cache();
+    if (c && c->tc_nfree > 0)
+        tid = c->tc_free[--c->tc_nfree];
+    else {
+        pthread_mutex_lock(&mutex);
+        if (c) {
+            c->tc_nfree = _tr_take(c->tc_free, RES_TR_BATCH);
+            if (c->tc_nfree > 0)
+                tid = c->tc_free[--c->tc_nfree];
+        }
+        else if (1 != _tr_take(&tid, 1))
+            tid = -1;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    if (tid < 0) {
+        RES_ATOMIC_ADD(&_tr_active, -1);
+        return -1;
+    }
+    _tr_slot(tid)->rt_in_use = 1;
+
+    return tid;
+}
+
+/*
+ * return a tid to the free list
+ */
+static void
+_tr_release(int tid)
+{
+    struct res_transaction *t = _tr_slot(tid);
+    struct res_tr_cache *c;
+
+    if ((NULL == t) || !RES_ATOMIC_CAS(&t->rt_in_use, 1, 0))
+        return;
+    RES_ATOMIC_ADD(&_tr_active, -1);
+
+    c = _tr_cache();
+    if (c) {
+        c->tc_released[c->tc_nreleased++] = tid;
+        if (c->tc_nreleased < RES_TR_BATCH)
+            return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (c) {
+        _tr_append(c->tc_released, c->tc_nreleased);
+        c->tc_nreleased = 0;
+    }
+    else
+        _tr_append(&tid, 1);
+    pthread_mutex_unlock(&mutex);
+}
+
+int
+res_io_set_max_transactions(int max)
+{
+    int old;
+
+    if (max < 0)
+        return -1;
+
+    pthread_mutex_lock(&mutex);
+    old = _tr_max;
+    _tr_max = max;
+    pthread_mutex_unlock(&mutex);
+
+    return old;
+}
+
+int
+res_io_get_max_transactions(void)
+{
+    return _tr_max;
+}
+
+int
+res_io_get_active_transactions(void)
+{
+    return (int) _tr_active;
+}
+
 /*
  * Find a port in the range 1024 - 65535 
  */
@@ -90,113 +473,2009 @@ bind_to_random_source(int af, SOCKET s)
     struct sockaddr *sa;
     size_t sock_size;
 
-    u_int16_t next_port;
-    int count = 0;
+    u_int16_t next_port;
+    int count = 0;
+
+    if (af == AF_INET) {
+        memset(&sa4, 0, sizeof(struct sockaddr_in));
+        memset(&sa4.sin_addr, 0, sizeof(sa4.sin_addr));
+        sa4.sin_family = AF_INET;
+        sa4.sin_addr.s_addr = htonl(INADDR_ANY);
+#ifdef VAL_IPV6
+    } else if (af == AF_INET6) {
+        memset(&sa6, 0, sizeof(struct sockaddr_in6));
+        memset(&sa6.sin6_addr, 0, sizeof(sa6.sin6_addr));
+        sa6.sin6_family = AF_INET6;
+        sa6.sin6_addr = in6addr_any;
+#endif
+    } else {
+        res_log(NULL,LOG_ERR,"libsres: could not bind to random port for unsupported address family %d", af);
+        return 1; /* failure */
+    }
+
+
+    do {
+        next_port = (libsres_random() % 64512) + 1024;
+
+        if (af == AF_INET) {
+            sa4.sin_port = htons(next_port);
+            sa = (struct sockaddr *) &sa4;
+            sock_size = sizeof(struct sockaddr_in);
+#ifdef VAL_IPV6
+        } else {
+            sa6.sin6_port = htons(next_port);
+            sa = (struct sockaddr *) &sa6;
+            sock_size = sizeof(struct sockaddr_in6);
+#endif
+        } 
+
+        if (0 == bind(s, sa, sock_size)) {
+            //res_log(NULL,LOG_ERR,"libsres: bound to random port %d", next_port);
+            return 0; /* success */
+        }
+    } while (count++ < NUM_RND_TRIES);
+
+    /* wrapped around and still no ports found */
+    res_log(NULL,LOG_ERR,"libsres: could not bind to random port");
+
+    return 1; /* failure */
+}
+
+/*
+ * UDP socket pool
+ *
+ * Sockets are bound to a random source port when created, as before,
+ * but are returned here when their query ends rather than closed. Each
+ * socket belongs to a single ea while borrowed, so the local port still
+ * identifies the query; the source address check in res_io_read_udp and
+ * the id/question check in res_io_read reject anything that was meant
+ * for a previous borrower.
+ *
+ * Reusing a port means an off-path attacker who learns it (from an
+ * earlier query) only has to guess the query id for the next ones, so
+ * by default a socket is used for a single query (RES_UDP_POOL_MAX_USES
+ * is 1) and every query gets its own random port, as before the pool.
+ * Applications that would rather save the socket()/bind() calls can
+ * turn reuse on with res_io_set_udp_pool(), but never beyond
+ * RES_UDP_POOL_USES_LIMIT queries or RES_UDP_POOL_AGE_LIMIT seconds per
+ * port.
+ */
+#define RES_UDP_POOL_MAX_IDLE   64
+#define RES_UDP_POOL_MAX_USES   1
+#define RES_UDP_POOL_MAX_AGE    5
+#define RES_UDP_POOL_USES_LIMIT 4
+#define RES_UDP_POOL_AGE_LIMIT  10
+
+struct res_udp_sock {
+    SOCKET          us_socket;
+    int             us_uses;
+    time_t          us_born;
+};
+
+struct res_udp_pool {
+    struct res_udp_sock *up_idle;
+    int                  up_count;
+    int                  up_size;
+};
+
+static struct res_udp_pool _udp_pool[2]; /* IPv4, IPv6 */
+static int      _udp_pool_max_idle = RES_UDP_POOL_MAX_IDLE;
+static int      _udp_pool_max_uses = RES_UDP_POOL_MAX_USES;
+static int      _udp_pool_max_age = RES_UDP_POOL_MAX_AGE;
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define UDP_POOL(af)    (&_udp_pool[(AF_INET == (af)) ? 0 : 1])
+
+/*
+ * throw away any datagrams still queued for a pooled socket
+ */
+static void
+_udp_drain(SOCKET s)
+{
+    char buf[64];
+    int  flags = 0;
+
+#ifdef MSG_DONTWAIT
+    flags = MSG_DONTWAIT;
+#else
+    return;
+#endif
+    while (recv(s, buf, sizeof(buf), flags) >= 0)
+        ;
+}
+
+static int
+_udp_sock_expired(int uses, time_t born, time_t now)
+{
+    return (uses >= _udp_pool_max_uses) ||
+        ((now - born) >= _udp_pool_max_age);
+}
+
+/*
+ * borrow a socket for af from the pool. returns INVALID_SOCKET if none
+ * is available.
+ */
+static SOCKET
+_udp_pool_get(int af, int *uses, time_t *born)
+{
+    struct res_udp_pool *pool = UDP_POOL(af);
+    struct res_udp_sock  us;
+    struct timeval       now;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    while (pool->up_count > 0) {
+        us = pool->up_idle[--pool->up_count];
+        if (!_udp_sock_expired(us.us_uses, us.us_born, now.tv_sec)) {
+            pthread_mutex_unlock(&pool_mutex);
+            _udp_drain(us.us_socket);
+            *uses = us.us_uses;
+            *born = us.us_born;
+            return us.us_socket;
+        }
+        CLOSESOCK(us.us_socket);
+        RES_ATOMIC_ADD(&_open_sockets, -1);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    return INVALID_SOCKET;
+}
+
+/*
+ * return a socket to the pool. returns 0 if the pool took it, or 1 if
+ * the caller should close it.
+ */
+static int
+_udp_pool_put(int af, SOCKET s, int uses, time_t born)
+{
+    struct res_udp_pool *pool = UDP_POOL(af);
+    struct timeval       now;
+
+    gettimeofday(&now, NULL);
+    if (_udp_sock_expired(uses, born, now.tv_sec))
+        return 1;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (pool->up_count >= _udp_pool_max_idle) {
+        pthread_mutex_unlock(&pool_mutex);
+        return 1;
+    }
+    if (pool->up_count >= pool->up_size) {
+        int                  size = pool->up_size ? pool->up_size * 2 : 16;
+        struct res_udp_sock *idle;
+
+        if (size > _udp_pool_max_idle)
+            size = _udp_pool_max_idle;
+        idle = (struct res_udp_sock *)
+            MALLOC(size * sizeof(struct res_udp_sock));
+        if (NULL == idle) {
+            pthread_mutex_unlock(&pool_mutex);
+            return 1;
+        }
+        if (pool->up_idle) {
+            memcpy(idle, pool->up_idle,
+                   pool->up_count * sizeof(struct res_udp_sock));
+            FREE(pool->up_idle);
+        }
+        pool->up_idle = idle;
+        pool->up_size = size;
+    }
+    pool->up_idle[pool->up_count].us_socket = s;
+    pool->up_idle[pool->up_count].us_uses = uses;
+    pool->up_idle[pool->up_count].us_born = born;
+    ++pool->up_count;
+    pthread_mutex_unlock(&pool_mutex);
+
+    return 0;
+}
+
+void
+res_io_set_udp_pool(int max_idle, int max_uses, int max_age)
+{
+    pthread_mutex_lock(&pool_mutex);
+    if (max_idle >= 0)
+        _udp_pool_max_idle = max_idle;
+    if (max_uses > RES_UDP_POOL_USES_LIMIT)
+        max_uses = RES_UDP_POOL_USES_LIMIT;
+    if (max_age > RES_UDP_POOL_AGE_LIMIT)
+        max_age = RES_UDP_POOL_AGE_LIMIT;
+    if (max_uses >= 0)
+        _udp_pool_max_uses = max_uses;
+    if (max_age >= 0)
+        _udp_pool_max_age = max_age;
+    pthread_mutex_unlock(&pool_mutex);
+
+    /* drop sockets that no longer fit */
+    if (max_idle >= 0 || max_uses >= 0 || max_age >= 0)
+        res_io_udp_pool_flush();
+}
+
+void
+res_io_udp_pool_flush(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool_mutex);
+    for (i = 0; i < 2; ++i) {
+        while (_udp_pool[i].up_count > 0) {
+            CLOSESOCK(_udp_pool[i].up_idle[--_udp_pool[i].up_count].us_socket);
+            RES_ATOMIC_ADD(&_open_sockets, -1);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/*
+ * UDP receive batching
+ *
+ * Each UDP query has a socket to itself (see the socket pool above), so
+ * datagrams for different queries can't be read in one call. A socket
+ * can still have several datagrams queued -- answers to a retransmitted
+ * query, late answers for its previous user, or forgeries -- and these
+ * used to be read one per wakeup. When the first datagram read is not
+ * the answer we are waiting for, the rest of the queue is read with
+ * recvmmsg(), up to _udp_batch_size datagrams per call.
+ */
+#define RES_UDP_BATCH_SIZE  8
+
+static int      _udp_batch_size = RES_UDP_BATCH_SIZE;
+static struct res_udp_io_stats _udp_stats;
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define UDP_STAT_ADD(field, n) \
+    ((void) RES_ATOMIC_ADD(&_udp_stats.field, (n)))
+
+int
+res_io_set_udp_batch(int batch)
+{
+    int old;
+
+    if (batch < 1)
+        return -1;
+
+    pthread_mutex_lock(&stats_mutex);
+    old = _udp_batch_size;
+    _udp_batch_size = batch;
+    pthread_mutex_unlock(&stats_mutex);
+
+    return old;
+}
+
+void
+res_io_get_udp_stats(struct res_udp_io_stats *stats)
+{
+    if (NULL == stats)
+        return;
+
+    pthread_mutex_lock(&stats_mutex);
+    memcpy(stats, &_udp_stats, sizeof(*stats));
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void
+res_io_reset_udp_stats(void)
+{
+    pthread_mutex_lock(&stats_mutex);
+    memset(&_udp_stats, 0, sizeof(_udp_stats));
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/*
+ * UDP receive buffers. Datagrams are read into a buffer sized to the
+ * payload size the query advertised, taken from a small pool of free
+ * buffers; reads which don't produce an answer (no data, spoofed or
+ * stale replies) put it straight back. An answer which fills a good
+ * part of its buffer keeps it, and the buffer becomes ea_response as is;
+ * smaller answers are copied out so the buffer can be reused. Either
+ * way ea_response is an ordinary heap block, which the code consuming
+ * the answer frees as before. Free buffers hold their size and the
+ * list link in their first bytes.
+ */
+#define RES_RBUF_POOL_MAX   32
+#define RES_RBUF_COPY_RATIO 4   /* copy answers under 1/4 of the buffer */
+
+struct res_rbuf {
+    struct res_rbuf *rb_next;
+    size_t          rb_size;
+};
+
+static struct res_rbuf *_rbuf_pool = NULL;
+static int      _rbuf_count = 0;
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t rbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * get a buffer of at least *size bytes; *size is set to its actual size
+ */
+static u_char *
+_rbuf_get(size_t *size)
+{
+    struct res_rbuf **prev, *rb = NULL;
+
+    if (*size < sizeof(struct res_rbuf))
+        *size = sizeof(struct res_rbuf);
+
+    pthread_mutex_lock(&rbuf_mutex);
+    for (prev = &_rbuf_pool; *prev; prev = &(*prev)->rb_next) {
+        if ((*prev)->rb_size >= *size) {
+            rb = *prev;
+            *prev = rb->rb_next;
+            --_rbuf_count;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rbuf_mutex);
+
+    if (rb) {
+        *size = rb->rb_size;
+        return (u_char *) rb;
+    }
+    return (u_char *) MALLOC(*size);
+}
+
+static void
+_rbuf_put(u_char *buf, size_t size)
+{
+    struct res_rbuf *rb = (struct res_rbuf *) buf;
+
+    if (NULL == buf)
+        return;
+
+    pthread_mutex_lock(&rbuf_mutex);
+    if (_rbuf_count < RES_RBUF_POOL_MAX) {
+        rb->rb_size = size;
+        rb->rb_next = _rbuf_pool;
+        _rbuf_pool = rb;
+        ++_rbuf_count;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&rbuf_mutex);
+
+    if (buf)
+        FREE(buf);
+}
+
+void
+res_io_rbuf_flush(void)
+{
+    struct res_rbuf *rb;
+
+    pthread_mutex_lock(&rbuf_mutex);
+    while (_rbuf_pool) {
+        rb = _rbuf_pool;
+        _rbuf_pool = rb->rb_next;
+        FREE(rb);
+    }
+    _rbuf_count = 0;
+    pthread_mutex_unlock(&rbuf_mutex);
+}
+
+/*
+ * length of a socket address of family af, for bind/connect.
+ * OS X wants sockaddr_in for INET, while Linux is happy with
+ * sockaddr_storage.
+ */
+static size_t
+_res_io_addr_len(int af)
+{
+    if (af == AF_INET)
+        return sizeof(struct sockaddr_in);
+#ifdef VAL_IPV6
+    if (af == AF_INET6)
+        return sizeof(struct sockaddr_in6);
+#endif
+    return sizeof(struct sockaddr_storage);
+}
+
+/*
+ * TCP connections
+ *
+ * TCP connections are shared by all queries to the same server address
+ * (RFC 7766). Each query attached to a connection has a waiter, which
+ * records the message id it was sent with. Whichever query finds the
+ * socket readable reads every complete message waiting and hands each
+ * one to the waiter with a matching id, so responses may arrive in any
+ * order. A query whose response was read for it by another query sees
+ * it as readable data on its next check.
+ *
+ * A connection with no queries attached is kept for
+ * RES_TCP_IDLE_TIMEOUT seconds. A new connection is opened when all
+ * existing ones to a server already have RES_TCP_MAX_PIPELINE queries
+ * outstanding, up to RES_TCP_MAX_CONNS connections per server; past
+ * that queries are spread over the existing connections.
+ *
+ * Connections are opened with a non-blocking connect, so an unresponsive
+ * server can't stall the caller. Queries attached to a connection which
+ * is still being set up are held back; the io manager checks on the
+ * connect each time their ea_next_try comes up, at an interval which
+ * grows with the time spent connecting (RES_TCP_CONNECT_POLL_MIN to
+ * RES_TCP_CONNECT_POLL_MAX msec). A connect which fails makes the socket
+ * readable, so failures are noticed straight away; one which never
+ * completes is given up on at the ea's ea_cancel_time, like any other
+ * query.
+ *
+ * The socket stays non-blocking once connected, so a server which is
+ * slow to take our queries can't hold up the callers sharing its
+ * connection. Whatever a send can't write at once is queued on the
+ * connection (tc_wbuf) and the socket is watched for writability in the
+ * poller of the query which queued it (tc_wpoller). The queue is
+ * flushed, in order, before anything else is sent and whenever a query
+ * on the connection finds the socket ready or is checked. Queries waited
+ * on with an fd_set can't be told when the socket is writable, so while
+ * output is queued their checks come around every RES_TCP_FLUSH_POLL
+ * msec.
+ */
+#define RES_TCP_MAX_CONNS       2
+#define RES_TCP_MAX_PIPELINE    32
+#define RES_TCP_IDLE_TIMEOUT    10
+#define RES_TCP_CONNECT_POLL_MIN    5
+#define RES_TCP_CONNECT_POLL_MAX    250
+#define RES_TCP_FLUSH_POLL      10
+#define RES_TCP_ID_TRIES        8   /* new ids to try if one is in use */
+
+#ifdef MSG_DONTWAIT
+#define RES_TCP_RECV_FLAGS      MSG_DONTWAIT
+#else
+#define RES_TCP_RECV_FLAGS      0
+#endif
+
+#ifdef WIN32
+#define RES_IO_ERRNO            WSAGetLastError()
+#define RES_IO_EINPROGRESS(e)   (WSAEWOULDBLOCK == (e) || WSAEINPROGRESS == (e))
+#define RES_IO_EWOULDBLOCK(e)   (WSAEWOULDBLOCK == (e))
+#else
+#define RES_IO_ERRNO            errno
+#define RES_IO_EINPROGRESS(e)   (EINPROGRESS == (e))
+#define RES_IO_EWOULDBLOCK(e)   (EAGAIN == (e) || EWOULDBLOCK == (e))
+#endif
+
+struct res_tcp_waiter {
+    struct expected_arrival *tw_ea;   /* the query; woken when answered */
+    int             tw_sent;          /* tw_id/tw_question are set */
+    u_int16_t       tw_id;
+    u_char         *tw_question;      /* question sent, to match answers */
+    size_t          tw_question_length;
+    u_char         *tw_response;
+    size_t          tw_response_length;
+    struct res_tcp_waiter *tw_next;
+};
+
+struct res_tcp_conn {
+    SOCKET          tc_socket;
+    struct sockaddr_storage tc_addr;
+    int             tc_refs;        /* queries attached */
+    int             tc_dead;        /* not to be used for new queries */
+    int             tc_connecting;  /* non-blocking connect in progress */
+    struct timeval  tc_connect_start;
+    time_t          tc_last_used;
+    struct res_tcp_waiter *tc_waiters;
+    /*
+     * message being read: the length prefix, then the body once the
+     * prefix is complete. tc_rgot counts bytes of both.
+     */
+    u_char          tc_rlen_n[sizeof(u_int16_t)];
+    u_char         *tc_rbuf;
+    size_t          tc_rlen;
+    size_t          tc_rgot;
+    /* output not yet taken by the socket; tc_wsent bytes already sent */
+    u_char         *tc_wbuf;
+    size_t          tc_wlen;
+    size_t          tc_wsent;
+    struct res_poller *tc_wpoller;  /* watching for writability */
+    struct res_tcp_conn *tc_next;
+#ifndef VAL_NO_THREADS
+    pthread_mutex_t tc_lock;        /* socket reads/writes and waiters */
+#endif
+};
+
+static struct res_tcp_conn *_tcp_conns = NULL;
+static int      _tcp_max_conns = RES_TCP_MAX_CONNS;
+static int      _tcp_max_pipeline = RES_TCP_MAX_PIPELINE;
+static int      _tcp_idle_timeout = RES_TCP_IDLE_TIMEOUT;
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t tcp_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int
+_tcp_addr_match(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family)
+        return 0;
+
+    if (AF_INET == a->ss_family) {
+        struct sockaddr_in *a4 = (struct sockaddr_in *) a;
+        struct sockaddr_in *b4 = (struct sockaddr_in *) b;
+        return (a4->sin_port == b4->sin_port) &&
+            !memcmp(&a4->sin_addr, &b4->sin_addr, sizeof(struct in_addr));
+    }
+#ifdef VAL_IPV6
+    if (AF_INET6 == a->ss_family) {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a;
+        struct sockaddr_in6 *b6 = (struct sockaddr_in6 *) b;
+        return (a6->sin6_port == b6->sin6_port) &&
+            !memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr));
+    }
+#endif
+    return 0;
+}
+
+/*
+ * put a socket in or out of non-blocking mode
+ */
+static int
+_res_io_set_nonblocking(SOCKET s, int on)
+{
+#ifdef WIN32
+    u_long arg = on ? 1 : 0;
+
+    return (0 == ioctlsocket(s, FIONBIO, &arg)) ? 0 : -1;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+
+    if (flags < 0)
+        return -1;
+    if (on)
+        flags |= O_NONBLOCK;
+    else
+        flags &= ~O_NONBLOCK;
+    return (fcntl(s, F_SETFL, flags) < 0) ? -1 : 0;
+#endif
+}
+
+/*
+ * check that an idle connection hasn't been closed by the server
+ */
+static int
+_tcp_conn_alive(struct res_tcp_conn *c)
+{
+#ifdef MSG_DONTWAIT
+    char b;
+
+    if (recv(c->tc_socket, &b, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+        (EAGAIN == errno || EWOULDBLOCK == errno))
+        return 1;
+    /* closed, error or unsolicited data */
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * watch for the connection becoming writable in poller p, or stop
+ * watching (p NULL). caller has the connection lock.
+ */
+static void
+_tcp_conn_watch_write(struct res_tcp_conn *c, struct res_poller *p)
+{
+    if (c->tc_wpoller == p)
+        return;
+    if (c->tc_wpoller)
+        res_poller_want_write(c->tc_wpoller, c->tc_socket, 0);
+    c->tc_wpoller = NULL;
+    if (p && (0 == res_poller_want_write(p, c->tc_socket, 1)))
+        c->tc_wpoller = p;
+}
+
+/*
+ * send as much of the connection's queued output as the socket will
+ * take without blocking. Returns 0, with the queue empty or waiting for
+ * the socket to be writable, or -1 if the connection failed. caller has
+ * the connection lock.
+ */
+static int
+_tcp_conn_flush(struct res_tcp_conn *c)
+{
+    ssize_t         n;
+    int             err;
+
+    while (c->tc_wsent < c->tc_wlen) {
+        n = send(c->tc_socket, (const char *)c->tc_wbuf + c->tc_wsent,
+                 c->tc_wlen - c->tc_wsent, 0);
+        if (n < 0) {
+            err = RES_IO_ERRNO;
+            if (RES_IO_EWOULDBLOCK(err))
+                return 0;
+            if (EINTR == err)
+                continue;
+            res_log(NULL, LOG_ERR, "libsres: ""sending on tcp connection %p "
+                    "failed, errno = %d", c, err);
+            return -1;
+        }
+        c->tc_wsent += n;
+    }
+
+    if (c->tc_wbuf)
+        FREE(c->tc_wbuf);
+    c->tc_wbuf = NULL;
+    c->tc_wlen = 0;
+    c->tc_wsent = 0;
+    _tcp_conn_watch_write(c, NULL);
+    return 0;
+}
+
+/*
+ * add a message to the connection's output and send what can be sent.
+ * Returns as _tcp_conn_flush, or -1 if out of memory. caller has the
+ * connection lock.
+ */
+static int
+_tcp_conn_write(struct res_tcp_conn *c, const u_char *msg, size_t len,
+                struct res_poller *p)
+{
+    u_char         *buf;
+    size_t          pending = c->tc_wlen - c->tc_wsent;
+
+    buf = (u_char *) MALLOC((pending + len) * sizeof(u_char));
+    if (NULL == buf)
+        return -1;
+    if (pending)
+        memcpy(buf, c->tc_wbuf + c->tc_wsent, pending);
+    memcpy(buf + pending, msg, len);
+    if (c->tc_wbuf)
+        FREE(c->tc_wbuf);
+    c->tc_wbuf = buf;
+    c->tc_wlen = pending + len;
+    c->tc_wsent = 0;
+
+    if (0 != _tcp_conn_flush(c))
+        return -1;
+    if (c->tc_wlen && (NULL == c->tc_wpoller))
+        _tcp_conn_watch_write(c, p);
+    return 0;
+}
+
+static void
+_tcp_conn_free(struct res_tcp_conn *c)
+{
+    struct res_tcp_waiter *w;
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""closing tcp connection %p fd %d",
+            c, c->tc_socket);
+    while (c->tc_waiters) {
+        w = c->tc_waiters;
+        c->tc_waiters = w->tw_next;
+        if (w->tw_question)
+            FREE(w->tw_question);
+        if (w->tw_response)
+            FREE(w->tw_response);
+        FREE(w);
+    }
+    if (c->tc_rbuf)
+        FREE(c->tc_rbuf);
+    if (c->tc_wbuf)
+        FREE(c->tc_wbuf);
+    CLOSESOCK(c->tc_socket);
+    RES_ATOMIC_ADD(&_open_sockets, -1);
+#ifndef VAL_NO_THREADS
+    pthread_mutex_destroy(&c->tc_lock);
+#endif
+    FREE(c);
+}
+
+/*
+ * close idle connections which have timed out or failed. caller has
+ * tcp_mutex.
+ */
+static void
+_tcp_reap(time_t now)
+{
+    struct res_tcp_conn **prev, *c;
+
+    for (prev = &_tcp_conns; *prev; ) {
+        c = *prev;
+        if ((0 == c->tc_refs) &&
+            (c->tc_dead || ((now - c->tc_last_used) >= _tcp_idle_timeout))) {
+            *prev = c->tc_next;
+            _tcp_conn_free(c);
+            continue;
+        }
+        prev = &c->tc_next;
+    }
+}
+
+/*
+ * open a new connection to the ea's current server address
+ */
+static struct res_tcp_conn *
+_tcp_conn_open(struct expected_arrival *ea)
+{
+    struct sockaddr_storage *addr = ea->ea_ns->ns_address[ea->ea_which_address];
+    struct res_tcp_conn *c;
+
+    c = (struct res_tcp_conn *) MALLOC(sizeof(struct res_tcp_conn));
+    if (NULL == c)
+        return NULL;
+    memset(c, 0, sizeof(struct res_tcp_conn));
+    memcpy(&c->tc_addr, addr, sizeof(c->tc_addr));
+
+    c->tc_socket = socket(addr->ss_family, SOCK_STREAM, 0);
+    if (c->tc_socket == INVALID_SOCKET) {
+        res_log(NULL,LOG_ERR,"libsres: ""socket() failed, errno = %d %s",
+                errno, strerror(errno));
+        FREE(c);
+        return NULL;
+    }
+    RES_ATOMIC_ADD(&_open_sockets, 1);
+#ifndef VAL_NO_THREADS
+    pthread_mutex_init(&c->tc_lock, NULL);
+#endif
+
+    /* Set the source port */
+    if (0 != bind_to_random_source(addr->ss_family, c->tc_socket)) {
+        _tcp_conn_free(c);
+        return NULL;
+    }
+
+    if (0 != _res_io_set_nonblocking(c->tc_socket, 1)) {
+        _tcp_conn_free(c);
+        return NULL;
+    }
+
+    if (connect(c->tc_socket, (struct sockaddr *) addr,
+                _res_io_addr_len(addr->ss_family)) == SOCKET_ERROR) {
+        int err = RES_IO_ERRNO;
+
+        if (!RES_IO_EINPROGRESS(err)) {
+            res_log(NULL, LOG_ERR,
+                    "libsres: ""Closing socket %d, connect errno = %d",
+                    c->tc_socket, err);
+            _tcp_conn_free(c);
+            return NULL;
+        }
+        c->tc_connecting = 1;
+        gettimeofday(&c->tc_connect_start, NULL);
+        res_log(NULL, LOG_DEBUG, "libsres: "
+                "connecting tcp connection %p fd %d", c, c->tc_socket);
+        return c;
+    }
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""opened tcp connection %p fd %d",
+            c, c->tc_socket);
+    return c;
+}
+
+/*
+ * attach an ea to a connection to its current server address, opening
+ * one if needed. returns 0 on success.
+ */
+static int
+_res_io_tcp_attach(struct expected_arrival *ea)
+{
+    struct sockaddr_storage *addr = ea->ea_ns->ns_address[ea->ea_which_address];
+    struct res_tcp_conn *c, *best = NULL;
+    struct res_tcp_waiter *w;
+    struct timeval  now;
+    int             count = 0;
+
+    if (ea->ea_tcp_conn)
+        return 0;
+
+    w = (struct res_tcp_waiter *) MALLOC(sizeof(struct res_tcp_waiter));
+    if (NULL == w)
+        return -1;
+    memset(w, 0, sizeof(struct res_tcp_waiter));
+    w->tw_ea = ea;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&tcp_mutex);
+    _tcp_reap(now.tv_sec);
+    for (c = _tcp_conns; c; c = c->tc_next) {
+        if (c->tc_dead || !_tcp_addr_match(&c->tc_addr, addr))
+            continue;
+        if (0 == c->tc_refs && (c->tc_rgot || !_tcp_conn_alive(c))) {
+            c->tc_dead = 1;
+            continue;
+        }
+        ++count;
+        if (NULL == best || c->tc_refs < best->tc_refs)
+            best = c;
+    }
+    if (best && (best->tc_refs >= _tcp_max_pipeline) &&
+        (count < _tcp_max_conns))
+        best = NULL;
+
+    if (NULL == best) {
+        /* connect doesn't block, so this is done with the list locked */
+        best = _tcp_conn_open(ea);
+        if (NULL == best) {
+            pthread_mutex_unlock(&tcp_mutex);
+            FREE(w);
+            return -1;
+        }
+        if (0 == _tcp_max_conns)
+            best->tc_dead = 1; /* reuse disabled */
+        best->tc_next = _tcp_conns;
+        _tcp_conns = best;
+    }
+    else
+        res_log(NULL, LOG_DEBUG, "libsres: ""ea %p reusing tcp connection %p "
+                "(%d queries outstanding)", ea, best, best->tc_refs);
+
+    ++best->tc_refs;
+    pthread_mutex_lock(&best->tc_lock);
+    w->tw_next = best->tc_waiters;
+    best->tc_waiters = w;
+    pthread_mutex_unlock(&best->tc_lock);
+    pthread_mutex_unlock(&tcp_mutex);
+
+    ea->ea_tcp_conn = best;
+    ea->ea_socket = best->tc_socket;
+
+    return 0;
+}
+
+/*
+ * detach an ea from its connection. The connection is closed if it has
+ * failed, or kept for reuse.
+ */
+static void
+_res_io_tcp_detach(struct expected_arrival *ea)
+{
+    struct res_tcp_conn *c = ea->ea_tcp_conn;
+    struct res_tcp_waiter **prev, *w;
+    struct timeval  now;
+
+    if (NULL == c)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&tcp_mutex);
+    pthread_mutex_lock(&c->tc_lock);
+    for (prev = &c->tc_waiters; *prev; prev = &(*prev)->tw_next) {
+        if ((*prev)->tw_ea != ea)
+            continue;
+        w = *prev;
+        *prev = w->tw_next;
+        if (w->tw_question)
+            FREE(w->tw_question);
+        if (w->tw_response)
+            FREE(w->tw_response);
+        FREE(w);
+        break;
+    }
+    /* queued output is now watched for by another query, if any */
+    if (ea->ea_poller && (c->tc_wpoller == ea->ea_poller)) {
+        _tcp_conn_watch_write(c, NULL);
+        for (w = c->tc_waiters; w && c->tc_wlen; w = w->tw_next) {
+            if (w->tw_ea->ea_poller) {
+                _tcp_conn_watch_write(c, w->tw_ea->ea_poller);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&c->tc_lock);
+    --c->tc_refs;
+    c->tc_last_used = now.tv_sec;
+    _tcp_reap(now.tv_sec);
+    pthread_mutex_unlock(&tcp_mutex);
+
+    ea->ea_tcp_conn = NULL;
+    ea->ea_socket = INVALID_SOCKET;
+}
+
+/*
+ * mark an ea's connection as unusable for new queries
+ */
+static void
+_res_io_tcp_failed(struct expected_arrival *ea)
+{
+    if (NULL == ea->ea_tcp_conn)
+        return;
+
+    pthread_mutex_lock(&tcp_mutex);
+    ea->ea_tcp_conn->tc_dead = 1;
+    pthread_mutex_unlock(&tcp_mutex);
+}
+
+/*
+ * waiter for an ea. caller has the connection lock.
+ */
+static struct res_tcp_waiter *
+_tcp_waiter(struct expected_arrival *ea)
+{
+    struct res_tcp_waiter *w;
+
+    for (w = ea->ea_tcp_conn->tc_waiters; w; w = w->tw_next)
+        if (w->tw_ea == ea)
+            return w;
+    return NULL;
+}
+
+/*
+ * length of the first question in a message (name, type and class), or
+ * 0 if it has none or it runs past the end of the message. Names in the
+ * question are never compressed.
+ */
+static size_t
+_tcp_question_len(const u_char *msg, size_t len)
+{
+    size_t          off = sizeof(HEADER);
+
+    if ((len < sizeof(HEADER)) || (0 == ((const HEADER *) msg)->qdcount))
+        return 0;
+
+    while ((off < len) && (0 != msg[off])) {
+        if (msg[off] & NS_CMPRSFLGS)
+            return 0;
+        off += msg[off] + 1;
+    }
+    off += 1 + 2 * sizeof(u_int16_t);
+    if (off > len)
+        return 0;
+
+    return off - sizeof(HEADER);
+}
+
+/*
+ * check if a query other than w's has already been sent on the
+ * connection with this id. caller has the connection lock.
+ */
+static int
+_tcp_id_in_use(struct res_tcp_conn *c, struct res_tcp_waiter *w,
+               u_int16_t id)
+{
+    struct res_tcp_waiter *o;
+
+    for (o = c->tc_waiters; o; o = o->tw_next)
+        if ((o != w) && o->tw_sent && (o->tw_id == id))
+            return 1;
+    return 0;
+}
+
+/*
+ * check that a message answers the query sent for w: the same id and
+ * question (the name without regard to case). Answers without a question
+ * section, such as some FORMERRs, are matched on the id alone.
+ */
+static int
+_tcp_answers(struct res_tcp_waiter *w, const u_char *msg, size_t len)
+{
+    size_t          qlen, i;
+    const u_char   *q;
+
+    if (!w->tw_sent || (len < sizeof(HEADER)) ||
+        memcmp(&w->tw_id, msg, sizeof(w->tw_id)))
+        return 0;
+
+    if (0 == ((const HEADER *) msg)->qdcount)
+        return 1;
+    qlen = _tcp_question_len(msg, len);
+    if ((0 == qlen) || (qlen != w->tw_question_length))
+        return 0;
+
+    /*
+     * label lengths are below 64, so never change case; type and class
+     * must match exactly
+     */
+    q = msg + sizeof(HEADER);
+    for (i = 0; i < qlen - 2 * sizeof(u_int16_t); ++i)
+        if (tolower(q[i]) != tolower(w->tw_question[i]))
+            return 0;
+    return !memcmp(q + i, w->tw_question + i, 2 * sizeof(u_int16_t));
+}
+
+/*
+ * read what is waiting on a connection into its partial message, without
+ * blocking. Returns 1 with the message in *msg once one is complete, 0
+ * if more is still to come, SR_IO_MEMORY_ERROR, or SR_IO_SOCKET_ERROR if
+ * the connection failed or was closed. caller has the connection lock.
+ */
+static int
+_tcp_conn_read(struct res_tcp_conn *c, u_char **msg, size_t *len)
+{
+    ssize_t         n;
+    u_int16_t       len_n;
+
+    for (;;) {
+        if (c->tc_rgot < sizeof(c->tc_rlen_n))
+            n = recv(c->tc_socket, (char *)c->tc_rlen_n + c->tc_rgot,
+                     sizeof(c->tc_rlen_n) - c->tc_rgot, RES_TCP_RECV_FLAGS);
+        else
+            n = recv(c->tc_socket,
+                     (char *)c->tc_rbuf + c->tc_rgot - sizeof(c->tc_rlen_n),
+                     c->tc_rlen + sizeof(c->tc_rlen_n) - c->tc_rgot,
+                     RES_TCP_RECV_FLAGS);
+        if (n < 0) {
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno) ||
+                (EINTR == errno))
+                return 0;
+            res_log(NULL, LOG_INFO, "libsres: ""read on tcp connection %p "
+                    "failed, errno %d %s", c, errno, strerror(errno));
+            return SR_IO_SOCKET_ERROR;
+        }
+        if (0 == n) {
+            res_log(NULL, LOG_INFO, "libsres: ""tcp connection %p shut down "
+                    "by the server", c);
+            return SR_IO_SOCKET_ERROR;
+        }
+        c->tc_rgot += n;
+
+        if ((NULL == c->tc_rbuf) && (c->tc_rgot == sizeof(c->tc_rlen_n))) {
+            memcpy(&len_n, c->tc_rlen_n, sizeof(len_n));
+            c->tc_rlen = ntohs(len_n);
+            if (c->tc_rlen < sizeof(u_int16_t))
+                return SR_IO_SOCKET_ERROR;
+            c->tc_rbuf = (u_char *) MALLOC(c->tc_rlen * sizeof(u_char));
+            if (NULL == c->tc_rbuf)
+                return SR_IO_MEMORY_ERROR;
+        }
+
+        if (c->tc_rbuf &&
+            (c->tc_rgot == c->tc_rlen + sizeof(c->tc_rlen_n))) {
+            *msg = c->tc_rbuf;
+            *len = c->tc_rlen;
+            c->tc_rbuf = NULL;
+            c->tc_rlen = 0;
+            c->tc_rgot = 0;
+            return 1;
+        }
+    }
+}
+
+/*
+ * check on the connect for an ea's connection. Returns 1 if connected,
+ * -1 if the connect failed, or 0 if it is still in progress, in which
+ * case ea_next_try is set for the next check.
+ */
+static int
+_res_io_tcp_check_connect(struct expected_arrival *ea)
+{
+    struct res_tcp_conn *c = ea->ea_tcp_conn;
+    struct sockaddr_storage peer;
+    socklen_t       len;
+    struct timeval  now, elapsed;
+    long            wait_ms;
+    int             err = 0, rc = 1;
+
+    if (NULL == c)
+        return -1;
+
+    pthread_mutex_lock(&c->tc_lock);
+    if (c->tc_connecting) {
+        len = sizeof(err);
+        if ((getsockopt(c->tc_socket, SOL_SOCKET, SO_ERROR,
+                        (char *)&err, &len) < 0) || (0 != err)) {
+            res_log(NULL, LOG_INFO, "libsres: "
+                    "connect failed on fd %d, errno = %d",
+                    c->tc_socket, err);
+            rc = -1;
+        }
+        else {
+            len = sizeof(peer);
+            if (0 != getpeername(c->tc_socket, (struct sockaddr *)&peer, &len))
+                rc = 0;
+            else {
+                c->tc_connecting = 0;
+                res_log(NULL, LOG_DEBUG, "libsres: "
+                        "tcp connection %p fd %d connected", c, c->tc_socket);
+            }
+        }
+    }
+    if (0 == rc) {
+        gettimeofday(&now, NULL);
+        timersub(&now, &c->tc_connect_start, &elapsed);
+        wait_ms = (elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000) / 4;
+        if (wait_ms < RES_TCP_CONNECT_POLL_MIN)
+            wait_ms = RES_TCP_CONNECT_POLL_MIN;
+        else if (wait_ms > RES_TCP_CONNECT_POLL_MAX)
+            wait_ms = RES_TCP_CONNECT_POLL_MAX;
+        ea->ea_next_try.tv_sec = now.tv_sec + wait_ms / 1000;
+        ea->ea_next_try.tv_usec = now.tv_usec + (wait_ms % 1000) * 1000;
+        if (ea->ea_next_try.tv_usec >= 1000000) {
+            ++ea->ea_next_try.tv_sec;
+            ea->ea_next_try.tv_usec -= 1000000;
+        }
+    }
+    pthread_mutex_unlock(&c->tc_lock);
+
+    return rc;
+}
+
+static int
+_res_io_tcp_is_connecting(struct expected_arrival *ea)
+{
+    int rc;
+
+    if (NULL == ea->ea_tcp_conn)
+        return 0;
+
+    pthread_mutex_lock(&ea->ea_tcp_conn->tc_lock);
+    rc = ea->ea_tcp_conn->tc_connecting;
+    pthread_mutex_unlock(&ea->ea_tcp_conn->tc_lock);
+
+    return rc;
+}
+
+/*
+ * check if another query has already read the response for this ea
+ */
+static int
+_res_io_tcp_has_response(struct expected_arrival *ea)
+{
+    struct res_tcp_waiter *w;
+    int rc = 0;
+
+    if (NULL == ea->ea_tcp_conn)
+        return 0;
+
+    pthread_mutex_lock(&ea->ea_tcp_conn->tc_lock);
+    w = _tcp_waiter(ea);
+    if (w && w->tw_response)
+        rc = 1;
+    pthread_mutex_unlock(&ea->ea_tcp_conn->tc_lock);
+
+    return rc;
+}
+
+/*
+ * flush the queued output on an ea's connection. If output is still
+ * queued, *next is moved up to the next time to try. Returns -1 if the
+ * connection failed.
+ */
+static int
+_res_io_tcp_flush(struct expected_arrival *ea, struct timeval *now,
+                  struct timeval *next)
+{
+    struct res_tcp_conn *c = ea->ea_tcp_conn;
+    struct timeval  when;
+    int             rc = 0;
+
+    if (NULL == c)
+        return 0;
+
+    pthread_mutex_lock(&c->tc_lock);
+    if (c->tc_wlen && !c->tc_connecting) {
+        rc = _tcp_conn_flush(c);
+        if ((0 == rc) && c->tc_wlen && next) {
+            when.tv_sec = now->tv_sec;
+            when.tv_usec = now->tv_usec + RES_TCP_FLUSH_POLL * 1000;
+            if (when.tv_usec >= 1000000) {
+                ++when.tv_sec;
+                when.tv_usec -= 1000000;
+            }
+            UPDATE(next, when);
+        }
+    }
+    pthread_mutex_unlock(&c->tc_lock);
+
+    return rc;
+}
+
+/*
+ * requeue an ea in its deadline queue (if any) after its deadlines or
+ * state changed: due now if an answer is waiting, else at the earlier of
+ * its next try and cancel time, or not at all once it has no attempts
+ * left.
+ */
+static void
+_res_io_timer_update(struct expected_arrival *ea)
+{
+    struct timeval  when;
+
+    if (NULL == ea->ea_timers)
+        return;
+
+    if (ea->ea_remaining_attempts == -1) {
+        res_timers_update(ea, NULL);
+        return;
+    }
+    if (ea->ea_response || _res_io_tcp_has_response(ea))
+        gettimeofday(&when, NULL);
+    else if (LTEQ(ea->ea_next_try, ea->ea_cancel_time))
+        when = ea->ea_next_try;
+    else
+        when = ea->ea_cancel_time;
+    res_timers_update(ea, &when);
+}
+
+/*
+ * send the query for an ea over its connection, length first. Queries
+ * go through the connection's output queue, under its lock, so queries
+ * from different threads can't be interleaved; whatever the socket
+ * doesn't take at once is sent later. A query whose id is already in
+ * use on the connection is made again with a new one, so answers can't
+ * be handed to the wrong waiter.
+ */
+static int
+_res_io_tcp_send(struct expected_arrival *ea)
+{
+    struct res_tcp_conn *c = ea->ea_tcp_conn;
+    struct res_tcp_waiter *w;
+    u_char         *buf = NULL, *q;
+    u_int16_t       length_n, id;
+    size_t          len = 0, qlen;
+    int             rc, tries = 0;
+
+    if ((NULL == c) || (ea->ea_signed_length < sizeof(HEADER)))
+        return -1;
+
+    pthread_mutex_lock(&c->tc_lock);
+    w = _tcp_waiter(ea);
+    memcpy(&id, ea->ea_signed, sizeof(id));
+    while (w && _tcp_id_in_use(c, w, id) && (tries++ < RES_TCP_ID_TRIES)) {
+        q = NULL;
+        qlen = 0;
+        if (res_create_query_payload(ea->ea_ns, ea->ea_name, ea->ea_class_h,
+                                     ea->ea_type_h, &q, &qlen) < 0)
+            break;
+        FREE(ea->ea_signed);
+        ea->ea_signed = q;
+        ea->ea_signed_length = qlen;
+        memcpy(&id, ea->ea_signed, sizeof(id));
+    }
+    if ((NULL == w) || _tcp_id_in_use(c, w, id)) {
+        pthread_mutex_unlock(&c->tc_lock);
+        res_log(NULL, LOG_ERR, "libsres: "
+                "no free query id on tcp connection %p", c);
+        return -1;
+    }
+
+    if (!w->tw_sent || (w->tw_id != id)) {
+        /* new query (e.g. after edns fallback); old response is stale */
+        if (w->tw_question)
+            FREE(w->tw_question);
+        w->tw_question = NULL;
+        w->tw_question_length = 0;
+        qlen = _tcp_question_len(ea->ea_signed, ea->ea_signed_length);
+        if (qlen > 0) {
+            w->tw_question = (u_char *) MALLOC(qlen * sizeof(u_char));
+            if (NULL == w->tw_question) {
+                pthread_mutex_unlock(&c->tc_lock);
+                return -1;
+            }
+            memcpy(w->tw_question, ea->ea_signed + sizeof(HEADER), qlen);
+            w->tw_question_length = qlen;
+        }
+        w->tw_id = id;
+        w->tw_sent = 1;
+        if (w->tw_response)
+            FREE(w->tw_response);
+        w->tw_response = NULL;
+        w->tw_response_length = 0;
+    }
+
+    len = sizeof(length_n) + ea->ea_signed_length;
+    buf = (u_char *) MALLOC(len * sizeof(u_char));
+    if (NULL == buf) {
+        pthread_mutex_unlock(&c->tc_lock);
+        return -1;
+    }
+    length_n = htons(ea->ea_signed_length);
+    memcpy(buf, &length_n, sizeof(length_n));
+    memcpy(buf + sizeof(length_n), ea->ea_signed, ea->ea_signed_length);
+
+    rc = _tcp_conn_write(c, buf, len, ea->ea_poller);
+    if ((0 == rc) && c->tc_wlen)
+        res_log(NULL, LOG_DEBUG, "libsres: ""tcp connection %p has %zd "
+                "bytes queued", c, c->tc_wlen - c->tc_wsent);
+    pthread_mutex_unlock(&c->tc_lock);
+
+    FREE(buf);
+    if (0 != rc) {
+        res_log(NULL, LOG_ERR, "libsres: "
+                "sending %zd bytes on tcp connection %p failed", len, c);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+res_io_set_tcp_reuse(int max_conns, int max_pipeline, int idle_timeout)
+{
+    struct timeval now;
+
+    pthread_mutex_lock(&tcp_mutex);
+    if (max_conns >= 0)
+        _tcp_max_conns = max_conns;
+    if (max_pipeline > 0)
+        _tcp_max_pipeline = max_pipeline;
+    if (idle_timeout >= 0)
+        _tcp_idle_timeout = idle_timeout;
+    gettimeofday(&now, NULL);
+    _tcp_reap(now.tv_sec);
+    pthread_mutex_unlock(&tcp_mutex);
+}
+
+void
+res_io_tcp_flush(void)
+{
+    struct res_tcp_conn *c;
+
+    pthread_mutex_lock(&tcp_mutex);
+    for (c = _tcp_conns; c; c = c->tc_next)
+        c->tc_dead = 1;
+    _tcp_reap(0);
+    pthread_mutex_unlock(&tcp_mutex);
+}
+
+/*
+ * find the max number of file descriptors for this process
+ */
+static int _init_max_fd(void) {
+    struct rlimit info;
+    int rc;
+    int lim;
+
+#ifndef HAVE_GETRLIMIT
+    /** hmm, cannot get current value. let's just guess. */
+    info.rlim_cur = info.rlim_max = SR_IO_NOFILE_UNKNOWN_SIZE;
+#else
+    rc = getrlimit( RLIMIT_NOFILE, &info);
+    if (rc) {
+        /** hmm, cannot get current value. let's just guess. */
+        info.rlim_cur = info.rlim_max = SR_IO_NOFILE_UNKNOWN_SIZE;
+    }
+#ifdef HAVE_SETRLIMIT
+    else if (info.rlim_cur < info.rlim_max) {
+        int prev = info.rlim_cur;
+        info.rlim_cur = info.rlim_max;
+        rc = setrlimit( RLIMIT_NOFILE, &info);
+        if (rc) /* oh well, we tried. revert to previous limit */
+            info.rlim_cur = prev;
+    }
+#endif /* HAVE_GETRLIMIT */
+#endif /* HAVE_GETRLIMIT */
+    lim = info.rlim_cur - SR_IO_NOFILE_RESERVED;
+    if (lim <= 0)
+        lim = 1;
+    return lim;
+}
+
+long
+res_io_get_max_fd(void) {
+    return _max_fd;
+}
+
+long
+res_io_get_open_sockets(void) {
+    return _open_sockets;
+}
+
+static long
+res_get_timeout(struct name_server *ns)
+{
+    int             i;
+    long            cancel_delay = 0;
+
+    for (i = 0; i <= ns->ns_retry; i++) {
+        cancel_delay += ns->ns_retrans;
+        //cancel_delay += ns->ns_retrans << i;
+    }
+
+    return cancel_delay;
+}
+
+void            res_print_ea(struct expected_arrival *ea);
+int             res_quecmp(u_char * query, u_char * response);
+
+/*
+ * In-flight query coalescing. A query for the same name, type and class,
+ * with the same flags and going to the same servers as one which is
+ * already in flight, doesn't send anything of its own: it is attached
+ * as a waiter to the first query (the leader), and holds off sending
+ * while the leader works. When the leader gets an answer, each waiter
+ * is given a copy, which it picks up the next time its ea list is
+ * checked. If the leader is freed without an answer, the longest
+ * waiting query takes over as leader and starts sending, with its
+ * schedule moved on by the time it spent waiting. Queries to servers
+ * using TSIG are never coalesced.
+ *
+ * Waiters in a deadline queue are woken (res_timers_wake) when the
+ * answer is handed over or they take over as leader. A wake only moves
+ * the deadline, so one blocked in another thread's wait is only seen
+ * when that wait ends; these are rechecked every RES_INFLIGHT_RECHECK
+ * msec in case. Waiters not in a deadline queue can't be woken, and
+ * check back every RES_INFLIGHT_POLL msec.
+ *
+ * Only the head ea of a list is linked to an in-flight entry.
+ */
+#define RES_INFLIGHT_BUCKETS    64
+#define RES_INFLIGHT_POLL       10      /* msec */
+#define RES_INFLIGHT_RECHECK    100     /* msec */
+
+struct res_inflight_waiter {
+    struct expected_arrival *iw_ea;
+    struct timeval  iw_since;
+    u_char         *iw_response;
+    size_t          iw_response_length;
+    struct sockaddr_storage iw_from;
+    int             iw_promoted;    /* now the leader */
+    struct res_inflight_waiter *iw_next;
+};
+
+struct res_inflight {
+    u_char         *if_key;
+    size_t          if_key_len;
+    u_int32_t       if_hash;
+    struct expected_arrival *if_leader; /* NULL once the leader is done */
+    struct res_inflight_waiter *if_waiters;
+    int             if_refs;        /* leader and waiters */
+    struct res_inflight *if_next;
+};
+
+static struct res_inflight *_inflight[RES_INFLIGHT_BUCKETS];
+static int      _inflight_enabled = 1;
+static unsigned long _inflight_coalesced = 0;
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t inflight_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int
+res_io_set_coalesce(int on)
+{
+    int old;
+
+    pthread_mutex_lock(&inflight_mutex);
+    old = _inflight_enabled;
+    _inflight_enabled = on ? 1 : 0;
+    pthread_mutex_unlock(&inflight_mutex);
+
+    return old;
+}
+
+unsigned long
+res_io_get_coalesced(void)
+{
+    unsigned long n;
+
+    pthread_mutex_lock(&inflight_mutex);
+    n = _inflight_coalesced;
+    pthread_mutex_unlock(&inflight_mutex);
+
+    return n;
+}
+
+/*
+ * append len bytes to a growing key buffer
+ */
+static int
+_inflight_key_add(u_char **key, size_t *len, size_t *size,
+                  const void *data, size_t n)
+{
+    u_char *tmp;
+
+    if (*len + n > *size) {
+        tmp = (u_char *) MALLOC((*len + n) * 2);
+        if (NULL == tmp)
+            return -1;
+        if (*key) {
+            memcpy(tmp, *key, *len);
+            FREE(*key);
+        }
+        *key = tmp;
+        *size = (*len + n) * 2;
+    }
+    memcpy(*key + *len, data, n);
+    *len += n;
+
+    return 0;
+}
+
+/*
+ * build the key identifying a query: name (lower cased), type, class,
+ * flags, and the options and addresses of each server. Returns NULL if
+ * the query can't be coalesced.
+ */
+static u_char *
+_inflight_key(const char *name, u_int16_t type_h, u_int16_t class_h,
+              u_int flags, struct name_server *ns_list, size_t *key_len)
+{
+    struct name_server *ns;
+    u_char         *key = NULL;
+    size_t          len = 0, size = 0;
+    char            c;
+    int             i, rc = 0;
+
+    for (; *name; ++name) {
+        c = tolower((unsigned char) *name);
+        rc |= _inflight_key_add(&key, &len, &size, &c, 1);
+    }
+    rc |= _inflight_key_add(&key, &len, &size, &type_h, sizeof(type_h));
+    rc |= _inflight_key_add(&key, &len, &size, &class_h, sizeof(class_h));
+    rc |= _inflight_key_add(&key, &len, &size, &flags, sizeof(flags));
+
+    for (ns = ns_list; ns && !rc; ns = ns->ns_next) {
+        if (ns->ns_tsig) {
+            rc = -1;
+            break;
+        }
+        rc |= _inflight_key_add(&key, &len, &size, &ns->ns_options,
+                                sizeof(ns->ns_options));
+        rc |= _inflight_key_add(&key, &len, &size, &ns->ns_edns0_size,
+                                sizeof(ns->ns_edns0_size));
+        for (i = 0; i < ns->ns_number_of_addresses; ++i) {
+            struct sockaddr_storage *a = ns->ns_address[i];
+            rc |= _inflight_key_add(&key, &len, &size, &a->ss_family,
+                                    sizeof(a->ss_family));
+            if (AF_INET == a->ss_family) {
+                struct sockaddr_in *a4 = (struct sockaddr_in *) a;
+                rc |= _inflight_key_add(&key, &len, &size, &a4->sin_port,
+                                        sizeof(a4->sin_port));
+                rc |= _inflight_key_add(&key, &len, &size, &a4->sin_addr,
+                                        sizeof(a4->sin_addr));
+            }
+#ifdef VAL_IPV6
+            else if (AF_INET6 == a->ss_family) {
+                struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a;
+                rc |= _inflight_key_add(&key, &len, &size, &a6->sin6_port,
+                                        sizeof(a6->sin6_port));
+                rc |= _inflight_key_add(&key, &len, &size, &a6->sin6_addr,
+                                        sizeof(a6->sin6_addr));
+            }
+#endif
+        }
+    }
+
+    if (rc || NULL == key) {
+        if (key)
+            FREE(key);
+        return NULL;
+    }
+    *key_len = len;
+    return key;
+}
+
+static void
+_inflight_unlink(struct res_inflight *inf)
+{
+    struct res_inflight **prev;
+
+    for (prev = &_inflight[inf->if_hash % RES_INFLIGHT_BUCKETS]; *prev;
+         prev = &(*prev)->if_next) {
+        if (*prev == inf) {
+            *prev = inf->if_next;
+            break;
+        }
+    }
+    inf->if_next = NULL;
+}
+
+/*
+ * find (and if unlink is set, remove) the waiter for an ea list; caller
+ * has lock
+ */
+static struct res_inflight_waiter *
+_inflight_waiter(struct res_inflight *inf, struct expected_arrival *head,
+                 int unlink)
+{
+    struct res_inflight_waiter **prev, *w;
+
+    for (prev = &inf->if_waiters; *prev; prev = &(*prev)->iw_next) {
+        if ((*prev)->iw_ea != head)
+            continue;
+        w = *prev;
+        if (unlink)
+            *prev = w->iw_next;
+        return w;
+    }
+    return NULL;
+}
+
+/*
+ * drop a reference to an entry; caller has lock
+ */
+static void
+_inflight_release(struct res_inflight *inf)
+{
+    if (--inf->if_refs > 0)
+        return;
+
+    FREE(inf->if_key);
+    FREE(inf);
+}
+
+/*
+ * register a new query, or attach it to an identical one in flight.
+ * Returns 1 if head is now waiting on another query.
+ */
+static int
+_res_io_inflight_join(struct expected_arrival *head, const char *name,
+                      u_int16_t type_h, u_int16_t class_h, u_int flags,
+                      struct name_server *ns_list)
+{
+    struct res_inflight *inf;
+    struct res_inflight_waiter *w;
+    u_char         *key;
+    size_t          key_len = 0, i;
+    u_int32_t       hash = 2166136261U;
+
+    if (!_inflight_enabled || NULL == head)
+        return 0;
+
+    key = _inflight_key(name, type_h, class_h, flags, ns_list, &key_len);
+    if (NULL == key)
+        return 0;
+    for (i = 0; i < key_len; ++i)
+        hash = (hash ^ key[i]) * 16777619U;
+
+    pthread_mutex_lock(&inflight_mutex);
+    for (inf = _inflight[hash % RES_INFLIGHT_BUCKETS]; inf;
+         inf = inf->if_next) {
+        if (inf->if_hash == hash && inf->if_key_len == key_len &&
+            !memcmp(inf->if_key, key, key_len))
+            break;
+    }
+
+    if (inf) {
+        FREE(key);
+        w = (struct res_inflight_waiter *)
+            MALLOC(sizeof(struct res_inflight_waiter));
+        if (NULL == w) {
+            pthread_mutex_unlock(&inflight_mutex);
+            return 0;
+        }
+        memset(w, 0, sizeof(*w));
+        w->iw_ea = head;
+        gettimeofday(&w->iw_since, NULL);
+        w->iw_next = inf->if_waiters;
+        inf->if_waiters = w;
+        ++inf->if_refs;
+        ++_inflight_coalesced;
+        head->ea_inflight = inf;
+        pthread_mutex_unlock(&inflight_mutex);
+        res_log(NULL, LOG_DEBUG, "libsres: ""ea %p waiting on ea %p for %s",
+                head, inf->if_leader, name);
+        return 1;
+    }
+
+    inf = (struct res_inflight *) MALLOC(sizeof(struct res_inflight));
+    if (NULL == inf) {
+        pthread_mutex_unlock(&inflight_mutex);
+        FREE(key);
+        return 0;
+    }
+    memset(inf, 0, sizeof(*inf));
+    inf->if_key = key;
+    inf->if_key_len = key_len;
+    inf->if_hash = hash;
+    inf->if_leader = head;
+    inf->if_refs = 1;
+    inf->if_next = _inflight[hash % RES_INFLIGHT_BUCKETS];
+    _inflight[hash % RES_INFLIGHT_BUCKETS] = inf;
+    head->ea_inflight = inf;
+    pthread_mutex_unlock(&inflight_mutex);
+
+    return 0;
+}
+
+/*
+ * the leader has an answer; give each waiter a copy and retire the
+ * entry, so later queries go to the network again.
+ */
+static void
+_res_io_inflight_answer(struct expected_arrival *head,
+                        struct expected_arrival *from,
+                        u_char *response, size_t response_length)
+{
+    struct res_inflight *inf;
+    struct res_inflight_waiter *w;
+
+    if (NULL == head || NULL == (inf = head->ea_inflight))
+        return;
+
+    pthread_mutex_lock(&inflight_mutex);
+    if (inf->if_leader == head) {
+        for (w = inf->if_waiters; w; w = w->iw_next) {
+            if (w->iw_response || w->iw_promoted)
+                continue;
+            w->iw_response = (u_char *) MALLOC(response_length);
+            if (NULL == w->iw_response)
+                continue;
+            memcpy(w->iw_response, response, response_length);
+            w->iw_response_length = response_length;
+            memcpy(&w->iw_from,
+                   from->ea_ns->ns_address[from->ea_which_address],
+                   sizeof(w->iw_from));
+            res_timers_wake(w->iw_ea);
+        }
+        _inflight_unlink(inf);
+        inf->if_leader = NULL;
+        head->ea_inflight = NULL;
+        _inflight_release(inf);
+    }
+    pthread_mutex_unlock(&inflight_mutex);
+}
+
+/*
+ * an ea list is being freed; detach it from its entry. If it was the
+ * leader, the longest waiting query (the last in the list) takes over.
+ */
+static void
+_res_io_inflight_leave(struct expected_arrival *head)
+{
+    struct res_inflight *inf = head->ea_inflight;
+    struct res_inflight_waiter *w;
+
+    if (NULL == inf)
+        return;
+
+    pthread_mutex_lock(&inflight_mutex);
+    w = _inflight_waiter(inf, head, 1);
+    if (w) {
+        if (w->iw_response)
+            FREE(w->iw_response);
+        FREE(w);
+    }
+    if (inf->if_leader == head) {
+        for (w = inf->if_waiters; w && w->iw_next; w = w->iw_next)
+            ;
+        if (w) {
+            w->iw_promoted = 1;
+            inf->if_leader = w->iw_ea;
+            res_timers_wake(w->iw_ea);
+            res_log(NULL, LOG_DEBUG, "libsres: ""ea %p takes over from ea %p",
+                    w->iw_ea, head);
+        } else {
+            _inflight_unlink(inf);
+            inf->if_leader = NULL;
+        }
+    }
+    head->ea_inflight = NULL;
+    _inflight_release(inf);
+    pthread_mutex_unlock(&inflight_mutex);
+}
+
+/*
+ * when to look at an ea list that is waiting on another query again
+ */
+static void
+_inflight_recheck_time(struct expected_arrival *head, struct timeval *now,
+                       struct timeval *when)
+{
+    long            wait_ms;
+
+    wait_ms = head->ea_timers ? RES_INFLIGHT_RECHECK : RES_INFLIGHT_POLL;
+    when->tv_sec = now->tv_sec + wait_ms / 1000;
+    when->tv_usec = now->tv_usec + (wait_ms % 1000) * 1000;
+    if (when->tv_usec >= 1000000) {
+        ++when->tv_sec;
+        when->tv_usec -= 1000000;
+    }
+}
+
+/*
+ * check if an ea list is waiting on another query, with nothing of its
+ * own to send or read
+ */
+static int
+_res_io_inflight_held(struct expected_arrival *head)
+{
+    struct res_inflight *inf = head->ea_inflight;
+    struct res_inflight_waiter *w;
+    int             rc = 0;
+
+    if (NULL == inf)
+        return 0;
+
+    pthread_mutex_lock(&inflight_mutex);
+    w = _inflight_waiter(inf, head, 0);
+    if (w && !w->iw_response && !w->iw_promoted && inf->if_leader)
+        rc = 1;
+    pthread_mutex_unlock(&inflight_mutex);
 
-    if (af == AF_INET) {
-        memset(&sa4, 0, sizeof(struct sockaddr_in));
-        memset(&sa4.sin_addr, 0, sizeof(sa4.sin_addr));
-        sa4.sin_family = AF_INET;
-        sa4.sin_addr.s_addr = htonl(INADDR_ANY);
-#ifdef VAL_IPV6
-    } else if (af == AF_INET6) {
-        memset(&sa6, 0, sizeof(struct sockaddr_in6));
-        memset(&sa6.sin6_addr, 0, sizeof(sa6.sin6_addr));
-        sa6.sin6_family = AF_INET6;
-        sa6.sin6_addr = in6addr_any;
-#endif
-    } else {
-        res_log(NULL,LOG_ERR,"libsres: could not bind to random port for unsupported address family %d", af);
-        return 1; /* failure */
-    }
+    return rc;
+}
 
+/*
+ * check on a waiting ea list. Returns 1 if it should not send anything
+ * yet, either because the leader is still working or because the
+ * answer has just been handed over; 0 if the list should go on as
+ * usual.
+ */
+static int
+_res_io_inflight_wait(struct expected_arrival *head, struct timeval *next_evt,
+                      struct timeval *now)
+{
+    struct res_inflight *inf = head->ea_inflight;
+    struct res_inflight_waiter *w;
+    struct expected_arrival *ea, *to;
+    struct timeval  waited, poll;
 
-    do {
-        next_port = (libsres_random() % 64512) + 1024;
+    if (NULL == inf)
+        return 0;
 
-        if (af == AF_INET) {
-            sa4.sin_port = htons(next_port);
-            sa = (struct sockaddr *) &sa4;
-            sock_size = sizeof(struct sockaddr_in);
-#ifdef VAL_IPV6
-        } else {
-            sa6.sin6_port = htons(next_port);
-            sa = (struct sockaddr *) &sa6;
-            sock_size = sizeof(struct sockaddr_in6);
-#endif
-        } 
+    pthread_mutex_lock(&inflight_mutex);
+    w = _inflight_waiter(inf, head, 0);
+    if (NULL == w) {
+        /* the leader */
+        pthread_mutex_unlock(&inflight_mutex);
+        return 0;
+    }
+    if (!w->iw_response && !w->iw_promoted && inf->if_leader) {
+        /* still waiting */
+        pthread_mutex_unlock(&inflight_mutex);
+        _inflight_recheck_time(head, now, &poll);
+        if (next_evt)
+            UPDATE(next_evt, poll);
+        /* the list's own deadlines are on hold too */
+        for (ea = head; ea; ea = ea->ea_next)
+            if (ea->ea_remaining_attempts != -1)
+                res_timers_update(ea, &poll);
+        return 1;
+    }
+    _inflight_waiter(inf, head, 1);
+    if (!w->iw_promoted) {
+        head->ea_inflight = NULL;
+        _inflight_release(inf);
+    }
+    /* else the reference is kept as leader */
+    pthread_mutex_unlock(&inflight_mutex);
 
-        if (0 == bind(s, sa, sock_size)) {
-            //res_log(NULL,LOG_ERR,"libsres: bound to random port %d", next_port);
-            return 0; /* success */
+    if (w->iw_response) {
+        /*
+         * hand the answer to the ea for the server which sent it, and
+         * retire the rest of the list.
+         */
+        for (to = head; to; to = to->ea_next)
+            if (to->ea_ns && to->ea_ns->ns_number_of_addresses &&
+                _tcp_addr_match(&w->iw_from,
+                                to->ea_ns->ns_address[to->ea_which_address]))
+                break;
+        if (NULL == to)
+            to = head;
+        for (ea = head; ea; ea = ea->ea_next) {
+            if (ea == to)
+                continue;
+            ea->ea_remaining_attempts = -1;
+            ea->ea_cancel_time = *now;
+            _res_io_timer_update(ea);
         }
-    } while (count++ < NUM_RND_TRIES);
+        to->ea_response = w->iw_response;
+        to->ea_response_length = w->iw_response_length;
+        /* it answers the leader's query; make it answer ours */
+        if (to->ea_signed && (to->ea_signed_length >= sizeof(u_int16_t)) &&
+            (to->ea_response_length >= sizeof(u_int16_t)))
+            memcpy(to->ea_response, to->ea_signed, sizeof(u_int16_t));
+        to->ea_next_try.tv_sec = now->tv_sec + to->ea_ns->ns_retrans;
+        to->ea_next_try.tv_usec = now->tv_usec;
+        to->ea_cancel_time.tv_sec =
+            to->ea_next_try.tv_sec + res_get_timeout(to->ea_ns);
+        to->ea_cancel_time.tv_usec = now->tv_usec;
+        _res_io_timer_update(to);
+        FREE(w);
+        res_log(NULL, LOG_DEBUG, "libsres: ""ea %p got coalesced answer",
+                to);
+        if (next_evt)
+            UPDATE(next_evt, (*now));
+        return 1;
+    }
 
-    /* wrapped around and still no ports found */
-    res_log(NULL,LOG_ERR,"libsres: could not bind to random port");
+    /*
+     * the leader went away without an answer (and this list has most
+     * likely taken over); carry on from where it left off when it
+     * started waiting.
+     */
+    timersub(now, &w->iw_since, &waited);
+    for (ea = head; ea; ea = ea->ea_next) {
+        timeradd(&ea->ea_next_try, &waited, &ea->ea_next_try);
+        timeradd(&ea->ea_cancel_time, &waited, &ea->ea_cancel_time);
+        _res_io_timer_update(ea);
+    }
+    FREE(w);
+    res_log(NULL, LOG_DEBUG, "libsres: ""ea %p now leading", head);
 
-    return 1; /* failure */
+    return 0;
 }
 
 /*
- * find the max number of file descriptors for this process
+ * data an ea's socket is registered with in its poller. eas sharing a
+ * tcp connection all register it with the connection, so each holds a
+ * reference to one registration.
  */
-static int _init_max_fd(void) {
-    struct rlimit info;
-    int rc;
-    int lim;
+static void *
+_res_io_poll_owner(struct expected_arrival *ea)
+{
+    return ea->ea_tcp_conn ? (void *) ea->ea_tcp_conn : (void *) ea;
+}
 
-#ifndef HAVE_GETRLIMIT
-    /** hmm, cannot get current value. let's just guess. */
-    info.rlim_cur = info.rlim_max = SR_IO_NOFILE_UNKNOWN_SIZE;
-#else
-    rc = getrlimit( RLIMIT_NOFILE, &info);
-    if (rc) {
-        /** hmm, cannot get current value. let's just guess. */
-        info.rlim_cur = info.rlim_max = SR_IO_NOFILE_UNKNOWN_SIZE;
-    }
-#ifdef HAVE_SETRLIMIT
-    else if (info.rlim_cur < info.rlim_max) {
-        int prev = info.rlim_cur;
-        info.rlim_cur = info.rlim_max;
-        rc = setrlimit( RLIMIT_NOFILE, &info);
-        if (rc) /* oh well, we tried. revert to previous limit */
-            info.rlim_cur = prev;
+/*
+ * close the socket for an ea, removing it from any poller first
+ */
+static void
+_res_io_close_socket(struct expected_arrival *ea)
+{
+    if (ea->ea_socket == INVALID_SOCKET)
+        return;
+
+    if (ea->ea_poller)
+        res_poller_del(ea->ea_poller, ea->ea_socket);
+    if (ea->ea_tcp_conn) {
+        _res_io_tcp_detach(ea);
+        return;
     }
-#endif /* HAVE_GETRLIMIT */
-#endif /* HAVE_GETRLIMIT */
-    lim = info.rlim_cur - SR_IO_NOFILE_RESERVED;
-    if (lim <= 0)
-        lim = 1;
-    return lim;
+    CLOSESOCK(ea->ea_socket);
+    RES_ATOMIC_ADD(&_open_sockets, -1);
+    ea->ea_socket = INVALID_SOCKET;
 }
 
-long
-res_io_get_max_fd(void) {
-    return _max_fd;
-}
+/*
+ * done with the socket for an ea; udp sockets go back to the pool
+ */
+static void
+_res_io_release_socket(struct expected_arrival *ea)
+{
+    int af;
 
-long
-res_io_get_open_sockets(void) {
-    return _open_sockets;
+    if ((ea->ea_socket == INVALID_SOCKET) || ea->ea_using_stream ||
+        (ea->ea_sock_born == 0) || (NULL == ea->ea_ns)) {
+        _res_io_close_socket(ea);
+        return;
+    }
+
+    af = ea->ea_ns->ns_address[ea->ea_which_address]->ss_family;
+    if (ea->ea_poller)
+        res_poller_del(ea->ea_poller, ea->ea_socket);
+    if (0 != _udp_pool_put(af, ea->ea_socket, ea->ea_sock_uses,
+                           ea->ea_sock_born)) {
+        /* already out of the poller; don't go through _res_io_close_socket */
+        CLOSESOCK(ea->ea_socket);
+        RES_ATOMIC_ADD(&_open_sockets, -1);
+    }
+    ea->ea_socket = INVALID_SOCKET;
 }
 
-static long
-res_get_timeout(struct name_server *ns)
+/*
+ * check if the socket for an ea has data waiting. If an fd_set is given,
+ * it is used; otherwise the ready state recorded by the ea's poller is.
+ */
+static int
+_res_io_is_readable(struct expected_arrival *ea, fd_set *fds)
 {
-    int             i;
-    long            cancel_delay = 0;
+    /* a coalesced answer arrives without a socket */
+    if (ea->ea_socket == INVALID_SOCKET)
+        return (ea->ea_response != NULL);
 
-    for (i = 0; i <= ns->ns_retry; i++) {
-        cancel_delay += ns->ns_retrans;
-        //cancel_delay += ns->ns_retrans << i;
+    if (_res_io_tcp_has_response(ea))
+        return 1;
+
+    if (fds) {
+#ifndef WIN32
+        if (ea->ea_socket >= FD_SETSIZE)
+            return 0;
+#endif
+        return FD_ISSET(ea->ea_socket, fds);
     }
 
-    return cancel_delay;
+    return res_poller_is_ready(ea->ea_poller, ea->ea_socket);
 }
 
-void            res_print_ea(struct expected_arrival *ea);
-int             res_quecmp(u_char * query, u_char * response);
+/*
+ * an ea still waiting on a udp answer is being given up on, usually
+ * because another server answered first. If it has waited longer than
+ * the server's timeout estimate, count it as a timeout; otherwise a
+ * server that never answers would never be measured.
+ */
+static void
+_res_io_rtt_abandon(struct expected_arrival *ea)
+{
+    struct sockaddr_storage *addr;
+    struct timeval  now, waited;
+    long            rto;
+
+    if ((ea->ea_remaining_attempts == -1) || ea->ea_using_stream ||
+        (ea->ea_sends == 0) || ea->ea_response || (NULL == ea->ea_ns))
+        return;
+
+    addr = ea->ea_ns->ns_address[ea->ea_which_address];
+    rto = res_rtt_rto(addr, ea->ea_ns->ns_retrans * 1000);
+    if (rto < 0)
+        rto = RES_RTT_MIN_RTO;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &ea->ea_sent, &waited);
+    if ((waited.tv_sec * 1000 + waited.tv_usec / 1000) >= rto)
+        res_rtt_timeout(addr);
+}
 
 void
 res_sq_free_expected_arrival(struct expected_arrival **ea)
@@ -204,20 +2483,21 @@ res_sq_free_expected_arrival(struct expected_arrival **ea)
     if ((ea == NULL) || (*ea == NULL))
         return;
 
+    _res_io_rtt_abandon(*ea);
+    _res_io_inflight_leave(*ea);
+    res_timers_update(*ea, NULL);
+
     if ((*ea)->ea_socket != INVALID_SOCKET)
         res_log(NULL, LOG_DEBUG, "libsres: ""ea %p, fd %d free",
                 *ea, (*ea)->ea_socket);
     else
         res_log(NULL, LOG_DEBUG+1, "libsres: ""ea %p, fd %d free",
                 *ea, (*ea)->ea_socket);
+    _res_io_release_socket(*ea);
     if ((*ea)->ea_ns != NULL)
         free_name_server(&((*ea)->ea_ns));
     if ((*ea)->ea_name != NULL)
         free((*ea)->ea_name);
-    if ((*ea)->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK((*ea)->ea_socket);
-        --_open_sockets;
-    }
     if ((*ea)->ea_signed)
         FREE((*ea)->ea_signed);
     if ((*ea)->ea_response)
@@ -264,6 +2544,24 @@ set_alarms(struct expected_arrival *ea, long next, long cancel)
     ea->ea_next_try.tv_sec += next;
     ea->ea_cancel_time.tv_sec = ea->ea_next_try.tv_sec + cancel;
     ea->ea_cancel_time.tv_usec = ea->ea_next_try.tv_usec;
+    _res_io_timer_update(ea);
+}
+
+/*
+ * like set_alarms, but with the next try in milliseconds
+ */
+static void
+set_alarms_ms(struct expected_arrival *ea, long next_ms, long cancel)
+{
+    struct timeval  next;
+
+    next.tv_sec = next_ms / 1000;
+    next.tv_usec = (next_ms % 1000) * 1000;
+    gettimeofday(&ea->ea_next_try, NULL);
+    timeradd(&ea->ea_next_try, &next, &ea->ea_next_try);
+    ea->ea_cancel_time.tv_sec = ea->ea_next_try.tv_sec + cancel;
+    ea->ea_cancel_time.tv_usec = ea->ea_next_try.tv_usec;
+    _res_io_timer_update(ea);
 }
 
 static struct expected_arrival *
@@ -314,14 +2612,11 @@ res_io_retry_source(struct expected_arrival *ea)
     res_print_ea(ea);
 
     /* close socket */
-    if (ea->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(ea->ea_socket);
-        --_open_sockets;
-        ea->ea_socket = INVALID_SOCKET;
-    }
+    _res_io_close_socket(ea);
 
     /* bump retry time to current time */
     gettimeofday(&ea->ea_next_try, NULL);
+    _res_io_timer_update(ea);
 }
 
 /*
@@ -335,14 +2630,11 @@ res_io_reset_source(struct expected_arrival *ea)
     res_print_ea(ea);
 
     /* close socket */
-    if (ea->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(ea->ea_socket);
-        --_open_sockets;
-        ea->ea_socket = INVALID_SOCKET;
-    }
+    _res_io_close_socket(ea);
 
     /* bump cancel time to current time */
     gettimeofday(&ea->ea_cancel_time, NULL);
+    _res_io_timer_update(ea);
 }
 
 /*
@@ -356,24 +2648,23 @@ res_io_cancel_source(struct expected_arrival *ea)
     res_print_ea(ea);
 
     /* close socket */
-    if (ea->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(ea->ea_socket);
-        --_open_sockets;
-        ea->ea_socket = INVALID_SOCKET;
-    }
+    _res_io_release_socket(ea);
 
     /* bump cancel time to current time */
     gettimeofday(&ea->ea_cancel_time, NULL);
 
     /* no more retries */
     ea->ea_remaining_attempts = -1;
+    _res_io_timer_update(ea);
 }
 
 void
 res_io_cancel_all_remaining_attempts(struct expected_arrival *ea)
 {
-    for ( ; ea; ea = ea->ea_next)
+    for ( ; ea; ea = ea->ea_next) {
+        _res_io_rtt_abandon(ea);
         res_io_cancel_source(ea);
+    }
 }
 
 int
@@ -391,6 +2682,51 @@ res_io_are_all_finished(struct expected_arrival *ea)
     return TRUE;
 }
 
+/*
+ * register a new or pooled socket with the ea's poller and connect it to
+ * the current server address. On failure the source is reset or retried.
+ */
+static int
+_res_io_setup_socket(struct expected_arrival *shipit)
+{
+    int             i = shipit->ea_which_address;
+    int             af = shipit->ea_ns->ns_address[i]->ss_family;
+    struct timeval  timeout;
+
+    if (shipit->ea_poller &&
+        0 != res_poller_add(shipit->ea_poller, shipit->ea_socket,
+                            _res_io_poll_owner(shipit))) {
+        res_io_retry_source(shipit);
+        return -1;
+    }
+
+    /*
+     * Set the timeout interval
+     */
+    timeout.tv_sec = shipit->ea_ns->ns_retrans;
+    timeout.tv_usec = 0;
+
+    if (setsockopt (shipit->ea_socket, SOL_SOCKET, SO_SNDTIMEO, 
+                (char *)&timeout, sizeof(timeout)) < 0) {
+        /* error */
+        res_io_retry_source(shipit);
+        return -1;
+    }
+
+    if (connect
+        (shipit->ea_socket,
+         (struct sockaddr *) shipit->ea_ns->ns_address[i],
+         _res_io_addr_len(af)) == SOCKET_ERROR) {
+        res_log(NULL, LOG_ERR,
+                "libsres: ""Closing socket %d, connect errno = %d",
+                shipit->ea_socket, errno);
+        res_io_reset_source(shipit);
+        return -1;
+    }
+
+    return 0;
+}
+
 int
 res_io_send(struct expected_arrival *shipit)
 {
@@ -400,10 +2736,8 @@ res_io_send(struct expected_arrival *shipit)
      */
     int             socket_type;
     int             socket_proto;
-    size_t          socket_size;
     size_t          bytes_sent;
     long            delay;
-    struct timeval  timeout;
 
     if (shipit == NULL)
         return SR_IO_INTERNAL_ERROR;
@@ -422,6 +2756,20 @@ res_io_send(struct expected_arrival *shipit)
             shipit->ea_using_stream ? "stream" : "dgram",
             (socket_proto == IPPROTO_TCP) ? "tcp" : "udp");
 
+    /* reuse a pooled udp socket if we can */
+    if (shipit->ea_socket == INVALID_SOCKET && !shipit->ea_using_stream) {
+        int af = shipit->ea_ns->ns_address[shipit->ea_which_address]->ss_family;
+
+        shipit->ea_socket = _udp_pool_get(af, &shipit->ea_sock_uses,
+                                          &shipit->ea_sock_born);
+        if (shipit->ea_socket != INVALID_SOCKET) {
+            res_log(NULL, LOG_DEBUG, "libsres: ""ea %p reusing socket %d (%d uses)",
+                    shipit, shipit->ea_socket, shipit->ea_sock_uses);
+            if (0 != _res_io_setup_socket(shipit))
+                return SR_IO_SOCKET_ERROR;
+        }
+    }
+
     /* don't send too many packets at once. */
     if (shipit->ea_socket == INVALID_SOCKET && _open_sockets >= _max_fd) {
         res_log(NULL, LOG_DEBUG, "libsres: ""ea %p too many packets in flight",
@@ -430,8 +2778,24 @@ res_io_send(struct expected_arrival *shipit)
     }
 
     /*
-     * If no socket exists for the transfer, create and connect it (TCP
-     * or UDP).  If for some reason this fails, return a INVALID_SOCKET 
+     * TCP queries share a connection to the server, if there is one.
+     */
+    if (shipit->ea_socket == INVALID_SOCKET && shipit->ea_using_stream) {
+        if (0 != _res_io_tcp_attach(shipit)) {
+            res_io_reset_source(shipit);
+            return SR_IO_SOCKET_ERROR;
+        }
+        if (shipit->ea_poller &&
+            0 != res_poller_add(shipit->ea_poller, shipit->ea_socket,
+                                _res_io_poll_owner(shipit))) {
+            res_io_retry_source(shipit);
+            return SR_IO_SOCKET_ERROR;
+        }
+    }
+
+    /*
+     * If no socket exists for the transfer, create and connect it (UDP).
+     * If for some reason this fails, return a INVALID_SOCKET 
      * which causes the source to be cancelled next go-round.
      */
     if (shipit->ea_socket == INVALID_SOCKET) {
@@ -444,7 +2808,7 @@ res_io_send(struct expected_arrival *shipit)
                     errno, strerror(errno));
             return SR_IO_SOCKET_ERROR;
         }
-        ++_open_sockets;
+        RES_ATOMIC_ADD(&_open_sockets, 1);
 
         /* Set the source port */
         if (0 != bind_to_random_source(af, shipit->ea_socket)) {
@@ -453,72 +2817,44 @@ res_io_send(struct expected_arrival *shipit)
             return SR_IO_SOCKET_ERROR;
         }
 
-        /*
-         * Set the timeout interval
-         */
-        timeout.tv_sec = shipit->ea_ns->ns_retrans;
-        timeout.tv_usec = 0;
-
-        if (setsockopt (shipit->ea_socket, SOL_SOCKET, SO_SNDTIMEO, 
-                    (char *)&timeout, sizeof(timeout)) < 0) {
-            /* error */
-            res_io_retry_source(shipit);
-            return SR_IO_SOCKET_ERROR;
-        }
-
-        /*
-         * OS X wants the socket size to be sockaddr_in for INET,
-         * while Linux is happy with sockaddr_storage. 
-         */
-        if (af == AF_INET) {
-            socket_size = sizeof(struct sockaddr_in);
-#ifdef VAL_IPV6
-        } else if (af == AF_INET6) {
-            socket_size = sizeof(struct sockaddr_in6);
-#endif
-        } else {
-            socket_size = sizeof(struct sockaddr_storage); 
-        }
+        /* udp sockets are returned to the pool when done */
+        shipit->ea_sock_uses = 0;
+        shipit->ea_sock_born = 0;
+        if (!shipit->ea_using_stream)
+            shipit->ea_sock_born = time(NULL);
 
-        if (connect
-            (shipit->ea_socket,
-             (struct sockaddr *) shipit->ea_ns->ns_address[i],
-             socket_size) == SOCKET_ERROR) {
-            res_log(NULL, LOG_ERR,
-                    "libsres: ""Closing socket %d, connect errno = %d",
-                    shipit->ea_socket, errno);
-            res_io_reset_source(shipit);
+        if (0 != _res_io_setup_socket(shipit))
             return SR_IO_SOCKET_ERROR;
-        }
     }
-
     /*
      * We must have a valid socket to use now, so we just need to send the
-     * query (but first the length if via TCP).  Again, errors return -1,
+     * query (with the length first if via TCP).  Again, errors return -1,
      * cause the source to be cancelled.
      */
     if (shipit->ea_using_stream) {
+        int connected = _res_io_tcp_check_connect(shipit);
 
-        u_int16_t length_n;
-        length_n = htons(shipit->ea_signed_length);
-
-
-        if ((bytes_sent =
-             send(shipit->ea_socket, (const char *)&length_n, sizeof(length_n), 0))
-            == SOCKET_ERROR) {
-            res_io_reset_source(shipit);
-            return SR_IO_SOCKET_ERROR;
+        if (0 == connected) {
+            res_log(NULL, LOG_DEBUG, "libsres: "
+                    "ea %p waiting for tcp connect", shipit);
+            _res_io_timer_update(shipit);
+            return SR_IO_UNSET;
         }
-
-
-        if (bytes_sent != sizeof(length_n)) {
+        if ((connected < 0) || (0 != _res_io_tcp_send(shipit))) {
+            _res_io_tcp_failed(shipit);
             res_io_reset_source(shipit);
             return SR_IO_SOCKET_ERROR;
         }
+        bytes_sent = shipit->ea_signed_length;
+    }
+    else {
+        /* the last transmission went unanswered */
+        if (shipit->ea_sends > 0)
+            res_rtt_timeout(shipit->ea_ns->ns_address[shipit->ea_which_address]);
+        bytes_sent = send(shipit->ea_socket, (const char*)shipit->ea_signed,
+                          shipit->ea_signed_length, 0);
+        UDP_STAT_ADD(uio_send_calls, 1);
     }
-
-    bytes_sent = send(shipit->ea_socket, (const char*)shipit->ea_signed,
-                      shipit->ea_signed_length, 0);
     if (bytes_sent != shipit->ea_signed_length) {
         res_log(NULL, LOG_ERR, "libsres: "
                 "Closing socket %d, sending %d bytes failed (rc %d)",
@@ -531,6 +2867,29 @@ res_io_send(struct expected_arrival *shipit)
     //    << (shipit->ea_ns->ns_retry + 1 - shipit->ea_remaining_attempts--);
     delay = shipit->ea_ns->ns_retrans;
     shipit->ea_remaining_attempts--;
+    shipit->ea_sock_uses++;
+    gettimeofday(&shipit->ea_sent, NULL);
+    shipit->ea_sends++;
+
+    /*
+     * retransmit udp queries after the server's estimated timeout,
+     * doubled for each retry, if we know it.
+     */
+    if (!shipit->ea_using_stream) {
+        long rto = res_rtt_rto(shipit->ea_ns->ns_address[shipit->ea_which_address],
+                               delay * 1000);
+        if (rto > 0) {
+            int shift = shipit->ea_sends - 1;
+            if (shift < 16 && (rto << shift) < delay * 1000)
+                rto <<= shift;
+            else
+                rto = delay * 1000;
+            res_log(NULL, LOG_DEBUG, "libsres: ""next try delay %ldms", rto);
+            set_alarms_ms(shipit, rto, res_get_timeout(shipit->ea_ns));
+            res_print_ea(shipit);
+            return SR_IO_UNSET;
+        }
+    }
     res_log(NULL, LOG_DEBUG, "libsres: ""next try delay %d", delay);
     set_alarms(shipit, delay, res_get_timeout(shipit->ea_ns));
     res_print_ea(shipit);
@@ -548,17 +2907,17 @@ int
 res_nsfallback(int transaction_id, struct timeval *closest_event, 
                struct name_server *server)
 {
-    struct expected_arrival *temp;
+    struct res_transaction *t;
     int ret_val = -1;
 
-    if (transaction_id < 0)
+    t = _tr_slot(transaction_id);
+    if (NULL == t)
         return -1;
 
-    pthread_mutex_lock(&mutex);
-    temp = transactions[transaction_id];
-    if (temp != NULL)
-        ret_val = res_nsfallback_ea(temp, closest_event, server);
-    pthread_mutex_unlock(&mutex);
+    TR_LOCK(t);
+    if (t->rt_ea != NULL)
+        ret_val = res_nsfallback_ea(t->rt_ea, closest_event, server);
+    TR_UNLOCK(t);
     return ret_val;
 }
 
@@ -585,6 +2944,7 @@ _reset_timeouts(struct expected_arrival *temp)
                         offset, t);
                 t->ea_next_try.tv_sec -= offset;
                 t->ea_cancel_time.tv_sec -= offset;
+                _res_io_timer_update(t);
             } 
         }
     }
@@ -659,6 +3019,10 @@ res_nsfallback_ea(struct expected_arrival *ea, struct timeval *closest_event,
         }
     }
 
+    if (temp->ea_ns->ns_edns0_size < old_size)
+        res_caps_fallback(temp->ea_ns->ns_address[temp->ea_which_address],
+                          old_size);
+
     /** didn't find a smaller size to try and were already on last attempt */
     if (temp->ea_remaining_attempts <= 0) {
         res_log(NULL, LOG_DEBUG, "libsres: "
@@ -692,11 +3056,7 @@ res_nsfallback_ea(struct expected_arrival *ea, struct timeval *closest_event,
     }
 
     /** close socket so retry uses different port */
-    if (temp->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(temp->ea_socket);
-        --_open_sockets;
-    }
-    temp->ea_socket = INVALID_SOCKET;
+    _res_io_close_socket(temp);
 
     res_log(NULL, LOG_INFO, "libsres: "
             "ns fallback for {%s %s(%d) %s(%d)}, edns0 size %d > %d",
@@ -718,13 +3078,10 @@ res_io_next_address(struct expected_arrival *ea,
         /*
          * Start over with new address 
          */
-        if (ea->ea_socket != INVALID_SOCKET) {
-            CLOSESOCK (ea->ea_socket);
-            --_open_sockets;
-            ea->ea_socket = INVALID_SOCKET;
-        }
+        _res_io_close_socket(ea);
         ea->ea_which_address++;
         ea->ea_remaining_attempts = ea->ea_ns->ns_retry+1;
+        ea->ea_sends = 0;
         set_alarms(ea, 0, res_get_timeout(ea->ea_ns));
         res_log(NULL, LOG_INFO,
                 "libsres: ""%s - SWITCHING TO NEW ADDRESS", more_prefix);
@@ -778,6 +3135,16 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
         res_log(NULL, LOG_DEBUG, "libsres: ""  Initial next event %ld.%ld",
                 next_evt->tv_sec, next_evt->tv_usec);
 
+    /* an identical query is in flight; wait for its answer */
+    if (ea && _res_io_inflight_wait(ea, next_evt, now)) {
+        for ( ; ea; ea = ea->ea_next)
+            if (ea->ea_remaining_attempts != -1)
+                ++remaining;
+        if (active)
+            *active = remaining;
+        return remaining ? SR_IO_UNSET : SR_IO_NO_ANSWER;
+    }
+
     for ( ; ea; ea = ea->ea_next ) {
         if (ea->ea_remaining_attempts == -1) {
             res_log(NULL, LOG_DEBUG, "libsres: "
@@ -791,6 +3158,10 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
         else
             ++no_sock;
 
+        /* queries queued on a busy tcp connection */
+        if (ea->ea_using_stream && (0 != _res_io_tcp_flush(ea, now, next_evt)))
+            _res_io_tcp_failed(ea);
+
         /*
          * check for timeouts. If there is another address, move to it
          */
@@ -798,8 +3169,15 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
              ((0 == ea->ea_remaining_attempts) && LTEQ(ea->ea_next_try, (*now)))) {
             if (net_change && ea->ea_socket != INVALID_SOCKET)
                 --(*net_change);
-            if (1 != res_nsfallback_ea(ea, next_evt, NULL))
+            /* don't leave later queries waiting on a stalled connect */
+            if (_res_io_tcp_is_connecting(ea))
+                _res_io_tcp_failed(ea);
+            /* (a fallback's resend records the timeout itself) */
+            if (1 != res_nsfallback_ea(ea, next_evt, NULL)) {
+                if (!ea->ea_using_stream && ea->ea_sends > 0)
+                    res_rtt_timeout(ea->ea_ns->ns_address[ea->ea_which_address]);
                 res_io_next_address(ea, "TIMEOUTS", "TIMEOUT - CANCELING");
+            }
         }
 
         /*
@@ -831,6 +3209,8 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
             if (next_evt) {
                 UPDATE(next_evt, ea->ea_cancel_time);
                 UPDATE(next_evt, ea->ea_next_try);
+                if (_res_io_tcp_has_response(ea))
+                    UPDATE(next_evt, (*now));
             }
             if (ea->ea_socket != INVALID_SOCKET)
                 ++open;
@@ -871,18 +3251,17 @@ res_io_check_one(struct expected_arrival *ea, struct timeval *next_evt,
     return res_io_check_ea_list(ea, next_evt, now, NULL, NULL);
 }
 
-/** static version that assume caller has mutex lock... */
+/** static version that assume caller has slot lock... */
 static int
-_check_one_tid(int tid, struct timeval *next_evt, struct timeval *now)
+_check_one_tid(struct res_transaction *t, struct timeval *next_evt,
+               struct timeval *now)
 {
     int                      active = 0;
-    struct expected_arrival *ea;
 
-    /** assume caller has mutex lock */
+    /** assume caller has slot lock */
 
-    ea = transactions[tid];
-    if (ea)
-        res_io_check_ea_list(ea, next_evt, now, NULL, &active);
+    if (t->rt_ea)
+        res_io_check_ea_list(t->rt_ea, next_evt, now, NULL, &active);
 
     return (active > 0); /* have active queries */
 }
@@ -895,15 +3274,16 @@ int
 res_io_check_one_tid(int tid, struct timeval *next_evt, struct timeval *now)
 {
     int ret_val;
+    struct res_transaction *t = _tr_slot(tid);
 
-    if ((NULL == next_evt) || (tid < 0) || (tid >= MAX_TRANSACTIONS))
+    if ((NULL == next_evt) || (NULL == t))
         return 0; /* i.e. no transactions for this tid */
 
-    pthread_mutex_lock(&mutex);
+    TR_LOCK(t);
 
-    ret_val = _check_one_tid(tid, next_evt, now);
+    ret_val = _check_one_tid(t, next_evt, now);
 
-    pthread_mutex_unlock(&mutex);
+    TR_UNLOCK(t);
 
     res_log(NULL, LOG_DEBUG, "libsres: "" tid %d next event is at %ld.%ld",
             tid, next_evt->tv_sec, next_evt->tv_usec);
@@ -913,18 +3293,15 @@ res_io_check_one_tid(int tid, struct timeval *next_evt, struct timeval *now)
 
 /*
  * for backwards compatability, this checks all transactions.
- * I'd like to have it call res_io_check_one_tid, but that'd
- * involve a mutex lock/unlock for each active transaction, which
- * seems wasteful...
  */
 int
 res_io_check(int transaction_id, struct timeval *next_evt)
 {
-    int             i, ret_val;
+    int             i, count, ret_val;
     struct timeval  tv;
+    struct res_transaction *t, *mine = _tr_slot(transaction_id);
 
-    if ((NULL == next_evt) || (transaction_id < 0) ||
-        (transaction_id >= MAX_TRANSACTIONS))
+    if ((NULL == next_evt) || (NULL == mine))
         return 0;
 
     gettimeofday(&tv, NULL);
@@ -937,17 +3314,21 @@ res_io_check(int transaction_id, struct timeval *next_evt)
     memset(next_evt, 0, sizeof(struct timeval));
     ret_val = 0; /* no active queries */
 
-    pthread_mutex_lock(&mutex);
-
     /** check all except specified transaction_id, ignore return */
-    for (i = 0; i < MAX_TRANSACTIONS; i++)
-        if ((i != transaction_id) && transactions[i])
-            _check_one_tid(i, next_evt, &tv);
+    count = _tr_size();
+    for (i = 0; i < count; i++) {
+        t = _tr_slot(i);
+        if ((t == mine) || !t->rt_in_use)
+            continue;
+        TR_LOCK(t);
+        _check_one_tid(t, next_evt, &tv);
+        TR_UNLOCK(t);
+    }
 
     /** check for remaining attempts for specified transaction */
-    ret_val = _check_one_tid(transaction_id, next_evt, &tv);
-
-    pthread_mutex_unlock(&mutex);
+    TR_LOCK(mine);
+    ret_val = _check_one_tid(mine, next_evt, &tv);
+    TR_UNLOCK(mine);
 
     res_log(NULL, LOG_DEBUG, "libsres: "" next global event is at %ld.%ld",
             next_evt->tv_sec, next_evt->tv_usec);
@@ -958,56 +3339,48 @@ res_io_check(int transaction_id, struct timeval *next_evt)
 int
 res_io_queue_ea(int *transaction_id, struct expected_arrival *new_ea)
 {
-    int             try_index;
+    struct res_transaction *t;
     struct expected_arrival *temp;
 
     /*
      * Determine (new) transaction location 
      */
-    pthread_mutex_lock(&mutex);
     if (*transaction_id == -1) {
         /*
          * Find a place to hold this transaction 
          */
-        try_index = next_transaction;
-        do {
-            if (transactions[try_index] == NULL)
-                break;
-            try_index = (try_index + 1) % MAX_TRANSACTIONS;
-        } while (try_index != next_transaction);
-
-        if (try_index == next_transaction
-            && transactions[try_index] != NULL) {
+        *transaction_id = _tr_alloc();
+        if (*transaction_id == -1) {
             /*
              * We've run out of places to hold transactions 
              */
-            pthread_mutex_unlock(&mutex);
             return SR_IO_TOO_MANY_TRANS;
         }
-
-        *transaction_id = try_index;
-        next_transaction = (try_index + 1) % MAX_TRANSACTIONS;
     }
 
+    t = _tr_slot(*transaction_id);
+    if (NULL == t)
+        return SR_IO_INTERNAL_ERROR;
+
     /*
      * Register this request 
      */
-    if (transactions[*transaction_id] == NULL) {
+    TR_LOCK(t);
+    if (t->rt_ea == NULL) {
         /*
          * Add this as the first request 
          */
-        transactions[*transaction_id] = new_ea;
+        t->rt_ea = new_ea;
     } else {
         /*
          * Retaining order is important 
          */
-        temp = transactions[*transaction_id];
+        temp = t->rt_ea;
         while (temp->ea_next)
             temp = temp->ea_next;
         temp->ea_next = new_ea;
     }
-
-    pthread_mutex_unlock(&mutex);
+    TR_UNLOCK(t);
 
     return SR_IO_UNSET;
 }
@@ -1027,18 +3400,17 @@ void
 res_io_select_info_tid(int tid, int *nfds,
                        fd_set * read_descriptors,struct timeval *next_evt)
 {
-    struct expected_arrival *ea;
+    struct res_transaction *t = _tr_slot(tid);
 
-    if ((tid < 0) || (tid >= MAX_TRANSACTIONS))
+    if (NULL == t)
         return;
 
-    pthread_mutex_lock(&mutex);
+    TR_LOCK(t);
 
-    ea = transactions[tid];
-    if (ea)
-        res_io_select_info(ea, nfds, read_descriptors, next_evt);
+    if (t->rt_ea)
+        res_io_select_info(t->rt_ea, nfds, read_descriptors, next_evt);
 
-    pthread_mutex_unlock(&mutex);
+    TR_UNLOCK(t);
 }
 
 void
@@ -1052,7 +3424,7 @@ void
 res_io_select_info(struct expected_arrival *ea_list, int *nfds,
                    fd_set * read_descriptors, struct timeval *timeout)
 {
-    struct timeval now, orig;
+    struct timeval now, orig, when;
     int            count = 0, skipped = 0;
 
     if (timeout) {
@@ -1066,6 +3438,18 @@ res_io_select_info(struct expected_arrival *ea_list, int *nfds,
     else
         res_log(NULL, LOG_DEBUG, "libsres: "" ea %p select info",
                 ea_list);
+
+    /*
+     * a list waiting on another query has no sockets, and its deadlines
+     * are on hold
+     */
+    if (ea_list && _res_io_inflight_held(ea_list)) {
+        if (timeout) {
+            _inflight_recheck_time(ea_list, &now, &when);
+            UPDATE(timeout, when);
+        }
+        return;
+    }
     /*
      * Find all sockets in use for a particular transaction chain of
      * expected arrivals
@@ -1085,6 +3469,22 @@ res_io_select_info(struct expected_arrival *ea_list, int *nfds,
             continue;
         }
 
+        /* response already read by another query on the connection */
+        if (timeout && _res_io_tcp_has_response(ea_list))
+            UPDATE(timeout, now);
+        /* output queued on the connection */
+        if (ea_list->ea_using_stream &&
+            (0 != _res_io_tcp_flush(ea_list, &now, timeout)))
+            _res_io_tcp_failed(ea_list);
+
+#ifndef WIN32
+        if (read_descriptors && (ea_list->ea_socket >= FD_SETSIZE)) {
+            ++skipped;
+            res_log(NULL,LOG_DEBUG, "libsres:""   fd %d exceeds FD_SETSIZE",
+                    ea_list->ea_socket);
+            continue;
+        }
+#endif
         if (read_descriptors &&
             FD_ISSET(ea_list->ea_socket, read_descriptors)) {
             ++skipped;
@@ -1259,11 +3659,7 @@ res_io_get_a_response(struct expected_arrival *ea_list, u_char ** answer,
             res_log(NULL, LOG_DEBUG, "libsres: "
                     "*** dropped response for ea %p rc %d", ea_list, retval);
             /** close socket so retry uses different port */
-            if (ea_list->ea_socket != INVALID_SOCKET) {
-                CLOSESOCK (ea_list->ea_socket);
-                --_open_sockets;
-                ea_list->ea_socket = INVALID_SOCKET;
-            }
+            _res_io_close_socket(ea_list);
             res_print_ea(ea_list);
             _clone_respondent(ea_list, respondent);
             set_alarms(ea_list, 0, res_get_timeout(ea_list->ea_ns));
@@ -1286,8 +3682,19 @@ res_io_get_a_response(struct expected_arrival *ea_list, u_char ** answer,
             if (SR_UNSET != retval)
                 return retval;
 
+            _res_io_inflight_answer(orig, ea_list, *answer, *answer_length);
             ea_list->ea_response = NULL;
             ea_list->ea_response_length = 0;
+            _res_io_timer_update(ea_list);
+
+            /* cancel any other attempts still in flight */
+            for ( ; orig; orig = orig->ea_next) {
+                if ((orig == ea_list) || (orig->ea_remaining_attempts == -1) ||
+                    (orig->ea_socket == INVALID_SOCKET))
+                    continue;
+                _res_io_rtt_abandon(orig);
+                res_io_cancel_source(orig);
+            }
             return SR_IO_GOT_ANSWER;
         }
     }
@@ -1340,61 +3747,368 @@ complete_read(SOCKET sock, u_char *field, size_t length)
     return bytes_read;
 }
 
+/*
+ * read every complete response waiting on the ea's tcp connection,
+ * handing each to the query it answers, then pick up this ea's answer
+ * if it has one. The socket is drained rather than read up to our own
+ * answer, since a poller which reports arrivals (io_uring) won't report
+ * data left behind.
+ */
 static int
 res_io_read_tcp(struct expected_arrival *arrival)
 {
-    u_int16_t    len_n;
+    struct res_tcp_conn *c = arrival->ea_tcp_conn;
+    struct res_tcp_waiter *w;
+    u_int16_t    id;
     size_t       len_h;
+    u_char      *msg;
+    int          rc = SR_IO_NO_ANSWER_YET, failed = 0, n;
+
+    if (NULL == c)
+        return SR_IO_INTERNAL_ERROR;
 
     /*
-     * Read length 
+     * the socket is readable while connecting only if the connect
+     * failed; if it has just completed, send our query
      */
-    if (complete_read(arrival->ea_socket, (u_char *)&len_n, sizeof(len_n))
-        != sizeof(len_n)) {
+    if (_res_io_tcp_is_connecting(arrival)) {
+        rc = _res_io_tcp_check_connect(arrival);
+        if (rc < 0) {
+            _res_io_tcp_failed(arrival);
+            res_io_reset_source(arrival);
+            return SR_IO_SOCKET_ERROR;
+        }
+        if (rc > 0)
+            gettimeofday(&arrival->ea_next_try, NULL);
+        _res_io_timer_update(arrival);
+        return SR_IO_NO_ANSWER_YET;
+    }
+
+    pthread_mutex_lock(&c->tc_lock);
+    /* the socket may be ready because queued queries can now be sent */
+    if (0 != _tcp_conn_flush(c))
+        rc = SR_IO_SOCKET_ERROR;
+    while (SR_IO_SOCKET_ERROR != rc) {
+        n = _tcp_conn_read(c, &msg, &len_h);
+        if (n <= 0) {
+            if (n < 0)
+                rc = n;
+            break;
+        }
+
         /*
-         * reset this source
+         * hand the message to the query it answers
          */
-        res_io_reset_source(arrival);
-        return SR_IO_SOCKET_ERROR;
+        for (w = c->tc_waiters; w; w = w->tw_next)
+            if ((NULL == w->tw_response) && _tcp_answers(w, msg, len_h))
+                break;
+        if (NULL == w) {
+            memcpy(&id, msg, sizeof(id));
+            res_log(NULL, LOG_INFO, "libsres: "
+                    "dropping unexpected tcp response id %d on fd %d",
+                    ntohs(id), c->tc_socket);
+            FREE(msg);
+            continue;
+        }
+        w->tw_response = msg;
+        w->tw_response_length = len_h;
+        if (w->tw_ea != arrival)
+            res_timers_wake(w->tw_ea);
     }
 
-    len_h = ntohs(len_n);
-
     /*
-     * read() message 
+     * an answer already read is used even if the connection has since
+     * failed; the connection isn't used for new queries either way
      */
-    arrival->ea_response = (u_char *) MALLOC(len_h * sizeof(u_char));
-    if (arrival->ea_response == NULL) {
-        /*
-         * retry this source 
-         */
-        res_io_retry_source(arrival);
-        return SR_IO_MEMORY_ERROR;
+    w = _tcp_waiter(arrival);
+    if (NULL == w)
+        rc = SR_IO_INTERNAL_ERROR;
+    else if (w->tw_response) {
+        arrival->ea_response = w->tw_response;
+        arrival->ea_response_length = w->tw_response_length;
+        w->tw_response = NULL;
+        w->tw_response_length = 0;
+        failed = (SR_IO_NO_ANSWER_YET != rc);
+        rc = SR_IO_UNSET;
     }
+    pthread_mutex_unlock(&c->tc_lock);
 
-    arrival->ea_response_length = len_h;
+    if (failed)
+        _res_io_tcp_failed(arrival);
 
-    if (complete_read(arrival->ea_socket, (u_char *)arrival->ea_response, len_h) !=
-        len_h) {
-        FREE(arrival->ea_response);
-        arrival->ea_response = NULL;
-        arrival->ea_response_length = 0;
+    if (SR_IO_SOCKET_ERROR == rc) {
         /*
-         * reset this source 
+         * reset this source
          */
+        _res_io_tcp_failed(arrival);
         res_io_reset_source(arrival);
-        return SR_IO_SOCKET_ERROR;
     }
-    return SR_IO_UNSET;
+    else if (SR_IO_MEMORY_ERROR == rc) {
+        /*
+         * retry this source; the stream is out of step now
+         */
+        _res_io_tcp_failed(arrival);
+        res_io_retry_source(arrival);
+    }
+
+    return rc;
+}
+
+/*
+ * check that a datagram came from the server the query was sent to
+ */
+static int
+_res_io_udp_from_ok(struct expected_arrival *arrival,
+                    struct sockaddr_storage *from)
+{
+    struct sockaddr_storage *to =
+        arrival->ea_ns->ns_address[arrival->ea_which_address];
+
+    if (from->ss_family != to->ss_family)
+        return 0;
+
+    if (AF_INET == from->ss_family) {
+        struct sockaddr_in *arr_in = (struct sockaddr_in *) to;
+        struct sockaddr_in *from_in = (struct sockaddr_in *) from;
+        if ((from_in->sin_port != arr_in->sin_port) ||
+            memcmp(&from_in->sin_addr, &arr_in->sin_addr,
+                   sizeof(struct in_addr)))
+            return 0;
+        return 1;
+    }
+#ifdef VAL_IPV6
+    else if (AF_INET6 == from->ss_family) {
+        struct sockaddr_in6 *arr_in = (struct sockaddr_in6 *) to;
+        struct sockaddr_in6 *from_in = (struct sockaddr_in6 *) from;
+        if ((from_in->sin6_port != arr_in->sin6_port) ||
+            (memcmp(&from_in->sin6_addr, &arr_in->sin6_addr,
+                   sizeof(struct in6_addr))))
+            return 0;
+        return 1;
+    }
+#endif
+
+    return 0; /* unknown family */
+}
+
+/*
+ * check that a datagram answers the query (same id and question)
+ */
+static int
+_res_io_udp_answers(struct expected_arrival *arrival, u_char *msg,
+                    size_t len)
+{
+    if (len < sizeof(HEADER))
+        return 0;
+
+    return !memcmp(arrival->ea_signed, msg, sizeof(u_int16_t)) &&
+        !res_quecmp(arrival->ea_signed, msg);
+}
+
+#ifdef HAVE_RECVMMSG
+/*
+ * per-thread arrays for batch reads, kept between reads and grown when
+ * the batch or buffer size goes up
+ */
+struct res_udp_batch {
+    int             ub_batch;
+    size_t          ub_bufsize;
+    struct mmsghdr *ub_msgs;
+    struct iovec   *ub_iov;
+    struct sockaddr_storage *ub_from;
+    u_char         *ub_bufs;
+};
+
+static void
+_udp_batch_clear(struct res_udp_batch *b)
+{
+    if (b->ub_msgs)
+        FREE(b->ub_msgs);
+    if (b->ub_iov)
+        FREE(b->ub_iov);
+    if (b->ub_from)
+        FREE(b->ub_from);
+    if (b->ub_bufs)
+        FREE(b->ub_bufs);
+    memset(b, 0, sizeof(*b));
+}
+
+#ifndef VAL_NO_THREADS
+static pthread_key_t _udp_batch_key;
+static pthread_once_t _udp_batch_once = PTHREAD_ONCE_INIT;
+static int      _udp_batch_ok = 0;
+
+static void
+_udp_batch_free(void *arg)
+{
+    struct res_udp_batch *b = (struct res_udp_batch *) arg;
+
+    _udp_batch_clear(b);
+    FREE(b);
+}
+
+static void
+_udp_batch_init(void)
+{
+    _udp_batch_ok = (0 == pthread_key_create(&_udp_batch_key,
+                                             _udp_batch_free));
+}
+#else
+static struct res_udp_batch _udp_batch;
+#endif /* VAL_NO_THREADS */
+
+/*
+ * this thread's arrays, with room for batch datagrams of bufsize bytes
+ */
+static struct res_udp_batch *
+_udp_batch_get(int batch, size_t bufsize)
+{
+    struct res_udp_batch *b;
+
+#ifndef VAL_NO_THREADS
+    pthread_once(&_udp_batch_once, _udp_batch_init);
+    if (!_udp_batch_ok)
+        return NULL;
+
+    b = (struct res_udp_batch *) pthread_getspecific(_udp_batch_key);
+    if (NULL == b) {
+        b = (struct res_udp_batch *) MALLOC(sizeof(struct res_udp_batch));
+        if (NULL == b)
+            return NULL;
+        memset(b, 0, sizeof(*b));
+        if (0 != pthread_setspecific(_udp_batch_key, b)) {
+            FREE(b);
+            return NULL;
+        }
+    }
+#else
+    b = &_udp_batch;
+#endif
+
+    if ((b->ub_batch >= batch) && (b->ub_bufsize >= bufsize))
+        return b;
+
+    _udp_batch_clear(b);
+    b->ub_msgs = (struct mmsghdr *) MALLOC(batch * sizeof(struct mmsghdr));
+    b->ub_iov = (struct iovec *) MALLOC(batch * sizeof(struct iovec));
+    b->ub_from = (struct sockaddr_storage *)
+        MALLOC(batch * sizeof(struct sockaddr_storage));
+    b->ub_bufs = (u_char *) MALLOC(batch * bufsize);
+    if (!b->ub_msgs || !b->ub_iov || !b->ub_from || !b->ub_bufs) {
+        _udp_batch_clear(b);
+        return NULL;
+    }
+    b->ub_batch = batch;
+    b->ub_bufsize = bufsize;
+
+    return b;
+}
+
+/*
+ * read the datagrams queued on the ea's socket in batches, until the
+ * answer to the query turns up or the queue is empty. Returns 1 if the
+ * answer was found; it replaces the contents of ea_response.
+ */
+static int
+_res_io_udp_read_batch(struct expected_arrival *arrival, size_t bufsize)
+{
+    struct res_udp_batch *b;
+    struct mmsghdr *msgs;
+    struct iovec   *iov;
+    struct sockaddr_storage *from;
+    int             batch = _udp_batch_size, found = 0, n, i;
+
+    if (batch < 2)
+        return 0;
+
+    b = _udp_batch_get(batch, bufsize);
+    if (NULL == b)
+        return 0;
+    msgs = b->ub_msgs;
+    iov = b->ub_iov;
+    from = b->ub_from;
+
+    while (!found) {
+        memset(msgs, 0, batch * sizeof(struct mmsghdr));
+        for (i = 0; i < batch; ++i) {
+            iov[i].iov_base = b->ub_bufs + (i * bufsize);
+            iov[i].iov_len = bufsize;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        }
+
+        n = recvmmsg(arrival->ea_socket, msgs, batch, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            break;
+        UDP_STAT_ADD(uio_batch_calls, 1);
+        UDP_STAT_ADD(uio_datagrams, n);
+        UDP_STAT_ADD(uio_calls_saved, n - 1);
+
+        for (i = 0; i < n; ++i) {
+            if (!_res_io_udp_from_ok(arrival, &from[i]) ||
+                !_res_io_udp_answers(arrival, iov[i].iov_base,
+                                     msgs[i].msg_len))
+                continue;
+            memcpy(arrival->ea_response, iov[i].iov_base, msgs[i].msg_len);
+            arrival->ea_response_length = msgs[i].msg_len;
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                ((HEADER *) arrival->ea_response)->tc = 1;
+            found = 1;
+            break;
+        }
+        if (n < batch)
+            break;
+    }
+    res_log(NULL, LOG_DEBUG, "libsres: ""batch read on socket %d: %s",
+            arrival->ea_socket, found ? "found answer" : "no answer");
+
+    return found;
+}
+#endif /* HAVE_RECVMMSG */
+
+/*
+ * the largest answer the query on this ea allows over udp
+ */
+static size_t
+_res_io_udp_bufsize(struct expected_arrival *arrival)
+{
+    struct name_server *ns = arrival->ea_ns;
+
+    if (ns && (ns->ns_options & SR_QUERY_SET_DO) &&
+        (ns->ns_edns0_size > NS_PACKETSZ))
+        return ns->ns_edns0_size;
+    return NS_PACKETSZ;
+}
+
+/*
+ * make the answer read into a pooled buffer the ea's response
+ */
+static void
+_res_io_udp_keep(struct expected_arrival *arrival, u_char *buf,
+                 size_t bufsize, size_t len)
+{
+    u_char         *copy;
+
+    if ((len * RES_RBUF_COPY_RATIO) < bufsize &&
+        NULL != (copy = (u_char *) MALLOC(len))) {
+        memcpy(copy, buf, len);
+        _rbuf_put(buf, bufsize);
+        buf = copy;
+    }
+    arrival->ea_response = buf;
+    arrival->ea_response_length = len;
 }
 
 static int
 res_io_read_udp(struct expected_arrival *arrival)
 {
-    size_t bytes_waiting = 8192;
+    size_t          bufsize;
+    u_char         *buf;
     struct sockaddr_storage from;
     socklen_t       from_length = sizeof(from);
-    int             ret_val, arr_family;
+    int             ret_val;
     int             flags = 0;
 
     if (NULL == arrival)
@@ -1407,19 +4121,25 @@ res_io_read_udp(struct expected_arrival *arrival)
         return SR_IO_UNSET;
     }
 
-    arrival->ea_response = (u_char *) MALLOC(bytes_waiting * sizeof(u_char));
-    if (NULL == arrival->ea_response)
+    bufsize = _res_io_udp_bufsize(arrival);
+    buf = _rbuf_get(&bufsize);
+    if (NULL == buf)
         return SR_IO_MEMORY_ERROR;
-    memset(arrival->ea_response, 0, bytes_waiting * sizeof(u_char));
 
     memset(&from, 0, sizeof(from));
 
 #ifdef MSG_DONTWAIT
     flags = MSG_DONTWAIT;
+#endif
+#if defined(__linux__) && defined(MSG_TRUNC)
+    flags |= MSG_TRUNC; /* return the real length of a longer datagram */
 #endif
     ret_val =
-        recvfrom(arrival->ea_socket, (char *)arrival->ea_response, bytes_waiting,
+        recvfrom(arrival->ea_socket, (char *)buf, bufsize,
                  flags, (struct sockaddr*)&from, &from_length);
+    UDP_STAT_ADD(uio_recv_calls, 1);
+    if (ret_val > 0)
+        UDP_STAT_ADD(uio_datagrams, 1);
 
     if (0 == ret_val) {
         res_log(NULL, LOG_INFO,
@@ -1433,37 +4153,42 @@ res_io_read_udp(struct expected_arrival *arrival)
         goto allow_retry;
     }
 
-    arr_family = arrival->ea_ns->ns_address[arrival->ea_which_address]->ss_family;
-    if ((ret_val < 0) || (from.ss_family != arr_family))
-        goto error;
-    
-    if (AF_INET == from.ss_family) {
-        struct sockaddr_in *arr_in = (struct sockaddr_in *)
-            arrival->ea_ns->ns_address[arrival->ea_which_address];
-        struct sockaddr_in *from_in = (struct sockaddr_in *) &from;
-        if ((from_in->sin_port != arr_in->sin_port) ||
-            memcmp(&from_in->sin_addr, &arr_in->sin_addr,
-                   sizeof(struct in_addr)))
-            goto error;
-        /* XXX Wait for actual response */ 
+    /*
+     * an answer larger than we asked for is cut at the buffer size;
+     * mark it truncated so the query is retried over tcp.
+     */
+    if (ret_val > (int) bufsize) {
+        res_log(NULL, LOG_INFO, "libsres: ""%d byte datagram on socket %d "
+                "exceeds %zd byte buffer", ret_val, arrival->ea_socket,
+                bufsize);
+        ret_val = bufsize;
+        if (ret_val >= (int) sizeof(HEADER))
+            ((HEADER *) buf)->tc = 1;
     }
-#ifdef VAL_IPV6
-    else if (AF_INET6 == from.ss_family) {
-        struct sockaddr_in6 *arr_in = (struct sockaddr_in6 *)
-            arrival->ea_ns->ns_address[arrival->ea_which_address];
-        struct sockaddr_in6 *from_in = (struct sockaddr_in6 *) &from;
-        if ((from_in->sin6_port != arr_in->sin6_port) ||
-            (memcmp(&from_in->sin6_addr, &arr_in->sin6_addr,
-                   sizeof(struct in6_addr))))
-            goto error;
-        /* XXX Wait for actual response */ 
+
+#ifdef HAVE_RECVMMSG
+    /*
+     * not the answer; see if it is further back in the queue
+     */
+    if ((ret_val > 0) &&
+        !(_res_io_udp_from_ok(arrival, &from) &&
+          _res_io_udp_answers(arrival, buf, ret_val))) {
+        arrival->ea_response = buf;
+        if (_res_io_udp_read_batch(arrival, bufsize)) {
+            arrival->ea_response = NULL;
+            _res_io_udp_keep(arrival, buf, bufsize,
+                             arrival->ea_response_length);
+            return SR_IO_UNSET;
+        }
+        arrival->ea_response = NULL;
     }
 #endif
-    else
-        goto error; /* unknown family */
+
+    if ((ret_val < 0) || !_res_io_udp_from_ok(arrival, &from))
+        goto error;
 
     /* ret_val is greater than zero here */
-    arrival->ea_response_length = ret_val;
+    _res_io_udp_keep(arrival, buf, bufsize, ret_val);
     return SR_IO_UNSET;
 
   error:
@@ -1473,7 +4198,7 @@ res_io_read_udp(struct expected_arrival *arrival)
     res_io_reset_source(arrival);
 
   allow_retry:
-    FREE(arrival->ea_response);
+    _rbuf_put(buf, bufsize);
     arrival->ea_response = NULL;
     arrival->ea_response_length = 0;
     return SR_IO_SOCKET_ERROR;
@@ -1498,12 +4223,9 @@ res_switch_to_tcp(struct expected_arrival *ea)
      * Use the same "ea_which_address," since it already got a rise. 
      */
     ea->ea_using_stream = TRUE;
-    if (ea->ea_socket != INVALID_SOCKET) {
-        CLOSESOCK(ea->ea_socket);
-        --_open_sockets;
-        ea->ea_socket = INVALID_SOCKET;
-    }
+    _res_io_close_socket(ea);
     ea->ea_remaining_attempts = ea->ea_ns->ns_retry+1;
+    ea->ea_sends = 0;
     set_alarms(ea, 0, res_get_timeout(ea->ea_ns));
 }
 
@@ -1528,25 +4250,42 @@ res_switch_all_to_tcp(struct expected_arrival *ea)
         ea->ea_response_length = 0;
 
         ea->ea_using_stream = TRUE;
-        if (ea->ea_socket != INVALID_SOCKET) {
-            CLOSESOCK(ea->ea_socket);
-            --_open_sockets;
-            ea->ea_socket = INVALID_SOCKET;
-        }
+        _res_io_close_socket(ea);
     }
 }
 
 void
 res_switch_all_to_tcp_tid(int tid)
 {
-    struct expected_arrival *ea;
+    struct res_transaction *t = _tr_slot(tid);
 
-    if ((tid < 0) || (tid >= MAX_TRANSACTIONS))
+    if (NULL == t)
         return;
 
-    ea = transactions[tid];
-    if (ea)
-        res_switch_all_to_tcp(ea);
+    TR_LOCK(t);
+    if (t->rt_ea)
+        res_switch_all_to_tcp(t->rt_ea);
+    TR_UNLOCK(t);
+}
+
+/*
+ * tell the capability cache what the answer on arrival shows about the
+ * server: the EDNS0 size that got through, and whether it truncated.
+ */
+static void
+_res_io_caps_answer(struct expected_arrival *arrival)
+{
+    HEADER         *hp = (HEADER *) arrival->ea_response;
+    int             edns0_size = 0;
+
+    if (arrival->ea_ns->ns_options & SR_QUERY_SET_DO) {
+        edns0_size = arrival->ea_ns->ns_edns0_size;
+        /* answered, but not with EDNS0 */
+        if ((ns_r_formerr == hp->rcode) || (ns_r_notimpl == hp->rcode))
+            edns0_size = -1;
+    }
+    res_caps_answer(arrival->ea_ns->ns_address[arrival->ea_which_address],
+                    edns0_size, hp->tc, arrival->ea_using_stream);
 }
 
 int
@@ -1562,8 +4301,7 @@ res_io_read(fd_set * read_descriptors, struct expected_arrival *ea_list)
          * skip canceled/expired attempts, or sockets without data
          */
         if ((ea_list->ea_remaining_attempts == -1) ||
-            (ea_list->ea_socket == INVALID_SOCKET) ||
-            ! FD_ISSET(ea_list->ea_socket, read_descriptors))
+            ! _res_io_is_readable(ea_list, read_descriptors))
             continue;
 
         { /* dummy block to preserve indentation; remove later */
@@ -1571,7 +4309,11 @@ res_io_read(fd_set * read_descriptors, struct expected_arrival *ea_list)
             res_log(NULL, LOG_DEBUG, "libsres: ""ACTIVITY on %d",
                     ea_list->ea_socket);
             ++handled;
-            FD_CLR(ea_list->ea_socket, read_descriptors);
+            if (ea_list->ea_socket != INVALID_SOCKET) {
+                if (read_descriptors)
+                    FD_CLR(ea_list->ea_socket, read_descriptors);
+                res_poller_clear(ea_list->ea_poller, ea_list->ea_socket);
+            }
 
             arrival = ea_list;
             res_print_ea(arrival);
@@ -1615,6 +4357,18 @@ res_io_read(fd_set * read_descriptors, struct expected_arrival *ea_list)
                 continue;
             }
 
+            /*
+             * a round trip sample, unless the query was retransmitted and
+             * we can't tell which copy this answers (Karn's algorithm)
+             */
+            if (!arrival->ea_using_stream && 1 == arrival->ea_sends) {
+                struct timeval  now;
+                gettimeofday(&now, NULL);
+                res_rtt_sample(arrival->ea_ns->ns_address[arrival->ea_which_address],
+                               &arrival->ea_sent, &now);
+            }
+            _res_io_caps_answer(arrival);
+
             /*
              * See if the message was truncated
              * switch to TCP
@@ -1640,6 +4394,7 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
     struct timeval  next_event;
     struct timeval zero_time;
     fd_set read_descriptors;
+    struct res_transaction *t = _tr_slot(transaction_id);
 
     timerclear(&zero_time);
 
@@ -1647,6 +4402,9 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
 
     res_log(NULL, LOG_DEBUG, "libsres: ""Calling io_accept");
 
+    if (NULL == t)
+        return SR_IO_NO_ANSWER;
+
     /*
      * See what needs to be sent.  A return code of 0 means that there
      * is nothing more to be sent and there is also nothing to wait for.
@@ -1661,12 +4419,12 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
     /*
      * See if there is a response waiting that we simply need to pluck.
      */
-    pthread_mutex_lock(&mutex);
-    if (res_io_get_a_response(transactions[transaction_id],
+    TR_LOCK(t);
+    if (res_io_get_a_response(t->rt_ea,
                               answer, answer_length,
                               respondent) == SR_IO_GOT_ANSWER) {
 
-        pthread_mutex_unlock(&mutex);
+        TR_UNLOCK(t);
         return SR_IO_GOT_ANSWER;
     }
 
@@ -1677,8 +4435,8 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
      * Answer for now -> just the sockets we are interested in.
      */
     res_io_collect_sockets(&read_descriptors, 
-                           transactions[transaction_id]);
-    pthread_mutex_unlock(&mutex);
+                           t->rt_ea);
+    TR_UNLOCK(t);
 
     ret_val = res_io_select_sockets(&read_descriptors, &zero_time);
 
@@ -1686,39 +4444,39 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
         /** select call failed */
         return SR_IO_SOCKET_ERROR;
 
-    pthread_mutex_lock(&mutex);
+    TR_LOCK(t);
 
     /** make sure transaction didn't get cancelled */
-    if (transactions[transaction_id] == NULL) {
-        pthread_mutex_unlock(&mutex);
+    if (t->rt_ea == NULL) {
+        TR_UNLOCK(t);
         return SR_IO_NO_ANSWER;
     }
 
-    if (ret_val == 0) { 
+    if (ret_val == 0 && !res_async_ea_isset(t->rt_ea, &read_descriptors)) { 
         /** There are sources, but none are talking (yet) */
 
         /* save descriptors that we are waiting on */
         res_io_collect_sockets(pending_desc, 
-                               transactions[transaction_id]);
+                               t->rt_ea);
 
         /* check if next_event is closer than closest_event */
         UPDATE(closest_event, next_event);
 
-        pthread_mutex_unlock(&mutex);
+        TR_UNLOCK(t);
         return SR_IO_NO_ANSWER_YET;
     }
 
     /*
      * React to the active desciptors.
      */
-    res_io_read(&read_descriptors, transactions[transaction_id]);
+    res_io_read(&read_descriptors, t->rt_ea);
 
     /*
      * Pluck the answer and return it to the caller.
      */
-    ret_val = res_io_get_a_response(transactions[transaction_id],
+    ret_val = res_io_get_a_response(t->rt_ea,
                                     answer, answer_length, respondent);
-    pthread_mutex_unlock(&mutex);
+    TR_UNLOCK(t);
 
     if (ret_val == SR_IO_UNSET)
         return SR_IO_NO_ANSWER_YET;
@@ -1731,6 +4489,7 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
 void
 res_cancel(int *transaction_id)
 {
+    struct res_transaction *t;
     struct expected_arrival *ea;
 
     if ((NULL == transaction_id) || (*transaction_id == -1))
@@ -1738,10 +4497,18 @@ res_cancel(int *transaction_id)
 
     res_log(NULL, LOG_DEBUG, "libsres: ""tid %d cancel", *transaction_id);
 
-    pthread_mutex_lock(&mutex);
-    ea = transactions[*transaction_id];
-    transactions[*transaction_id] = NULL;
-    pthread_mutex_unlock(&mutex);
+    t = _tr_slot(*transaction_id);
+    if (NULL == t) {
+        *transaction_id = -1;
+        return;
+    }
+
+    TR_LOCK(t);
+    ea = t->rt_ea;
+    t->rt_ea = NULL;
+    TR_UNLOCK(t);
+
+    _tr_release(*transaction_id);
 
     res_free_ea_list(ea);
 
@@ -1751,8 +4518,8 @@ res_cancel(int *transaction_id)
 void
 res_io_cancel_all(void)
 {
-    int             i, j;
-    for (i = 0; i < MAX_TRANSACTIONS; i++) {
+    int             i, j, count = _tr_size();
+    for (i = 0; i < count; i++) {
         j = i;
         res_cancel(&j);
     }
@@ -1831,24 +4598,28 @@ res_print_ea(struct expected_arrival *ea)
 void
 res_io_view(void)
 {
-    int             i;
+    int             i, count;
     int             j;
+    struct res_transaction *t;
     struct expected_arrival *ea;
     struct timeval  tv;
 
     gettimeofday(&tv, NULL);
     res_log(NULL, LOG_DEBUG, "libsres: ""Current time is %ld", tv.tv_sec);
 
-    pthread_mutex_lock(&mutex);
-    for (i = 0; i < MAX_TRANSACTIONS; i++)
-        if (transactions[i]) {
+    count = _tr_size();
+    for (i = 0; i < count; i++) {
+        t = _tr_slot(i);
+        TR_LOCK(t);
+        if (t->rt_ea) {
             res_log(NULL, LOG_DEBUG, "libsres: ""Transaction id: %3d", i);
-            for (ea = transactions[i], j = 0; ea; ea = ea->ea_next, j++) {
+            for (ea = t->rt_ea, j = 0; ea; ea = ea->ea_next, j++) {
                 res_log(NULL, LOG_DEBUG, "libsres: ""Source #%d", j);
                 res_print_ea(ea);
             }
         }
-    pthread_mutex_unlock(&mutex);
+        TR_UNLOCK(t);
+    }
 }
 
 void
@@ -1917,6 +4688,97 @@ res_async_query_send(const char *name, const u_int16_t type_h,
     return head;
 }
 
+/*
+ * Parallel starts. Rather than working through a server's addresses one
+ * at a time, moving on only when one times out, each address of the
+ * first _parallel_servers servers gets its own ea, and these are started
+ * _parallel_stagger ms apart, alternating address families. A broken
+ * IPv6 (or IPv4) path then costs a query one stagger interval instead of
+ * a full retransmit timeout. The first answer wins; the other attempts
+ * still in flight are canceled in res_io_get_a_response. Any further
+ * servers are tried LIBSRES_NS_STAGGER seconds apart, as before.
+ */
+#define RES_PARALLEL_SERVERS    1
+#define RES_PARALLEL_STAGGER    250     /* msec */
+
+static int      _parallel_servers = RES_PARALLEL_SERVERS;
+static int      _parallel_stagger = RES_PARALLEL_STAGGER;
+
+void
+res_io_set_parallel(int max_servers, int stagger_ms)
+{
+    if (max_servers >= 0)
+        _parallel_servers = max_servers;
+    if (stagger_ms >= 0)
+        _parallel_stagger = stagger_ms;
+}
+
+/*
+ * reorder a server's addresses so that families alternate, keeping
+ * their order within each family.
+ */
+static void
+_res_io_interleave_families(struct name_server *ns)
+{
+    struct sockaddr_storage *addr;
+    int             n = ns->ns_number_of_addresses, i, j;
+
+    for (i = 1; i < n; ++i) {
+        if (ns->ns_address[i]->ss_family != ns->ns_address[i - 1]->ss_family)
+            continue;
+        for (j = i + 1; j < n; ++j)
+            if (ns->ns_address[j]->ss_family !=
+                ns->ns_address[i - 1]->ss_family)
+                break;
+        if (j == n)
+            break; /* only one family left */
+        addr = ns->ns_address[j];
+        memmove(&ns->ns_address[i + 1], &ns->ns_address[i],
+                (j - i) * sizeof(struct sockaddr_storage *));
+        ns->ns_address[i] = addr;
+    }
+}
+
+/*
+ * split the first _parallel_servers servers in ns_list into one server
+ * per address. Returns the number of single address servers this leaves
+ * at the head of the list, or -1 on error.
+ */
+static int
+_res_io_split_servers(struct name_server *ns_list)
+{
+    struct name_server *ns, *single, *next;
+    int             servers, count = 0, n, i, j;
+
+    for (ns = ns_list, servers = 0; ns && servers < _parallel_servers;
+         ns = next, ++servers) {
+        next = ns->ns_next;
+        n = ns->ns_number_of_addresses;
+        count += (n > 1) ? n : 1;
+        if (n < 2)
+            continue;
+        _res_io_interleave_families(ns);
+
+        /* insert in reverse so they end up in address order */
+        for (i = n - 1; i > 0; --i) {
+            if (SR_UNSET != clone_ns(&single, ns) || NULL == single)
+                return -1;
+            for (j = 0; j < single->ns_number_of_addresses; ++j)
+                if (j != i)
+                    FREE(single->ns_address[j]);
+            single->ns_address[0] = single->ns_address[i];
+            single->ns_number_of_addresses = 1;
+            single->ns_next = ns->ns_next;
+            ns->ns_next = single;
+        }
+        for (i = 1; i < n; ++i)
+            FREE(ns->ns_address[i]);
+        ns->ns_number_of_addresses = 1;
+    }
+
+    return count;
+}
+
 struct expected_arrival *
 res_async_query_create(const char *name, const u_int16_t type_h,
                        const u_int16_t class_h, struct name_server *pref_ns,
@@ -1929,6 +4791,7 @@ res_async_query_create(const char *name, const u_int16_t type_h,
     struct name_server *ns;
     struct expected_arrival *head = NULL, *new_ea, *temp_ea;
     long                delay = 0;
+    int                 nparallel, i;
 
     if ((name == NULL) || (pref_ns == NULL))
         return NULL;
@@ -1938,15 +4801,25 @@ res_async_query_create(const char *name, const u_int16_t type_h,
      */
     if ((ret_val = clone_ns_list(&ns_list, pref_ns)) != SR_UNSET)
         return NULL;
+    res_rtt_order(&ns_list);
+    res_caps_order(&ns_list);
+    nparallel = _res_io_split_servers(ns_list);
+    if (nparallel < 0) {
+        free_name_servers(&ns_list);
+        return NULL;
+    }
 
     /*
      * Loop through the list of destinations, form the query and send it
      */
-    for (ns = ns_list; ns; ns = ns->ns_next) {
+    for (ns = ns_list, i = 0; ns; ns = ns->ns_next, ++i) {
 
         signed_query = NULL;
         signed_length = 0;
 
+        /** start from what we already know about the server */
+        res_caps_edns0(ns);
+
         /** create payload */
         ret_val = res_create_query_payload(ns, name, class_h, type_h,
                                            &signed_query, &signed_length);
@@ -1961,6 +4834,12 @@ res_async_query_create(const char *name, const u_int16_t type_h,
             ret_val = SR_IO_MEMORY_ERROR;
             break; /* fatal, bail */
         }
+        if ((ns->ns_number_of_addresses > 0) &&
+            res_caps_use_tcp(ns->ns_address[0]))
+            new_ea->ea_using_stream = TRUE;
+        if (i < nparallel)
+            set_alarms_ms(new_ea, i * _parallel_stagger,
+                          res_get_timeout(ns));
 
         /** add to list */
         if (NULL != head) {
@@ -1971,7 +4850,8 @@ res_async_query_create(const char *name, const u_int16_t type_h,
         } else
             head = new_ea;
 
-        delay += LIBSRES_NS_STAGGER;
+        if (i >= nparallel - 1)
+            delay += LIBSRES_NS_STAGGER;
     }
 
     /** if bad ret_val, clear list, else send query */
@@ -1979,6 +4859,8 @@ res_async_query_create(const char *name, const u_int16_t type_h,
         res_free_ea_list(head);
         head = NULL;
     }
+    else
+        _res_io_inflight_join(head, name, type_h, class_h, flags, pref_ns);
 
     return head;
 }
@@ -1998,7 +4880,7 @@ res_async_query_handle(struct expected_arrival *ea, int *handled, fd_set *fds)
 {
     int ret_val = SR_NO_ANSWER;
 
-    if (!ea || !handled || !fds)
+    if (!ea || !handled)
         return SR_INTERNAL_ERROR;
 
     /*
@@ -2020,6 +4902,41 @@ res_async_query_handle(struct expected_arrival *ea, int *handled, fd_set *fds)
     return ret_val;
 }
 
+void
+res_async_query_set_poller(struct expected_arrival *ea,
+                           struct res_poller *poller)
+{
+    for ( ; ea; ea = ea->ea_next) {
+        if (ea->ea_poller == poller)
+            continue;
+        if (ea->ea_socket != INVALID_SOCKET) {
+            if (ea->ea_poller)
+                res_poller_del(ea->ea_poller, ea->ea_socket);
+            if (poller &&
+                0 != res_poller_add(poller, ea->ea_socket,
+                                    _res_io_poll_owner(ea))) {
+                /* can't wait on this socket; try again with a new one */
+                ea->ea_poller = NULL;
+                res_io_retry_source(ea);
+            }
+        }
+        ea->ea_poller = poller;
+    }
+}
+
+void
+res_async_query_set_timers(struct expected_arrival *ea,
+                           struct res_timers *timers)
+{
+    for ( ; ea; ea = ea->ea_next) {
+        if (ea->ea_timers == timers)
+            continue;
+        res_timers_update(ea, NULL);
+        ea->ea_timers = timers;
+        _res_io_timer_update(ea);
+    }
+}
+
 void
 res_async_query_free(struct expected_arrival *ea)
 {
@@ -2044,12 +4961,11 @@ res_async_ea_is_using_stream(struct expected_arrival *ea)
 int
 res_async_ea_isset(struct expected_arrival *ea, fd_set *fds)
 {
-    if (NULL == ea || NULL == fds)
+    if (NULL == ea)
         return 0;
 
     for (; ea; ea = ea->ea_next) {
-        if (ea->ea_socket != INVALID_SOCKET &&
-                FD_ISSET(ea->ea_socket, fds))
+        if (_res_io_is_readable(ea, fds))
             return 1;
     }
 
@@ -2060,16 +4976,17 @@ int
 res_async_tid_isset(int tid, fd_set *fds)
 {
     int retval = 0;
+    struct res_transaction *t = _tr_slot(tid);
 
-    if (tid < 0 || tid >= MAX_TRANSACTIONS || NULL == fds)
+    if (NULL == t || NULL == fds)
         return 0;
 
-    pthread_mutex_lock(&mutex);
+    TR_LOCK(t);
 
-    if (transactions[tid])
-        retval = res_async_ea_isset(transactions[tid],fds);
+    if (t->rt_ea)
+        retval = res_async_ea_isset(t->rt_ea,fds);
 
-    pthread_mutex_unlock(&mutex);
+    TR_UNLOCK(t);
 
     return retval;
 }
@@ -0,0 +1,1031 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * DESCRIPTION
+ * Socket poller used by the io manager to wait for responses. Sockets
+ * are registered once, when they are opened, and deregistered when
+ * they are closed, so waiting does not require rebuilding (and
+ * scanning) an fd_set for every pending query.
+ *
+ * Three backends are available: io_uring, if configured with
+ * --with-io-uring and supported by the running kernel; epoll, where
+ * supported; and select, which is always available but limited to
+ * FD_SETSIZE descriptors. The default is the first of these that works.
+ *
+ * The io_uring backend arms a multishot poll for each socket, so once a
+ * socket is registered its arrivals are reported without any further
+ * calls; registering and deregistering each take one io_uring_enter,
+ * and waiting takes one to sleep, plus one to submit its timeout (and
+ * any polls re-armed) first. Kernels without multishot poll get a
+ * one-shot poll which is re-armed as it fires. Unlike epoll, this
+ * reports each arrival rather than the state of the socket, which suits
+ * the io manager since it drains a socket when it reads it.
+ */
+#include "validator-internal.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef LIBSRES_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#endif
+
+#include "res_support.h"
+
+#ifdef VAL_NO_THREADS
+#define pthread_mutex_lock(x)
+#define pthread_mutex_unlock(x)
+#endif
+
+/* number of events collected per call to epoll_wait */
+#define RES_POLL_BATCH      256
+
+/* longest single select() wait, in seconds */
+#define RES_POLL_MAX_SELECT_WAIT   86400
+
+/* growth increment for the per-descriptor slot table */
+#define RES_POLL_SLOT_CHUNK 64
+
+/* io_uring submission queue size */
+#define RES_URING_ENTRIES   256
+
+#define PS_REGISTERED   0x01
+#define PS_READY        0x02
+#define PS_WRITE        0x04    /* also report writability */
+
+struct res_poll_slot {
+    void           *ps_data;
+    int             ps_flags;
+    int             ps_refs;    /* adds not yet matched by a del */
+    u_int32_t       ps_gen;     /* registration count */
+};
+
+/*
+ * epoll and io_uring events carry the descriptor and its registration
+ * count, so events for a descriptor that has since been deregistered
+ * (and possibly registered again) are ignored.
+ */
+#define POLL_DATA(fd, gen)  (((u_int64_t)(gen) << 32) | (u_int32_t)(fd))
+#define POLL_DATA_FD(d)     ((int) ((d) & 0xffffffff))
+
+#ifdef LIBSRES_IO_URING
+#define URING_TIMEOUT       0xffffffffffffffffULL
+#define URING_REMOVE        0xfffffffffffffffeULL
+
+struct res_uring {
+    u_char         *ru_sq;          /* submission ring */
+    size_t          ru_sq_len;
+    u_char         *ru_cq;          /* completion ring, may be ru_sq */
+    size_t          ru_cq_len;
+    struct io_uring_sqe *ru_sqes;
+    size_t          ru_sqes_len;
+    unsigned       *ru_sq_head;
+    unsigned       *ru_sq_tail;
+    unsigned        ru_sq_mask;
+    unsigned        ru_sq_entries;
+    unsigned       *ru_cq_head;
+    unsigned       *ru_cq_tail;
+    unsigned        ru_cq_mask;
+    struct io_uring_cqe *ru_cqes;
+    unsigned        ru_queued;      /* sqes not yet submitted */
+    int             ru_multishot;
+};
+#endif
+
+struct res_poller {
+    int                   rp_backend;
+    int                   rp_fd;        /* epoll/io_uring descriptor */
+    int                   rp_count;     /* registered sockets */
+    struct res_poll_slot *rp_slots;     /* indexed by descriptor */
+    int                   rp_nslots;
+    fd_set                rp_fds;       /* select backend */
+    fd_set                rp_wfds;      /* select backend, PS_WRITE */
+    int                   rp_maxfd;     /* select backend */
+#ifdef LIBSRES_IO_URING
+    struct res_uring     *rp_uring;
+#endif
+    res_poller_watch_cb   rp_watch;     /* told of registrations */
+    void                 *rp_watch_data;
+#ifndef VAL_NO_THREADS
+    pthread_mutex_t       rp_lock;
+#endif
+};
+
+/*
+ * record a ready descriptor and add it to the caller's event list.
+ * caller has lock.
+ */
+static void
+_mark_ready(struct res_poller *p, int fd, struct res_poll_event *events,
+            int max_events, int *count)
+{
+    /* socket might have been closed while we were waiting */
+    if ((fd < 0) || (fd >= p->rp_nslots) ||
+        !(p->rp_slots[fd].ps_flags & PS_REGISTERED))
+        return;
+
+    p->rp_slots[fd].ps_flags |= PS_READY;
+    if (events && (*count < max_events)) {
+        events[*count].pe_fd = fd;
+        events[*count].pe_data = p->rp_slots[fd].ps_data;
+    }
+    ++(*count);
+}
+
+#ifdef LIBSRES_IO_URING
+static int
+_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+             unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                         flags, NULL, 0);
+}
+
+static void
+_uring_free(struct res_poller *p)
+{
+    struct res_uring *r = p->rp_uring;
+
+    if (NULL == r)
+        return;
+    if (r->ru_sqes)
+        munmap(r->ru_sqes, r->ru_sqes_len);
+    if (r->ru_cq && (r->ru_cq != r->ru_sq))
+        munmap(r->ru_cq, r->ru_cq_len);
+    if (r->ru_sq)
+        munmap(r->ru_sq, r->ru_sq_len);
+    FREE(r);
+    p->rp_uring = NULL;
+}
+
+/*
+ * set up the rings. Fails if the kernel doesn't support io_uring (or
+ * it has been disabled), or is too old to be relied on.
+ */
+static int
+_uring_create(struct res_poller *p)
+{
+    struct io_uring_params params;
+    struct res_uring *r;
+    void            *m;
+    unsigned         i, *array;
+
+    memset(&params, 0, sizeof(params));
+    p->rp_fd = (int) syscall(__NR_io_uring_setup, RES_URING_ENTRIES, &params);
+    if (p->rp_fd < 0) {
+        res_log(NULL, LOG_INFO,
+                "libsres: ""io_uring_setup failed, errno = %d %s",
+                errno, strerror(errno));
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        res_log(NULL, LOG_INFO, "libsres: ""io_uring too old");
+        goto err;
+    }
+
+    r = (struct res_uring *) MALLOC(sizeof(struct res_uring));
+    if (NULL == r)
+        goto err;
+    memset(r, 0, sizeof(struct res_uring));
+    p->rp_uring = r;
+
+    r->ru_sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->ru_cq_len = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) &&
+        (r->ru_cq_len > r->ru_sq_len))
+        r->ru_sq_len = r->ru_cq_len;
+
+    m = mmap(NULL, r->ru_sq_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, p->rp_fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == m)
+        goto err;
+    r->ru_sq = (u_char *) m;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        r->ru_cq = r->ru_sq;
+    else {
+        m = mmap(NULL, r->ru_cq_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, p->rp_fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == m)
+            goto err;
+        r->ru_cq = (u_char *) m;
+    }
+
+    r->ru_sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    m = mmap(NULL, r->ru_sqes_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, p->rp_fd, IORING_OFF_SQES);
+    if (MAP_FAILED == m)
+        goto err;
+    r->ru_sqes = (struct io_uring_sqe *) m;
+
+    r->ru_sq_head = (unsigned *) (r->ru_sq + params.sq_off.head);
+    r->ru_sq_tail = (unsigned *) (r->ru_sq + params.sq_off.tail);
+    r->ru_sq_mask = *(unsigned *) (r->ru_sq + params.sq_off.ring_mask);
+    r->ru_sq_entries = params.sq_entries;
+    r->ru_cq_head = (unsigned *) (r->ru_cq + params.cq_off.head);
+    r->ru_cq_tail = (unsigned *) (r->ru_cq + params.cq_off.tail);
+    r->ru_cq_mask = *(unsigned *) (r->ru_cq + params.cq_off.ring_mask);
+    r->ru_cqes = (struct io_uring_cqe *) (r->ru_cq + params.cq_off.cqes);
+
+    /* sqes are always used in ring order */
+    array = (unsigned *) (r->ru_sq + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; ++i)
+        array[i] = i;
+
+    r->ru_multishot = 1;
+    return 0;
+
+  err:
+    _uring_free(p);
+    close(p->rp_fd);
+    p->rp_fd = -1;
+    return -1;
+}
+
+/*
+ * submit queued sqes. caller has lock.
+ */
+static int
+_uring_submit(struct res_poller *p)
+{
+    struct res_uring *r = p->rp_uring;
+    int               rc;
+
+    while (r->ru_queued > 0) {
+        rc = _uring_enter(p->rp_fd, r->ru_queued, 0, 0);
+        if (rc < 0) {
+            if (EINTR == errno)
+                continue;
+            res_log(NULL, LOG_WARNING,
+                    "libsres: ""io_uring_enter failed, errno = %d %s",
+                    errno, strerror(errno));
+            return -1;
+        }
+        if (0 == rc)
+            break; /* nothing the kernel could take */
+        r->ru_queued -= (rc < (int) r->ru_queued) ? rc : r->ru_queued;
+    }
+    r->ru_queued = 0;
+    return 0;
+}
+
+/*
+ * next free sqe, cleared. caller has lock, and must call _uring_queue
+ * once it is filled in.
+ */
+static struct io_uring_sqe *
+_uring_sqe(struct res_poller *p)
+{
+    struct res_uring *r = p->rp_uring;
+    unsigned          tail = *r->ru_sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if ((tail - __atomic_load_n(r->ru_sq_head, __ATOMIC_ACQUIRE)) >=
+        r->ru_sq_entries) {
+        if (0 != _uring_submit(p))
+            return NULL;
+    }
+    sqe = &r->ru_sqes[tail & r->ru_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void
+_uring_queue(struct res_poller *p)
+{
+    struct res_uring *r = p->rp_uring;
+
+    __atomic_store_n(r->ru_sq_tail, *r->ru_sq_tail + 1, __ATOMIC_RELEASE);
+    ++r->ru_queued;
+}
+
+/*
+ * queue a poll for a registered descriptor. caller has lock.
+ */
+static int
+_uring_arm(struct res_poller *p, int fd)
+{
+    struct io_uring_sqe *sqe = _uring_sqe(p);
+    u_int32_t            mask = POLLIN;
+
+    if (NULL == sqe)
+        return -1;
+    if (p->rp_slots[fd].ps_flags & PS_WRITE)
+        mask |= POLLOUT;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    mask = (mask << 16) | (mask >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    if (p->rp_uring->ru_multishot)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = POLL_DATA(fd, p->rp_slots[fd].ps_gen);
+    _uring_queue(p);
+    return 0;
+}
+
+/*
+ * queue removal of the poll for a descriptor. caller has lock.
+ */
+static int
+_uring_disarm(struct res_poller *p, int fd)
+{
+    struct io_uring_sqe *sqe = _uring_sqe(p);
+
+    if (NULL == sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = POLL_DATA(fd, p->rp_slots[fd].ps_gen);
+    sqe->user_data = URING_REMOVE;
+    _uring_queue(p);
+    return 0;
+}
+
+/*
+ * handle completions. caller has lock.
+ */
+static void
+_uring_reap(struct res_poller *p, struct res_poll_event *events,
+            int max_events, int *count)
+{
+    struct res_uring *r = p->rp_uring;
+    struct io_uring_cqe *cqe;
+    unsigned          head, tail;
+    int               fd;
+
+    head = *r->ru_cq_head;
+    tail = __atomic_load_n(r->ru_cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; ++head) {
+        cqe = &r->ru_cqes[head & r->ru_cq_mask];
+        if ((URING_TIMEOUT == cqe->user_data) ||
+            (URING_REMOVE == cqe->user_data))
+            continue;
+
+        fd = POLL_DATA_FD(cqe->user_data);
+        if ((fd >= p->rp_nslots) ||
+            !(p->rp_slots[fd].ps_flags & PS_REGISTERED) ||
+            (cqe->user_data != POLL_DATA(fd, p->rp_slots[fd].ps_gen)))
+            continue; /* descriptor was deregistered */
+
+        if ((-EINVAL == cqe->res) && r->ru_multishot) {
+            res_log(NULL, LOG_INFO,
+                    "libsres: ""no multishot poll, using one-shot");
+            r->ru_multishot = 0;
+            _uring_arm(p, fd);
+            continue;
+        }
+        /* errors are left for the read to find */
+        _mark_ready(p, fd, events, max_events, count);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            _uring_arm(p, fd);
+    }
+    __atomic_store_n(r->ru_cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Several threads may wait on one poller. The submission queue is only
+ * touched, and sqes only submitted, with the poller locked; each wait
+ * queues its own timeout (the kernel copies the timespec when the sqe
+ * is submitted) and then sleeps unlocked, submitting nothing.
+ */
+static int
+_uring_wait(struct res_poller *p, struct timeval *timeout,
+            struct res_poll_event *events, int max_events)
+{
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec ts;
+    int               count = 0, wait = 1, rc;
+
+    pthread_mutex_lock(&p->rp_lock);
+
+    /* anything already complete? */
+    _uring_reap(p, events, max_events, &count);
+    if (count || (timeout && !timerisset(timeout)))
+        wait = 0;
+    else if (timeout) {
+        /* times out, or completes along with the first poll */
+        sqe = _uring_sqe(p);
+        if (NULL == sqe) {
+            pthread_mutex_unlock(&p->rp_lock);
+            return -1;
+        }
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000L;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (u_int64_t) (uintptr_t) &ts;
+        sqe->len = 1;
+        sqe->off = 1;
+        sqe->user_data = URING_TIMEOUT;
+        _uring_queue(p);
+    }
+    rc = _uring_submit(p);
+
+    pthread_mutex_unlock(&p->rp_lock);
+
+    if (0 != rc)
+        return -1;
+
+    if (wait) {
+        rc = _uring_enter(p->rp_fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if ((rc < 0) && (EINTR != errno)) {
+            res_log(NULL, LOG_WARNING,
+                    "libsres: ""io_uring_enter failed, errno = %d %s",
+                    errno, strerror(errno));
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&p->rp_lock);
+    /* polls can complete as they are submitted, so look even if not waiting */
+    _uring_reap(p, events, max_events, &count);
+    /* polls re-armed while reaping */
+    _uring_submit(p);
+    pthread_mutex_unlock(&p->rp_lock);
+
+    return count;
+}
+#endif /* LIBSRES_IO_URING */
+
+struct res_poller *
+res_poller_create(int backend)
+{
+    struct res_poller *p;
+    int                requested = backend;
+
+    if (RES_POLLER_DEFAULT == backend) {
+#ifdef LIBSRES_IO_URING
+        /* falls back below if the kernel can't do it */
+        backend = RES_POLLER_IO_URING;
+#elif defined(HAVE_SYS_EPOLL_H)
+        backend = RES_POLLER_EPOLL;
+#else
+        backend = RES_POLLER_SELECT;
+#endif
+    }
+
+#ifndef HAVE_SYS_EPOLL_H
+    if (RES_POLLER_EPOLL == backend) {
+        res_log(NULL, LOG_INFO, "libsres: ""epoll not supported");
+        return NULL;
+    }
+#endif
+#ifndef LIBSRES_IO_URING
+    if (RES_POLLER_IO_URING == backend) {
+        res_log(NULL, LOG_INFO, "libsres: ""io_uring not supported");
+        return NULL;
+    }
+#endif
+    if ((RES_POLLER_SELECT != backend) && (RES_POLLER_EPOLL != backend) &&
+        (RES_POLLER_IO_URING != backend))
+        return NULL;
+
+    p = (struct res_poller *) MALLOC(sizeof(struct res_poller));
+    if (NULL == p)
+        return NULL;
+    memset(p, 0, sizeof(struct res_poller));
+    p->rp_backend = backend;
+    p->rp_fd = -1;
+    p->rp_maxfd = -1;
+    FD_ZERO(&p->rp_fds);
+    FD_ZERO(&p->rp_wfds);
+
+#ifdef LIBSRES_IO_URING
+    if (RES_POLLER_IO_URING == backend) {
+        if (0 != _uring_create(p)) {
+            if (RES_POLLER_DEFAULT != requested) {
+                FREE(p);
+                return NULL;
+            }
+            res_log(NULL, LOG_INFO, "libsres: "
+                    "io_uring not available, falling back");
+#ifdef HAVE_SYS_EPOLL_H
+            backend = RES_POLLER_EPOLL;
+#else
+            backend = RES_POLLER_SELECT;
+#endif
+            p->rp_backend = backend;
+        }
+    }
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (RES_POLLER_EPOLL == backend) {
+#ifdef EPOLL_CLOEXEC
+        p->rp_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+        p->rp_fd = epoll_create(RES_POLL_BATCH);
+#endif
+        if (p->rp_fd < 0) {
+            res_log(NULL, LOG_WARNING,
+                    "libsres: ""epoll_create failed, errno = %d %s",
+                    errno, strerror(errno));
+            FREE(p);
+            return NULL;
+        }
+    }
+#endif
+
+#ifndef VAL_NO_THREADS
+    if (0 != pthread_mutex_init(&p->rp_lock, NULL)) {
+#ifdef LIBSRES_IO_URING
+        _uring_free(p);
+#endif
+        if (p->rp_fd >= 0)
+            close(p->rp_fd);
+        FREE(p);
+        return NULL;
+    }
+#endif
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""poller %p created (%s%s)", p,
+            res_poller_backend_name(p),
+            (RES_POLLER_DEFAULT == requested) ? ", default" : "");
+    return p;
+}
+
+void
+res_poller_free(struct res_poller *p)
+{
+    if (NULL == p)
+        return;
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""poller %p free, %d sockets", p,
+            p->rp_count);
+#ifdef LIBSRES_IO_URING
+    _uring_free(p);
+#endif
+    if (p->rp_fd >= 0)
+        close(p->rp_fd);
+    if (p->rp_slots)
+        FREE(p->rp_slots);
+#ifndef VAL_NO_THREADS
+    pthread_mutex_destroy(&p->rp_lock);
+#endif
+    FREE(p);
+}
+
+int
+res_poller_backend(struct res_poller *p)
+{
+    return p ? p->rp_backend : -1;
+}
+
+const char *
+res_poller_backend_name(struct res_poller *p)
+{
+    switch (res_poller_backend(p)) {
+    case RES_POLLER_SELECT:
+        return "select";
+    case RES_POLLER_EPOLL:
+        return "epoll";
+    case RES_POLLER_IO_URING:
+        return "io_uring";
+    default:
+        return "none";
+    }
+}
+
+int
+res_poller_fd(struct res_poller *p)
+{
+    return p ? p->rp_fd : -1;
+}
+
+int
+res_poller_count(struct res_poller *p)
+{
+    return p ? p->rp_count : 0;
+}
+
+/*
+ * make sure the slot table can be indexed by fd. caller has lock.
+ */
+static int
+_grow_slots(struct res_poller *p, int fd)
+{
+    struct res_poll_slot *slots;
+    int                   nslots;
+
+    if (fd < p->rp_nslots)
+        return 0;
+
+    nslots = ((fd / RES_POLL_SLOT_CHUNK) + 1) * RES_POLL_SLOT_CHUNK;
+    slots = (struct res_poll_slot *)
+        MALLOC(nslots * sizeof(struct res_poll_slot));
+    if (NULL == slots)
+        return -1;
+    if (p->rp_slots) {
+        memcpy(slots, p->rp_slots,
+               p->rp_nslots * sizeof(struct res_poll_slot));
+        FREE(p->rp_slots);
+    }
+    memset(&slots[p->rp_nslots], 0,
+           (nslots - p->rp_nslots) * sizeof(struct res_poll_slot));
+    p->rp_slots = slots;
+    p->rp_nslots = nslots;
+
+    return 0;
+}
+
+int
+res_poller_add(struct res_poller *p, SOCKET fd, void *data)
+{
+    int rc = 0;
+    res_poller_watch_cb watch = NULL;
+    void *watch_data = NULL;
+
+    if ((NULL == p) || (fd == INVALID_SOCKET) || ((int)fd < 0))
+        return -1;
+
+    if ((RES_POLLER_SELECT == p->rp_backend) && (fd >= FD_SETSIZE)) {
+        res_log(NULL, LOG_WARNING,
+                "libsres: ""fd %d exceeds FD_SETSIZE for select poller", fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&p->rp_lock);
+
+    if (0 != _grow_slots(p, fd)) {
+        pthread_mutex_unlock(&p->rp_lock);
+        return -1;
+    }
+
+    if (p->rp_slots[fd].ps_flags & PS_REGISTERED) {
+        /*
+         * already registered. Another reference for the same owner (a
+         * shared tcp connection) is counted; anything else is refused,
+         * since events already handed out carry the registered data.
+         */
+        if (p->rp_slots[fd].ps_data != data) {
+            pthread_mutex_unlock(&p->rp_lock);
+            res_log(NULL, LOG_WARNING,
+                    "libsres: ""fd %d is already registered with poller %p",
+                    fd, p);
+            return -1;
+        }
+        ++p->rp_slots[fd].ps_refs;
+        pthread_mutex_unlock(&p->rp_lock);
+        return 0;
+    }
+
+    /* events for any earlier registration no longer match */
+    ++p->rp_slots[fd].ps_gen;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (RES_POLLER_EPOLL == p->rp_backend) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = POLL_DATA(fd, p->rp_slots[fd].ps_gen);
+        rc = epoll_ctl(p->rp_fd, EPOLL_CTL_ADD, fd, &ev);
+        if (rc < 0)
+            res_log(NULL, LOG_WARNING,
+                    "libsres: ""epoll_ctl(ADD, %d) failed, errno = %d %s",
+                    fd, errno, strerror(errno));
+    }
+    else
+#endif
+#ifdef LIBSRES_IO_URING
+    if (RES_POLLER_IO_URING == p->rp_backend) {
+        /* submitted now, in case the ring fd is being waited on */
+        rc = _uring_arm(p, fd);
+        if (0 == rc)
+            rc = _uring_submit(p);
+    }
+    else
+#endif
+    {
+        FD_SET(fd, &p->rp_fds);
+        if ((int)fd > p->rp_maxfd)
+            p->rp_maxfd = fd;
+    }
+
+    if (0 == rc) {
+        p->rp_slots[fd].ps_data = data;
+        p->rp_slots[fd].ps_flags = PS_REGISTERED;
+        p->rp_slots[fd].ps_refs = 1;
+        ++p->rp_count;
+        watch = p->rp_watch;
+        watch_data = p->rp_watch_data;
+    }
+
+    pthread_mutex_unlock(&p->rp_lock);
+
+    /* unlocked, so the callback may use the poller */
+    if (watch)
+        (*watch)(fd, 1, watch_data);
+
+    return rc;
+}
+
+int
+res_poller_del(struct res_poller *p, SOCKET fd)
+{
+    res_poller_watch_cb watch;
+    void *watch_data;
+
+    if ((NULL == p) || (fd == INVALID_SOCKET) || ((int)fd < 0))
+        return -1;
+
+    pthread_mutex_lock(&p->rp_lock);
+
+    if ((int)fd >= p->rp_nslots ||
+        !(p->rp_slots[fd].ps_flags & PS_REGISTERED)) {
+        pthread_mutex_unlock(&p->rp_lock);
+        return -1;
+    }
+
+    if (--p->rp_slots[fd].ps_refs > 0) {
+        pthread_mutex_unlock(&p->rp_lock);
+        return 0;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (RES_POLLER_EPOLL == p->rp_backend) {
+        struct epoll_event ev; /* non-NULL for pre 2.6.9 kernels */
+
+        memset(&ev, 0, sizeof(ev));
+        epoll_ctl(p->rp_fd, EPOLL_CTL_DEL, fd, &ev);
+    }
+    else
+#endif
+#ifdef LIBSRES_IO_URING
+    if (RES_POLLER_IO_URING == p->rp_backend) {
+        /* now, since the poll keeps the socket open */
+        if (0 == _uring_disarm(p, fd))
+            _uring_submit(p);
+    }
+    else
+#endif
+    {
+        FD_CLR(fd, &p->rp_fds);
+        FD_CLR(fd, &p->rp_wfds);
+        if ((int)fd == p->rp_maxfd) {
+            for (--p->rp_maxfd; p->rp_maxfd >= 0; --p->rp_maxfd)
+                if (p->rp_slots[p->rp_maxfd].ps_flags & PS_REGISTERED)
+                    break;
+        }
+    }
+
+    /* drop any readiness not yet read, and any events still in flight */
+    p->rp_slots[fd].ps_data = NULL;
+    p->rp_slots[fd].ps_flags = 0;
+    p->rp_slots[fd].ps_refs = 0;
+    ++p->rp_slots[fd].ps_gen;
+    --p->rp_count;
+    watch = p->rp_watch;
+    watch_data = p->rp_watch_data;
+
+    pthread_mutex_unlock(&p->rp_lock);
+
+    if (watch)
+        (*watch)(fd, 0, watch_data);
+
+    return 0;
+}
+
+int
+res_poller_want_write(struct res_poller *p, SOCKET fd, int on)
+{
+    int rc = 0;
+
+    if ((NULL == p) || (fd == INVALID_SOCKET) || ((int)fd < 0))
+        return -1;
+
+    pthread_mutex_lock(&p->rp_lock);
+
+    if ((int)fd >= p->rp_nslots ||
+        !(p->rp_slots[fd].ps_flags & PS_REGISTERED)) {
+        pthread_mutex_unlock(&p->rp_lock);
+        return -1;
+    }
+    if (!(p->rp_slots[fd].ps_flags & PS_WRITE) == !on) {
+        pthread_mutex_unlock(&p->rp_lock);
+        return 0;
+    }
+    if (on)
+        p->rp_slots[fd].ps_flags |= PS_WRITE;
+    else
+        p->rp_slots[fd].ps_flags &= ~PS_WRITE;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (RES_POLLER_EPOLL == p->rp_backend) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+        ev.data.u64 = POLL_DATA(fd, p->rp_slots[fd].ps_gen);
+        rc = epoll_ctl(p->rp_fd, EPOLL_CTL_MOD, fd, &ev);
+        if (rc < 0)
+            res_log(NULL, LOG_WARNING,
+                    "libsres: ""epoll_ctl(MOD, %d) failed, errno = %d %s",
+                    fd, errno, strerror(errno));
+    }
+    else
+#endif
+#ifdef LIBSRES_IO_URING
+    if (RES_POLLER_IO_URING == p->rp_backend) {
+        /*
+         * replace the poll with one for the new mask. The registration
+         * count moves on so the old poll's last completion is ignored
+         * rather than re-arming it.
+         */
+        rc = _uring_disarm(p, fd);
+        if (0 == rc) {
+            ++p->rp_slots[fd].ps_gen;
+            rc = _uring_arm(p, fd);
+        }
+        if (0 == rc)
+            rc = _uring_submit(p);
+    }
+    else
+#endif
+    {
+        if (on)
+            FD_SET(fd, &p->rp_wfds);
+        else
+            FD_CLR(fd, &p->rp_wfds);
+    }
+
+    pthread_mutex_unlock(&p->rp_lock);
+
+    return rc;
+}
+
+int
+res_poller_wait(struct res_poller *p, struct timeval *timeout,
+                struct res_poll_event *events, int max_events)
+{
+    int             ready, count = 0, i;
+
+    if (NULL == p)
+        return -1;
+
+#ifdef LIBSRES_IO_URING
+    if (RES_POLLER_IO_URING == p->rp_backend)
+        count = _uring_wait(p, timeout, events, max_events);
+    else
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (RES_POLLER_EPOLL == p->rp_backend) {
+        struct epoll_event evs[RES_POLL_BATCH];
+        long               msec = -1;
+
+        if (timeout) {
+            msec = (timeout->tv_sec * 1000) + ((timeout->tv_usec + 999) / 1000);
+            if (msec < 0)
+                msec = 0;
+            else if (msec > INT_MAX)
+                msec = INT_MAX;
+        }
+        ready = epoll_wait(p->rp_fd, evs, RES_POLL_BATCH, (int)msec);
+        if (ready < 0) {
+            if (EINTR == errno)
+                return 0;
+            return -1;
+        }
+
+        pthread_mutex_lock(&p->rp_lock);
+        for (i = 0; i < ready; ++i) {
+            int fd = POLL_DATA_FD(evs[i].data.u64);
+
+            /* skip events for an earlier registration of the descriptor */
+            if ((fd < p->rp_nslots) &&
+                (evs[i].data.u64 == POLL_DATA(fd, p->rp_slots[fd].ps_gen)))
+                _mark_ready(p, fd, events, max_events, &count);
+        }
+        pthread_mutex_unlock(&p->rp_lock);
+    }
+    else
+#endif
+    {
+        fd_set          fds, wfds;
+        int             maxfd;
+        struct timeval  tv;
+
+        /* select rejects very large timeouts */
+        if (timeout && (timeout->tv_sec > RES_POLL_MAX_SELECT_WAIT)) {
+            tv.tv_sec = RES_POLL_MAX_SELECT_WAIT;
+            tv.tv_usec = 0;
+            timeout = &tv;
+        }
+
+        pthread_mutex_lock(&p->rp_lock);
+        memcpy(&fds, &p->rp_fds, sizeof(fds));
+        memcpy(&wfds, &p->rp_wfds, sizeof(wfds));
+        maxfd = p->rp_maxfd;
+        pthread_mutex_unlock(&p->rp_lock);
+
+        ready = select(maxfd + 1, &fds, &wfds, NULL, timeout);
+        if (ready < 0) {
+            if (EINTR == errno)
+                return 0;
+            return -1;
+        }
+
+        pthread_mutex_lock(&p->rp_lock);
+        for (i = 0; ready > 0 && i <= maxfd; ++i) {
+            if (FD_ISSET(i, &fds))
+                --ready;
+            if (FD_ISSET(i, &wfds))
+                --ready;
+            else if (!FD_ISSET(i, &fds))
+                continue;
+            _mark_ready(p, i, events, max_events, &count);
+        }
+        pthread_mutex_unlock(&p->rp_lock);
+    }
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""poller %p: %d ready of %d", p,
+            count, p->rp_count);
+
+    return count;
+}
+
+int
+res_poller_is_ready(struct res_poller *p, SOCKET fd)
+{
+    int ready = 0;
+
+    if ((NULL == p) || (fd == INVALID_SOCKET) || ((int)fd < 0))
+        return 0;
+
+    pthread_mutex_lock(&p->rp_lock);
+    if ((int)fd < p->rp_nslots)
+        ready = (p->rp_slots[fd].ps_flags & PS_READY) ? 1 : 0;
+    pthread_mutex_unlock(&p->rp_lock);
+
+    return ready;
+}
+
+void
+res_poller_clear(struct res_poller *p, SOCKET fd)
+{
+    if ((NULL == p) || (fd == INVALID_SOCKET) || ((int)fd < 0))
+        return;
+
+    pthread_mutex_lock(&p->rp_lock);
+    if ((int)fd < p->rp_nslots)
+        p->rp_slots[fd].ps_flags &= ~PS_READY;
+    pthread_mutex_unlock(&p->rp_lock);
+}
+
+int
+res_poller_set_ready(struct res_poller *p, SOCKET fd)
+{
+    int rc = -1;
+
+    if ((NULL == p) || (fd == INVALID_SOCKET) || ((int)fd < 0))
+        return -1;
+
+    pthread_mutex_lock(&p->rp_lock);
+    if (((int)fd < p->rp_nslots) &&
+        (p->rp_slots[fd].ps_flags & PS_REGISTERED)) {
+        p->rp_slots[fd].ps_flags |= PS_READY;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&p->rp_lock);
+
+    return rc;
+}
+
+void
+res_poller_set_watch(struct res_poller *p, res_poller_watch_cb cb,
+                     void *data)
+{
+    int  fd, i, n = 0;
+    int *fds = NULL;
+
+    if (NULL == p)
+        return;
+
+    pthread_mutex_lock(&p->rp_lock);
+    p->rp_watch = cb;
+    p->rp_watch_data = data;
+    /* note the sockets already registered, to catch up on unlocked */
+    if (cb && (p->rp_count > 0)) {
+        fds = (int *) MALLOC(p->rp_count * sizeof(int));
+        if (NULL == fds)
+            res_log(NULL, LOG_WARNING, "libsres: "
+                    "no memory to report registered sockets to watcher");
+        for (fd = 0; fds && fd < p->rp_nslots && n < p->rp_count; ++fd)
+            if (p->rp_slots[fd].ps_flags & PS_REGISTERED)
+                fds[n++] = fd;
+    }
+    pthread_mutex_unlock(&p->rp_lock);
+
+    for (i = 0; i < n; ++i)
+        (*cb)(fds[i], 1, data);
+    if (fds)
+        FREE(fds);
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * DESCRIPTION
+ * Server round trip time cache. A smoothed round trip time and mean
+ * deviation are kept for each server address, computed as for TCP
+ * (RFC 6298) from the time between sending a query and reading its
+ * answer. Only queries answered on their first transmission are used,
+ * since the answer to a retransmitted query could be for either copy.
+ *
+ * The io manager uses these to try the fastest servers first, and to set
+ * the retransmit timeout for a query to the server's RTO instead of the
+ * fixed ns_retrans. A query which goes unanswered doubles the server's
+ * RTO and smoothed RTT, so lossy or dead servers fall to the back of the
+ * list and are retried less eagerly; the next answer starts bringing
+ * them back. Entries not refreshed for RES_RTT_TTL seconds are dropped.
+ */
+#include "validator-internal.h"
+
+#include "res_support.h"
+#include "res_addr_cache.h"
+#include "res_rtt.h"
+
+#ifdef VAL_NO_THREADS
+#define pthread_mutex_lock(x)
+#define pthread_mutex_unlock(x)
+#endif
+
+#define RES_RTT_TTL         900         /* seconds */
+#define RES_RTT_MAX         120000000L  /* usec */
+
+struct res_rtt_entry {
+    struct res_addr_entry re_head;  /* must be first */
+    long            re_srtt;    /* usec */
+    long            re_rttvar;  /* usec */
+    long            re_backoff; /* rto multiplier after timeouts */
+};
+
+static void     _rtt_init(struct res_addr_entry *e, time_t now);
+
+static struct res_addr_cache _rtt_cache =
+    RES_ADDR_CACHE_INIT(struct res_rtt_entry, RES_RTT_TTL, _rtt_init);
+static int      _rtt_enabled = 1;
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t rtt_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+_rtt_init(struct res_addr_entry *e, time_t now)
+{
+    struct res_rtt_entry *re = (struct res_rtt_entry *) e;
+
+    re->re_srtt = -1;
+    re->re_backoff = 1;
+}
+
+/*
+ * find the entry for addr, adding it if create is set. caller has lock.
+ */
+static struct res_rtt_entry *
+_rtt_find(struct sockaddr_storage *addr, int create, time_t now)
+{
+    return (struct res_rtt_entry *)
+        res_addr_cache_find(&_rtt_cache, addr, create, now);
+}
+
+void
+res_rtt_sample(struct sockaddr_storage *addr, struct timeval *sent,
+               struct timeval *received)
+{
+    struct res_rtt_entry *e;
+    struct timeval  diff;
+    long            rtt, delta;
+
+    if (!_rtt_enabled || !addr || !sent || !received)
+        return;
+
+    timersub(received, sent, &diff);
+    if (diff.tv_sec < 0)
+        return;
+    rtt = (diff.tv_sec >= (RES_RTT_MAX / 1000000)) ? RES_RTT_MAX :
+        (diff.tv_sec * 1000000L) + diff.tv_usec;
+
+    pthread_mutex_lock(&rtt_mutex);
+    e = _rtt_find(addr, 1, received->tv_sec);
+    if (e) {
+        if (e->re_srtt < 0) {
+            e->re_srtt = rtt;
+            e->re_rttvar = rtt / 2;
+        } else {
+            delta = e->re_srtt - rtt;
+            if (delta < 0)
+                delta = -delta;
+            e->re_rttvar += (delta - e->re_rttvar) / 4;
+            e->re_srtt += (rtt - e->re_srtt) / 8;
+        }
+        e->re_backoff = 1;
+        e->re_head.ae_updated = received->tv_sec;
+        res_log(NULL, LOG_DEBUG, "libsres: "
+                "rtt sample %ld usec, srtt %ld rttvar %ld", rtt,
+                e->re_srtt, e->re_rttvar);
+    }
+    pthread_mutex_unlock(&rtt_mutex);
+}
+
+void
+res_rtt_timeout(struct sockaddr_storage *addr)
+{
+    struct res_rtt_entry *e;
+    struct timeval  now;
+
+    if (!_rtt_enabled || !addr)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&rtt_mutex);
+    e = _rtt_find(addr, 1, now.tv_sec);
+    if (e) {
+        if (e->re_srtt < 0) {
+            /* never answered; rank it behind servers that have */
+            e->re_srtt = RES_RTT_MIN_RTO * 1000L;
+            e->re_rttvar = e->re_srtt / 2;
+        } else if (e->re_srtt < RES_RTT_MAX / 2)
+            e->re_srtt *= 2;
+        if (e->re_backoff < 64)
+            e->re_backoff *= 2;
+        e->re_head.ae_updated = now.tv_sec;
+        res_log(NULL, LOG_DEBUG, "libsres: "
+                "rtt timeout, srtt %ld backoff %ld", e->re_srtt,
+                e->re_backoff);
+    }
+    pthread_mutex_unlock(&rtt_mutex);
+}
+
+long
+res_rtt_rto(struct sockaddr_storage *addr, long max_ms)
+{
+    struct res_rtt_entry *e;
+    struct timeval  now;
+    long            rto = -1;
+
+    if (!_rtt_enabled || !addr)
+        return -1;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&rtt_mutex);
+    e = _rtt_find(addr, 0, now.tv_sec);
+    if (e && e->re_srtt >= 0) {
+        rto = (e->re_srtt + 4 * e->re_rttvar) / 1000;
+        if (rto < RES_RTT_MIN_RTO)
+            rto = RES_RTT_MIN_RTO;
+        if (rto < max_ms / e->re_backoff)
+            rto *= e->re_backoff;
+        else
+            rto = max_ms;
+    }
+    pthread_mutex_unlock(&rtt_mutex);
+
+    if (rto > max_ms)
+        rto = max_ms;
+
+    return rto;
+}
+
+/*
+ * smoothed rtt for an address, or 0 if unknown, so that new servers
+ * are tried (and measured) ahead of known ones. caller has lock.
+ */
+static long
+_rtt_rank(struct sockaddr_storage *addr, time_t now)
+{
+    struct res_rtt_entry *e = _rtt_find(addr, 0, now);
+
+    return (e && e->re_srtt > 0) ? e->re_srtt : 0;
+}
+
+void
+res_rtt_order(struct name_server **ns_list)
+{
+    struct name_server *ns, *sorted = NULL, **pos, *next;
+    struct sockaddr_storage *addr;
+    struct timeval  now;
+    long           *rank = NULL, best;
+    int             nrank = 0, n, i, j;
+
+    if (!_rtt_enabled || !ns_list || !*ns_list)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    for (n = 0, ns = *ns_list; ns; ns = ns->ns_next)
+        ++n;
+    if (n > 1) {
+        rank = (long *) MALLOC(n * sizeof(long));
+        if (NULL == rank)
+            return;
+    }
+
+    pthread_mutex_lock(&rtt_mutex);
+    for (ns = *ns_list; ns; ns = ns->ns_next) {
+        /*
+         * order the server's addresses (insertion sort; lists are short)
+         * and rank the server by its best one
+         */
+        for (i = 1; i < ns->ns_number_of_addresses; ++i) {
+            addr = ns->ns_address[i];
+            best = _rtt_rank(addr, now.tv_sec);
+            for (j = i; j > 0 &&
+                 _rtt_rank(ns->ns_address[j - 1], now.tv_sec) > best; --j)
+                ns->ns_address[j] = ns->ns_address[j - 1];
+            ns->ns_address[j] = addr;
+        }
+        if (rank)
+            rank[nrank++] = (ns->ns_number_of_addresses > 0) ?
+                _rtt_rank(ns->ns_address[0], now.tv_sec) : 0;
+    }
+    pthread_mutex_unlock(&rtt_mutex);
+
+    if (NULL == rank)
+        return;
+
+    /*
+     * stable insertion sort of the server list by rank
+     */
+    for (i = 0, ns = *ns_list; ns; ns = next, ++i) {
+        next = ns->ns_next;
+        for (pos = &sorted, j = 0; *pos; pos = &(*pos)->ns_next, ++j)
+            if (rank[j] > rank[i])
+                break;
+        /* keep rank[] in step with the sorted list */
+        best = rank[i];
+        memmove(&rank[j + 1], &rank[j], (i - j) * sizeof(long));
+        rank[j] = best;
+        ns->ns_next = *pos;
+        *pos = ns;
+    }
+    *ns_list = sorted;
+
+    FREE(rank);
+}
+
+int
+res_rtt_get(struct sockaddr_storage *addr, long *srtt, long *rttvar)
+{
+    struct res_rtt_entry *e;
+    struct timeval  now;
+    int             rc = -1;
+
+    if (NULL == addr)
+        return -1;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&rtt_mutex);
+    e = _rtt_find(addr, 0, now.tv_sec);
+    if (e && e->re_srtt >= 0) {
+        if (srtt)
+            *srtt = e->re_srtt;
+        if (rttvar)
+            *rttvar = e->re_rttvar;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&rtt_mutex);
+
+    return rc;
+}
+
+int
+res_rtt_enable(int on)
+{
+    int old = _rtt_enabled;
+
+    _rtt_enabled = on ? 1 : 0;
+    return old;
+}
+
+void
+res_rtt_flush(void)
+{
+    pthread_mutex_lock(&rtt_mutex);
+    res_addr_cache_flush(&_rtt_cache);
+    pthread_mutex_unlock(&rtt_mutex);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+#ifndef __RES_RTT_H__
+#define __RES_RTT_H__
+
+#define RES_RTT_MIN_RTO     200     /* msec */
+
+/*
+ * record a round trip time sample for a server address
+ */
+void            res_rtt_sample(struct sockaddr_storage *addr,
+                               struct timeval *sent,
+                               struct timeval *received);
+/*
+ * record that a query to a server address went unanswered
+ */
+void            res_rtt_timeout(struct sockaddr_storage *addr);
+/*
+ * retransmit timeout (msec) for a server address, at most max_ms, or -1
+ * if nothing is known about the server.
+ */
+long            res_rtt_rto(struct sockaddr_storage *addr, long max_ms);
+/*
+ * sort a name server list, and the addresses of each server, fastest
+ * first.
+ */
+void            res_rtt_order(struct name_server **ns_list);
+
+#endif                          /* __RES_RTT_H__ */
@@ -0,0 +1,257 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * DESCRIPTION
+ * Deadline queue for async queries. The io manager keeps the next
+ * deadline (retransmit, cancel, or "now" for an answer waiting to be
+ * collected) of every ea registered with a queue in a binary min-heap,
+ * updating it whenever the deadline changes. The closest event for all
+ * registered queries is then the top of the heap, and whether anything
+ * is due can be answered without walking every ea list.
+ *
+ * Each ea records its position in the heap, so changing or removing its
+ * deadline costs O(log n). eas with no remaining attempts are not
+ * queued.
+ */
+#include "validator-internal.h"
+
+#include "res_support.h"
+#include "res_timer.h"
+
+#ifdef VAL_NO_THREADS
+#define pthread_mutex_lock(x)
+#define pthread_mutex_unlock(x)
+#endif
+
+/* growth increment for the heap array */
+#define RES_TIMERS_CHUNK    64
+
+struct res_timers {
+    struct expected_arrival **rt_heap;
+    int                   rt_count;
+    int                   rt_size;
+#ifndef VAL_NO_THREADS
+    pthread_mutex_t       rt_lock;
+#endif
+};
+
+/* ea_timer_slot is the heap position + 1, so 0 means not queued */
+#define SLOT(ea)        ((ea)->ea_timer_slot - 1)
+#define KEY(t, i)       ((t)->rt_heap[i]->ea_timer_key)
+#define BEFORE(a, b)    timercmp(&(a), &(b), <)
+
+struct res_timers *
+res_timers_create(void)
+{
+    struct res_timers *t;
+
+    t = (struct res_timers *) MALLOC(sizeof(struct res_timers));
+    if (NULL == t)
+        return NULL;
+    memset(t, 0, sizeof(struct res_timers));
+
+#ifndef VAL_NO_THREADS
+    if (0 != pthread_mutex_init(&t->rt_lock, NULL)) {
+        FREE(t);
+        return NULL;
+    }
+#endif
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""timers %p created", t);
+    return t;
+}
+
+void
+res_timers_free(struct res_timers *t)
+{
+    int i;
+
+    if (NULL == t)
+        return;
+
+    res_log(NULL, LOG_DEBUG, "libsres: ""timers %p free, %d queued", t,
+            t->rt_count);
+
+    /* don't leave dangling references in eas still registered */
+    for (i = 0; i < t->rt_count; ++i) {
+        t->rt_heap[i]->ea_timers = NULL;
+        t->rt_heap[i]->ea_timer_slot = 0;
+    }
+    if (t->rt_heap)
+        FREE(t->rt_heap);
+#ifndef VAL_NO_THREADS
+    pthread_mutex_destroy(&t->rt_lock);
+#endif
+    FREE(t);
+}
+
+int
+res_timers_count(struct res_timers *t)
+{
+    int count;
+
+    if (NULL == t)
+        return 0;
+
+    pthread_mutex_lock(&t->rt_lock);
+    count = t->rt_count;
+    pthread_mutex_unlock(&t->rt_lock);
+
+    return count;
+}
+
+int
+res_timers_next(struct res_timers *t, struct timeval *when)
+{
+    int rc = -1;
+
+    if ((NULL == t) || (NULL == when))
+        return -1;
+
+    pthread_mutex_lock(&t->rt_lock);
+    if (t->rt_count > 0) {
+        memcpy(when, &KEY(t, 0), sizeof(struct timeval));
+        rc = 0;
+    }
+    pthread_mutex_unlock(&t->rt_lock);
+
+    return rc;
+}
+
+/*
+ * place ea at heap position i. caller has lock.
+ */
+static void
+_heap_set(struct res_timers *t, int i, struct expected_arrival *ea)
+{
+    t->rt_heap[i] = ea;
+    ea->ea_timer_slot = i + 1;
+}
+
+static void
+_heap_up(struct res_timers *t, int i)
+{
+    struct expected_arrival *ea = t->rt_heap[i];
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!BEFORE(ea->ea_timer_key, KEY(t, parent)))
+            break;
+        _heap_set(t, i, t->rt_heap[parent]);
+        i = parent;
+    }
+    _heap_set(t, i, ea);
+}
+
+static void
+_heap_down(struct res_timers *t, int i)
+{
+    struct expected_arrival *ea = t->rt_heap[i];
+    int child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= t->rt_count)
+            break;
+        if ((child + 1 < t->rt_count) &&
+            BEFORE(KEY(t, child + 1), KEY(t, child)))
+            ++child;
+        if (!BEFORE(KEY(t, child), ea->ea_timer_key))
+            break;
+        _heap_set(t, i, t->rt_heap[child]);
+        i = child;
+    }
+    _heap_set(t, i, ea);
+}
+
+/*
+ * take ea out of the heap. caller has lock.
+ */
+static void
+_heap_remove(struct res_timers *t, struct expected_arrival *ea)
+{
+    int i = SLOT(ea);
+
+    ea->ea_timer_slot = 0;
+    if (--t->rt_count == i)
+        return;
+
+    /* fill the hole with the last entry and restore the heap order */
+    _heap_set(t, i, t->rt_heap[t->rt_count]);
+    if ((i > 0) && BEFORE(KEY(t, i), KEY(t, (i - 1) / 2)))
+        _heap_up(t, i);
+    else
+        _heap_down(t, i);
+}
+
+void
+res_timers_update(struct expected_arrival *ea, struct timeval *when)
+{
+    struct res_timers *t;
+    struct expected_arrival **heap;
+    struct timeval  old;
+    int             i;
+
+    if ((NULL == ea) || (NULL == (t = ea->ea_timers)))
+        return;
+
+    pthread_mutex_lock(&t->rt_lock);
+
+    if (NULL == when) {
+        if (ea->ea_timer_slot)
+            _heap_remove(t, ea);
+        pthread_mutex_unlock(&t->rt_lock);
+        return;
+    }
+
+    if (ea->ea_timer_slot) {
+        i = SLOT(ea);
+        old = ea->ea_timer_key;
+        ea->ea_timer_key = *when;
+        if (BEFORE(*when, old))
+            _heap_up(t, i);
+        else
+            _heap_down(t, i);
+        pthread_mutex_unlock(&t->rt_lock);
+        return;
+    }
+
+    if (t->rt_count == t->rt_size) {
+        heap = (struct expected_arrival **)
+            MALLOC((t->rt_size + RES_TIMERS_CHUNK) * sizeof(*heap));
+        if (NULL == heap) {
+            /* the query still runs, the owner just can't see its deadline */
+            pthread_mutex_unlock(&t->rt_lock);
+            res_log(NULL, LOG_WARNING, "libsres: ""timers %p: no memory", t);
+            return;
+        }
+        if (t->rt_heap) {
+            memcpy(heap, t->rt_heap, t->rt_count * sizeof(*heap));
+            FREE(t->rt_heap);
+        }
+        t->rt_heap = heap;
+        t->rt_size += RES_TIMERS_CHUNK;
+    }
+
+    ea->ea_timer_key = *when;
+    i = t->rt_count++;
+    t->rt_heap[i] = ea;
+    _heap_up(t, i);
+
+    pthread_mutex_unlock(&t->rt_lock);
+}
+
+void
+res_timers_wake(struct expected_arrival *ea)
+{
+    struct timeval  now;
+
+    if ((NULL == ea) || (NULL == ea->ea_timers))
+        return;
+
+    gettimeofday(&now, NULL);
+    res_timers_update(ea, &now);
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+#ifndef __RES_TIMER_H__
+#define __RES_TIMER_H__
+
+/*
+ * set the deadline for an ea in the queue it is registered with (if
+ * any), or take it out of the queue if when is NULL.
+ */
+void            res_timers_update(struct expected_arrival *ea,
+                                  struct timeval *when);
+/*
+ * make an ea due now. Only touches the queue, so it may be used on an
+ * ea owned by another thread (e.g. when reading its answer off a shared
+ * tcp connection).
+ */
+void            res_timers_wake(struct expected_arrival *ea);
+
+#endif                          /* __RES_TIMER_H__ */
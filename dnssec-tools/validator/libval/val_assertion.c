@@ -764,10 +764,10 @@ find_dlv_trust_point(val_context_t * ctx, u_char * zone_n,
                  u_char ** dlv_tp, u_char ** dlv_target, u_int32_t *ttl_x)
 {
 
-    policy_entry_t *ta_pol, *ta_cur, *ta_tmphead;
-    size_t       name_len;
-    u_char       *zp = zone_n;
-    u_char       *ep;
+    policy_entry_t *ta_pol;
+    size_t       len;
+    u_char       *zp;
+    u_char       *tp;
 
     /*
      * This function should never be called with a NULL zone_n, but still... 
@@ -778,67 +778,33 @@ find_dlv_trust_point(val_context_t * ctx, u_char * zone_n,
     *dlv_tp = NULL;
     *dlv_target = NULL;
 
-    name_len = wire_name_length(zp);
-    ep = zp + name_len;
-    
-    RETRIEVE_POLICY(ctx, P_DLV_TRUST_POINTS, ta_pol);
-    
+    ta_pol = find_zone_policy(ctx, P_DLV_TRUST_POINTS, zone_n, &zp);
     if (ta_pol == NULL) {
         return VAL_NO_ERROR;
     }
+    tp = ((struct dlv_policy *)(ta_pol->pol))->trust_point;
+    if (!tp)
+        return VAL_NO_ERROR;
 
-    /*
-     * skip longer names 
-     */
-    for (ta_cur = ta_pol;
-         ta_cur && (wire_name_length(ta_cur->zone_n) > name_len);
-         ta_cur = ta_cur->next);
-
-    /*
-     * for the remaining nodes, see if there is any hope 
-     */
-    ta_tmphead = ta_cur;
-    while (zp < ep) {
-        for (ta_cur = ta_tmphead; ta_cur; ta_cur = ta_cur->next) {
-            if (wire_name_length(zp) < wire_name_length(ta_cur->zone_n))
-                /** next time look from this point */
-                ta_tmphead = ta_cur->next;
-
-            if (namecmp(ta_cur->zone_n, zp) == 0) {
-                /** We have hope */
-                size_t len;
-
-                u_char *tp = ((struct dlv_policy *)(ta_cur->pol))->trust_point;
-                if (!tp)
-                    continue;
-                len = wire_name_length(tp);
-                *dlv_tp = (u_char *) MALLOC(len * sizeof(u_char));
-                if (*dlv_tp == NULL)
-                    return VAL_OUT_OF_MEMORY;
-                memcpy(*dlv_tp, tp, len);
+    /** We have hope */
+    len = wire_name_length(tp);
+    *dlv_tp = (u_char *) MALLOC(len * sizeof(u_char));
+    if (*dlv_tp == NULL)
+        return VAL_OUT_OF_MEMORY;
+    memcpy(*dlv_tp, tp, len);
     
-                len = wire_name_length(zp);
-                *dlv_target =
-                    (u_char *) MALLOC(len * sizeof(u_char));
-                if (*dlv_target == NULL) {
-                    FREE(*dlv_tp);
-                    *dlv_tp = NULL;
-                    return VAL_OUT_OF_MEMORY;
-                }
-                memcpy(*dlv_target, zp, len);
-
-                if (ta_cur->exp_ttl > 0)
-                    *ttl_x = ta_cur->exp_ttl;
-
-                return VAL_NO_ERROR;
-            }
-        }
-
-        /*
-         * trim the top label from our candidate zone 
-         */
-        zp += (int) zp[0] + 1;
+    len = wire_name_length(zp);
+    *dlv_target =
+        (u_char *) MALLOC(len * sizeof(u_char));
+    if (*dlv_target == NULL) {
+        FREE(*dlv_tp);
+        *dlv_tp = NULL;
+        return VAL_OUT_OF_MEMORY;
     }
+    memcpy(*dlv_target, zp, len);
+
+    if (ta_pol->exp_ttl > 0)
+        *ttl_x = ta_pol->exp_ttl;
 
     return VAL_NO_ERROR;
 }
@@ -888,9 +854,7 @@ int
 get_zse(val_context_t * ctx, u_char * name_n, u_int32_t flags, 
         u_int16_t *status, u_char ** match_ptr, u_int32_t *ttl_x)
 {
-    policy_entry_t *zse_pol, *zse_cur;
-    size_t          name_len;
-    u_char         *p;
+    policy_entry_t *zse_pol;
     int             retval;
 
     /*
@@ -905,63 +869,29 @@ get_zse(val_context_t * ctx, u_char * name_n, u_int32_t flags,
 
     retval = VAL_NO_ERROR;
 
-    name_len = wire_name_length(name_n);
-
     /*
      * Check if the zone is trusted 
      */
     
-    RETRIEVE_POLICY(ctx, P_ZONE_SECURITY_EXPECTATION, zse_pol);
+    zse_pol = find_zone_policy(ctx, P_ZONE_SECURITY_EXPECTATION, name_n,
+                               match_ptr);
     if (zse_pol != NULL) {
-        for (zse_cur = zse_pol;
-             zse_cur && (wire_name_length(zse_cur->zone_n) > name_len);
-             zse_cur = zse_cur->next);
-
-        /*
-         * for all zones which are shorter or as long, do a strstr 
-         */
-        /*
-         * Because of the ordering, the longest match is found first 
-         */
-        for (; zse_cur; zse_cur = zse_cur->next) {
-            int             root_zone = 0;
-            if (!namecmp(zse_cur->zone_n, (const u_char *) ""))
-                root_zone = 1;
-            else {
-                /*
-                 * Find the last occurrence of zse_cur->zone_n in name_n 
-                 */
-                p = name_n;
-                while (p && (*p != '\0')) {
-                    if (!namecmp(p, zse_cur->zone_n))
-                        break;
-                    p = p + *p + 1;
-                }
-            }
-
-            if ((root_zone || (!namecmp(p, zse_cur->zone_n))) && zse_cur->pol) {
-                struct zone_se_policy *pol = 
-                    (struct zone_se_policy *)(zse_cur->pol);
-    
-                if (match_ptr) {
-                    *match_ptr = namename(name_n, zse_cur->zone_n);
-                }
+        struct zone_se_policy *pol = 
+            (struct zone_se_policy *)(zse_pol->pol);
 
-                if (zse_cur->exp_ttl > 0)
-                    *ttl_x = zse_cur->exp_ttl;
+        if (zse_pol->exp_ttl > 0)
+            *ttl_x = zse_pol->exp_ttl;
                 
-                if (pol->trusted == ZONE_SE_UNTRUSTED) {
-                    *status = VAL_AC_UNTRUSTED_ZONE;
-                    goto done;
-                } else if (pol->trusted == ZONE_SE_DO_VAL) {
-                    *status = VAL_AC_WAIT_FOR_TRUST;
-                    goto done;
-                } else {
-                    /** ZONE_SE_IGNORE */
-                    *status = VAL_AC_IGNORE_VALIDATION;
-                    goto done;
-                }
-            }
+        if (pol->trusted == ZONE_SE_UNTRUSTED) {
+            *status = VAL_AC_UNTRUSTED_ZONE;
+            goto done;
+        } else if (pol->trusted == ZONE_SE_DO_VAL) {
+            *status = VAL_AC_WAIT_FOR_TRUST;
+            goto done;
+        } else {
+            /** ZONE_SE_IGNORE */
+            *status = VAL_AC_IGNORE_VALIDATION;
+            goto done;
         }
     }
 
@@ -978,10 +908,9 @@ find_trust_point(val_context_t * ctx, u_char * zone_n,
                  u_char ** matched_zone, u_int32_t *ttl_x)
 {
 
-    policy_entry_t *ta_pol, *ta_cur, *ta_tmphead;
-    size_t       name_len;
-    u_char       *zp = zone_n;
-    u_char       *ep;
+    policy_entry_t *ta_pol;
+    u_char       *zp;
+    size_t       len;
 
     /*
      * This function should never be called with a NULL zone_n, but still... 
@@ -992,52 +921,20 @@ find_trust_point(val_context_t * ctx, u_char * zone_n,
     *matched_zone = NULL;
     *ttl_x = 0;
 
-    name_len = wire_name_length(zp);
-    ep = zp + name_len;
-    
-    RETRIEVE_POLICY(ctx, P_TRUST_ANCHOR, ta_pol);
-    
+    ta_pol = find_zone_policy(ctx, P_TRUST_ANCHOR, zone_n, &zp);
     if (ta_pol == NULL) {
         return VAL_NO_ERROR;
     }
 
-    /*
-     * skip longer names 
-     */
-    for (ta_cur = ta_pol;
-         ta_cur && (wire_name_length(ta_cur->zone_n) > name_len);
-         ta_cur = ta_cur->next);
-
-    /*
-     * for the remaining nodes, see if there is any hope 
-     */
-    ta_tmphead = ta_cur;
-    while (zp < ep) {
-        for (ta_cur = ta_tmphead; ta_cur; ta_cur = ta_cur->next) {
-            if (wire_name_length(zp) < wire_name_length(ta_cur->zone_n))
-                /** next time look from this point */
-                ta_tmphead = ta_cur->next;
-
-            if (namecmp(ta_cur->zone_n, zp) == 0) {
-                size_t len;
-                len = wire_name_length(zp);
-                /** We have hope */
-                *matched_zone =
-                   (u_char *) MALLOC( len * sizeof(u_char));
-                if (*matched_zone == NULL) {
-                    return VAL_OUT_OF_MEMORY;
-                }
-                memcpy(*matched_zone, zp, len);
-                if (ta_cur->exp_ttl > 0)
-                    *ttl_x = ta_cur->exp_ttl;
-                return VAL_NO_ERROR;
-            }
-        }
-        /*
-         * trim the top label from our candidate zone 
-         */
-        zp += (int) zp[0] + 1;
+    /** We have hope */
+    len = wire_name_length(zp);
+    *matched_zone = (u_char *) MALLOC(len * sizeof(u_char));
+    if (*matched_zone == NULL) {
+        return VAL_OUT_OF_MEMORY;
     }
+    memcpy(*matched_zone, zp, len);
+    if (ta_pol->exp_ttl > 0)
+        *ttl_x = ta_pol->exp_ttl;
 
     return VAL_NO_ERROR;
 }
@@ -1046,13 +943,11 @@ static int
 is_trusted_key(val_context_t * ctx, u_char * zone_n, struct rrset_rr *key, 
                val_astatus_t * status, u_int32_t flags, u_int32_t *ttl_x)
 {
-    policy_entry_t *ta_pol, *ta_cur, *ta_tmphead;
-    size_t       name_len;
-    u_char       *ep; 
-    val_dnskey_rdata_t dnskey, *dnskey_p = &dnskey;
+    policy_entry_t **ta_pols, **ta_cur;
     struct rrset_rr  *curkey;
     u_char       *zp;
-    int ta_specified;
+    u_char       *matched = NULL;
+    long         now;
     int found;
 
     /*
@@ -1068,79 +963,69 @@ is_trusted_key(val_context_t * ctx, u_char * zone_n, struct rrset_rr *key,
      */
     *status = VAL_AC_NO_LINK;
 
-    name_len = wire_name_length(zp);
-    ep = zp + name_len;
-
-    RETRIEVE_POLICY(ctx, P_TRUST_ANCHOR, ta_pol);
-    if (ta_pol == NULL) {
+    if (ctx == NULL || ctx->e_pol[P_TRUST_ANCHOR] == NULL) {
         val_log(ctx, LOG_INFO, "is_trusted_key(): No trust anchor policy available"); 
         *status = VAL_AC_NO_LINK;
         return VAL_NO_ERROR;
     }
 
     /*
-     * skip longer names 
+     * the closest trust anchors at or above this zone
      */
-    for (ta_cur = ta_pol;
-         ta_cur && (wire_name_length(ta_cur->zone_n) > name_len);
-         ta_cur = ta_cur->next);
+    ta_pols = find_zone_policies(ctx, P_TRUST_ANCHOR, zp, &matched, &now);
 
-    /*
-     * for the remaining nodes, if the length of the zones are 
-     * the same, look for an exact match 
-     */
-    ta_specified = 0;
-    found = 0;
-    for (; ta_cur &&
-         (wire_name_length(ta_cur->zone_n) == name_len);
-         ta_cur = ta_cur->next) {
+    if (ta_pols && matched == zp) {
+        /*
+         * Trust anchors exist at this level; look for an exact match.
+         * Keys are compared with the anchors' pre-digested key tag,
+         * algorithm and wire format, so they need not be parsed.
+         */
+        found = 0;
+        for (curkey = key; curkey; curkey = curkey->rr_next) {
+            u_int16_t   key_tag;
+            u_char      algorithm;
+
+            if (curkey->rr_rdata == NULL || curkey->rr_rdata_length < 4) {
+                val_log(ctx, LOG_INFO, "is_trusted_key(): could not parse DNSKEY");
+                continue;
+            }
+            algorithm = curkey->rr_rdata[3];
+            key_tag = val_dnskey_rdata_keytag(curkey->rr_rdata,
+                                              curkey->rr_rdata_length);
 
-        if (!namecmp(ta_cur->zone_n, zp)) {
+            for (ta_cur = ta_pols; *ta_cur; ta_cur++) {
+                struct trust_anchor_policy *pol;
+                val_astatus_t tmp_status;
 
-            ta_specified = 1;
-            for (curkey = key; curkey; curkey = curkey->rr_next) {
-                /*
-                 * parse key and compare
-                 */
-                if (VAL_NO_ERROR != val_parse_dnskey_rdata(curkey->rr_rdata,
-                                       curkey->rr_rdata_length, &dnskey)) {
-                    val_log(ctx, LOG_INFO, "is_trusted_key(): could not parse DNSKEY");
+                if (!POLICY_USABLE(*ta_cur, now))
+                    continue;
+                pol = (struct trust_anchor_policy *)((*ta_cur)->pol);
+                if (pol->key_tag != key_tag || pol->algorithm != algorithm)
                     continue;
-                }
 
-                if (ta_cur->pol) {
-                    struct trust_anchor_policy *pol = 
-                        (struct trust_anchor_policy *)(ta_cur->pol);
-
-                    val_astatus_t tmp_status;
-                        /* check if the given dnskey matches the configured dnskey */
-                    if ((pol->publickey &&
-                            DNSKEY_MATCHES_DNSKEY(dnskey_p, pol->publickey)) ||
-                        /* check if the given dnskey matches the configured ds */
-                        (pol->ds &&
-                            DNSKEY_MATCHES_DS(ctx, &dnskey, pol->ds,
-                                               zp, curkey, &tmp_status))) {
-
-                        char            name_p[NS_MAXDNAME];
-                        if (-1 == ns_name_ntop(zp, name_p, sizeof(name_p)))
-                            snprintf(name_p, sizeof(name_p), "unknown/error");
-                        curkey->rr_status = VAL_AC_TRUST_POINT;
-                        if (ta_cur->exp_ttl > 0)
-                            *ttl_x = ta_cur->exp_ttl;
-                        val_log(ctx, LOG_DEBUG, "is_trusted_key(): key %s is trusted", name_p);
-                        found = 1;
-                    } 
-                }
-                if (dnskey.public_key != NULL) {
-                    FREE(dnskey.public_key);
-                    dnskey.public_key = NULL;
-                }
+                    /* check if the given dnskey matches the configured dnskey */
+                if ((pol->rdata &&
+                        pol->rdata_len == curkey->rr_rdata_length &&
+                        !memcmp(pol->rdata, curkey->rr_rdata, pol->rdata_len)) ||
+                    /* check if the given dnskey matches the configured ds */
+                    (pol->ds &&
+                        ds_hash_is_equal(ctx, pol->ds->d_type,
+                                         pol->ds->d_hash,
+                                         (size_t)(pol->ds->d_hash_len),
+                                         zp, curkey, &tmp_status))) {
+
+                    char            name_p[NS_MAXDNAME];
+                    if (-1 == ns_name_ntop(zp, name_p, sizeof(name_p)))
+                        snprintf(name_p, sizeof(name_p), "unknown/error");
+                    curkey->rr_status = VAL_AC_TRUST_POINT;
+                    if ((*ta_cur)->exp_ttl > 0)
+                        *ttl_x = (*ta_cur)->exp_ttl;
+                    val_log(ctx, LOG_DEBUG, "is_trusted_key(): key %s is trusted", name_p);
+                    found = 1;
+                } 
             }
-            /* we will continue as long as there is a trust anchor above this level */
         }
-    }
 
-    if (ta_specified) {
         if (found) {
             *status = VAL_AC_TRUST_NOCHK;
             return VAL_NO_ERROR;
@@ -1162,27 +1047,21 @@ is_trusted_key(val_context_t * ctx, u_char * zone_n, struct rrset_rr *key,
             *status = VAL_AC_NO_LINK;
             return VAL_NO_ERROR;
         }
+
+        /* we will continue as long as there is a trust anchor above this level */
+        ta_pols = NULL;
+        if (*zp != '\0') {
+            zp += zp[0] + 1;
+            ta_pols = find_zone_policies(ctx, P_TRUST_ANCHOR, zp, NULL, &now);
+        }
     }
 
     /*
-     * for the remaining nodes, see if there is any hope 
+     * see if there is any hope 
      */
-    ta_tmphead = ta_cur;
-    while (zp < ep) {
-        /*
-         * trim the top label from our candidate zone 
-         */
-        zp += zp[0] + 1;
-        for (ta_cur = ta_tmphead; ta_cur; ta_cur = ta_cur->next) {
-            if (wire_name_length(zp) < wire_name_length(ta_cur->zone_n))
-                /** next time look from this point */
-                ta_tmphead = ta_cur->next;
-
-            if (namecmp(ta_cur->zone_n, zp) == 0) {
-                *status = VAL_AC_WAIT_FOR_TRUST;
-                return VAL_NO_ERROR;
-            }
-        }
+    if (ta_pols) {
+        *status = VAL_AC_WAIT_FOR_TRUST;
+        return VAL_NO_ERROR;
     }
 
 #ifdef LIBVAL_DLV
@@ -2646,69 +2525,24 @@ compute_nsec3_hash(val_context_t * ctx, u_char * qname_n,
                    u_char saltlen, u_char * salt,
                    size_t * b32_hashlen, u_char ** b32_hash, u_int32_t *ttl_x)
 {
-    int             name_len;
-    policy_entry_t *pol, *cur;
-    u_char         *p;
-    char            name_p[NS_MAXDNAME];
+    policy_entry_t *pol;
     size_t          hashlen;
     u_char         *hash;
 
     if (alg != ALG_NSEC3_HASH_SHA1)
         return NULL;
 
-    pol = NULL;
-
     if (soa_name_n != NULL) {
-        name_len = wire_name_length(soa_name_n);
-        RETRIEVE_POLICY(ctx, P_NSEC3_MAX_ITER, pol);
-
+        pol = find_zone_policy(ctx, P_NSEC3_MAX_ITER, soa_name_n, NULL);
         if (pol != NULL) {
-            /*
-             * go past longer names 
-             */
-            for (cur = pol;
-                 cur && (wire_name_length(cur->zone_n) > name_len);
-                 cur = cur->next);
-    
-            /*
-             * for all zones which are shorter or as long, do a strstr 
-             */
-            /*
-             * Because of the ordering, the longest match is found first 
-             */
-            for (; cur; cur = cur->next) {
-                int             root_zone = 0;
-                if (!namecmp(cur->zone_n, (const u_char *) ""))
-                    root_zone = 1;
-                else {
-                    /*
-                     * Find the last occurrence of cur->zone_n in soa_name_n 
-                     */
-                    p = soa_name_n;
-                    while (p && (*p != '\0')) {
-                        if (!namecmp(p, cur->zone_n))
-                            break;
-                        p = p + *p + 1;
-                    }
-                }
-    
-                if (root_zone || !namecmp(p, cur->zone_n)) {
-                    if (-1 == ns_name_ntop(soa_name_n, name_p, sizeof(name_p)))
-                        snprintf(name_p, sizeof(name_p), "unknown/error");
-    
-                    if (cur->pol != NULL) {
-                        int nsec3_pol_iter;
+            int nsec3_pol_iter;
 
-                        if (cur->exp_ttl > 0)
-                            *ttl_x = cur->exp_ttl;
-                        nsec3_pol_iter = ((struct nsec3_max_iter_policy *)(cur->pol))->iter;
+            if (pol->exp_ttl > 0)
+                *ttl_x = pol->exp_ttl;
+            nsec3_pol_iter = ((struct nsec3_max_iter_policy *)(pol->pol))->iter;
                         
-                        if (nsec3_pol_iter > 0 && nsec3_pol_iter < iter) 
-                            return NULL;
-                    }
-                    break;
-                }
-            }
+            if (nsec3_pol_iter > 0 && nsec3_pol_iter < iter) 
+                return NULL;
         }
     }
 
@@ -4243,59 +4077,25 @@ donefornow:
 static int
 is_pu_trusted(val_context_t *ctx, u_char *name_n, u_int32_t *ttl_x)
 {
-    policy_entry_t *pu_pol, *pu_cur;
-    u_char       *p;
+    policy_entry_t *pu_pol;
     char         name_p[NS_MAXDNAME];
-    size_t       name_len;
 
-    RETRIEVE_POLICY(ctx, P_PROV_INSECURE, pu_pol);
+    pu_pol = find_zone_policy(ctx, P_PROV_INSECURE, name_n, NULL);
     if (pu_pol) {
+        struct prov_insecure_policy *pol =
+            (struct prov_insecure_policy *)(pu_pol->pol);
+        if (-1 == ns_name_ntop(name_n, name_p, sizeof(name_p)))
+            snprintf(name_p, sizeof(name_p), "unknown/error");
+        if (pu_pol->exp_ttl > 0)
+            *ttl_x = pu_pol->exp_ttl;
 
-        name_len = wire_name_length(name_n);
-        
-        for (pu_cur = pu_pol;
-             pu_cur && (wire_name_length(pu_cur->zone_n) > name_len);
-             pu_cur = pu_cur->next);
-
-        /*
-         * for all zones which are shorter or as long, do a strstr 
-         */
-        /*
-         * Because of the ordering, the longest match is found first 
-         */
-        for (; pu_cur; pu_cur = pu_cur->next) {
-            int             root_zone = 0;
-            if (!namecmp(pu_cur->zone_n, (const u_char *) ""))
-                root_zone = 1;
-            else {
-                /*
-                 * Find the last occurrence of zse_cur->zone_n in name_n 
-                 */
-                p = name_n;
-                while (p && (*p != '\0')) {
-                    if (!namecmp(p, pu_cur->zone_n))
-                        break;
-                    p = p + *p + 1;
-                }
-            }
-
-            if ((root_zone || (!namecmp(p, pu_cur->zone_n))) && pu_cur->pol) {
-                struct prov_insecure_policy *pol =
-                    (struct prov_insecure_policy *)(pu_cur->pol);
-                if (-1 == ns_name_ntop(name_n, name_p, sizeof(name_p)))
-                    snprintf(name_p, sizeof(name_p), "unknown/error");
-                if (pu_cur->exp_ttl > 0)
-                    *ttl_x = pu_cur->exp_ttl;
-
-                if (pol->trusted == ZONE_PU_UNTRUSTED) {
-                    val_log(ctx, LOG_INFO, "is_pu_trusted(): zone %s provable insecure status is not trusted",
-                            name_p);
-                    return 0;
-                } else { 
-                    val_log(ctx, LOG_INFO, "is_pu_trusted(): zone %s provably insecure status is trusted", name_p);
-                    return 1;
-                }
-            }
+        if (pol->trusted == ZONE_PU_UNTRUSTED) {
+            val_log(ctx, LOG_INFO, "is_pu_trusted(): zone %s provable insecure status is not trusted",
+                    name_p);
+            return 0;
+        } else { 
+            val_log(ctx, LOG_INFO, "is_pu_trusted(): zone %s provably insecure status is trusted", name_p);
+            return 1;
         }
     }
     return 1; /* trust provably insecure state by default */
@@ -6388,6 +6188,56 @@ int try_chase_query(val_context_t * context,
     return retval;
 }
 
+/*
+ * The deadline for a query passed before its authentication chain was
+ * complete. Report how far it got -- VAL_INDETERMINATE if the answer
+ * itself arrived, VAL_DNS_ERROR if not -- and stop the upstream queries
+ * that no one else is waiting on. These are reset, so that a later
+ * lookup sends them again.
+ */
+static int
+_query_deadline_expired(val_context_t * context,
+                        struct queries_for_query *top_qfq,
+                        struct queries_for_query *queries,
+                        struct val_result_chain **results)
+{
+    struct val_result_chain *res;
+    struct val_result_chain *prev = NULL;
+    struct val_query_chain *q;
+    val_status_t status;
+    char   name_p[NS_MAXDNAME];
+    int abandoned = 0;
+
+    if (context == NULL || top_qfq == NULL || results == NULL)
+        return VAL_BAD_ARGUMENT;
+
+    q = top_qfq->qfq_query;
+    status = (q->qc_state == Q_ANSWERED) ? VAL_INDETERMINATE : VAL_DNS_ERROR;
+    if (-1 == ns_name_ntop(q->qc_original_name, name_p, sizeof(name_p)))
+        snprintf(name_p, sizeof(name_p), "unknown/error");
+
+    for (; queries; queries = queries->qfq_next) {
+        q = queries->qfq_query;
+        if (q && (q->qc_state != Q_INIT) && (q->qc_state < Q_ANSWERED) &&
+            clear_query_chain_structure(q))
+            ++abandoned;
+    }
+
+    val_log(context, LOG_INFO,
+            "Deadline expired for {%s %s(%d) %s(%d)}: %s, %d queries abandoned",
+            name_p, p_class(top_qfq->qfq_query->qc_class_h),
+            top_qfq->qfq_query->qc_class_h,
+            p_type(top_qfq->qfq_query->qc_type_h),
+            top_qfq->qfq_query->qc_type_h, p_val_status(status), abandoned);
+
+    val_free_result_chain(*results);
+    *results = NULL;
+    CREATE_RESULT_BLOCK(res, prev, *results);
+    res->val_rc_status = status;
+
+    return VAL_NO_ERROR;
+}
+
 /*
  * Look inside the cache, ask the resolver for missing data.
  * Then try and validate what ever is possible.
@@ -6402,6 +6252,23 @@ val_resolve_and_check(val_context_t * ctx,
                       u_int32_t flags,
                       struct val_result_chain **results)
 {
+    return val_resolve_and_check_ex(ctx, domain_name, class_h, type_h,
+                                    flags, NULL, results);
+}
+
+/*
+ * As val_resolve_and_check, but give up once budget (if not NULL) has
+ * elapsed, returning the status reached so far.
+ */
+int
+val_resolve_and_check_ex(val_context_t * ctx,
+                         const char * domain_name,
+                         int class_h,
+                         int type_h,
+                         u_int32_t flags,
+                         const struct timeval *budget,
+                         struct val_result_chain **results)
+{
 
     int             retval;
     struct queries_for_query *top_q = NULL;
@@ -6414,11 +6281,21 @@ val_resolve_and_check(val_context_t * ctx,
     val_context_t  *context = NULL;
     u_char domain_name_n[NS_MAXCDNAME];
     u_int16_t q_class, q_type;
+    struct timeval deadline, now;
     
     if ((results == NULL) || (domain_name == NULL))
         return VAL_BAD_ARGUMENT;
 
     val_log(NULL, LOG_DEBUG, __FUNCTION__);
+
+    timerclear(&deadline);
+    if (budget) {
+        if (budget->tv_sec < 0 || budget->tv_usec < 0)
+            return VAL_BAD_ARGUMENT;
+        gettimeofday(&deadline, NULL);
+        timeradd(&deadline, budget, &deadline);
+    }
+
     /* 
      * Sanity check the values of class and type 
      * Should not be larger than sizeof u_int16_t
@@ -6525,6 +6402,20 @@ val_resolve_and_check(val_context_t * ctx,
         }
 
         /* We are either done or we are waiting for some data */
+        if (!done && timerisset(&deadline)) {
+            gettimeofday(&now, NULL);
+            if (!timercmp(&deadline, &now, >)) {
+                if (VAL_NO_ERROR != (retval =
+                        _query_deadline_expired(context, top_q, queries,
+                                                results)))
+                    goto err;
+                break;
+            }
+            /* don't sleep past the deadline */
+            if (timerisset(&closest_event) &&
+                timercmp(&deadline, &closest_event, <))
+                closest_event = deadline;
+        }
         if (!done) {
 
             /* Release the lock, let some other thread get some time slice to run */
@@ -6701,6 +6592,8 @@ _context_as_remove(val_context_t *context, val_async_status *as)
     }
 }
 
+static void     _async_loop_update(val_context_t *context);
+
 static int
 _async_status_free(val_async_status **as)
 {
@@ -6742,77 +6635,427 @@ _async_status_free(val_async_status **as)
 }
 
 /*
- * call callbacks for completed requests
- *
- * returns 1 if callback called, 0 otherwise
+ * copy a list of val_rr_recs, into a single block as copy_rr_rec_list
+ * does.
  */
-static int
-_call_callbacks(int event, val_async_status *as)
+static struct val_rr_rec *
+_dup_val_rr_list(struct val_rr_rec *o_rr)
 {
-    int callit = 1;
+    struct val_rr_rec *c_rr, *n_rr, *head_rr;
+    size_t siz = 0;
+    u_char *buf;
 
-    if ((NULL == as) || (NULL == as->val_as_result_cb) ||
-        (as->val_as_flags & VAL_AS_CALLBACK_CALLED))
-        return 0;
+    if (NULL == o_rr)
+        return NULL;
 
-    /*
-     * one callback per customer, please (otherwise caller might
-     * call async cancel, which will call callbacks = instant loop!)
-     */
-    as->val_as_flags |= VAL_AS_CALLBACK_CALLED;
-    if (as->val_as_flags & VAL_AS_INFLIGHT) {
-        as->val_as_flags ^= VAL_AS_INFLIGHT;
-    }
+    for (c_rr = o_rr; c_rr; c_rr = c_rr->rr_next)
+        siz += c_rr->rr_rdata_length + sizeof(struct val_rr_rec);
 
-    if (VAL_AS_EVENT_COMPLETED == event) {
-        if (!(as->val_as_flags & VAL_AS_DONE) ||
-            (as->val_as_flags & VAL_AS_NO_CALLBACKS))
-            callit = 0;
-    } else if (VAL_AS_EVENT_CANCELED == event) {
-        if (as->val_as_flags & VAL_AS_NO_CANCEL_CALLBACKS)
-            callit = 0;
+    buf = (u_char *) MALLOC (siz * sizeof(u_char));
+    if (NULL == buf)
+        return NULL;
+
+    head_rr = (struct val_rr_rec *)buf;
+    for (c_rr = o_rr; c_rr; c_rr = c_rr->rr_next) {
+        n_rr = (struct val_rr_rec *)buf;
+        n_rr->rr_rdata = buf + sizeof(struct val_rr_rec);
+        memcpy(n_rr->rr_rdata, c_rr->rr_rdata, c_rr->rr_rdata_length);
+        n_rr->rr_rdata_length = c_rr->rr_rdata_length;
+        n_rr->rr_status = c_rr->rr_status;
+        buf += sizeof(struct val_rr_rec) + n_rr->rr_rdata_length;
+        n_rr->rr_next = c_rr->rr_next ? (struct val_rr_rec *)buf : NULL;
     }
 
-    if (callit) {
-        val_cb_params_t cbp;
-        memset(&cbp, 0, sizeof(cbp));
+    return head_rr;
+}
 
-        // XXX SK Do we need to set val_status to val_as_retval?
-        cbp.val_status = as->val_as_retval;
-        cbp.name = as->val_as_name;
-        cbp.class_h = as->val_as_class;
-        cbp.type_h = as->val_as_type;
-        cbp.retval = as->val_as_retval;
-        cbp.results = as->val_as_results;
-        cbp.answers = as->val_as_answers;
+static struct val_rrset_rec *
+_dup_val_rrset(struct val_rrset_rec *o_rrset)
+{
+    struct val_rrset_rec *n_rrset;
 
-        (*as->val_as_result_cb)(as, event, as->val_as_ctx,
-                                as->val_as_cb_user_ctx, &cbp );
+    n_rrset = (struct val_rrset_rec *) MALLOC(sizeof(struct val_rrset_rec));
+    if (NULL == n_rrset)
+        return NULL;
 
-        /** did callback release resources? */
-        if (NULL == cbp.results)
-            as->val_as_results = NULL;
-        if (NULL == cbp.answers)
-            as->val_as_answers = NULL;
-        if (NULL == cbp.name)
-            as->val_as_name = NULL;
+    memcpy(n_rrset, o_rrset, sizeof(struct val_rrset_rec));
+    n_rrset->val_rrset_server = NULL;
+    n_rrset->val_rrset_data = _dup_val_rr_list(o_rrset->val_rrset_data);
+    n_rrset->val_rrset_sig = _dup_val_rr_list(o_rrset->val_rrset_sig);
+    if ((o_rrset->val_rrset_data && !n_rrset->val_rrset_data) ||
+        (o_rrset->val_rrset_sig && !n_rrset->val_rrset_sig)) {
+        free_val_rrset(n_rrset);
+        return NULL;
+    }
+    if (o_rrset->val_rrset_server) {
+        n_rrset->val_rrset_server =
+            (struct sockaddr *) MALLOC(sizeof(struct sockaddr_storage));
+        if (n_rrset->val_rrset_server != NULL)
+            memcpy(n_rrset->val_rrset_server, o_rrset->val_rrset_server,
+                   sizeof(struct sockaddr_storage));
     }
-    return callit;
-}
 
-static void
-_handle_completed(val_context_t *context)
+    return n_rrset;
+}
 
+/*
+ * copy an authentication chain. If o_match is one of its rrsets, *n_match
+ * is set to the copy of it.
+ */
+static int
+_dup_authentication_chain(struct val_authentication_chain *o_ac,
+                          struct val_authentication_chain **n_ac,
+                          struct val_rrset_rec *o_match,
+                          struct val_rrset_rec **n_match)
 {
-#ifndef VAL_NO_THREADS
-    pthread_t                   self = pthread_self();
-#endif
-    val_async_status           *as, *next, *last = NULL, *completed = NULL;
-
-    if ((NULL == context) || (NULL == context->as_list))
-        return;
+    struct val_authentication_chain *ac;
 
-    CTX_LOCK_ACACHE(context);
+    for (*n_ac = NULL; o_ac; o_ac = o_ac->val_ac_trust) {
+        ac = (struct val_authentication_chain *)
+            MALLOC(sizeof(struct val_authentication_chain));
+        if (NULL == ac)
+            return VAL_OUT_OF_MEMORY;
+        ac->val_ac_status = o_ac->val_ac_status;
+        ac->val_ac_trust = NULL;
+        ac->val_ac_rrset = NULL;
+        *n_ac = ac;
+        n_ac = &ac->val_ac_trust;
+        if (o_ac->val_ac_rrset) {
+            ac->val_ac_rrset = _dup_val_rrset(o_ac->val_ac_rrset);
+            if (NULL == ac->val_ac_rrset)
+                return VAL_OUT_OF_MEMORY;
+            if (n_match && o_ac->val_ac_rrset == o_match)
+                *n_match = ac->val_ac_rrset;
+        }
+    }
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * copy a result chain, for a request sharing another's results
+ */
+static int
+_dup_result_chain(struct val_result_chain *o_res,
+                  struct val_result_chain **n_res)
+{
+    struct val_result_chain *res, *prev = NULL;
+    int i, retval = VAL_NO_ERROR;
+
+    if (NULL == n_res)
+        return VAL_BAD_ARGUMENT;
+
+    for (*n_res = NULL; o_res; o_res = o_res->val_rc_next) {
+        res = (struct val_result_chain *)
+            MALLOC(sizeof(struct val_result_chain));
+        if (NULL == res) {
+            retval = VAL_OUT_OF_MEMORY;
+            break;
+        }
+        memset(res, 0, sizeof(struct val_result_chain));
+        if (prev)
+            prev->val_rc_next = res;
+        else
+            *n_res = res;
+        prev = res;
+
+        res->val_rc_status = o_res->val_rc_status;
+        if (o_res->val_rc_alias &&
+            NULL == (res->val_rc_alias = strdup(o_res->val_rc_alias))) {
+            retval = VAL_OUT_OF_MEMORY;
+            break;
+        }
+
+        /* with an authentication chain, val_rc_rrset points into it */
+        if (o_res->val_rc_answer) {
+            retval = _dup_authentication_chain(o_res->val_rc_answer,
+                                               &res->val_rc_answer,
+                                               o_res->val_rc_rrset,
+                                               &res->val_rc_rrset);
+        } else if (o_res->val_rc_rrset) {
+            res->val_rc_rrset = _dup_val_rrset(o_res->val_rc_rrset);
+            if (NULL == res->val_rc_rrset)
+                retval = VAL_OUT_OF_MEMORY;
+        }
+        if (VAL_NO_ERROR != retval)
+            break;
+
+        res->val_rc_proof_count = o_res->val_rc_proof_count;
+        for (i = 0; i < o_res->val_rc_proof_count; i++) {
+            if (VAL_NO_ERROR !=
+                (retval = _dup_authentication_chain(o_res->val_rc_proofs[i],
+                                                    &res->val_rc_proofs[i],
+                                                    NULL, NULL)))
+                break;
+        }
+        if (VAL_NO_ERROR != retval)
+            break;
+    }
+
+    if (VAL_NO_ERROR != retval) {
+        val_free_result_chain(*n_res);
+        *n_res = NULL;
+    }
+    return retval;
+}
+
+/*
+ * find an in flight request which a new one, for the same name, class,
+ * type and query flags, can wait on instead of doing the same work.
+ * The new request must not give up before the one it waits on, and must
+ * be handled by the same thread.
+ * caller must have CTX_LOCK_ACACHE.
+ */
+static val_async_status *
+_async_find_primary(val_context_t *context, val_async_status *as)
+{
+    val_async_status *p;
+
+    ASSERT_HAVE_AC_LOCK(context);
+
+    for (p = context->as_list; p; p = p->val_as_next) {
+        if ((p->val_as_flags & VAL_AS_DONE) || p->val_as_primary ||
+            (p->val_as_type != as->val_as_type) ||
+            (p->val_as_class != as->val_as_class) ||
+            (p->val_as_qflags != as->val_as_qflags) ||
+            (NULL == p->val_as_queries) ||
+            strcasecmp(p->val_as_name, as->val_as_name))
+            continue;
+#ifndef VAL_NO_THREADS
+        if (! (context->ctx_flags & CTX_PROCESS_ALL_THREADS) &&
+            ! pthread_equal(p->val_as_tid, as->val_as_tid))
+            continue;
+#endif
+        if (timerisset(&p->val_as_deadline) &&
+            (!timerisset(&as->val_as_deadline) ||
+             timercmp(&p->val_as_deadline, &as->val_as_deadline, <)))
+            continue;
+        return p;
+    }
+
+    return NULL;
+}
+
+/*
+ * stop waiting on another request
+ */
+static void
+_async_detach_waiter(val_async_status *as)
+{
+    val_async_status **wp;
+
+    if (NULL == as->val_as_primary)
+        return;
+
+    for (wp = &as->val_as_primary->val_as_waiters; *wp;
+         wp = &(*wp)->val_as_next_waiter) {
+        if (*wp == as) {
+            *wp = as->val_as_next_waiter;
+            break;
+        }
+    }
+    as->val_as_primary = NULL;
+    as->val_as_next_waiter = NULL;
+}
+
+/*
+ * a request with waiters is going away without completing; hand its
+ * queries over to the waiter willing to wait longest, and the other
+ * waiters with them.
+ */
+static void
+_async_promote_waiter(val_async_status *as)
+{
+    val_async_status *w, *best = NULL;
+
+    for (w = as->val_as_waiters; w; w = w->val_as_next_waiter) {
+        if ((NULL == best) || !timerisset(&w->val_as_deadline) ||
+            (timerisset(&best->val_as_deadline) &&
+             timercmp(&w->val_as_deadline, &best->val_as_deadline, >)))
+            best = w;
+        if (!timerisset(&best->val_as_deadline))
+            break;
+    }
+    if (NULL == best)
+        return;
+
+    _async_detach_waiter(best);
+    best->val_as_waiters = as->val_as_waiters;
+    for (w = best->val_as_waiters; w; w = w->val_as_next_waiter)
+        w->val_as_primary = best;
+    best->val_as_queries = as->val_as_queries;
+    best->val_as_top_q = as->val_as_top_q;
+    best->val_as_gen = 0;
+    as->val_as_waiters = NULL;
+    as->val_as_queries = NULL;
+    as->val_as_top_q = NULL;
+
+    val_log(as->val_as_ctx, LOG_DEBUG, "as %p takes over from as %p",
+            best, as);
+}
+
+/*
+ * a request completed; give its waiters copies of its results.
+ *
+ * returns the number of waiters completed.
+ */
+static int
+_async_complete_waiters(val_async_status *as)
+{
+    val_async_status *w;
+    int count = 0;
+
+    while (NULL != (w = as->val_as_waiters)) {
+        as->val_as_waiters = w->val_as_next_waiter;
+        w->val_as_primary = NULL;
+        w->val_as_next_waiter = NULL;
+
+        w->val_as_retval = as->val_as_retval;
+        if (as->val_as_results &&
+            (VAL_NO_ERROR != _dup_result_chain(as->val_as_results,
+                                               &w->val_as_results)))
+            w->val_as_retval = VAL_OUT_OF_MEMORY;
+        w->val_as_flags |= VAL_AS_DONE;
+        ++count;
+    }
+    if (count)
+        val_log(as->val_as_ctx, LOG_DEBUG, "as %p shared with %d waiters",
+                as, count);
+
+    return count;
+}
+
+/*
+ * call callbacks for completed requests
+ *
+ * returns 1 if callback called, 0 otherwise
+ */
+static int
+_call_callbacks(int event, val_async_status *as)
+{
+    int callit = 1;
+
+    if ((NULL == as) || (NULL == as->val_as_result_cb) ||
+        (as->val_as_flags & VAL_AS_CALLBACK_CALLED))
+        return 0;
+
+    /*
+     * one callback per customer, please (otherwise caller might
+     * call async cancel, which will call callbacks = instant loop!)
+     */
+    as->val_as_flags |= VAL_AS_CALLBACK_CALLED;
+    if (as->val_as_flags & VAL_AS_INFLIGHT) {
+        as->val_as_flags ^= VAL_AS_INFLIGHT;
+    }
+
+    if (VAL_AS_EVENT_COMPLETED == event) {
+        if (!(as->val_as_flags & VAL_AS_DONE) ||
+            (as->val_as_flags & VAL_AS_NO_CALLBACKS))
+            callit = 0;
+    } else if (VAL_AS_EVENT_CANCELED == event) {
+        if (as->val_as_flags & VAL_AS_NO_CANCEL_CALLBACKS)
+            callit = 0;
+    }
+
+    if (callit) {
+        val_cb_params_t cbp;
+        memset(&cbp, 0, sizeof(cbp));
+
+        // XXX SK Do we need to set val_status to val_as_retval?
+        cbp.val_status = as->val_as_retval;
+        cbp.name = as->val_as_name;
+        cbp.class_h = as->val_as_class;
+        cbp.type_h = as->val_as_type;
+        cbp.retval = as->val_as_retval;
+        cbp.results = as->val_as_results;
+        cbp.answers = as->val_as_answers;
+
+        (*as->val_as_result_cb)(as, event, as->val_as_ctx,
+                                as->val_as_cb_user_ctx, &cbp );
+
+        /** did callback release resources? */
+        if (NULL == cbp.results)
+            as->val_as_results = NULL;
+        if (NULL == cbp.answers)
+            as->val_as_answers = NULL;
+        if (NULL == cbp.name)
+            as->val_as_name = NULL;
+    }
+    return callit;
+}
+
+/*
+ * Completion queue
+ *
+ * Producers (whichever thread finds a request completed) push onto the
+ * as_cq stack with compare and swap, so they never wait for a consumer.
+ * A consumer takes the whole stack at once, reverses it to get the
+ * oldest request first and hands it out in batches from as_cq_ready.
+ * Consumers only contend with each other, on as_cq_lock.
+ *
+ * Nothing is ever popped off as_cq singly, so a reused request address
+ * (ABA) can't corrupt it.
+ */
+#if defined(VAL_NO_THREADS)
+#define VAL_CQ_CAS(p, o, n)     ((*(p) == (o)) ? (*(p) = (n), 1) : 0)
+#elif defined(__GNUC__)
+#define VAL_CQ_CAS(p, o, n)     __sync_bool_compare_and_swap((p), (o), (n))
+#elif defined(WIN32)
+#define VAL_CQ_CAS(p, o, n)                                             \
+    (InterlockedCompareExchangePointer((PVOID volatile *)(p), (n), (o)) == (o))
+#else
+static pthread_mutex_t cq_cas_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+_val_cq_cas(val_async_status **p, val_async_status *o, val_async_status *n)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&cq_cas_mutex);
+    if (*p == o) {
+        *p = n;
+        rc = 1;
+    }
+    pthread_mutex_unlock(&cq_cas_mutex);
+    return rc;
+}
+#define VAL_CQ_CAS(p, o, n)     _val_cq_cas((p), (o), (n))
+#endif
+
+/*
+ * queue a completed request, which has already been removed from the
+ * context list. From here on it belongs to whoever dequeues it.
+ */
+static void
+_async_cq_push(val_context_t *context, val_async_status *as)
+{
+    val_async_status *head;
+
+    if (as->val_as_flags & VAL_AS_INFLIGHT)
+        as->val_as_flags ^= VAL_AS_INFLIGHT;
+    as->val_as_flags |= VAL_AS_QUEUED;
+    as->val_as_ctx = NULL;
+
+    val_log(context, LOG_DEBUG, "as %p queued", as);
+    do {
+        head = context->as_cq;
+        as->val_as_next = head;
+    } while (!VAL_CQ_CAS(&context->as_cq, head, as));
+}
+
+static void
+_handle_completed(val_context_t *context)
+
+{
+#ifndef VAL_NO_THREADS
+    pthread_t                   self = pthread_self();
+#endif
+    val_async_status           *as, *next, *last = NULL, *completed = NULL;
+
+    if ((NULL == context) || (NULL == context->as_list))
+        return;
+
+    CTX_LOCK_ACACHE(context);
 
     /** find any completed requests and deal with them. */
     for (as = context->as_list; as; as = next) {
@@ -6849,9 +7092,13 @@ _handle_completed(val_context_t *context)
     while (completed) {
         as = completed;
         completed = completed->val_as_next;
-        _call_callbacks(VAL_AS_EVENT_COMPLETED, as);
-        as->val_as_ctx = NULL; /* we've already removed ourselves */
-        _async_status_free(&as); /* no ctx, so no lock needed */
+        if (as->val_as_flags & VAL_AS_COMPLETION_QUEUE)
+            _async_cq_push(context, as);
+        else {
+            _call_callbacks(VAL_AS_EVENT_COMPLETED, as);
+            as->val_as_ctx = NULL; /* we've already removed ourselves */
+            _async_status_free(&as); /* no ctx, so no lock needed */
+        }
         CTX_UNLOCK_POL(context);
     }
 }
@@ -6864,10 +7111,25 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
                  int type_h, u_int32_t flags, val_async_event_cb callback,
                  void *cb_data, val_async_status **async_status)
 {
+    return val_async_submit_ex(ctx, domain_name, class_h, type_h, flags,
+                               NULL, callback, cb_data, async_status);
+}
+
+/*
+ * As val_async_submit, but complete the request once budget (if not
+ * NULL) has elapsed, with the status reached so far.
+ */
+int
+val_async_submit_ex(val_context_t * ctx,  const char * domain_name,
+                    int class_h, int type_h, u_int32_t flags,
+                    const struct timeval *budget,
+                    val_async_event_cb callback, void *cb_data,
+                    val_async_status **async_status)
+{
 
     int             retval;
     struct queries_for_query *added_q = NULL;
-    val_async_status         *as;
+    val_async_status         *as, *primary;
     val_context_t            *context;
     int data_received = 0;
     int data_missing = 1, more_data;
@@ -6887,6 +7149,8 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
         type_h > ns_t_max || class_h > ns_c_max) {
         return VAL_BAD_ARGUMENT;
     }
+    if (budget && (budget->tv_sec < 0 || budget->tv_usec < 0))
+        return VAL_BAD_ARGUMENT;
 
     if ((retval = ns_name_pton(domain_name, domain_name_n,
                                NS_MAXCDNAME)) == -1) {
@@ -6915,6 +7179,10 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
     as->val_as_cb_user_ctx = cb_data;
     as->val_as_class = (u_int16_t) class_h;
     as->val_as_type = (u_int16_t) type_h;
+    if (budget) {
+        gettimeofday(&as->val_as_deadline, NULL);
+        timeradd(&as->val_as_deadline, budget, &as->val_as_deadline);
+    }
 
     /*
      * get context, if needed
@@ -6926,18 +7194,51 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
     }
 
     as->val_as_ctx = context;
+    if (context->as_cq_on)
+        as->val_as_flags |= VAL_AS_COMPLETION_QUEUE;
 
     tflags = VAL_QFLAGS_USERMASK & (flags | VAL_QUERY_ASYNC | 
                 context->def_cflags | context->def_uflags);
 
     CTX_LOCK_ACACHE(context);
 
-    retval = add_to_qfq_chain(context, &as->val_as_queries,
-                              domain_name_n, as->val_as_type,
-                              as->val_as_class,
-                              tflags,
-                              &added_q);
-    if (VAL_NO_ERROR == retval) {
+    /*
+     * sockets for async queries are registered with the context poller
+     * as they are opened. If we can't get one, fd_set based waiting
+     * still works.
+     */
+    if (NULL == context->as_poller) {
+        context->as_poller = res_poller_create(RES_POLLER_DEFAULT);
+        if (NULL == context->as_poller)
+            val_log(context, LOG_INFO, "val_async_submit(): no poller");
+    }
+    /*
+     * likewise their deadlines are kept in the context deadline queue,
+     * so the next event doesn't require walking every query.
+     */
+    if (NULL == context->as_timers) {
+        context->as_timers = res_timers_create();
+        if (NULL == context->as_timers)
+            val_log(context, LOG_INFO, "val_async_submit(): no timers");
+    }
+
+    /* if the same request is already in flight, wait for its results */
+    as->val_as_qflags = tflags;
+    primary = _async_find_primary(context, as);
+    if (NULL != primary) {
+        val_log(context, LOG_DEBUG, "as %p waiting on as %p", as, primary);
+        as->val_as_primary = primary;
+        as->val_as_next_waiter = primary->val_as_waiters;
+        primary->val_as_waiters = as;
+        as->val_as_flags |= VAL_AS_INFLIGHT;
+        retval = VAL_NO_ERROR;
+    } else
+        retval = add_to_qfq_chain(context, &as->val_as_queries,
+                                  domain_name_n, as->val_as_type,
+                                  as->val_as_class,
+                                  tflags,
+                                  &added_q);
+    if ((VAL_NO_ERROR == retval) && (NULL == primary)) {
         as->val_as_top_q = added_q;
 
         /*
@@ -6981,7 +7282,7 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
     /*
      * Send un-sent queries
      */
-    if ((VAL_NO_ERROR == retval) &&
+    if ((VAL_NO_ERROR == retval) && (NULL == primary) &&
         (added_q->qfq_query->qc_state == Q_INIT)) {
 
         retval = _resolver_submit_one(context, &as->val_as_queries,
@@ -7014,16 +7315,55 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
                 LOG_DEBUG, "adding %s to context as_list", as->val_as_name);
         as->val_as_next = context->as_list;
         context->as_list = as;
+        /* its queries may be ones others are waiting on */
+        ++context->as_gen;
     }
 
     CTX_UNLOCK_ACACHE(context);
 
+    _async_loop_update(context);
+
     *async_status = as;
 
     return retval;
 }
 
 
+/*
+ * a request which was only waiting for answers when last checked needs
+ * no work until one of its sockets has data or a deadline comes up
+ * (or answers arrive for another request, see as_gen). If so, count its
+ * pending queries.
+ */
+static int
+_async_still_waiting(val_async_status *as, int *remaining)
+{
+    val_context_t            *context = as->val_as_ctx;
+    struct queries_for_query *qfq;
+    struct timeval            now, next;
+    int                       pending = 0;
+
+    if ((NULL == context->as_timers) || (as->val_as_gen != context->as_gen))
+        return 0;
+
+    if (0 == res_timers_next(context->as_timers, &next)) {
+        gettimeofday(&now, NULL);
+        if (!timercmp(&next, &now, >))
+            return 0;
+    }
+
+    for (qfq = as->val_as_queries; qfq; qfq = qfq->qfq_next) {
+        if (NULL == qfq->qfq_query->qc_ea)
+            continue;
+        if (res_async_ea_isset(qfq->qfq_query->qc_ea, NULL))
+            return 0;
+        ++pending;
+    }
+
+    *remaining += pending ? pending : 1;
+    return 1;
+}
+
 /*
  * Look inside the cache, ask the resolver for missing data.
  * Then try and validate what ever is possible.
@@ -7034,15 +7374,15 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
 {
     struct queries_for_query   *qfq, *initial_q;
     val_context_t              *context;
-    struct timeval             closest_event, now;
+    struct timeval             closest_event, now, next;
     int retval, data_received, data_missing, done, checked = 0, as_remain;
+    int idle, changed = 0;
     struct expected_arrival   *ea;
 #ifndef VAL_NO_THREADS
     pthread_t                   self = pthread_self();
 #endif
 
-    if ((NULL == as) || (as->val_as_ctx == NULL) ||
-        (pending_desc == NULL) || (NULL == nfds) || (NULL == remaining))
+    if ((NULL == as) || (as->val_as_ctx == NULL) || (NULL == remaining))
         return VAL_BAD_ARGUMENT;
 
     context = as->val_as_ctx;
@@ -7059,6 +7399,27 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
             as->val_as_tid, remaining ? *remaining : 0);
 #endif
 
+    if (timerisset(&as->val_as_deadline)) {
+        gettimeofday(&now, NULL);
+        if (!timercmp(&as->val_as_deadline, &now, >)) {
+            retval = _query_deadline_expired(context, as->val_as_top_q,
+                                             as->val_as_queries,
+                                             &as->val_as_results);
+            if (VAL_NO_ERROR == retval) {
+                as->val_as_flags |= VAL_AS_DONE;
+                free_qfq_chain(context, as->val_as_queries);
+                as->val_as_queries = NULL;
+            }
+            return retval;
+        }
+    }
+
+    /* with the poller, sockets without data can be told apart cheaply */
+    if ((NULL == pending_desc) && _async_still_waiting(as, remaining)) {
+        val_log(context, LOG_DEBUG+1, "as %p still waiting", as);
+        return VAL_NO_ERROR;
+    }
+
     do { 
     done = 0;
     initial_q = qfq = as->val_as_queries;
@@ -7082,6 +7443,13 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
      */
     timerclear(&closest_event);
     gettimeofday(&now, NULL);
+    /*
+     * if no retransmit or cancel deadline has come up for any query in
+     * the context, only those with data waiting need to be looked at.
+     */
+    idle = (NULL != context->as_timers) &&
+        ((res_timers_next(context->as_timers, &next) < 0) ||
+         timercmp(&next, &now, >));
     for (; qfq; qfq = qfq->qfq_next) {
         int qfq_remain = 0;
 
@@ -7098,6 +7466,10 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
             retval = _resolver_rcv_one(as->val_as_ctx, &as->val_as_queries, qfq,
                                        pending_desc, &closest_event,
                                        &data_received);
+        else if (idle) {
+            retval = VAL_NO_ERROR;
+            qfq_remain = 1;
+        }
         else
             retval = res_io_check_ea_list(qfq->qfq_query->qc_ea, &closest_event,
                                           &now, NULL, &qfq_remain);
@@ -7140,6 +7512,8 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
         (retval = fix_glue(context, &as->val_as_queries, &data_missing)))
         goto done;
 
+    if (data_received)
+        changed = 1;
     if (data_received || !data_missing) {
         struct val_internal_result *w_results = NULL;
 
@@ -7149,6 +7523,7 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
                                                 &done);
         if (done) {
             as->val_as_flags |= VAL_AS_DONE;
+            changed = 1;
             val_log(context, LOG_DEBUG, "as %p _async_check_one/DONE", as);
         } else {
             val_free_result_chain(as->val_as_results);
@@ -7176,6 +7551,15 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
         as->val_as_queries = NULL;
     }
 
+    /*
+     * new answers may complete queries other requests share, so they
+     * all need another look. Otherwise this one is just waiting.
+     */
+    if (changed)
+        ++context->as_gen;
+    else if (VAL_NO_ERROR == retval)
+        as->val_as_gen = context->as_gen;
+
   done:
     if (remaining)
         *remaining += as_remain ? as_remain : checked;
@@ -7185,6 +7569,84 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
     return retval;
 }
 
+/*
+ * a request waiting on another gives up if its own deadline passes
+ * first, with the status the other has reached.
+ */
+static int
+_async_waiter_expired(val_async_status *as)
+{
+    struct timeval now;
+
+    if (!timerisset(&as->val_as_deadline))
+        return 0;
+    gettimeofday(&now, NULL);
+    if (timercmp(&as->val_as_deadline, &now, >))
+        return 0;
+
+    if (VAL_NO_ERROR !=
+        _query_deadline_expired(as->val_as_ctx,
+                                as->val_as_primary->val_as_top_q, NULL,
+                                &as->val_as_results))
+        return 0;
+    _async_detach_waiter(as);
+    as->val_as_flags |= VAL_AS_DONE;
+    return 1;
+}
+
+/*
+ * check all async requests for this thread (or all threads, if the
+ * context is so configured) and handle any that completed.
+ * pending_desc may be NULL, in which case the context poller state
+ * determines which sockets have data.
+ *
+ * returns the number of requests still pending.
+ */
+static int
+_async_check_all(val_context_t *context, fd_set *pending_desc, int *nfds,
+                 u_int32_t flags)
+{
+#ifndef VAL_NO_THREADS
+    pthread_t                   self = pthread_self();
+#endif
+    val_async_status           *as;
+    int                         count = 0, completed = 0;
+
+    CTX_LOCK_ACACHE(context);
+
+    for (as = context->as_list; as; as = as->val_as_next) {
+
+#ifndef VAL_NO_THREADS
+        if (! (as->val_as_ctx->ctx_flags & CTX_PROCESS_ALL_THREADS) &&
+            (! pthread_equal(self, as->val_as_tid)))
+            continue;
+#endif
+
+        if (as->val_as_flags & VAL_AS_DONE)
+            ++completed;
+        else if (as->val_as_primary) {
+            /* completed along with the request it waits on */
+            if (_async_waiter_expired(as))
+                ++completed;
+            else
+                ++count;
+        }
+        else {
+            /* ignore errors, keep trying other requests */
+            _async_check_one(as, pending_desc, nfds, &count, flags);
+            if (as->val_as_flags & VAL_AS_DONE)
+                completed += 1 + _async_complete_waiters(as);
+        }
+    }
+
+    CTX_UNLOCK_ACACHE(context);
+
+    if (completed)
+        _handle_completed(context);
+
+    return count;
+}
+
 /*
  * Function: val_async_select
  *
@@ -7266,11 +7728,6 @@ int
 val_async_check_wait(val_context_t *ctx, fd_set *pending_desc,
                      int *nfds, struct timeval *tv, u_int32_t flags)
 {
-#ifndef VAL_NO_THREADS
-    pthread_t                   self = pthread_self();
-#endif
-    val_async_status           *as;
-    int                         count = 0, completed = 0;
     val_context_t *context;
     int retval = VAL_NO_ERROR;
     fd_set local_fdset;
@@ -7331,38 +7788,274 @@ val_async_check_wait(val_context_t *ctx, fd_set *pending_desc,
          */
     }
 
+    retval = _async_check_all(context, pending_desc, nfds, flags);
+
+done:
+    CTX_UNLOCK_POL(context);
+    return retval;
+}
+
+/*
+ * Function: val_async_check_poll
+ *
+ * Purpose:
+ * fd_set free version of val_async_check_wait. Wait for responses to
+ * pending async requests using the context poller, then look inside the
+ * cache, ask the resolver for missing data and try and validate what
+ * ever is possible.
+ *
+ * Note that this can result in callbacks being called.
+ *
+ * Parameters: context  -- context for pending async requests
+ *             timeout -- maximum time application wants to wait for data.
+ *                        May be NULL, in which case the wait ends at the
+ *                        closest event for pending async requests.
+ *                        A zero timeout can be used after an application
+ *                        event loop has seen the descriptor returned by
+ *                        val_async_poll_info become readable.
+ *             flags -- flags affecting operation of this function.
+ *                      None defined yet.
+ *
+ * Returns:  < 0  : VAL_* error
+ *             0  : no pending requests found
+ *           > 0  : number of requests still pending
+ */
+int
+val_async_check_poll(val_context_t *ctx, struct timeval *timeout,
+                     u_int32_t flags)
+{
+    val_context_t *context;
+    struct timeval wait;
+    int            retval = VAL_NO_ERROR;
+
+    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
+    if (NULL == context)
+        return VAL_INTERNAL_ERROR;
+
+    if (NULL == context->as_list)
+        goto done;
+
+    /** handle any completed requests */
+    _handle_completed(context);
+
+    if (NULL == context->as_list)
+        goto done;
+
+    /** no poller, fall back to select */
+    if (NULL == context->as_poller) {
+        CTX_UNLOCK_POL(context);
+        return val_async_check_wait(ctx, NULL, NULL, timeout, flags);
+    }
+
+    if (timeout)
+        memcpy(&wait, timeout, sizeof(wait));
+    else {
+        wait.tv_sec = LONG_MAX;
+        wait.tv_usec = 0;
+    }
+    retval = val_async_select_info(context, NULL, NULL, &wait);
+    if (VAL_NO_ERROR != retval)
+        goto done;
+
+    val_log(context, LOG_DEBUG,
+            "val_async_check_poll: %s waiting for %ld.%ld seconds",
+            res_poller_backend_name(context->as_poller),
+            wait.tv_sec, wait.tv_usec);
+    if (res_poller_wait(context->as_poller, &wait, NULL, 0) < 0) {
+        retval = VAL_INTERNAL_ERROR;
+        goto done;
+    }
+    /*
+     * even if nothing waiting, keep going. queries might be
+     * completed or waiting to be sent.
+     */
+
+    retval = _async_check_all(context, NULL, NULL, flags);
+
+done:
+    CTX_UNLOCK_POL(context);
+    return retval;
+}
+
+/*
+ * Event loop interface
+ *
+ * The context poller tells us when sockets are registered and
+ * deregistered, and we pass that on to the application, which watches
+ * them and calls val_async_process_fd when one is readable. The next
+ * deadline is passed on after each call into the async API, if it has
+ * changed, and the application calls val_async_process_timer when it
+ * comes up.
+ */
+static void
+_async_loop_watch(SOCKET fd, int on, void *data)
+{
+    val_context_t *context = (val_context_t *) data;
+    val_async_event_loop_t loop;
+
+    /*
+     * the poller calls us unlocked, so the loop may be changing under
+     * us; work from a copy
+     */
+    memcpy(&loop, &context->as_loop, sizeof(loop));
+    if (on && loop.val_el_watch)
+        (*loop.val_el_watch)(context, fd, loop.val_el_data);
+    else if (!on && loop.val_el_unwatch)
+        (*loop.val_el_unwatch)(context, fd, loop.val_el_data);
+}
+
+/*
+ * tell the application loop when to wake us next, if that has changed.
+ * caller must not have the acache lock.
+ */
+static void
+_async_loop_update(val_context_t *context)
+{
+    struct timeval  now, when, timeout, *tp = NULL;
+
+    if (NULL == context || NULL == context->as_loop.val_el_timer)
+        return;
+
+    timeout.tv_sec = LONG_MAX;
+    timeout.tv_usec = 0;
+    if ((NULL != context->as_list) &&
+        (VAL_NO_ERROR ==
+         val_async_select_info(context, NULL, NULL, &timeout)) &&
+        (timeout.tv_sec < (LONG_MAX / 2)))
+        tp = &timeout;
+
+    gettimeofday(&now, NULL);
+    if (tp)
+        timeradd(&now, tp, &when);
+    else
+        timerclear(&when);
+
     CTX_LOCK_ACACHE(context);
+    if ((when.tv_sec == context->as_loop_next.tv_sec) &&
+        (when.tv_usec == context->as_loop_next.tv_usec)) {
+        CTX_UNLOCK_ACACHE(context);
+        return;
+    }
+    context->as_loop_next = when;
+    CTX_UNLOCK_ACACHE(context);
 
-    for (as = context->as_list; as; as = as->val_as_next) {
+    val_log(context, LOG_DEBUG, "async loop: next event in %ld.%06ld",
+            tp ? tp->tv_sec : -1L, tp ? tp->tv_usec : 0L);
+    (*context->as_loop.val_el_timer)(context, tp, context->as_loop.val_el_data);
+}
 
-#ifndef VAL_NO_THREADS
-        if (! (as->val_as_ctx->ctx_flags & CTX_PROCESS_ALL_THREADS) &&
-            (! pthread_equal(self, as->val_as_tid)))
-            continue;
-#endif
+/*
+ * Function: val_async_set_event_loop
+ *
+ * Purpose: have the application event loop watch the sockets and
+ *          deadlines of async requests, instead of waiting with
+ *          val_async_check_wait or val_async_check_poll.
+ *
+ * Parameters: context -- context for async requests
+ *             loop -- callbacks and data for the event loop, or NULL to
+ *                     stop using it. The callbacks are called with the
+ *                     context locked, so must not call back into libval.
+ *
+ * Returns: VAL_NO_ERROR, or VAL_RESOURCE_UNAVAILABLE if the context has
+ *          no poller.
+ */
+int
+val_async_set_event_loop(val_context_t *ctx, val_async_event_loop_t *loop)
+{
+    val_context_t *context;
+    int            retval = VAL_NO_ERROR;
 
-        if (as->val_as_flags & VAL_AS_DONE)
-            ++completed;
-        else {
-            /* ignore errors, keep trying other requests */
-            _async_check_one(as, pending_desc, nfds, &count, flags);
-            if (as->val_as_flags & VAL_AS_DONE)
-                ++completed;
-        }
+    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
+    if (NULL == context)
+        return VAL_INTERNAL_ERROR;
+
+    CTX_LOCK_ACACHE(context);
+
+    if (NULL == context->as_poller)
+        context->as_poller = res_poller_create(RES_POLLER_DEFAULT);
+    if (NULL == context->as_poller) {
+        retval = VAL_RESOURCE_UNAVAILABLE;
+    } else {
+        res_poller_set_watch(context->as_poller, NULL, NULL);
+        if (loop)
+            memcpy(&context->as_loop, loop, sizeof(context->as_loop));
+        else
+            memset(&context->as_loop, 0, sizeof(context->as_loop));
+        timerclear(&context->as_loop_next);
+        if (loop)
+            res_poller_set_watch(context->as_poller, _async_loop_watch,
+                                 context);
     }
 
     CTX_UNLOCK_ACACHE(context);
 
-    if (completed)
+    if (VAL_NO_ERROR == retval)
+        _async_loop_update(context);
+
+    CTX_UNLOCK_POL(context);
+    return retval;
+}
+
+static int
+_async_process(val_context_t *ctx, int fd, u_int32_t flags)
+{
+    val_context_t *context;
+    int            retval = VAL_NO_ERROR;
+
+    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
+    if (NULL == context)
+        return VAL_INTERNAL_ERROR;
+
+    if ((fd >= 0) && (NULL != context->as_poller))
+        res_poller_set_ready(context->as_poller, fd);
+
+    if (NULL != context->as_list) {
         _handle_completed(context);
+        if (NULL != context->as_list)
+            retval = _async_check_all(context, NULL, NULL, flags);
+    }
 
-    retval = count;
+    _async_loop_update(context);
 
-done:
     CTX_UNLOCK_POL(context);
     return retval;
 }
 
+/*
+ * Function: val_async_process_fd
+ *
+ * Purpose: process the responses waiting on a socket the application
+ *          event loop has found readable, and anything else now due.
+ *
+ * Note that this can result in callbacks being called.
+ *
+ * Returns:  < 0  : VAL_* error
+ *             0  : no pending requests found
+ *           > 0  : number of requests still pending
+ */
+int
+val_async_process_fd(val_context_t *context, int fd, unsigned int flags)
+{
+    if (fd < 0)
+        return VAL_BAD_ARGUMENT;
+
+    return _async_process(context, fd, flags);
+}
+
+/*
+ * Function: val_async_process_timer
+ *
+ * Purpose: handle retries and timeouts when the wakeup asked of the
+ *          application event loop comes up.
+ *
+ * Returns: as for val_async_process_fd
+ */
+int
+val_async_process_timer(val_context_t *context, unsigned int flags)
+{
+    return _async_process(context, -1, flags);
+}
+
 /** for backwards compatibility. see val_async_check_wait */
 int
 val_async_check(val_context_t *context, fd_set *pending_desc,
@@ -7392,6 +8085,10 @@ _async_cancel_one(val_context_t *context, val_async_status *as, u_int flags)
 
     val_log(context, LOG_DEBUG, "as %p cancelled", as);
 
+    /* requests waiting on this one carry on without it */
+    _async_detach_waiter(as);
+    _async_promote_waiter(as);
+
     if (! (flags & VAL_AS_CANCEL_CTX_REMOVED))
         _context_as_remove(context, as);
 
@@ -7423,6 +8120,8 @@ val_async_cancel(val_context_t *context, val_async_status *as, unsigned int flag
 
     CTX_UNLOCK_ACACHE(context);
 
+    _async_loop_update(context);
+
     return VAL_NO_ERROR;
 }
 
@@ -7455,6 +8154,8 @@ val_async_cancel_all(val_context_t *context, unsigned int flags)
 
     CTX_UNLOCK_ACACHE(context);
 
+    _async_loop_update(context);
+
     return VAL_NO_ERROR;
 }
 
@@ -7474,4 +8175,128 @@ val_async_getflags(val_async_status *as)
     return as->val_as_flags;
 }
 
+/*
+ * Function: val_async_set_completion_queue
+ *
+ * Purpose: have requests submitted to the context from now on put on its
+ *          completion queue when done, instead of calling their
+ *          callbacks. They are then collected with val_async_dequeue,
+ *          possibly by other threads. Cancelled requests still get
+ *          cancel callbacks.
+ *
+ * Parameters: context -- context for async requests
+ *             on -- non-zero to queue completed requests, 0 to go back
+ *                   to callbacks
+ */
+int
+val_async_set_completion_queue(val_context_t *ctx, int on)
+{
+    val_context_t *context;
+
+    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
+    if (NULL == context)
+        return VAL_INTERNAL_ERROR;
+
+    CTX_LOCK_ACACHE(context);
+    context->as_cq_on = on ? 1 : 0;
+    CTX_UNLOCK_ACACHE(context);
+
+    CTX_UNLOCK_POL(context);
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Function: val_async_dequeue
+ *
+ * Purpose: take completed requests off the completion queue (see
+ *          val_async_set_completion_queue), oldest first. Does not
+ *          wait. May be called from any thread, including while another
+ *          is processing responses.
+ *
+ * Parameters: context -- context the requests were submitted to
+ *             batch -- array for the completed requests
+ *             max -- size of batch
+ *
+ * Returns: number of requests placed in batch, or VAL_BAD_ARGUMENT.
+ *          Each must be released with val_async_release.
+ */
+int
+val_async_dequeue(val_context_t *context, val_async_status **batch, int max)
+{
+    val_async_status *taken, *as, *rev;
+    int               count = 0;
+
+    if ((NULL == context) || (NULL == batch) || (max <= 0))
+        return VAL_BAD_ARGUMENT;
+
+#ifndef VAL_NO_THREADS
+    pthread_mutex_lock(&context->as_cq_lock);
+#endif
+
+    if ((NULL == context->as_cq_ready) && (NULL != context->as_cq)) {
+        /* take everything queued so far, and put it in arrival order */
+        do {
+            taken = context->as_cq;
+        } while (!VAL_CQ_CAS(&context->as_cq, taken, NULL));
+        for (rev = NULL; taken; taken = as) {
+            as = taken->val_as_next;
+            taken->val_as_next = rev;
+            rev = taken;
+        }
+        context->as_cq_ready = rev;
+    }
+
+    while ((count < max) && (NULL != (as = context->as_cq_ready))) {
+        context->as_cq_ready = as->val_as_next;
+        as->val_as_next = NULL;
+        batch[count++] = as;
+    }
+
+#ifndef VAL_NO_THREADS
+    pthread_mutex_unlock(&context->as_cq_lock);
+#endif
+
+    return count;
+}
+
+/*
+ * Function: val_async_get_params
+ *
+ * Purpose: get the results of a dequeued request, as they would have
+ *          been passed to a completion callback. They still belong to
+ *          the request, and are freed by val_async_release.
+ */
+int
+val_async_get_params(val_async_status *as, val_cb_params_t *cbp)
+{
+    if ((NULL == as) || (NULL == cbp) || !(as->val_as_flags & VAL_AS_QUEUED))
+        return VAL_BAD_ARGUMENT;
+
+    memset(cbp, 0, sizeof(*cbp));
+    cbp->val_status = as->val_as_retval;
+    cbp->name = as->val_as_name;
+    cbp->class_h = as->val_as_class;
+    cbp->type_h = as->val_as_type;
+    cbp->retval = as->val_as_retval;
+    cbp->results = as->val_as_results;
+    cbp->answers = as->val_as_answers;
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Function: val_async_release
+ *
+ * Purpose: free a request taken from the completion queue, and its
+ *          results.
+ */
+int
+val_async_release(val_async_status *as)
+{
+    if ((NULL == as) || !(as->val_as_flags & VAL_AS_QUEUED))
+        return VAL_BAD_ARGUMENT;
+
+    return _async_status_free(&as); /* no ctx, so no lock needed */
+}
+
 #endif /* VAL_NO_ASYNC */
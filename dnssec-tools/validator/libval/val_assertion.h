@@ -33,6 +33,13 @@ void            free_authentication_chain(struct val_digested_auth_chain
 void            free_query_chain_structure(struct val_query_chain *queries);
 int             get_zse(val_context_t * ctx, u_char * name_n, 
                         u_int32_t flags, u_int16_t *status, u_char ** match_ptr, u_int32_t *ttl_x);
+#ifdef LIBVAL_NSEC3
+u_char         *compute_nsec3_hash(val_context_t * ctx, u_char * qname_n,
+                                   u_char * soa_name_n, u_char alg,
+                                   u_int16_t iter, u_char saltlen,
+                                   u_char * salt, size_t * b32_hashlen,
+                                   u_char ** b32_hash, u_int32_t *ttl_x);
+#endif
 int             find_trust_point(val_context_t * ctx, u_char * zone_n, 
                                  u_char ** matched_zone, u_int32_t *ttl_x);
 #ifdef LIBVAL_DLV
@@ -0,0 +1,730 @@
+/*
+ * Copyright 2005-2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+
+/*
+ * DESCRIPTION
+ * Multi-threaded async engine. The engine owns a pool of worker
+ * threads, each with its own context (so its own in flight requests,
+ * sockets, poller and deadlines) but sharing the rrset cache. Requests
+ * submitted to the engine are spread over the workers' inboxes, and a
+ * worker with nothing left in its inbox steals half of the busiest one,
+ * so answers already in the cache (which are validated as soon as a
+ * request is started) don't queue up behind a single busy worker.
+ * Workers take jobs off their inbox one at a time, so jobs a busy
+ * worker has yet to start can still be stolen. Workers with nothing to
+ * do sleep on the engine condition variable, which is signalled
+ * whenever a job is queued.
+ *
+ * Completed requests either have their callbacks called on the worker
+ * thread, or with VAL_ENGINE_COMPLETION_QUEUE are queued on the worker
+ * contexts for val_async_engine_dequeue.
+ */
+#include "validator-internal.h"
+#include "val_context.h"
+
+#ifndef VAL_NO_ASYNC
+#ifndef VAL_NO_THREADS
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+/* requests a worker starts before it looks at its responses again */
+#define ENGINE_BATCH        32
+/*
+ * longest a worker waits for responses without checking its inbox
+ * (there's no wake pipe on windows to cut it short)
+ */
+#ifndef WIN32
+#define ENGINE_BUSY_WAIT_MS 100
+#else
+#define ENGINE_BUSY_WAIT_MS 20
+#endif
+
+/* next worker, round robin */
+#ifdef WIN32
+#define ENGINE_NEXT(e)                                                  \
+    ((unsigned int) InterlockedIncrement((volatile LONG *) &(e)->ve_next))
+#else
+#define ENGINE_NEXT(e)  __sync_fetch_and_add(&(e)->ve_next, 1)
+#endif
+
+struct engine_job {
+    char                *ej_name;
+    int                  ej_class;
+    int                  ej_type;
+    unsigned int         ej_flags;
+    val_async_event_cb   ej_cb;
+    void                *ej_cb_data;
+    struct timeval       ej_deadline;   /* unset for no deadline */
+    struct engine_job   *ej_next;
+};
+
+struct engine_worker {
+    struct val_async_engine_s *ew_engine;
+    int                  ew_index;
+    val_context_t       *ew_ctx;
+    pthread_t            ew_thread;
+    int                  ew_started;
+
+    /* inbox, oldest first */
+    pthread_mutex_t      ew_lock;
+    struct engine_job   *ew_head;
+    struct engine_job   *ew_tail;
+    int                  ew_queued;
+    int                  ew_idle;   /* waiting on ve_cond */
+    int                  ew_woken;  /* wake byte not yet read */
+
+    /* registered with the context poller, to interrupt a wait */
+    int                  ew_wake[2];
+};
+
+struct val_async_engine_s {
+    unsigned int          ve_flags;
+    int                   ve_count;
+    struct engine_worker *ve_workers;
+    volatile int          ve_stop;
+    unsigned int          ve_next;   /* round robin submit/dequeue */
+
+    /* idle workers wait on ve_cond for ve_work to change */
+    pthread_mutex_t       ve_lock;
+    pthread_cond_t        ve_cond;
+    unsigned int          ve_work;   /* bumped when jobs are queued */
+    int                   ve_idle;   /* workers waiting */
+    int                   ve_locks;  /* ve_lock and ve_cond set up */
+};
+
+static void
+_job_free(struct engine_job *job)
+{
+    if (job->ej_name)
+        FREE(job->ej_name);
+    FREE(job);
+}
+
+/*
+ * tell the caller a request could not be started (or never was), as
+ * for a cancelled request: event VAL_AS_EVENT_CANCELED, with the error
+ * in both retval and val_status, and no results or answers.
+ */
+static void
+_job_fail(val_context_t *context, struct engine_job *job, int retval)
+{
+    val_cb_params_t cbp;
+
+    if ((NULL == job->ej_cb) ||
+        (job->ej_flags & VAL_AS_NO_CANCEL_CALLBACKS))
+        return;
+
+    memset(&cbp, 0, sizeof(cbp));
+    cbp.val_status = retval;
+    cbp.name = job->ej_name;
+    cbp.class_h = job->ej_class;
+    cbp.type_h = job->ej_type;
+    cbp.retval = retval;
+    (*job->ej_cb)(NULL, VAL_AS_EVENT_CANCELED, context, job->ej_cb_data,
+                  &cbp);
+    /* the callback may have taken the name, as for other callbacks */
+    job->ej_name = cbp.name;
+}
+
+/*
+ * interrupt a busy worker's wait for responses, for new jobs (or to
+ * stop). Idle workers are woken through ve_cond. caller has ew_lock.
+ */
+static void
+_worker_wake(struct engine_worker *w)
+{
+#ifndef WIN32
+    if (!w->ew_idle && !w->ew_woken && (w->ew_wake[1] >= 0)) {
+        char c = 0;
+        if (1 == write(w->ew_wake[1], &c, 1))
+            w->ew_woken = 1;
+    }
+#endif
+}
+
+/*
+ * tell the idle workers there is work (or that the engine is stopping)
+ */
+static void
+_engine_signal(struct val_async_engine_s *engine, int all)
+{
+    pthread_mutex_lock(&engine->ve_lock);
+    ++engine->ve_work;
+    if (all)
+        pthread_cond_broadcast(&engine->ve_cond);
+    else if (engine->ve_idle)
+        pthread_cond_signal(&engine->ve_cond);
+    pthread_mutex_unlock(&engine->ve_lock);
+}
+
+/*
+ * append a list of n jobs to a worker's inbox. caller has ew_lock.
+ */
+static void
+_inbox_put(struct engine_worker *w, struct engine_job *first, int n)
+{
+    struct engine_job *last;
+
+    for (last = first; last->ej_next; last = last->ej_next)
+        ;
+    if (w->ew_tail)
+        w->ew_tail->ej_next = first;
+    else
+        w->ew_head = first;
+    w->ew_tail = last;
+    w->ew_queued += n;
+}
+
+/*
+ * take up to max jobs off the front of a worker's inbox. caller has
+ * ew_lock.
+ */
+static struct engine_job *
+_inbox_take(struct engine_worker *w, int max, int *count)
+{
+    struct engine_job *first, *last;
+    int                n;
+
+    if (NULL == w->ew_head)
+        return NULL;
+
+    first = last = w->ew_head;
+    for (n = 1; (n < max) && last->ej_next; ++n)
+        last = last->ej_next;
+
+    w->ew_head = last->ej_next;
+    if (NULL == w->ew_head)
+        w->ew_tail = NULL;
+    w->ew_queued -= n;
+    last->ej_next = NULL;
+    if (count)
+        *count = n;
+
+    return first;
+}
+
+/*
+ * get the next job for w: the oldest in its own inbox, or else the
+ * oldest of half the jobs waiting for the busiest other worker, whether
+ * or not that worker is idle. The rest of the stolen jobs go in w's
+ * inbox, where they can be stolen in turn.
+ */
+static struct engine_job *
+_worker_job(struct engine_worker *w)
+{
+    struct val_async_engine_s *engine = w->ew_engine;
+    struct engine_worker *victim = NULL;
+    struct engine_job    *job;
+    int                   i, n, most = 0;
+
+    pthread_mutex_lock(&w->ew_lock);
+    job = _inbox_take(w, 1, NULL);
+    pthread_mutex_unlock(&w->ew_lock);
+    if (job)
+        return job;
+
+    /* counts are read unlocked; a stale one just means a wasted look */
+    for (i = 0; i < engine->ve_count; ++i) {
+        if ((&engine->ve_workers[i] != w) &&
+            (engine->ve_workers[i].ew_queued > most)) {
+            victim = &engine->ve_workers[i];
+            most = victim->ew_queued;
+        }
+    }
+    if (NULL == victim)
+        return NULL;
+
+    pthread_mutex_lock(&victim->ew_lock);
+    job = _inbox_take(victim, (victim->ew_queued + 1) / 2, &n);
+    pthread_mutex_unlock(&victim->ew_lock);
+    if (NULL == job)
+        return NULL;
+
+    val_log(w->ew_ctx, LOG_DEBUG, "engine worker %d stole %d from %d",
+            w->ew_index, n, victim->ew_index);
+    if (job->ej_next) {
+        pthread_mutex_lock(&w->ew_lock);
+        _inbox_put(w, job->ej_next, n - 1);
+        pthread_mutex_unlock(&w->ew_lock);
+        job->ej_next = NULL;
+    }
+    return job;
+}
+
+/*
+ * sleep until jobs are queued anywhere, or the engine stops. work is
+ * the value of ve_work from before the last look for jobs, so jobs
+ * queued since then aren't missed.
+ */
+static void
+_worker_idle(struct engine_worker *w, unsigned int work)
+{
+    struct val_async_engine_s *engine = w->ew_engine;
+
+    pthread_mutex_lock(&w->ew_lock);
+    w->ew_idle = 1;
+    pthread_mutex_unlock(&w->ew_lock);
+
+    pthread_mutex_lock(&engine->ve_lock);
+    ++engine->ve_idle;
+    while ((work == engine->ve_work) && !engine->ve_stop)
+        pthread_cond_wait(&engine->ve_cond, &engine->ve_lock);
+    --engine->ve_idle;
+    pthread_mutex_unlock(&engine->ve_lock);
+
+    pthread_mutex_lock(&w->ew_lock);
+    w->ew_idle = 0;
+    pthread_mutex_unlock(&w->ew_lock);
+}
+
+static void
+_worker_drain_wake(struct engine_worker *w)
+{
+#ifndef WIN32
+    char buf[64];
+
+    if (w->ew_wake[0] < 0)
+        return;
+
+    pthread_mutex_lock(&w->ew_lock);
+    while (read(w->ew_wake[0], buf, sizeof(buf)) > 0)
+        ;
+    w->ew_woken = 0;
+    pthread_mutex_unlock(&w->ew_lock);
+
+    CTX_LOCK_ACACHE(w->ew_ctx);
+    res_poller_clear(w->ew_ctx->as_poller, w->ew_wake[0]);
+    CTX_UNLOCK_ACACHE(w->ew_ctx);
+#endif
+}
+
+static void *
+_worker_main(void *arg)
+{
+    struct engine_worker      *w = (struct engine_worker *) arg;
+    struct val_async_engine_s *engine = w->ew_engine;
+    struct engine_job         *jobs, *job;
+    val_async_status          *as;
+    struct timeval             wait, now, left;
+    unsigned int               work;
+    int                        retval, n;
+
+    val_log(w->ew_ctx, LOG_DEBUG, "engine worker %d started", w->ew_index);
+
+    while (!engine->ve_stop) {
+
+        pthread_mutex_lock(&engine->ve_lock);
+        work = engine->ve_work;
+        pthread_mutex_unlock(&engine->ve_lock);
+
+        /*
+         * start new requests. Answers already in the cache are
+         * validated (and completed) right here.
+         */
+        for (n = 0; (n < ENGINE_BATCH) && !engine->ve_stop; ++n) {
+            if (NULL == (job = _worker_job(w)))
+                break;
+            /* time spent in the inbox counts against the budget */
+            if (timerisset(&job->ej_deadline)) {
+                gettimeofday(&now, NULL);
+                if (timercmp(&job->ej_deadline, &now, >))
+                    timersub(&job->ej_deadline, &now, &left);
+                else
+                    timerclear(&left);
+            }
+            retval = val_async_submit_ex(w->ew_ctx, job->ej_name,
+                                         job->ej_class, job->ej_type,
+                                         job->ej_flags,
+                                         timerisset(&job->ej_deadline) ?
+                                         &left : NULL,
+                                         job->ej_cb, job->ej_cb_data, &as);
+            if (VAL_NO_ERROR != retval)
+                _job_fail(w->ew_ctx, job, retval);
+            _job_free(job);
+        }
+        if (engine->ve_stop)
+            break;
+
+        if (NULL == w->ew_ctx->as_list) {
+            /* nothing in flight; sleep until jobs arrive */
+            if (n < ENGINE_BATCH)
+                _worker_idle(w, work);
+            continue;
+        }
+
+        /*
+         * don't wait if more jobs are queued; otherwise new jobs
+         * interrupt the wait through the wake pipe
+         */
+        wait.tv_sec = 0;
+        if (w->ew_queued)
+            wait.tv_usec = 0;
+        else
+            wait.tv_usec = ENGINE_BUSY_WAIT_MS * 1000;
+        val_async_check_poll(w->ew_ctx, &wait, 0);
+        _worker_drain_wake(w);
+    }
+
+    /* jobs never started */
+    pthread_mutex_lock(&w->ew_lock);
+    jobs = _inbox_take(w, INT_MAX, NULL);
+    pthread_mutex_unlock(&w->ew_lock);
+    while (NULL != (job = jobs)) {
+        jobs = job->ej_next;
+        _job_fail(w->ew_ctx, job, VAL_RESOURCE_UNAVAILABLE);
+        _job_free(job);
+    }
+
+    /* requests hold context locks taken by this thread */
+    val_async_cancel_all(w->ew_ctx, 0);
+
+    val_log(w->ew_ctx, LOG_DEBUG, "engine worker %d done", w->ew_index);
+    return NULL;
+}
+
+/*
+ * set up a worker context and its wake pipe
+ */
+static int
+_worker_init(struct val_async_engine_s *engine, struct engine_worker *w,
+             const char *label, val_context_opt_t *opt)
+{
+    int retval;
+
+    /*
+     * each worker needs a context of its own, never the default one:
+     * workers must not share a poller, and each frees its context
+     */
+    retval = val_create_private_context(label, opt, &w->ew_ctx);
+    if (VAL_NO_ERROR != retval) {
+        w->ew_ctx = NULL;
+        return retval;
+    }
+
+    if (engine->ve_flags & VAL_ENGINE_COMPLETION_QUEUE)
+        val_async_set_completion_queue(w->ew_ctx, 1);
+
+    CTX_LOCK_ACACHE(w->ew_ctx);
+    if (NULL == w->ew_ctx->as_poller)
+        w->ew_ctx->as_poller = res_poller_create(RES_POLLER_DEFAULT);
+    if (NULL == w->ew_ctx->as_timers)
+        w->ew_ctx->as_timers = res_timers_create();
+#ifndef WIN32
+    if ((NULL != w->ew_ctx->as_poller) && (0 == pipe(w->ew_wake))) {
+        fcntl(w->ew_wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(w->ew_wake[1], F_SETFL, O_NONBLOCK);
+        if (0 != res_poller_add(w->ew_ctx->as_poller, w->ew_wake[0], NULL)) {
+            close(w->ew_wake[0]);
+            close(w->ew_wake[1]);
+            w->ew_wake[0] = w->ew_wake[1] = -1;
+        }
+    }
+#endif
+    CTX_UNLOCK_ACACHE(w->ew_ctx);
+
+    if (NULL == w->ew_ctx->as_poller)
+        return VAL_RESOURCE_UNAVAILABLE;
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Function: val_async_engine_create
+ *
+ * Purpose: start an async engine with nthreads worker threads, each
+ *          with a private context created from label and opt (as
+ *          for val_create_context_ex; opt may be NULL). label may be
+ *          NULL; the workers still never share the default context.
+ *
+ * Parameters: nthreads -- number of workers, or <= 0 for one per cpu
+ *             flags -- VAL_ENGINE_COMPLETION_QUEUE to queue completed
+ *                      requests for val_async_engine_dequeue instead of
+ *                      calling their callbacks
+ *
+ * Returns: VAL_NO_ERROR, or an error from creating the contexts
+ */
+int
+val_async_engine_create(const char *label, val_context_opt_t *opt,
+                        int nthreads, unsigned int flags,
+                        val_async_engine_t **engine)
+{
+    struct val_async_engine_s *e;
+    int                        i, retval = VAL_NO_ERROR;
+
+    if (NULL == engine)
+        return VAL_BAD_ARGUMENT;
+    *engine = NULL;
+
+    if (nthreads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (nthreads <= 0)
+            nthreads = 1;
+    }
+
+    e = (struct val_async_engine_s *) MALLOC(sizeof(*e));
+    if (NULL == e)
+        return VAL_OUT_OF_MEMORY;
+    memset(e, 0, sizeof(*e));
+    e->ve_flags = flags;
+    if (0 != pthread_mutex_init(&e->ve_lock, NULL)) {
+        FREE(e);
+        return VAL_INTERNAL_ERROR;
+    }
+    if (0 != pthread_cond_init(&e->ve_cond, NULL)) {
+        pthread_mutex_destroy(&e->ve_lock);
+        FREE(e);
+        return VAL_INTERNAL_ERROR;
+    }
+    e->ve_locks = 1;
+
+    e->ve_workers = (struct engine_worker *)
+        MALLOC(nthreads * sizeof(struct engine_worker));
+    if (NULL == e->ve_workers) {
+        val_async_engine_free(e);
+        return VAL_OUT_OF_MEMORY;
+    }
+    memset(e->ve_workers, 0, nthreads * sizeof(struct engine_worker));
+
+    for (i = 0; i < nthreads; ++i) {
+        struct engine_worker *w = &e->ve_workers[i];
+
+        w->ew_engine = e;
+        w->ew_index = i;
+        w->ew_wake[0] = w->ew_wake[1] = -1;
+        if (0 != pthread_mutex_init(&w->ew_lock, NULL)) {
+            retval = VAL_INTERNAL_ERROR;
+            break;
+        }
+        e->ve_count = i + 1;
+        retval = _worker_init(e, w, label, opt);
+        if (VAL_NO_ERROR != retval)
+            break;
+    }
+
+    for (i = 0; (VAL_NO_ERROR == retval) && (i < e->ve_count); ++i) {
+        if (0 != pthread_create(&e->ve_workers[i].ew_thread, NULL,
+                                _worker_main, &e->ve_workers[i]))
+            retval = VAL_INTERNAL_ERROR;
+        else
+            e->ve_workers[i].ew_started = 1;
+    }
+
+    if (VAL_NO_ERROR != retval) {
+        val_log(NULL, LOG_ERR, "val_async_engine_create(): %s",
+                p_val_err(retval));
+        val_async_engine_free(e);
+        return retval;
+    }
+
+    val_log(NULL, LOG_INFO, "async engine %p: %d workers", e, e->ve_count);
+    *engine = e;
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Function: val_async_engine_submit
+ *
+ * Purpose: queue a request for one of the engine workers. The callback
+ *          is called on the worker thread, as for val_async_submit, or
+ *          with async_status NULL and event VAL_AS_EVENT_CANCELED if
+ *          the request could not be started.
+ */
+int
+val_async_engine_submit(val_async_engine_t *engine, const char *name,
+                        int class_h, int type_h, unsigned int flags,
+                        val_async_event_cb callback, void *cb_data)
+{
+    return val_async_engine_submit_ex(engine, name, class_h, type_h, flags,
+                                      NULL, callback, cb_data);
+}
+
+/*
+ * Function: val_async_engine_submit_ex
+ *
+ * Purpose: as val_async_engine_submit, but the request is completed
+ *          once budget (if not NULL) has elapsed, counting from now,
+ *          as for val_async_submit_ex.
+ */
+int
+val_async_engine_submit_ex(val_async_engine_t *engine, const char *name,
+                           int class_h, int type_h, unsigned int flags,
+                           const struct timeval *budget,
+                           val_async_event_cb callback, void *cb_data)
+{
+    struct engine_worker *w;
+    struct engine_job    *job;
+
+    if ((NULL == engine) || (NULL == name) || engine->ve_stop)
+        return VAL_BAD_ARGUMENT;
+    if (budget && (budget->tv_sec < 0 || budget->tv_usec < 0))
+        return VAL_BAD_ARGUMENT;
+
+    job = (struct engine_job *) MALLOC(sizeof(*job));
+    if (NULL == job)
+        return VAL_OUT_OF_MEMORY;
+    memset(job, 0, sizeof(*job));
+    job->ej_name = strdup(name);
+    if (NULL == job->ej_name) {
+        FREE(job);
+        return VAL_OUT_OF_MEMORY;
+    }
+    job->ej_class = class_h;
+    job->ej_type = type_h;
+    job->ej_flags = flags;
+    job->ej_cb = callback;
+    job->ej_cb_data = cb_data;
+    if (budget) {
+        gettimeofday(&job->ej_deadline, NULL);
+        timeradd(&job->ej_deadline, budget, &job->ej_deadline);
+    }
+
+    /* idle workers steal, so plain round robin is good enough here */
+    w = &engine->ve_workers[ENGINE_NEXT(engine) %
+                            engine->ve_count];
+
+    pthread_mutex_lock(&w->ew_lock);
+    _inbox_put(w, job, 1);
+    _worker_wake(w);
+    pthread_mutex_unlock(&w->ew_lock);
+
+    /* an idle worker takes it if w is busy (or asleep itself) */
+    _engine_signal(engine, 0);
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Function: val_async_engine_dequeue
+ *
+ * Purpose: collect completed requests from all workers, for an engine
+ *          created with VAL_ENGINE_COMPLETION_QUEUE. See
+ *          val_async_dequeue.
+ */
+int
+val_async_engine_dequeue(val_async_engine_t *engine,
+                         val_async_status **batch, int max)
+{
+    int i, n, start, count = 0;
+
+    if ((NULL == engine) || (NULL == batch) || (max <= 0))
+        return VAL_BAD_ARGUMENT;
+
+    /* don't always favour the first worker */
+    start = ENGINE_NEXT(engine);
+    for (i = 0; (i < engine->ve_count) && (count < max); ++i) {
+        n = val_async_dequeue(engine->ve_workers[(start + i) %
+                                                 engine->ve_count].ew_ctx,
+                              batch + count, max - count);
+        if (n > 0)
+            count += n;
+    }
+
+    return count;
+}
+
+/*
+ * Function: val_async_engine_free
+ *
+ * Purpose: stop the workers and free the engine. Requests not yet
+ *          completed are cancelled (with callbacks), and completed
+ *          requests not yet dequeued are freed.
+ */
+void
+val_async_engine_free(val_async_engine_t *engine)
+{
+    struct engine_worker *w;
+    int                   i;
+
+    if (NULL == engine)
+        return;
+
+    engine->ve_stop = 1;
+    if (engine->ve_locks)
+        _engine_signal(engine, 1);
+    for (i = 0; i < engine->ve_count; ++i) {
+        w = &engine->ve_workers[i];
+        pthread_mutex_lock(&w->ew_lock);
+        w->ew_woken = 0;
+        _worker_wake(w);
+        pthread_mutex_unlock(&w->ew_lock);
+    }
+
+    for (i = 0; i < engine->ve_count; ++i) {
+        w = &engine->ve_workers[i];
+        if (w->ew_started)
+            pthread_join(w->ew_thread, NULL);
+        if (w->ew_ctx) {
+#ifndef WIN32
+            if (w->ew_wake[0] >= 0) {
+                CTX_LOCK_ACACHE(w->ew_ctx);
+                res_poller_del(w->ew_ctx->as_poller, w->ew_wake[0]);
+                CTX_UNLOCK_ACACHE(w->ew_ctx);
+            }
+#endif
+            val_free_context(w->ew_ctx);
+        }
+#ifndef WIN32
+        if (w->ew_wake[0] >= 0) {
+            close(w->ew_wake[0]);
+            close(w->ew_wake[1]);
+        }
+#endif
+        pthread_mutex_destroy(&w->ew_lock);
+    }
+
+    if (engine->ve_workers)
+        FREE(engine->ve_workers);
+    if (engine->ve_locks) {
+        pthread_cond_destroy(&engine->ve_cond);
+        pthread_mutex_destroy(&engine->ve_lock);
+    }
+    FREE(engine);
+}
+
+#else /* VAL_NO_THREADS */
+
+int
+val_async_engine_create(const char *label, val_context_opt_t *opt,
+                        int nthreads, unsigned int flags,
+                        val_async_engine_t **engine)
+{
+    return VAL_NOT_IMPLEMENTED;
+}
+
+int
+val_async_engine_submit(val_async_engine_t *engine, const char *name,
+                        int class_h, int type_h, unsigned int flags,
+                        val_async_event_cb callback, void *cb_data)
+{
+    return VAL_NOT_IMPLEMENTED;
+}
+
+int
+val_async_engine_submit_ex(val_async_engine_t *engine, const char *name,
+                           int class_h, int type_h, unsigned int flags,
+                           const struct timeval *budget,
+                           val_async_event_cb callback, void *cb_data)
+{
+    return VAL_NOT_IMPLEMENTED;
+}
+
+int
+val_async_engine_dequeue(val_async_engine_t *engine,
+                         val_async_status **batch, int max)
+{
+    return VAL_NOT_IMPLEMENTED;
+}
+
+void
+val_async_engine_free(val_async_engine_t *engine)
+{
+}
+
+#endif /* VAL_NO_THREADS */
+#endif /* VAL_NO_ASYNC */
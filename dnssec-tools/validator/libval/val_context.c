@@ -15,6 +15,10 @@
 #include <ifaddrs.h>
 #endif
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #ifndef OPENSSL_NO_ENGINE
@@ -73,6 +77,398 @@ pthread_mutex_t ctx_default =  PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 
+/*
+ * Configuration watcher
+ *
+ * By default every call that refreshes the context stat()s all its
+ * configuration files. With a watcher, a thread waits for changes to
+ * the files (with inotify where available, otherwise by stat()ing them
+ * every few seconds; files inotify can't watch are stat()ed too) and
+ * bumps a generation counter, so the files only
+ * need looking at when the counter has moved. Without thread support
+ * the files are just looked at no more than once per interval.
+ */
+#if !defined(VAL_NO_THREADS) && !defined(WIN32)
+#define VAL_CONF_WATCH_THREAD
+#include <poll.h>
+#include <fcntl.h>
+#endif
+
+#ifdef WIN32
+#define WATCH_GEN_BUMP(w) InterlockedIncrement((volatile LONG *) &(w)->cw_gen)
+#define WATCH_GEN(w)                                                    \
+    ((u_int32_t) InterlockedCompareExchange((volatile LONG *) &(w)->cw_gen, 0, 0))
+#else
+#define WATCH_GEN_BUMP(w) __sync_fetch_and_add(&(w)->cw_gen, 1)
+#define WATCH_GEN(w)      __sync_fetch_and_add(&(w)->cw_gen, 0)
+#endif
+
+struct conf_watch_file {
+    char           *wf_path;
+    const char     *wf_base;    /* file name within wf_path */
+    int             wf_wd;      /* inotify watch on its directory */
+    time_t          wf_mtime;   /* when stat()ing instead */
+    struct conf_watch_file *wf_next;
+};
+
+struct val_conf_watch {
+    volatile u_int32_t cw_gen;      /* bumped when files may have changed */
+    u_int32_t       cw_seen;        /* cw_gen when files were last looked at */
+    int             cw_interval;    /* seconds between stat()s */
+    time_t          cw_last;        /* files last looked at (no thread) */
+#ifdef VAL_CONF_WATCH_THREAD
+    pthread_t       cw_thread;
+    int             cw_started;
+    volatile int    cw_stop;
+    int             cw_wake[2];
+    int             cw_inotify;     /* -1 if stat()ing */
+    pthread_mutex_t cw_lock;        /* protects cw_files, cw_unwatched */
+    struct conf_watch_file *cw_files;
+    int             cw_unwatched;   /* files inotify couldn't watch */
+#endif
+};
+
+#ifdef VAL_CONF_WATCH_THREAD
+
+#define WATCH_INOTIFY_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                            IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+static void
+_watch_free_files(struct val_conf_watch *w, struct conf_watch_file *files,
+                  struct conf_watch_file *keep)
+{
+    struct conf_watch_file *f, *k;
+
+    while (NULL != (f = files)) {
+        files = f->wf_next;
+#ifdef HAVE_SYS_INOTIFY_H
+        /* directories shared with the new list keep their watch */
+        for (k = keep; k; k = k->wf_next)
+            if (k->wf_wd == f->wf_wd)
+                break;
+        if ((f->wf_wd >= 0) && (NULL == k))
+            inotify_rm_watch(w->cw_inotify, f->wf_wd);
+#endif
+        FREE(f->wf_path);
+        FREE(f);
+    }
+}
+
+static int
+_watch_add_file(struct val_conf_watch *w, struct conf_watch_file **files,
+                const char *path)
+{
+    struct conf_watch_file *f;
+    struct stat sb;
+    char *slash;
+
+    if (NULL == path)
+        return VAL_NO_ERROR;
+
+    f = (struct conf_watch_file *) MALLOC(sizeof(*f));
+    if (NULL == f)
+        return VAL_OUT_OF_MEMORY;
+    memset(f, 0, sizeof(*f));
+    f->wf_wd = -1;
+    f->wf_path = strdup(path);
+    if (NULL == f->wf_path) {
+        FREE(f);
+        return VAL_OUT_OF_MEMORY;
+    }
+    slash = strrchr(f->wf_path, '/');
+    f->wf_base = slash ? slash + 1 : f->wf_path;
+
+#ifdef HAVE_SYS_INOTIFY_H
+    /*
+     * watch the directory, so files replaced by a rename (as most
+     * editors and package managers do) are still seen.
+     */
+    if (w->cw_inotify >= 0) {
+        if (slash == f->wf_path)
+            f->wf_wd = inotify_add_watch(w->cw_inotify, "/",
+                                         WATCH_INOTIFY_MASK);
+        else if (slash) {
+            *slash = '\0';
+            f->wf_wd = inotify_add_watch(w->cw_inotify, f->wf_path,
+                                         WATCH_INOTIFY_MASK);
+            *slash = '/';
+        } else
+            f->wf_wd = inotify_add_watch(w->cw_inotify, ".",
+                                         WATCH_INOTIFY_MASK);
+        if (f->wf_wd < 0)
+            val_log(NULL, LOG_INFO,
+                    "val_context_watch_config(): can't watch %s (%s), "
+                    "polling it instead", path, strerror(errno));
+    }
+#endif
+    if (0 == stat(path, &sb))
+        f->wf_mtime = sb.st_mtime;
+
+    f->wf_next = *files;
+    *files = f;
+    return VAL_NO_ERROR;
+}
+
+/*
+ * (re)build the list of files to watch from the context. The list of
+ * dnsval.conf files can change whenever the policy is re-read.
+ * caller must have the exclusive policy lock.
+ */
+static int
+_watch_set_files(val_context_t *context)
+{
+    struct val_conf_watch *w = context->ctx_watch;
+    struct conf_watch_file *files = NULL, *old, *f;
+    struct dnsval_list *dnsval_l;
+    int retval, unwatched = 0;
+
+    retval = _watch_add_file(w, &files, context->resolv_conf);
+    if (VAL_NO_ERROR == retval)
+        retval = _watch_add_file(w, &files, context->root_conf);
+    for (dnsval_l = context->dnsval_l;
+         (VAL_NO_ERROR == retval) && dnsval_l; dnsval_l = dnsval_l->next)
+        retval = _watch_add_file(w, &files, dnsval_l->dnsval_conf);
+    if (w->cw_inotify >= 0)
+        for (f = files; f; f = f->wf_next)
+            if (f->wf_wd < 0)
+                ++unwatched;
+
+    pthread_mutex_lock(&w->cw_lock);
+    old = w->cw_files;
+    w->cw_files = files;
+    w->cw_unwatched = unwatched;
+    pthread_mutex_unlock(&w->cw_lock);
+    _watch_free_files(w, old, files);
+
+    /* the thread may need to start (or stop) stat()ing some of them */
+    if ((w->cw_wake[1] >= 0) && (write(w->cw_wake[1], "", 1) < 0))
+        val_log(NULL, LOG_WARNING, "config watcher: can't wake thread");
+
+    return retval;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * returns 1 if any of the events are for a watched file
+ */
+static int
+_watch_read_events(struct val_conf_watch *w)
+{
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct conf_watch_file *f;
+    ssize_t len;
+    char *ptr;
+    int changed = 0;
+
+    while ((len = read(w->cw_inotify, buf, sizeof(buf))) > 0) {
+        pthread_mutex_lock(&w->cw_lock);
+        for (ptr = buf; ptr < buf + len;
+             ptr += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *) ptr;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                changed = 1;
+                continue;
+            }
+            if (0 == ev->len)
+                continue;
+            for (f = w->cw_files; f; f = f->wf_next) {
+                if ((f->wf_wd == ev->wd) && !strcmp(f->wf_base, ev->name)) {
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&w->cw_lock);
+    }
+
+    return changed;
+}
+#endif
+
+/*
+ * returns 1 if any of the watched files has a new mtime. With
+ * unwatched set, only files without an inotify watch are looked at.
+ */
+static int
+_watch_stat_files(struct val_conf_watch *w, int unwatched)
+{
+    struct conf_watch_file *f;
+    struct stat sb;
+    int changed = 0;
+
+    pthread_mutex_lock(&w->cw_lock);
+    for (f = w->cw_files; f; f = f->wf_next) {
+        if (unwatched && (f->wf_wd >= 0))
+            continue;
+        if (0 != stat(f->wf_path, &sb))
+            sb.st_mtime = 0;
+        if (sb.st_mtime != f->wf_mtime) {
+            f->wf_mtime = sb.st_mtime;
+            changed = 1;
+        }
+    }
+    pthread_mutex_unlock(&w->cw_lock);
+
+    return changed;
+}
+
+static void *
+_watch_main(void *arg)
+{
+    struct val_conf_watch *w = (struct val_conf_watch *) arg;
+    struct pollfd pfd[2];
+    int nfds, n, unwatched, timeout;
+    char c;
+
+    pfd[0].fd = w->cw_wake[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = w->cw_inotify;
+    pfd[1].events = POLLIN;
+    nfds = (w->cw_inotify >= 0) ? 2 : 1;
+
+    while (!w->cw_stop) {
+        /* files inotify can't watch are stat()ed instead */
+        pthread_mutex_lock(&w->cw_lock);
+        unwatched = w->cw_unwatched;
+        pthread_mutex_unlock(&w->cw_lock);
+        timeout = ((nfds == 2) && !unwatched) ? -1 : w->cw_interval * 1000;
+
+        n = poll(pfd, nfds, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            val_log(NULL, LOG_ERR, "config watcher: poll failed: %s",
+                    strerror(errno));
+            break;
+        }
+        if ((n > 0) && (pfd[0].revents & POLLIN)) {
+            while (read(w->cw_wake[0], &c, 1) > 0)
+                ;
+            continue;
+        }
+#ifdef HAVE_SYS_INOTIFY_H
+        if (nfds == 2) {
+            if ((n > 0) && _watch_read_events(w))
+                WATCH_GEN_BUMP(w);
+            else if (unwatched && _watch_stat_files(w, 1))
+                WATCH_GEN_BUMP(w);
+            continue;
+        }
+#endif
+        if (_watch_stat_files(w, 0))
+            WATCH_GEN_BUMP(w);
+    }
+
+    return NULL;
+}
+
+static void
+_watch_free(struct val_conf_watch *w)
+{
+    if (NULL == w)
+        return;
+
+    if (w->cw_started) {
+        w->cw_stop = 1;
+        if (write(w->cw_wake[1], "", 1) < 0)
+            val_log(NULL, LOG_WARNING, "config watcher: can't wake thread");
+        pthread_join(w->cw_thread, NULL);
+    }
+    _watch_free_files(w, w->cw_files, NULL);
+    if (w->cw_wake[0] >= 0) {
+        close(w->cw_wake[0]);
+        close(w->cw_wake[1]);
+    }
+    if (w->cw_inotify >= 0)
+        close(w->cw_inotify);
+    pthread_mutex_destroy(&w->cw_lock);
+    FREE(w);
+}
+
+static struct val_conf_watch *
+_watch_create(val_context_t *context, int interval)
+{
+    struct val_conf_watch *w;
+    int i;
+
+    w = (struct val_conf_watch *) MALLOC(sizeof(*w));
+    if (NULL == w)
+        return NULL;
+    memset(w, 0, sizeof(*w));
+    w->cw_interval = interval;
+    w->cw_wake[0] = w->cw_wake[1] = w->cw_inotify = -1;
+    if (0 != pthread_mutex_init(&w->cw_lock, NULL)) {
+        FREE(w);
+        return NULL;
+    }
+
+#ifdef HAVE_SYS_INOTIFY_H
+    w->cw_inotify = inotify_init();
+    if (w->cw_inotify >= 0)
+        fcntl(w->cw_inotify, F_SETFL, O_NONBLOCK);
+    else
+        val_log(context, LOG_INFO,
+                "val_context_watch_config(): no inotify, polling every %ds",
+                interval);
+#endif
+    if (0 != pipe(w->cw_wake)) {
+        w->cw_wake[0] = w->cw_wake[1] = -1;
+        _watch_free(w);
+        return NULL;
+    }
+    for (i = 0; i < 2; ++i)
+        fcntl(w->cw_wake[i], F_SETFL, O_NONBLOCK);
+
+    context->ctx_watch = w;
+    if ((VAL_NO_ERROR != _watch_set_files(context)) ||
+        (0 != pthread_create(&w->cw_thread, NULL, _watch_main, w))) {
+        context->ctx_watch = NULL;
+        _watch_free(w);
+        return NULL;
+    }
+    w->cw_started = 1;
+
+    return w;
+}
+
+#define WATCH_CHANGED(w) (WATCH_GEN(w) != (w)->cw_seen)
+
+#else /* VAL_CONF_WATCH_THREAD */
+
+static void
+_watch_free(struct val_conf_watch *w)
+{
+    if (w)
+        FREE(w);
+}
+
+static struct val_conf_watch *
+_watch_create(val_context_t *context, int interval)
+{
+    struct val_conf_watch *w;
+
+    w = (struct val_conf_watch *) MALLOC(sizeof(*w));
+    if (NULL == w)
+        return NULL;
+    memset(w, 0, sizeof(*w));
+    w->cw_interval = interval;
+    w->cw_last = time(NULL);
+    context->ctx_watch = w;
+    return w;
+}
+
+static int
+_watch_set_files(val_context_t *context)
+{
+    return VAL_NO_ERROR;
+}
+
+#define WATCH_CHANGED(w) ((time(NULL) - (w)->cw_last) >= (w)->cw_interval)
+
+#endif /* VAL_CONF_WATCH_THREAD */
+
 /*
  * check if we have ipv4/ipv6 addresses
  */
@@ -236,10 +632,31 @@ val_refresh_context(val_context_t *context)
     struct stat rsb, vsb, hsb;
     struct dnsval_list *dnsval_l;
     int retval;
+    int reread = 0;
+    int idle;
+    u_int32_t gen = 0;
 
     if (NULL == context)
         return VAL_BAD_ARGUMENT;
 
+    /* 
+     * nothing to do until the watcher sees a change, unless there are
+     * policies to expire or retired policy tries to free. The watcher
+     * is opt-in: without one, go straight to the full check below
+     * (a stale NULL only costs that). It is replaced under the
+     * exclusive lock, so look at it under the shared one.
+     */
+    if (context->ctx_watch) {
+        CTX_LOCK_POL_SH(context);
+        idle = context->ctx_watch && !WATCH_CHANGED(context->ctx_watch) &&
+            (context->e_pol_retired == NULL) &&
+            (context->e_pol_expiry == 0 ||
+             context->e_pol_expiry > time(NULL));
+        CTX_UNLOCK_POL(context);
+        if (idle)
+            return VAL_NO_ERROR;
+    }
+
     /* 
      * Don't refresh the context if someone else is using it
      */
@@ -248,18 +665,30 @@ val_refresh_context(val_context_t *context)
     }
     CTX_LOCK_COUNT_INC(context,pol_count); /* only needed for EX_TRY */
 
+    /* changes from here on are for the next refresh */
+    if (context->ctx_watch)
+        gen = WATCH_GEN(context->ctx_watch);
+
+    expire_policies(context);
+    if (context->ctx_watch && !WATCH_CHANGED(context->ctx_watch)) {
+        retval = VAL_NO_ERROR;
+        goto err;
+    }
+
     GET_LATEST_TIMESTAMP(context, context->resolv_conf, context->r_timestamp,
                          rsb);
     if (rsb.st_mtime != 0 &&  rsb.st_mtime != context->r_timestamp) {
         if (VAL_NO_ERROR != (retval = val_refresh_resolver_policy(context))) {
             goto err;
         }
+        reread = 1;
     }    
     GET_LATEST_TIMESTAMP(context, context->root_conf, context->h_timestamp, hsb);
     if (hsb.st_mtime != 0 &&  hsb.st_mtime != context->h_timestamp){
         if (VAL_NO_ERROR != (retval = val_refresh_root_hints(context))) {
             goto err;
         }
+        reread = 1;
     }
 
     /* dnsval.conf can point to a list of files */
@@ -271,10 +700,19 @@ val_refresh_context(val_context_t *context)
             if (VAL_NO_ERROR != retval) {
                 goto err;
             }
+            reread = 1;
             break;
         }
     }
 
+    if (context->ctx_watch) {
+        /* the set of dnsval.conf files may have changed */
+        if (reread)
+            _watch_set_files(context);
+        context->ctx_watch->cw_seen = gen;
+        context->ctx_watch->cw_last = time(NULL);
+    }
+
     retval = VAL_NO_ERROR;
 
 err:
@@ -289,9 +727,11 @@ err:
  * then set the global value of default_context, but only if 
  * it was NULL. I.E. don't override a previously set 
  * default_context.
+ * A private context never reuses the default context, nor becomes it.
  */
 static int
 val_create_context_internal( const char *label, 
+                             int private_ctx,
                              unsigned int flags,
                              unsigned int polflags,
                              char *valpol,
@@ -435,7 +875,7 @@ val_create_context_internal( const char *label,
      *  either label should be NULL, or if label is not NULL, our global policy should
      *  be set so that environment overrides what ever is passed by the app
      */
-    if (the_default_context && 
+    if (the_default_context && !private_ctx &&
         (label == NULL || 
          (the_default_context->g_opt && 
           (the_default_context->g_opt->env_policy == VAL_POL_GOPT_OVERRIDE || 
@@ -521,6 +961,19 @@ val_create_context_internal( const char *label,
         goto err;
     }
 #endif
+#ifndef VAL_NO_ASYNC
+    if (0 != pthread_mutex_init(&(*newcontext)->as_cq_lock, NULL)) {
+        pthread_rwlock_destroy(&(*newcontext)->pol_rwlock);
+        pthread_mutex_destroy(&(*newcontext)->ac_lock);
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_destroy(&(*newcontext)->ref_lock);
+#endif
+        FREE(*newcontext);
+        *newcontext = NULL;
+        retval = VAL_INTERNAL_ERROR;
+        goto err;
+    }
+#endif
 #endif
 
     if (snprintf
@@ -559,10 +1012,28 @@ val_create_context_internal( const char *label,
     }
     memset(((*newcontext)->e_pol), 0,
            MAX_POL_TOKEN * sizeof(policy_entry_t *));
+    (*newcontext)->e_pol_trie = (struct policy_trie **)
+        MALLOC(MAX_POL_TOKEN * sizeof(struct policy_trie *));
+    if ((*newcontext)->e_pol_trie == NULL) {
+        retval = VAL_OUT_OF_MEMORY;
+        goto err;
+    }
+    memset(((*newcontext)->e_pol_trie), 0,
+           MAX_POL_TOKEN * sizeof(struct policy_trie *));
+    (*newcontext)->e_pol_retired = NULL;
+    (*newcontext)->e_pol_expiry = 0;
    
     (*newcontext)->val_log_targets = NULL;
     (*newcontext)->q_list = NULL;
     (*newcontext)->as_list = NULL;
+    (*newcontext)->as_poller = NULL;
+    (*newcontext)->as_timers = NULL;
+    memset(&(*newcontext)->as_loop, 0, sizeof((*newcontext)->as_loop));
+    timerclear(&(*newcontext)->as_loop_next);
+    (*newcontext)->as_gen = 1;
+    (*newcontext)->as_cq = NULL;
+    (*newcontext)->as_cq_ready = NULL;
+    (*newcontext)->as_cq_on = 0;
     (*newcontext)->def_cflags = 0; 
     (*newcontext)->def_uflags = flags & VAL_QFLAGS_USERMASK; 
 
@@ -600,7 +1071,7 @@ val_create_context_internal( const char *label,
             (*newcontext)->resolv_conf,
             (*newcontext)->root_conf);
 
-    if (label == NULL) {
+    if (label == NULL && !private_ctx) {
         /*
          * Set the default context if this was not set earlier.
          * We do not override a previously set default context,
@@ -644,7 +1115,7 @@ val_create_context_with_conf(const char *label,
                              char *root_conf, 
                              val_context_t ** newcontext)
 {
-    return val_create_context_internal(label, 0, 0, NULL, NULL,
+    return val_create_context_internal(label, 0, 0, 0, NULL, NULL,
                 dnsval_conf, resolv_conf, root_conf, NULL, newcontext); 
 }
 
@@ -661,7 +1132,7 @@ val_create_context_ex(const char *label,
     if (opt == NULL)
         return VAL_BAD_ARGUMENT;
 
-    return val_create_context_internal(label, 
+    return val_create_context_internal(label, 0,
                 opt->vc_qflags, 
                 opt->vc_polflags, 
                 opt->vc_valpol,
@@ -681,10 +1152,36 @@ int
 val_create_context(const char *label, 
                    val_context_t ** newcontext)
 {
-    return val_create_context_internal(label, 0, 0, NULL, 
+    return val_create_context_internal(label, 0, 0, 0, NULL, 
                 NULL, NULL, NULL, NULL, NULL, newcontext);
 }
 
+/*
+ * Create a context that belongs to the caller alone: unlike the
+ * functions above, a NULL label or a policy override does not hand
+ * back the shared default context. opt may be NULL.
+ */
+int
+val_create_private_context(const char *label,
+                           val_context_opt_t *opt,
+                           val_context_t ** newcontext)
+{
+    if (opt == NULL)
+        return val_create_context_internal(label, 1, 0, 0, NULL,
+                    NULL, NULL, NULL, NULL, NULL, newcontext);
+
+    return val_create_context_internal(label, 1,
+                opt->vc_qflags, 
+                opt->vc_polflags, 
+                opt->vc_valpol,
+                opt->vc_nslist,
+                opt->vc_val_conf, 
+                opt->vc_res_conf, 
+                opt->vc_root_conf, 
+                opt->vc_gopt, 
+                newcontext); 
+}
+
 /*
  * Function: val_create_or_refresh_context
  *
@@ -763,15 +1260,27 @@ val_free_context(val_context_t * context)
      * unlocking since we're going to destroy it anyway.
      */
 
+    _watch_free(context->ctx_watch);
+    context->ctx_watch = NULL;
+
 #ifndef VAL_NO_ASYNC
     /** cancel uses locks, so this must be before locks are destroyed */
     val_async_cancel_all(context, 0);
+    /** completed requests nobody dequeued */
+    {
+        val_async_status *as;
+        while (val_async_dequeue(context, &as, 1) > 0)
+            val_async_release(as);
+    }
 #endif
 
     CTX_UNLOCK_POL(context);
 #ifndef VAL_NO_THREADS
     pthread_rwlock_destroy(&context->pol_rwlock);
     pthread_mutex_destroy(&context->ac_lock);
+#ifndef VAL_NO_ASYNC
+    pthread_mutex_destroy(&context->as_cq_lock);
+#endif
 #endif
 
     if (context->label)
@@ -807,12 +1316,20 @@ val_free_context(val_context_t * context)
     destroy_respol(context);
     destroy_valpol(context);
     FREE(context->e_pol);
+    FREE(context->e_pol_trie);
 
     while (NULL != (q = context->q_list)) {
         context->q_list = q->qc_next;
         free_query_chain_structure(q);
         q = NULL;
     }
+#ifndef VAL_NO_ASYNC
+    /** after the queries, which deregister their sockets */
+    if (context->as_poller)
+        res_poller_free(context->as_poller);
+    if (context->as_timers)
+        res_timers_free(context->as_timers);
+#endif
     if (context->base_dnsval_conf)
         FREE(context->base_dnsval_conf);
     
@@ -868,6 +1385,40 @@ val_free_validator_state()
     return VAL_NO_ERROR;
 }
 
+/*
+ * Function: val_context_watch_config
+ *
+ * Purpose:  stop stat()ing the context's configuration files on every
+ *           call, and re-read them only after a watcher has seen them
+ *           change. interval is how often (in seconds) to look at the
+ *           files if they can't be watched; 0 turns the watcher off.
+ *
+ * Returns:  VAL_NO_ERROR or error code
+ */
+int
+val_context_watch_config(val_context_t *context, int interval)
+{
+    int retval = VAL_NO_ERROR;
+
+    if ((NULL == context) || (interval < 0))
+        return VAL_BAD_ARGUMENT;
+
+    CTX_LOCK_POL_EX(context);
+
+    _watch_free(context->ctx_watch);
+    context->ctx_watch = NULL;
+
+    if ((interval > 0) && (NULL == _watch_create(context, interval)))
+        retval = VAL_OUT_OF_MEMORY;
+
+    val_log(context, LOG_INFO, "val_context_watch_config(): watcher %s",
+            context->ctx_watch ? "on" : "off");
+
+    CTX_UNLOCK_POL(context);
+
+    return retval;
+}
+
 int 
 val_context_setqflags(val_context_t *context, 
                       unsigned char action, 
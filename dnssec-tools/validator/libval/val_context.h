@@ -77,6 +77,9 @@ int             val_create_context_ex(const char *label,
                                       val_context_t ** newcontext);
 int             val_create_context(const char *label,
                                    val_context_t ** newcontext);
+int             val_create_private_context(const char *label,
+                                           val_context_opt_t *opt,
+                                           val_context_t ** newcontext);
 val_context_t * val_create_or_refresh_context(val_context_t *ctx);
 void            val_free_context(val_context_t * context);
 int             val_free_validator_state(void);
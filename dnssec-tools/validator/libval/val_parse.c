@@ -38,6 +38,18 @@ keytag(const u_char key[],       /* the RDATA part of the DNSKEY RR */
     return ac & 0xFFFF;
 }
 
+/*
+ * Compute the key tag of the rdata portion of a DNSKEY RR
+ * without parsing it
+ */
+u_int16_t
+val_dnskey_rdata_keytag(const u_char *buf, size_t buflen)
+{
+    if ((buf != NULL) && (buflen >= 4) && (buf[3] == ALG_RSAMD5))
+        return rsamd5_keytag(buf, buflen);
+    return keytag(buf, buflen);
+}
+
 /*
  * Parse a domain name
  */
@@ -347,8 +359,7 @@ val_parse_dnskey_string(char *keystr, size_t keystrlen,
     bp = buf;
     flags = (*dnskey_rdata)->flags;
 
-    memcpy(bp, &flags, sizeof(u_int16_t));
-    bp += sizeof(u_int16_t);
+    NS_PUT16(flags, bp);
     *bp = (*dnskey_rdata)->protocol;
     bp++;
     *bp = (*dnskey_rdata)->algorithm;
@@ -23,6 +23,10 @@ int             val_parse_dname(const u_char *buf, size_t buflen,
 int             val_parse_dnskey_rdata(const u_char *buf,
                                        size_t buflen,
                                        val_dnskey_rdata_t * rdata);
+/*
+ * Compute the key tag of the rdata portion of a DNSKEY resource record
+ */
+u_int16_t       val_dnskey_rdata_keytag(const u_char *buf, size_t buflen);
 /*
  * Parse the dnskey from the string. The string contains the flags, 
  * protocol, algorithm and the base64 key delimited by spaces.
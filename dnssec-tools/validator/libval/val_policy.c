@@ -18,6 +18,10 @@
 #include "val_assertion.h"
 #include "val_parse.h"
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #if !defined(WIN32) || defined(LIBVAL_CONFIGURED)
 #include "val_inline_conf.h"
 #else
@@ -230,6 +234,424 @@ int free_policy_entry(policy_entry_t *pol_entry, int index)
 
 }
 
+/*
+ ***************************************************************
+ * Per-zone policies of each type are also kept in a label trie,
+ * so that the policy for the closest enclosing zone of a name is
+ * found in a single walk down the name's labels.  A trie is built
+ * from ctx->e_pol[index] whenever that list changes and is never
+ * modified afterwards, so readers only need the shared policy lock.
+ * A trie that is replaced while readers may still be using it (and
+ * any policy entries removed along with it) is kept on a retired
+ * list until the policy lock is next held exclusively.
+ ***************************************************************
+ */
+
+/* a wire format name has at most 127 labels besides the root */
+#define POL_TRIE_MAX_LABELS 128
+
+struct policy_trie_node {
+    const u_char   *pn_label;       /* length-prefixed, within a zone_n */
+    policy_entry_t **pn_pol;        /* NULL terminated, in list order */
+    size_t          pn_pol_count;
+    struct policy_trie_node *pn_child;  /* sorted by label_cmp() */
+    size_t          pn_child_count;
+};
+
+struct policy_trie {
+    int             pt_index;
+    long            pt_expiry;      /* earliest exp_ttl, 0 if none */
+    struct policy_trie_node pt_root;
+    policy_entry_t *pt_dead;        /* entries to free with this trie */
+    struct policy_trie *pt_next;    /* retired list */
+};
+
+#ifdef WIN32
+#define POL_TRIE_PUBLISH(slot, t)                                       \
+    InterlockedExchangePointer((PVOID volatile *) &(slot), (t))
+#else
+#define POL_TRIE_PUBLISH(slot, t) do {                                  \
+    __sync_synchronize();                                               \
+    (slot) = (t);                                                       \
+} while (0)
+#endif
+
+static int
+label_cmp(const u_char *a, const u_char *b)
+{
+    int i, ca, cb;
+
+    if (*a != *b)
+        return (*a < *b) ? -1 : 1;
+    for (i = 1; i <= *a; i++) {
+        ca = tolower(a[i]);
+        cb = tolower(b[i]);
+        if (ca != cb)
+            return (ca < cb) ? -1 : 1;
+    }
+    return 0;
+}
+
+static struct policy_trie_node *
+policy_trie_child(const struct policy_trie_node *node, const u_char *label,
+                  size_t *pos)
+{
+    size_t lo = 0, hi = node->pn_child_count, mid;
+    int c;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        c = label_cmp(label, node->pn_child[mid].pn_label);
+        if (c == 0)
+            return &node->pn_child[mid];
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (pos)
+        *pos = lo;
+    return NULL;
+}
+
+static void
+policy_trie_free_node(struct policy_trie_node *node)
+{
+    size_t i;
+
+    for (i = 0; i < node->pn_child_count; i++)
+        policy_trie_free_node(&node->pn_child[i]);
+    if (node->pn_child)
+        FREE(node->pn_child);
+    if (node->pn_pol)
+        FREE(node->pn_pol);
+}
+
+static void
+policy_trie_free(struct policy_trie *t)
+{
+    if (t == NULL)
+        return;
+    policy_trie_free_node(&t->pt_root);
+    free_policy_entry(t->pt_dead, t->pt_index);
+    FREE(t);
+}
+
+static int
+policy_trie_insert(struct policy_trie *t, policy_entry_t *pe)
+{
+    const u_char *labels[POL_TRIE_MAX_LABELS];
+    struct policy_trie_node *node, *child;
+    policy_entry_t **pols;
+    const u_char *p;
+    size_t pos;
+    int n = 0;
+
+    for (p = pe->zone_n; *p != '\0'; p += *p + 1) {
+        if (n == POL_TRIE_MAX_LABELS)
+            return VAL_BAD_ARGUMENT;
+        labels[n++] = p;
+    }
+
+    node = &t->pt_root;
+    while (n-- > 0) {
+        child = policy_trie_child(node, labels[n], &pos);
+        if (child == NULL) {
+            child = (struct policy_trie_node *)
+                MALLOC((node->pn_child_count + 1) * sizeof(*child));
+            if (child == NULL)
+                return VAL_OUT_OF_MEMORY;
+            if (node->pn_child) {
+                memcpy(child, node->pn_child, pos * sizeof(*child));
+                memcpy(&child[pos + 1], &node->pn_child[pos],
+                       (node->pn_child_count - pos) * sizeof(*child));
+                FREE(node->pn_child);
+            }
+            node->pn_child = child;
+            node->pn_child_count++;
+            child = &child[pos];
+            memset(child, 0, sizeof(*child));
+            child->pn_label = labels[n];
+        }
+        node = child;
+    }
+
+    pols = (policy_entry_t **)
+        MALLOC((node->pn_pol_count + 2) * sizeof(*pols));
+    if (pols == NULL)
+        return VAL_OUT_OF_MEMORY;
+    if (node->pn_pol) {
+        memcpy(pols, node->pn_pol, node->pn_pol_count * sizeof(*pols));
+        FREE(node->pn_pol);
+    }
+    pols[node->pn_pol_count++] = pe;
+    pols[node->pn_pol_count] = NULL;
+    node->pn_pol = pols;
+
+    if (pe->exp_ttl > 0 &&
+        (t->pt_expiry == 0 || pe->exp_ttl < t->pt_expiry))
+        t->pt_expiry = pe->exp_ttl;
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * build a trie from a policy list, leaving out entries that
+ * have expired by now
+ */
+static struct policy_trie *
+policy_trie_build(policy_entry_t *list, int index, long now)
+{
+    struct policy_trie *t;
+    policy_entry_t *pe;
+
+    t = (struct policy_trie *) MALLOC(sizeof(struct policy_trie));
+    if (t == NULL)
+        return NULL;
+    memset(t, 0, sizeof(struct policy_trie));
+    t->pt_index = index;
+    t->pt_root.pn_label = (const u_char *) "";
+
+    for (pe = list; pe; pe = pe->next) {
+        if (POL_EXPIRED(pe, now))
+            continue;
+        if (VAL_NO_ERROR != policy_trie_insert(t, pe)) {
+            policy_trie_free(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+static void
+update_policy_expiry(val_context_t *ctx)
+{
+    long expiry = 0;
+    int i;
+
+    for (i = 0; i < MAX_POL_TOKEN; i++) {
+        struct policy_trie *t = ctx->e_pol_trie[i];
+        if (t && t->pt_expiry > 0 && (expiry == 0 || t->pt_expiry < expiry))
+            expiry = t->pt_expiry;
+    }
+    ctx->e_pol_expiry = expiry;
+}
+
+/*
+ * Rebuild the trie for ctx->e_pol[index] after the list has changed.
+ * The old trie is retired along with dead, a list of entries that
+ * have been unlinked from ctx->e_pol[index] but may still be in use.
+ * Caller must hold the policy lock and serialize with other writers.
+ */
+int
+rebuild_policy_trie(val_context_t *ctx, int index, policy_entry_t *dead)
+{
+    struct policy_trie *t, *old;
+    struct timeval  tv;
+
+    if (ctx == NULL || index < 0 || index >= MAX_POL_TOKEN)
+        return VAL_BAD_ARGUMENT;
+
+    gettimeofday(&tv, NULL);
+    t = policy_trie_build(ctx->e_pol[index], index, tv.tv_sec);
+    if (t == NULL)
+        return VAL_OUT_OF_MEMORY;
+
+    old = ctx->e_pol_trie[index];
+    POL_TRIE_PUBLISH(ctx->e_pol_trie[index], t);
+    if (old == NULL) {
+        /* nothing refers to dead entries without a trie */
+        free_policy_entry(dead, index);
+    } else {
+        old->pt_dead = dead;
+        old->pt_next = ctx->e_pol_retired;
+        ctx->e_pol_retired = old;
+    }
+    update_policy_expiry(ctx);
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Build the tries for all policy types, after the configuration
+ * has been (re)read. Caller must hold the exclusive policy lock.
+ */
+int
+build_policy_tries(val_context_t *ctx)
+{
+    struct timeval  tv;
+    int i;
+
+    gettimeofday(&tv, NULL);
+    for (i = 0; i < MAX_POL_TOKEN; i++) {
+        policy_trie_free(ctx->e_pol_trie[i]);
+        ctx->e_pol_trie[i] = policy_trie_build(ctx->e_pol[i], i, tv.tv_sec);
+        if (ctx->e_pol_trie[i] == NULL)
+            return VAL_OUT_OF_MEMORY;
+    }
+    update_policy_expiry(ctx);
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Free the policy tries. Caller must hold the exclusive policy lock.
+ */
+void
+destroy_policy_tries(val_context_t *ctx)
+{
+    struct policy_trie *t;
+    int i;
+
+    if (ctx->e_pol_trie) {
+        for (i = 0; i < MAX_POL_TOKEN; i++) {
+            policy_trie_free(ctx->e_pol_trie[i]);
+            ctx->e_pol_trie[i] = NULL;
+        }
+    }
+    while (NULL != (t = ctx->e_pol_retired)) {
+        ctx->e_pol_retired = t->pt_next;
+        policy_trie_free(t);
+    }
+    ctx->e_pol_expiry = 0;
+}
+
+/*
+ * Drop expired per-zone policies and free retired tries. This is
+ * where policies with a TTL go away, rather than on each lookup.
+ * Caller must hold the exclusive policy lock.
+ */
+void
+expire_policies(val_context_t *ctx)
+{
+    struct policy_trie *t;
+    policy_entry_t *pe, *prev, *next;
+    struct timeval  tv;
+    int i;
+
+    while (NULL != (t = ctx->e_pol_retired)) {
+        ctx->e_pol_retired = t->pt_next;
+        policy_trie_free(t);
+    }
+
+    if (ctx->e_pol_expiry == 0)
+        return;
+    gettimeofday(&tv, NULL);
+    if (ctx->e_pol_expiry > tv.tv_sec)
+        return;
+
+    for (i = 0; i < MAX_POL_TOKEN; i++) {
+        if (ctx->e_pol_trie[i] == NULL ||
+            ctx->e_pol_trie[i]->pt_expiry == 0 ||
+            ctx->e_pol_trie[i]->pt_expiry > tv.tv_sec)
+            continue;
+
+        t = policy_trie_build(ctx->e_pol[i], i, tv.tv_sec);
+        if (t == NULL) {
+            val_log(ctx, LOG_WARNING,
+                    "expire_policies(): could not rebuild policy index");
+            continue;
+        }
+        policy_trie_free(ctx->e_pol_trie[i]);
+        ctx->e_pol_trie[i] = t;
+
+        prev = NULL;
+        for (pe = ctx->e_pol[i]; pe; pe = next) {
+            next = pe->next;
+            if (POL_EXPIRED(pe, tv.tv_sec)) {
+                if (prev)
+                    prev->next = next;
+                else
+                    ctx->e_pol[i] = next;
+                pe->next = NULL;
+                free_policy_entry(pe, i);
+            } else
+                prev = pe;
+        }
+    }
+    update_policy_expiry(ctx);
+}
+
+/*
+ * Find the per-zone policies of type index for the closest zone
+ * enclosing name_n (or name_n itself) that has at least one policy
+ * entry with a policy that hasn't expired. Returns a NULL-terminated
+ * array of all the entries for that zone, in the order they are
+ * stored in ctx->e_pol[index], or NULL if no zone matched. If matched
+ * is non-NULL, it is set to point to the matching suffix of name_n.
+ * Callers should skip entries for which POLICY_USABLE() is false.
+ * Caller must hold the policy lock (shared is sufficient).
+ */
+policy_entry_t **
+find_zone_policies(val_context_t *ctx, int index, u_char *name_n,
+                   u_char **matched, long *now)
+{
+    u_char *labels[POL_TRIE_MAX_LABELS];
+    const struct policy_trie_node *node, *best = NULL;
+    struct policy_trie *t;
+    struct timeval  tv;
+    u_char *p, *best_p = NULL;
+    int n = 0;
+    size_t i;
+
+    *now = 0;
+    if (ctx == NULL || ctx->e_pol_trie == NULL || name_n == NULL ||
+        index < 0 || index >= MAX_POL_TOKEN)
+        return NULL;
+    t = ctx->e_pol_trie[index];
+    if (t == NULL)
+        return NULL;
+    if (t->pt_expiry > 0) {
+        gettimeofday(&tv, NULL);
+        *now = tv.tv_sec;
+    }
+
+    for (p = name_n; *p != '\0' && n < POL_TRIE_MAX_LABELS; p += *p + 1)
+        labels[n++] = p;
+
+    /* the root zone matches the terminating label */
+    node = &t->pt_root;
+    while (node) {
+        for (i = 0; i < node->pn_pol_count; i++) {
+            if (POLICY_USABLE(node->pn_pol[i], *now)) {
+                best = node;
+                best_p = p;
+                break;
+            }
+        }
+        if (n == 0)
+            break;
+        p = labels[--n];
+        node = policy_trie_child(node, p, NULL);
+    }
+
+    if (best == NULL)
+        return NULL;
+    if (matched)
+        *matched = best_p;
+    return best->pn_pol;
+}
+
+/*
+ * Like find_zone_policies(), but return only the first usable entry
+ * for the closest matching zone.
+ */
+policy_entry_t *
+find_zone_policy(val_context_t *ctx, int index, u_char *name_n,
+                 u_char **matched)
+{
+    policy_entry_t **pols;
+    long now;
+
+    pols = find_zone_policies(ctx, index, name_n, matched, &now);
+    if (pols == NULL)
+        return NULL;
+    for (; *pols; pols++)
+        if (POLICY_USABLE(*pols, now))
+            return *pols;
+    return NULL;
+}
+
 static void
 set_global_opt_defaults(val_global_opt_t *gopt)
 {
@@ -298,26 +720,79 @@ free_global_options(val_global_opt_t *g)
     }
 }
 
+/*
+ * Length of the wire format name at buf, or 0 if buf does not hold a
+ * complete, valid name.  Used for names read back from policy images.
+ */
+static size_t
+policy_image_name_len(const u_char *buf, size_t buflen)
+{
+    size_t          len = 0;
+
+    while (len < buflen && len < NS_MAXCDNAME) {
+        if (buf[len] == 0)
+            return len + 1;
+        if (buf[len] > NS_MAXLABEL)
+            return 0;
+        len += buf[len] + 1;
+    }
+    return 0;
+}
+
+static int
+pack_int(int value, u_char *buf, size_t *buflen)
+{
+    if (buflen == NULL)
+        return VAL_BAD_ARGUMENT;
+    if (buf != NULL) {
+        if (*buflen < NS_INT32SZ)
+            return VAL_BAD_ARGUMENT;
+        NS_PUT32((u_int32_t) value, buf);
+    }
+    *buflen = NS_INT32SZ;
+    return VAL_NO_ERROR;
+}
+
+static int
+unpack_int(const u_char *buf, size_t buflen, int *value)
+{
+    u_int32_t       v;
+
+    if (buf == NULL || value == NULL || buflen != NS_INT32SZ)
+        return VAL_CONF_PARSE_ERROR;
+    VAL_GET32(v, buf);
+    *value = (int) v;
+    return VAL_NO_ERROR;
+}
+
 /*
  ***************************************************************
- * The following are the parsing and freeup routines for 
+ * The following are the parsing, packing and freeup routines for 
  * different policy fragments in the validator configuration
- * file
+ * file.  pack() serializes the data of an entry for a policy 
+ * image (with a NULL buffer it only reports the length needed), 
+ * and unpack() rebuilds it from the image.
  **************************************************************
  */
 const struct policy_conf_element conf_elem_array[MAX_POL_TOKEN] = {
-    {POL_TRUST_ANCHOR_STR, parse_trust_anchor, free_trust_anchor},
-    {POL_CLOCK_SKEW_STR, parse_clock_skew, free_clock_skew},
+    {POL_TRUST_ANCHOR_STR, parse_trust_anchor, free_trust_anchor,
+     pack_trust_anchor, unpack_trust_anchor},
+    {POL_CLOCK_SKEW_STR, parse_clock_skew, free_clock_skew,
+     pack_clock_skew, unpack_clock_skew},
     {POL_PROV_INSEC_STR, parse_prov_insecure_status, 
-     free_prov_insecure_status},
+     free_prov_insecure_status, pack_prov_insecure_status,
+     unpack_prov_insecure_status},
     {POL_ZONE_SE_STR, parse_zone_security_expectation,
-     free_zone_security_expectation},
+     free_zone_security_expectation, pack_zone_security_expectation,
+     unpack_zone_security_expectation},
 #ifdef LIBVAL_NSEC3
-    {POL_NSEC3_MAX_ITER_STR, parse_nsec3_max_iter, free_nsec3_max_iter},
+    {POL_NSEC3_MAX_ITER_STR, parse_nsec3_max_iter, free_nsec3_max_iter,
+     pack_nsec3_max_iter, unpack_nsec3_max_iter},
 #endif
 #ifdef LIBVAL_DLV
     {POL_DLV_TRUST_POINTS_STR, parse_dlv_trust_points,
-     free_dlv_trust_points},
+     free_dlv_trust_points, pack_dlv_trust_points,
+     unpack_dlv_trust_points},
 #endif
 };
 
@@ -345,8 +820,7 @@ parse_trust_anchor(char **buf_ptr, char *end_ptr, policy_entry_t * pol_entry,
     if (ta_pol == NULL) {
         return VAL_OUT_OF_MEMORY;
     }
-    ta_pol->publickey = NULL;
-    ta_pol->ds = NULL;
+    memset(ta_pol, 0, sizeof(struct trust_anchor_policy));
 
     pkstr = &ta_token[0];
     endptr = pkstr + strlen(ta_token);
@@ -364,6 +838,8 @@ parse_trust_anchor(char **buf_ptr, char *end_ptr, policy_entry_t * pol_entry,
             FREE(ta_pol);
             return retval;
         }
+        ta_pol->key_tag = ta_pol->ds->d_keytag;
+        ta_pol->algorithm = ta_pol->ds->d_algo;
 
     } else {
         if (!strncasecmp(pkstr, DNSKEY_STR, strlen(DNSKEY_STR))) {
@@ -385,6 +861,26 @@ parse_trust_anchor(char **buf_ptr, char *end_ptr, policy_entry_t * pol_entry,
             FREE(ta_pol);
             return retval;
         }
+        ta_pol->key_tag = ta_pol->publickey->key_tag;
+        ta_pol->algorithm = ta_pol->publickey->algorithm;
+
+        /* keep the wire format around for comparing against DNSKEYs */
+        ta_pol->rdata_len = 4 + ta_pol->publickey->public_key_len;
+        ta_pol->rdata = (u_char *) MALLOC(ta_pol->rdata_len);
+        if (ta_pol->rdata == NULL) {
+            if (ta_pol->publickey->public_key)
+                FREE(ta_pol->publickey->public_key);
+            FREE(ta_pol->publickey);
+            FREE(ta_pol);
+            return VAL_OUT_OF_MEMORY;
+        }
+        ta_pol->rdata[0] = (ta_pol->publickey->flags >> 8) & 0xff;
+        ta_pol->rdata[1] = ta_pol->publickey->flags & 0xff;
+        ta_pol->rdata[2] = ta_pol->publickey->protocol;
+        ta_pol->rdata[3] = ta_pol->publickey->algorithm;
+        if (ta_pol->publickey->public_key_len > 0)
+            memcpy(&ta_pol->rdata[4], ta_pol->publickey->public_key,
+                   ta_pol->publickey->public_key_len);
     }
 
     pol_entry->pol = ta_pol;
@@ -398,6 +894,8 @@ free_trust_anchor(policy_entry_t * pol_entry)
     if (pol_entry && pol_entry->pol) {
         struct trust_anchor_policy *ta_pol = (struct trust_anchor_policy *)(pol_entry->pol);
 
+        if (ta_pol->rdata)
+            FREE(ta_pol->rdata);
         if (ta_pol->publickey) {
             if (ta_pol->publickey->public_key)
                 FREE(ta_pol->publickey->public_key);
@@ -413,6 +911,119 @@ free_trust_anchor(policy_entry_t * pol_entry)
     return VAL_NO_ERROR;
 }
 
+#define TA_IMAGE_DNSKEY 1
+#define TA_IMAGE_DS     2
+
+/*
+ * The trust anchor is stored as a kind octet followed by the
+ * DNSKEY or DS rdata 
+ */
+int
+pack_trust_anchor(policy_entry_t * pol_entry, u_char *buf, size_t *buflen)
+{
+    struct trust_anchor_policy *ta_pol;
+    size_t          len;
+
+    if ((pol_entry == NULL) || (pol_entry->pol == NULL) || (buflen == NULL))
+        return VAL_BAD_ARGUMENT;
+
+    ta_pol = (struct trust_anchor_policy *)(pol_entry->pol);
+    if (ta_pol->ds)
+        len = 1 + 4 + ta_pol->ds->d_hash_len;
+    else
+        len = 1 + ta_pol->rdata_len;
+
+    if (buf != NULL) {
+        if (*buflen < len)
+            return VAL_BAD_ARGUMENT;
+        if (ta_pol->ds) {
+            *buf++ = TA_IMAGE_DS;
+            NS_PUT16(ta_pol->ds->d_keytag, buf);
+            *buf++ = ta_pol->ds->d_algo;
+            *buf++ = ta_pol->ds->d_type;
+            memcpy(buf, ta_pol->ds->d_hash, ta_pol->ds->d_hash_len);
+        } else {
+            *buf++ = TA_IMAGE_DNSKEY;
+            memcpy(buf, ta_pol->rdata, ta_pol->rdata_len);
+        }
+    }
+    *buflen = len;
+
+    return VAL_NO_ERROR;
+}
+
+int
+unpack_trust_anchor(const u_char *buf, size_t buflen, policy_entry_t * pol_entry)
+{
+    struct trust_anchor_policy *ta_pol;
+    int             retval;
+
+    if ((buf == NULL) || (pol_entry == NULL))
+        return VAL_BAD_ARGUMENT;
+    if (buflen < 1)
+        return VAL_CONF_PARSE_ERROR;
+
+    ta_pol = (struct trust_anchor_policy *)
+            MALLOC(sizeof(struct trust_anchor_policy));
+    if (ta_pol == NULL) {
+        return VAL_OUT_OF_MEMORY;
+    }
+    memset(ta_pol, 0, sizeof(struct trust_anchor_policy));
+
+    if (buf[0] == TA_IMAGE_DS) {
+        ta_pol->ds = (val_ds_rdata_t *) MALLOC(sizeof(val_ds_rdata_t));
+        if (ta_pol->ds == NULL) {
+            FREE(ta_pol);
+            return VAL_OUT_OF_MEMORY;
+        }
+        if (VAL_NO_ERROR !=
+            (retval = val_parse_ds_rdata(buf + 1, buflen - 1, ta_pol->ds))) {
+            FREE(ta_pol->ds);
+            FREE(ta_pol);
+            return retval;
+        }
+        ta_pol->key_tag = ta_pol->ds->d_keytag;
+        ta_pol->algorithm = ta_pol->ds->d_algo;
+
+    } else if (buf[0] == TA_IMAGE_DNSKEY) {
+        ta_pol->publickey = (val_dnskey_rdata_t *)
+            MALLOC(sizeof(val_dnskey_rdata_t));
+        if (ta_pol->publickey == NULL) {
+            FREE(ta_pol);
+            return VAL_OUT_OF_MEMORY;
+        }
+        if (VAL_NO_ERROR !=
+            (retval = val_parse_dnskey_rdata(buf + 1, buflen - 1,
+                                             ta_pol->publickey))) {
+            FREE(ta_pol->publickey);
+            FREE(ta_pol);
+            return retval;
+        }
+        ta_pol->publickey->next = NULL;
+        ta_pol->key_tag = ta_pol->publickey->key_tag;
+        ta_pol->algorithm = ta_pol->publickey->algorithm;
+
+        ta_pol->rdata_len = buflen - 1;
+        ta_pol->rdata = (u_char *) MALLOC(ta_pol->rdata_len);
+        if (ta_pol->rdata == NULL) {
+            if (ta_pol->publickey->public_key)
+                FREE(ta_pol->publickey->public_key);
+            FREE(ta_pol->publickey);
+            FREE(ta_pol);
+            return VAL_OUT_OF_MEMORY;
+        }
+        memcpy(ta_pol->rdata, buf + 1, ta_pol->rdata_len);
+
+    } else {
+        FREE(ta_pol);
+        return VAL_CONF_PARSE_ERROR;
+    }
+
+    pol_entry->pol = ta_pol;
+
+    return VAL_NO_ERROR;
+}
+
 /*
  * parse additional data (time in seconds) for the clock skew policy 
  */
@@ -453,11 +1064,44 @@ free_clock_skew(policy_entry_t * pol_entry)
     return VAL_NO_ERROR;
 }
 
-/*
- * parse additional data (trusted or untrusted) for the provably insecure status 
- */
 int
-parse_prov_insecure_status(char **buf_ptr, char *end_ptr, policy_entry_t * pol_entry, 
+pack_clock_skew(policy_entry_t * pol_entry, u_char *buf, size_t *buflen)
+{
+    if ((pol_entry == NULL) || (pol_entry->pol == NULL))
+        return VAL_BAD_ARGUMENT;
+    return pack_int(((struct clock_skew_policy *)(pol_entry->pol))->clock_skew,
+                    buf, buflen);
+}
+
+int
+unpack_clock_skew(const u_char *buf, size_t buflen, policy_entry_t * pol_entry)
+{
+    struct clock_skew_policy  *cs_pol;
+    int             retval;
+
+    if (pol_entry == NULL)
+        return VAL_BAD_ARGUMENT;
+
+    cs_pol = (struct clock_skew_policy *)
+            MALLOC(sizeof(struct clock_skew_policy));
+    if (cs_pol == NULL) {
+        return VAL_OUT_OF_MEMORY;
+    }
+    if (VAL_NO_ERROR !=
+            (retval = unpack_int(buf, buflen, &cs_pol->clock_skew))) {
+        FREE(cs_pol);
+        return retval;
+    }
+    pol_entry->pol = cs_pol;
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * parse additional data (trusted or untrusted) for the provably insecure status 
+ */
+int
+parse_prov_insecure_status(char **buf_ptr, char *end_ptr, policy_entry_t * pol_entry, 
                            int *line_number, int *endst)
 {
     char            pu_token[TOKEN_MAX];
@@ -499,6 +1143,41 @@ free_prov_insecure_status(policy_entry_t * pol_entry)
     return VAL_NO_ERROR;
 }
 
+int
+pack_prov_insecure_status(policy_entry_t * pol_entry, u_char *buf, size_t *buflen)
+{
+    if ((pol_entry == NULL) || (pol_entry->pol == NULL))
+        return VAL_BAD_ARGUMENT;
+    return pack_int(((struct prov_insecure_policy *)(pol_entry->pol))->trusted,
+                    buf, buflen);
+}
+
+int
+unpack_prov_insecure_status(const u_char *buf, size_t buflen, policy_entry_t * pol_entry)
+{
+    struct prov_insecure_policy *pu_pol;
+    int             retval;
+    int             zone_status;
+
+    if (pol_entry == NULL)
+        return VAL_BAD_ARGUMENT;
+
+    if (VAL_NO_ERROR != (retval = unpack_int(buf, buflen, &zone_status)))
+        return retval;
+    if (zone_status != ZONE_PU_TRUSTED && zone_status != ZONE_PU_UNTRUSTED)
+        return VAL_CONF_PARSE_ERROR;
+
+    pu_pol = (struct prov_insecure_policy *)
+            MALLOC(sizeof(struct prov_insecure_policy));
+    if (pu_pol == NULL) {
+        return VAL_OUT_OF_MEMORY;
+    }
+    pu_pol->trusted = zone_status;
+    pol_entry->pol = pu_pol;
+
+    return VAL_NO_ERROR;
+}
+
 /*
  * parse additional data (ignore, trusted, validate, untrusted) 
  * for the zone security expectation policy 
@@ -549,6 +1228,42 @@ free_zone_security_expectation(policy_entry_t * pol_entry)
     return VAL_NO_ERROR;
 }
 
+int
+pack_zone_security_expectation(policy_entry_t * pol_entry, u_char *buf, size_t *buflen)
+{
+    if ((pol_entry == NULL) || (pol_entry->pol == NULL))
+        return VAL_BAD_ARGUMENT;
+    return pack_int(((struct zone_se_policy *)(pol_entry->pol))->trusted,
+                    buf, buflen);
+}
+
+int
+unpack_zone_security_expectation(const u_char *buf, size_t buflen, policy_entry_t * pol_entry)
+{
+    struct zone_se_policy *zse_pol;
+    int             retval;
+    int             zone_status;
+
+    if (pol_entry == NULL)
+        return VAL_BAD_ARGUMENT;
+
+    if (VAL_NO_ERROR != (retval = unpack_int(buf, buflen, &zone_status)))
+        return retval;
+    if (zone_status != ZONE_SE_IGNORE && zone_status != ZONE_SE_DO_VAL &&
+            zone_status != ZONE_SE_UNTRUSTED)
+        return VAL_CONF_PARSE_ERROR;
+
+    zse_pol = (struct zone_se_policy *)
+            MALLOC(sizeof(struct zone_se_policy));
+    if (zse_pol == NULL) {
+        return VAL_OUT_OF_MEMORY;
+    }
+    zse_pol->trusted = zone_status;
+    pol_entry->pol = zse_pol;
+
+    return VAL_NO_ERROR;
+}
+
 
 #ifdef LIBVAL_NSEC3
 /*
@@ -592,6 +1307,38 @@ free_nsec3_max_iter(policy_entry_t * pol_entry)
     }
     return VAL_NO_ERROR;
 }
+
+int
+pack_nsec3_max_iter(policy_entry_t * pol_entry, u_char *buf, size_t *buflen)
+{
+    if ((pol_entry == NULL) || (pol_entry->pol == NULL))
+        return VAL_BAD_ARGUMENT;
+    return pack_int(((struct nsec3_max_iter_policy *)(pol_entry->pol))->iter,
+                    buf, buflen);
+}
+
+int
+unpack_nsec3_max_iter(const u_char *buf, size_t buflen, policy_entry_t * pol_entry)
+{
+    struct nsec3_max_iter_policy *pol;
+    int             retval;
+
+    if (pol_entry == NULL)
+        return VAL_BAD_ARGUMENT;
+
+    pol = (struct nsec3_max_iter_policy *)
+            MALLOC(sizeof(struct nsec3_max_iter_policy));
+    if (pol == NULL) {
+        return  VAL_OUT_OF_MEMORY;
+    }
+    if (VAL_NO_ERROR != (retval = unpack_int(buf, buflen, &pol->iter))) {
+        FREE(pol);
+        return retval;
+    }
+    pol_entry->pol = pol;
+
+    return VAL_NO_ERROR;
+}
 #endif
 
 #ifdef LIBVAL_DLV
@@ -650,6 +1397,57 @@ free_dlv_trust_points(policy_entry_t * pol_entry)
     return VAL_NO_ERROR;
 }
 
+/*
+ * The DLV trust point is stored as a wire format name
+ */
+int
+pack_dlv_trust_points(policy_entry_t * pol_entry, u_char *buf, size_t *buflen)
+{
+    u_char         *tp;
+    size_t          len;
+
+    if ((pol_entry == NULL) || (pol_entry->pol == NULL) || (buflen == NULL))
+        return VAL_BAD_ARGUMENT;
+
+    tp = ((struct dlv_policy *)(pol_entry->pol))->trust_point;
+    len = wire_name_length(tp);
+    if (buf != NULL) {
+        if (*buflen < len)
+            return VAL_BAD_ARGUMENT;
+        memcpy(buf, tp, len);
+    }
+    *buflen = len;
+
+    return VAL_NO_ERROR;
+}
+
+int
+unpack_dlv_trust_points(const u_char *buf, size_t buflen, policy_entry_t * pol_entry)
+{
+    struct dlv_policy *dlv_pol;
+
+    if ((buf == NULL) || (pol_entry == NULL))
+        return VAL_BAD_ARGUMENT;
+    if (buflen == 0 || policy_image_name_len(buf, buflen) != buflen)
+        return VAL_CONF_PARSE_ERROR;
+
+    dlv_pol = (struct dlv_policy *)
+            MALLOC(sizeof(struct dlv_policy));
+    if (dlv_pol == NULL) {
+        return VAL_OUT_OF_MEMORY;
+    }
+    dlv_pol->trust_point = (u_char *) MALLOC (buflen * sizeof(u_char));
+    if (dlv_pol->trust_point == NULL) {
+        FREE(dlv_pol);
+        return VAL_OUT_OF_MEMORY;
+    }
+    memcpy(dlv_pol->trust_point, buf, buflen);
+
+    pol_entry->pol = dlv_pol;
+
+    return VAL_NO_ERROR;
+}
+
 #endif
 
 /*
@@ -1549,91 +2347,720 @@ store_policy_overrides(struct policy_overrides **overrides,
     (*pfrag)->pol = NULL;
     FREE(*pfrag);
 
-    return VAL_NO_ERROR;
-}
+    return VAL_NO_ERROR;
+}
+
+void
+destroy_valpolovr(struct policy_overrides **po)
+{
+    struct policy_overrides *cur, *prev;
+
+    if ((NULL == po) || (NULL == *po))
+        return;
+
+    cur = *po;
+    while (cur) {
+        struct policy_list *plist, *plist_next;
+
+        prev = cur;
+        cur = cur->next;
+
+        FREE(prev->label);
+        for (plist = prev->plist; plist; plist = plist_next) {
+            plist_next = plist->next;
+            if ((plist->pol != NULL) && (plist->index < MAX_POL_TOKEN)) {
+                free_policy_entry(plist->pol, plist->index);
+                plist->pol = NULL;
+            }
+            FREE(plist);
+        }
+        FREE(prev);
+    }
+    *po = NULL;
+}
+
+void
+destroy_valpol(val_context_t * ctx)
+{
+    int             i;
+    struct dnsval_list *dnsval_c;
+    
+    if (ctx == NULL)
+        return;
+
+    /* free the list of dnsval_conf files */
+    dnsval_c = ctx->dnsval_l;
+    while (dnsval_c) {
+        struct dnsval_list *dnsval_n;
+        dnsval_n = dnsval_c->next;
+        if (dnsval_c->dnsval_conf)
+            FREE(dnsval_c->dnsval_conf);
+        FREE(dnsval_c);
+        dnsval_c = dnsval_n;
+    }
+    
+    destroy_policy_tries(ctx);
+
+    for (i = 0; i < MAX_POL_TOKEN; i++) {
+        /* Free this list */
+        if (ctx->e_pol[i]) {
+            free_policy_entry(ctx->e_pol[i], i);
+        }
+        ctx->e_pol[i] = NULL;
+    }
+
+    if (ctx->g_opt) {
+        /*XXX should stop logging to current channel */
+        free_global_options(ctx->g_opt);
+        FREE(ctx->g_opt);
+        ctx->g_opt = NULL;
+    }
+}
+
+
+#if defined(__linux__) && !defined(eabi)
+#define getprogname() program_invocation_short_name 
+#endif
+#ifdef solaris2
+#define getprogname() getexecname()
+#endif
+#ifdef WIN32
+#define getprogname() NULL
+#endif
+#ifdef __OpenBSD__
+#define getprogname() NULL
+#endif
+#ifdef eabi
+#define getprogname() NULL
+#endif
+
+/*
+ * Adopt the global options gt_opt, read from line_number of dnsval_c.
+ * gt_opt is consumed.  Returns 1 if the options select a different
+ * policy label, in which case the caller must read the file again
+ * with *next_label as the scope.
+ */
+static int
+use_global_options(val_context_t *ctx, 
+                   const char *label, 
+                   struct dnsval_list *dnsval_c, 
+                   struct dnsval_list *dlist,
+                   val_global_opt_t **g_opt,
+                   val_global_opt_t *gt_opt,
+                   int line_number,
+                   const char **next_label)
+{
+    if (*g_opt || (dnsval_c != dlist)) {
+        /* 
+         * re-definition of global options 
+         * or global options was not in the first file
+         */
+        val_log(ctx, LOG_WARNING, 
+                "use_global_options(): Ignoring global options from line %d of %s",
+                line_number, dnsval_c->dnsval_conf);
+        free_global_options(gt_opt);
+        FREE(gt_opt);
+        return 0;
+    } 
+
+    *g_opt = gt_opt;
+    val_log(ctx, LOG_DEBUG, 
+            "use_global_options(): Using global options from line %d of %s",
+            line_number, dnsval_c->dnsval_conf);
+    
+    if (gt_opt->env_policy == VAL_POL_GOPT_OVERRIDE ||
+            (label == NULL && gt_opt->env_policy == VAL_POL_GOPT_ENABLE)) {
+        *next_label = getenv(VAL_CONTEXT_LABEL);
+        if (*next_label != NULL) {
+            val_log(ctx, LOG_NOTICE, 
+                    "use_global_options(): Using policy label from environment: %s",
+                    *next_label);
+            return 1;
+        }
+        /* policy does not exist, dont create the impression that we have one */
+        gt_opt->env_policy = VAL_POL_GOPT_DISABLE;
+        *next_label = label;
+    } 
+    if (gt_opt->app_policy == VAL_POL_GOPT_OVERRIDE ||
+            (label == NULL && gt_opt->app_policy == VAL_POL_GOPT_ENABLE)) {
+        const char *c_next_label = getprogname();
+        if (c_next_label != NULL) {
+            val_log(ctx, LOG_NOTICE, 
+                    "use_global_options(): Using policy label from app name: %s",
+                    c_next_label);
+            *next_label = (const char *)c_next_label;
+            return 1;
+        }
+        /* policy does not exist, dont create the impression that we have one */
+        gt_opt->app_policy = VAL_POL_GOPT_DISABLE;
+        *next_label = label;
+    }
+
+    return 0;
+}
+
+/*
+ * Append the file named in token (a TOKEN_MAX buffer, in which any
+ * environment variable reference is expanded) to the list of files
+ * included from dnsval_c.  *dnsval_l is the last file added so far.
+ */
+static int
+add_included_file(val_context_t *ctx,
+                  char *token,
+                  struct dnsval_list *dnsval_c, 
+                  struct dnsval_list *dlist, 
+                  struct dnsval_list **added_files,
+                  struct dnsval_list **dnsval_l,
+                  int line_number)
+{
+    struct dnsval_list *dnsval_temp;
+    char *dnsval_filename = NULL;
+    char *env = NULL;
+
+    /* expand any environment variables */
+    if (NULL != (env = strchr(token, '$'))) {
+        char env_token[TOKEN_MAX];
+        char *cp1, *cp2, *cp3;
+        int len;
+
+        strcpy(env_token, "");
+        cp1 = env_token;
+
+        cp2 = env;
+        cp2++; /* next character after $ */
+
+        /* get the variable name in cp1 */
+        while ((*cp2 != '\0') && isalnum(*cp2)) {
+            *cp1 = *cp2;
+            cp1++; cp2++;
+        }
+        *cp1 = '\0';
+        
+        /* get the value in cp1 */
+        if ((NULL == (cp1 = getenv(env_token))) ||
+            (strlen(token) + strlen(cp1) - strlen(env_token) 
+                >= TOKEN_MAX)) {
+
+            val_log(ctx, LOG_ERR, 
+                "add_included_file(): Unknown environment"
+                "variable in line %d of %s ", 
+                line_number, dnsval_c->dnsval_conf);
+            return VAL_CONF_PARSE_ERROR;
+        } 
+
+        /* save the length of the reference */
+        /* Add 1 for the $ character */
+        len = strlen(env_token) + 1; 
+        
+        /* cp3 will contain the complete expanded file name */
+        strcpy(env_token, "");
+        cp3 = env_token;
+
+        /* 
+         *  the value of the env variable is in cp1, 
+         *  env points to the string of length len where it is 
+         *  referenced.
+         *  Replace reference with value and store in env_token. 
+         */
+        cp2 = token;
+        while (*cp2 != '\0' && cp2 < env) { 
+            *cp3 = *cp2;
+            cp3++; cp2++;
+        }
+        while (*cp1 != '\0') {
+            *cp3 = *cp1;
+            cp3++; cp1++; 
+        }
+        cp2 = env + len;
+        while (*cp2 != '\0') { 
+            *cp3 = *cp2;
+            cp3++; cp2++; 
+        }
+        *cp3 = '\0';
+
+        strcpy(token, env_token);
+    } 
+
+    /* check if filename already exists in the list */
+    for (dnsval_temp=dlist; dnsval_temp; dnsval_temp=dnsval_temp->next) {
+        if (!strcmp(dnsval_temp->dnsval_conf, token)) {
+            val_log(ctx, LOG_ERR, 
+                    "add_included_file(): File already included, possible loop in line %d of %s ",
+                    line_number, dnsval_c->dnsval_conf);
+            return VAL_CONF_PARSE_ERROR;
+        }
+    } 
+
+    dnsval_filename = strdup(token);
+    if (dnsval_filename == NULL) {
+        return VAL_OUT_OF_MEMORY;
+    }
+    dnsval_temp = (struct dnsval_list *) MALLOC (sizeof(struct dnsval_list));
+    if (dnsval_temp == NULL) {
+        FREE(dnsval_filename);
+        return VAL_OUT_OF_MEMORY;
+    }
+    dnsval_temp->dnsval_conf = dnsval_filename; 
+    dnsval_temp->next = NULL;
+
+    if (*dnsval_l) {
+        (*dnsval_l)->next = dnsval_temp;
+    } else {
+        *added_files = dnsval_temp;
+    }
+    *dnsval_l = dnsval_temp;
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ ***************************************************************
+ * Compiled policy images.  
+ *
+ * val_policy_compile() writes the global options, include 
+ * directives and policy fragments of a configuration file, in 
+ * file order and with every entry already parsed, to 
+ * <file>.bin.  read_policy_image() maps that image and rebuilds 
+ * the same overrides as read_next_val_config_file() would from 
+ * the text, as long as the source file has not changed since 
+ * the image was written.
+ ***************************************************************
+ */
+
+static char *
+policy_image_name(const char *dnsval_conf)
+{
+    char *image;
+    size_t len = strlen(dnsval_conf);
+
+    image = (char *) MALLOC(len + strlen(POL_IMAGE_SUFFIX) + 1);
+    if (image == NULL)
+        return NULL;
+    memcpy(image, dnsval_conf, len);
+    strcpy(image + len, POL_IMAGE_SUFFIX);
+    return image;
+}
+
+static u_int32_t
+policy_image_checksum(const u_char *cp, size_t len)
+{
+    u_int32_t h = 2166136261U;
+
+    while (len-- > 0) {
+        h ^= *cp++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/*
+ * Decode a global-options record.  With g_opt NULL the record is
+ * only checked.
+ */
+static int
+decode_image_gopt(const u_char *cp, size_t len, val_global_opt_t **g_opt)
+{
+    const u_char *end = cp + len;
+    u_int32_t v[10];
+    u_int16_t slen;
+    int i;
+
+    if (len < sizeof(v)/sizeof(v[0]) * NS_INT32SZ + NS_INT16SZ)
+        return VAL_CONF_PARSE_ERROR;
+    for (i = 0; i < sizeof(v)/sizeof(v[0]); i++) {
+        VAL_GET32(v[i], cp);
+    }
+    VAL_GET16(slen, cp);
+    if (end - cp != slen || memchr(cp, '\0', slen) != NULL)
+        return VAL_CONF_PARSE_ERROR;
+
+    if (g_opt == NULL)
+        return VAL_NO_ERROR;
+
+    *g_opt = (val_global_opt_t *) MALLOC (sizeof (val_global_opt_t));
+    if (*g_opt == NULL)
+        return VAL_OUT_OF_MEMORY;
+    set_global_opt_defaults(*g_opt);
+    (*g_opt)->local_is_trusted = (int) v[0];
+    (*g_opt)->edns0_size = (long) (int) v[1];
+    (*g_opt)->env_policy = (int) v[2];
+    (*g_opt)->app_policy = (int) v[3];
+    (*g_opt)->closest_ta_only = (int) v[4];
+    (*g_opt)->rec_fallback = (int) v[5];
+    (*g_opt)->max_refresh = (long) (int) v[6];
+    (*g_opt)->proto = (int) v[7];
+    (*g_opt)->timeout = (int) v[8];
+    (*g_opt)->retry = (int) v[9];
+    if (slen > 0) {
+        (*g_opt)->log_target = (char *) MALLOC(slen + 1);
+        if ((*g_opt)->log_target == NULL) {
+            FREE(*g_opt);
+            *g_opt = NULL;
+            return VAL_OUT_OF_MEMORY;
+        }
+        memcpy((*g_opt)->log_target, cp, slen);
+        (*g_opt)->log_target[slen] = '\0';
+    }
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Decode a policy fragment record.  With pol_frag NULL the record is
+ * only checked; otherwise *pol_frag is set if the fragment is relevant
+ * to scope, and left NULL if it is not.  The entries were written in 
+ * list order, so they are simply appended.
+ */
+static int
+decode_image_fragment(const u_char *cp, size_t len, const char *scope,
+                      struct policy_fragment **pol_frag)
+{
+    const u_char *end = cp + len;
+    u_int16_t label_len, plen;
+    u_int32_t count;
+    size_t kw_len, name_len;
+    char *label = NULL;
+    int label_count;
+    int relevant = 1;
+    policy_entry_t *pol = NULL, *tail = NULL, *pol_entry;
+    int index = 0;
+    int retval;
+
+#define IMAGE_NEED(n) do {\
+    if ((size_t)(end - cp) < (size_t)(n)) {\
+        retval = VAL_CONF_PARSE_ERROR;\
+        goto err;\
+    }\
+} while (0)
+
+    IMAGE_NEED(NS_INT16SZ);
+    VAL_GET16(label_len, cp);
+    IMAGE_NEED(label_len + 1);
+    if (label_len == 0 || memchr(cp, '\0', label_len) != NULL)
+        return VAL_CONF_PARSE_ERROR;
+    if (pol_frag != NULL) {
+        label = (char *) MALLOC(label_len + 1);
+        if (label == NULL)
+            return VAL_OUT_OF_MEMORY;
+        memcpy(label, cp, label_len);
+        label[label_len] = '\0';
+    }
+    cp += label_len;
+
+    kw_len = *cp++;
+    IMAGE_NEED(kw_len + NS_INT32SZ);
+    for (index = 0; index < MAX_POL_TOKEN; index++) {
+        if (strlen(conf_elem_array[index].keyword) == kw_len &&
+            !strncmp((const char *)cp, conf_elem_array[index].keyword, kw_len))
+            break;
+    }
+    if (index == MAX_POL_TOKEN) {
+        /* not supported by this build of the library */
+        retval = VAL_CONF_PARSE_ERROR;
+        goto err;
+    }
+    cp += kw_len;
+    VAL_GET32(count, cp);
+
+    if (label != NULL) {
+        if (VAL_NO_ERROR != 
+                (retval = check_relevance(label, scope, &label_count, &relevant)))
+            goto err;
+    }
+
+    while (count-- > 0) {
+        name_len = policy_image_name_len(cp, end - cp);
+        if (name_len == 0) {
+            retval = VAL_CONF_PARSE_ERROR;
+            goto err;
+        }
+        IMAGE_NEED(name_len + NS_INT16SZ);
+        cp += name_len;
+        VAL_GET16(plen, cp);
+        IMAGE_NEED(plen);
+
+        if (label != NULL && relevant) {
+            pol_entry = (policy_entry_t *) MALLOC (sizeof(policy_entry_t));
+            if (pol_entry == NULL) {
+                retval = VAL_OUT_OF_MEMORY;
+                goto err;
+            }
+            memcpy(pol_entry->zone_n, cp - NS_INT16SZ - name_len, name_len);
+            pol_entry->exp_ttl = 0;
+            pol_entry->next = NULL;
+            pol_entry->pol = NULL;
+            if (VAL_NO_ERROR != 
+                    (retval = conf_elem_array[index].unpack(cp, plen, pol_entry))) {
+                FREE(pol_entry);
+                goto err;
+            }
+            if (tail)
+                tail->next = pol_entry;
+            else
+                pol = pol_entry;
+            tail = pol_entry;
+        }
+        cp += plen;
+    }
+    if (cp != end) {
+        retval = VAL_CONF_PARSE_ERROR;
+        goto err;
+    }
+#undef IMAGE_NEED
+
+    if (label == NULL)
+        return VAL_NO_ERROR;
+    if (!relevant) {
+        FREE(label);
+        return VAL_NO_ERROR;
+    }
+
+    *pol_frag =
+        (struct policy_fragment *) MALLOC(sizeof(struct policy_fragment));
+    if (*pol_frag == NULL) {
+        retval = VAL_OUT_OF_MEMORY;
+        goto err;
+    }
+    (*pol_frag)->label = label;
+    (*pol_frag)->label_count = label_count;
+    (*pol_frag)->index = index;
+    (*pol_frag)->pol = pol;
+
+    return VAL_NO_ERROR;
+
+err:
+    if (pol)
+        free_policy_entry(pol, index);
+    if (label)
+        FREE(label);
+    return retval;
+}
+
+/*
+ * Check the header and the structure of every record of the image,
+ * so that a stale, truncated or foreign image can be ignored before
+ * anything is taken from it.
+ */
+static int
+check_policy_image(const u_char *base, size_t size, struct stat *sb,
+                   u_int32_t *nrec)
+{
+    const u_char *cp = base;
+    const u_char *end = base + size;
+    u_int16_t version;
+    u_int32_t hi, lo, length, cksum, i, len;
+    u_int64_t mtime, fsize;
+    u_char type;
+
+    if (size < POL_IMAGE_HDR_LEN || 
+            memcmp(cp, POL_IMAGE_MAGIC, strlen(POL_IMAGE_MAGIC)))
+        return VAL_CONF_PARSE_ERROR;
+    cp += strlen(POL_IMAGE_MAGIC);
+    VAL_GET16(version, cp);
+    cp += NS_INT16SZ;
+    VAL_GET32(hi, cp);
+    VAL_GET32(lo, cp);
+    mtime = ((u_int64_t) hi << 32) | lo;
+    VAL_GET32(hi, cp);
+    VAL_GET32(lo, cp);
+    fsize = ((u_int64_t) hi << 32) | lo;
+    VAL_GET32(*nrec, cp);
+    VAL_GET32(length, cp);
+    VAL_GET32(cksum, cp);
+
+    if (version != POL_IMAGE_VERSION || length != size ||
+            cksum != policy_image_checksum(cp, end - cp))
+        return VAL_CONF_PARSE_ERROR;
+    if (mtime != (u_int64_t) sb->st_mtime || fsize != (u_int64_t) sb->st_size)
+        return VAL_CONF_NOT_FOUND;
+
+    for (i = 0; i < *nrec; i++) {
+        if (end - cp < POL_IMAGE_REC_HDR_LEN)
+            return VAL_CONF_PARSE_ERROR;
+        type = *cp;
+        cp += 1 + NS_INT32SZ;
+        VAL_GET32(len, cp);
+        if ((size_t)(end - cp) < len)
+            return VAL_CONF_PARSE_ERROR;
+        if ((type == POL_IMAGE_REC_GOPT && 
+                VAL_NO_ERROR != decode_image_gopt(cp, len, NULL)) ||
+            (type == POL_IMAGE_REC_INCLUDE &&
+                (len == 0 || len >= TOKEN_MAX || memchr(cp, '\0', len))) ||
+            (type == POL_IMAGE_REC_FRAGMENT &&
+                VAL_NO_ERROR != decode_image_fragment(cp, len, NULL, NULL)) ||
+            (type != POL_IMAGE_REC_GOPT && type != POL_IMAGE_REC_INCLUDE &&
+                type != POL_IMAGE_REC_FRAGMENT))
+            return VAL_CONF_PARSE_ERROR;
+        cp += len;
+    }
+    if (cp != end)
+        return VAL_CONF_PARSE_ERROR;
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Read the policy for dnsval_c from its compiled image.  *loaded is
+ * left at 0, with nothing changed, if there is no usable image and
+ * the text must be parsed instead.
+ */
+static int
+read_policy_image(val_context_t *ctx, 
+                  const char **label, 
+                  struct dnsval_list *dnsval_c, 
+                  struct dnsval_list *dlist, 
+                  struct dnsval_list **added_files,
+                  struct policy_overrides **overrides,
+                  val_global_opt_t **g_opt,
+                  int *loaded)
+{
+    char *image = NULL;
+    int fd = -1;
+    struct stat sb, isb;
+    u_char *base = NULL;
+    size_t size = 0;
+    const u_char *cp;
+    u_int32_t nrec, i, line, len;
+    u_char type;
+    char token[TOKEN_MAX];
+    struct policy_fragment *pol_frag = NULL;
+    struct dnsval_list *dnsval_l;
+    const char *next_label;
+    int restart;
+    int retval = VAL_NO_ERROR;
+
+    *loaded = 0;
+
+    if (0 != stat(dnsval_c->dnsval_conf, &sb))
+        return VAL_NO_ERROR;
+    if (NULL == (image = policy_image_name(dnsval_c->dnsval_conf)))
+        return VAL_NO_ERROR;
+    fd = open(image, O_RDONLY);
+    if (fd < 0) {
+        FREE(image);
+        return VAL_NO_ERROR;
+    }
+    if (0 != fstat(fd, &isb) || isb.st_size < POL_IMAGE_HDR_LEN) {
+        val_log(ctx, LOG_WARNING, 
+                "read_policy_image(): Ignoring unusable policy image %s", image);
+        goto done;
+    }
+    size = isb.st_size;
+#ifdef HAVE_SYS_MMAN_H
+    base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        base = NULL;
+        goto done;
+    }
+#else
+    base = (u_char *) MALLOC(size);
+    if (base == NULL)
+        goto done;
+    if (read(fd, base, size) != (int) size) {
+        FREE(base);
+        base = NULL;
+        goto done;
+    }
+#endif
+    close(fd);
+    fd = -1;
+
+    retval = check_policy_image(base, size, &sb, &nrec);
+    if (retval == VAL_CONF_NOT_FOUND) {
+        val_log(ctx, LOG_INFO, 
+                "read_policy_image(): Policy image %s is out of date with %s",
+                image, dnsval_c->dnsval_conf);
+        retval = VAL_NO_ERROR;
+        goto done;
+    } else if (retval != VAL_NO_ERROR) {
+        val_log(ctx, LOG_WARNING, 
+                "read_policy_image(): Ignoring unusable policy image %s", image);
+        retval = VAL_NO_ERROR;
+        goto done;
+    }
+
+    /* from here on the image is authoritative */
+    *loaded = 1;
+    *added_files = NULL;
+    next_label = *label;
 
-void
-destroy_valpolovr(struct policy_overrides **po)
-{
-    struct policy_overrides *cur, *prev;
+    val_log(ctx, LOG_NOTICE, "read_policy_image(): Reading validator policy from %s",
+            image);
 
-    if ((NULL == po) || (NULL == *po))
-        return;
+    do {
+        restart = 0;
 
-    cur = *po;
-    while (cur) {
-        struct policy_list *plist, *plist_next;
+        if (*added_files) {
+            FREE_DNSVAL_FILE_LIST(*added_files);
+            *added_files = NULL;
+        }
+        /* if we're looping again for the first file, trash our temporary overrides */
+        if (*overrides && dnsval_c == dlist) {
+            destroy_valpolovr(overrides);
+            *overrides = NULL;
+        }
+        dnsval_l = NULL;
 
-        prev = cur;
-        cur = cur->next;
+        cp = base + POL_IMAGE_HDR_LEN;
+        for (i = 0; i < nrec && !restart; i++) {
+            type = *cp++;
+            VAL_GET32(line, cp);
+            VAL_GET32(len, cp);
 
-        FREE(prev->label);
-        for (plist = prev->plist; plist; plist = plist_next) {
-            plist_next = plist->next;
-            if ((plist->pol != NULL) && (plist->index < MAX_POL_TOKEN)) {
-                free_policy_entry(plist->pol, plist->index);
-                plist->pol = NULL;
+            if (type == POL_IMAGE_REC_GOPT) {
+                val_global_opt_t *gt_opt = NULL;
+                if (VAL_NO_ERROR != (retval = 
+                        decode_image_gopt(cp, len, &gt_opt)))
+                    goto err;
+                restart = use_global_options(ctx, *label, dnsval_c, dlist,
+                                             g_opt, gt_opt, line, 
+                                             &next_label);
+            } else if (type == POL_IMAGE_REC_INCLUDE) {
+                memcpy(token, cp, len);
+                token[len] = '\0';
+                if (VAL_NO_ERROR != (retval = 
+                        add_included_file(ctx, token, dnsval_c, dlist,
+                                          added_files, &dnsval_l, line)))
+                    goto err;
+            } else {
+                if (VAL_NO_ERROR != (retval = 
+                        decode_image_fragment(cp, len, next_label, &pol_frag))) {
+                    val_log(ctx, LOG_ERR, 
+                            "read_policy_image(): Error in policy from line %d of %s",
+                            line, dnsval_c->dnsval_conf);
+                    goto err;
+                }
+                if (pol_frag) {
+                    /* Store this fragment as an override, consume pol_frag */
+                    store_policy_overrides(overrides, &pol_frag);
+                    pol_frag = NULL;
+                }
             }
-            FREE(plist);
+            cp += len;
         }
-        FREE(prev);
-    }
-    *po = NULL;
-}
+    } while (restart);
 
-void
-destroy_valpol(val_context_t * ctx)
-{
-    int             i;
-    struct dnsval_list *dnsval_c;
-    
-    if (ctx == NULL)
-        return;
+    dnsval_c->v_timestamp = sb.st_mtime;
+    *label = next_label;
+    retval = VAL_NO_ERROR;
+    goto done;
 
-    /* free the list of dnsval_conf files */
-    dnsval_c = ctx->dnsval_l;
-    while (dnsval_c) {
-        struct dnsval_list *dnsval_n;
-        dnsval_n = dnsval_c->next;
-        if (dnsval_c->dnsval_conf)
-            FREE(dnsval_c->dnsval_conf);
-        FREE(dnsval_c);
-        dnsval_c = dnsval_n;
-    }
-    
-    for (i = 0; i < MAX_POL_TOKEN; i++) {
-        /* Free this list */
-        if (ctx->e_pol[i]) {
-            free_policy_entry(ctx->e_pol[i], i);
-        }
-        ctx->e_pol[i] = NULL;
-    }
+err:
+    FREE_DNSVAL_FILE_LIST(*added_files);
 
-    if (ctx->g_opt) {
-        /*XXX should stop logging to current channel */
-        free_global_options(ctx->g_opt);
-        FREE(ctx->g_opt);
-        ctx->g_opt = NULL;
+done:
+    if (base) {
+#ifdef HAVE_SYS_MMAN_H
+        munmap(base, size);
+#else
+        FREE(base);
+#endif
     }
+    if (fd != -1)
+        close(fd);
+    FREE(image);
+    return retval;
 }
 
-
-#if defined(__linux__) && !defined(eabi)
-#define getprogname() program_invocation_short_name 
-#endif
-#ifdef solaris2
-#define getprogname() getexecname()
-#endif
-#ifdef WIN32
-#define getprogname() NULL
-#endif
-#ifdef __OpenBSD__
-#define getprogname() NULL
-#endif
-#ifdef eabi
-#define getprogname() NULL
-#endif
-
 static int
 read_next_val_config_file(val_context_t *ctx, 
                           const char **label, 
@@ -1657,12 +3084,11 @@ read_next_val_config_file(val_context_t *ctx,
     struct policy_fragment *pol_frag = NULL;
     int g_opt_seen = 0;
     int include_seen = 0;
-    char *dnsval_filename = NULL;
     struct dnsval_list *dnsval_l;
     int retval = VAL_NO_ERROR;
     const char *next_label;
     int done;
-    char *env = NULL;
+    int loaded = 0;
 
     if (ctx == NULL || label == NULL || 
         dnsval_c == NULL || dlist == NULL ||
@@ -1675,6 +3101,12 @@ read_next_val_config_file(val_context_t *ctx,
     *added_files = NULL;
 
     next_label = *label;
+
+    /* use the compiled policy image instead, if it is up to date */
+    retval = read_policy_image(ctx, label, dnsval_c, dlist, added_files,
+                               overrides, g_opt, &loaded);
+    if (retval != VAL_NO_ERROR || loaded)
+        return retval;
    
     fd = open(dnsval_c->dnsval_conf, O_RDONLY);
 
@@ -1786,56 +3218,14 @@ read_next_val_config_file(val_context_t *ctx,
                     goto err;
                 }
     
-                if (*g_opt || (dnsval_c != dlist)) {
-                    /* 
-                     * re-definition of global options 
-                     * or global options was not in the first file
-                     */
-                    val_log(ctx, LOG_WARNING, 
-                            "read_next_val_config_file(): Ignoring global options from line %d of %s",
-                            line_number, dnsval_c->dnsval_conf);
-                    free_global_options(gt_opt);
-                    FREE(gt_opt);
-                    gt_opt = NULL;
-                } else {
-                    *g_opt = gt_opt;
-                    val_log(ctx, LOG_DEBUG, 
-                            "read_next_val_config_file(): Using global options from line %d of %s",
-                            line_number, dnsval_c->dnsval_conf);
-                    
-                    if (gt_opt->env_policy == VAL_POL_GOPT_OVERRIDE ||
-                            (*label == NULL && gt_opt->env_policy == VAL_POL_GOPT_ENABLE)) {
-                        next_label = getenv(VAL_CONTEXT_LABEL);
-                        if (next_label != NULL) {
-                            val_log(ctx, LOG_NOTICE, 
-                                    "read_next_val_config_file(): Using policy label from environment: %s",
-                                    next_label);
-                            done = 0;
-                            break;
-                        }
-                        /* policy does not exist, dont create the impression that we have one */
-                        gt_opt->env_policy = VAL_POL_GOPT_DISABLE;
-                        next_label = *label;
-                    } 
-                    if (gt_opt->app_policy == VAL_POL_GOPT_OVERRIDE ||
-                            (*label == NULL && gt_opt->app_policy == VAL_POL_GOPT_ENABLE)) {
-                        const char *c_next_label = getprogname();
-                        if (c_next_label != NULL) {
-                            val_log(ctx, LOG_NOTICE, 
-                                    "read_next_val_config_file(): Using policy label from app name: %s",
-                                    c_next_label);
-                            done = 0;
-                            next_label = (const char *)c_next_label;
-                            break;
-                        }
-                        /* policy does not exist, dont create the impression that we have one */
-                        gt_opt->app_policy = VAL_POL_GOPT_DISABLE;
-                        next_label = *label;
-                    }
-                } 
+                if (use_global_options(ctx, *label, dnsval_c, dlist, 
+                                       g_opt, gt_opt, line_number, 
+                                       &next_label)) {
+                    done = 0;
+                    break;
+                }
             } else if (include_seen) { 
                 /* need to include another file */
-                struct dnsval_list *dnsval_temp;
                 include_seen = 0;
                 /* read the filename in the next token */
                 if (VAL_NO_ERROR != (retval = 
@@ -1855,102 +3245,12 @@ read_next_val_config_file(val_context_t *ctx,
                     goto err;
                 }
 
-                /* expand any environment variables */
-                if (NULL != (env = strchr(token, '$'))) {
-                    char env_token[TOKEN_MAX];
-                    char *cp1, *cp2, *cp3;
-                    int len;
-
-                    strcpy(env_token, "");
-                    cp1 = env_token;
-
-                    cp2 = env;
-                    cp2++; /* next character after $ */
-
-                    /* get the variable name in cp1 */
-                    while ((*cp2 != '\0') && isalnum(*cp2)) {
-                        *cp1 = *cp2;
-                        cp1++; cp2++;
-                    }
-                    *cp1 = '\0';
-                    
-                    /* get the value in cp1 */
-                    if ((NULL == (cp1 = getenv(env_token))) ||
-                        (strlen(token) + strlen(cp1) - strlen(env_token) 
-                            >= TOKEN_MAX)) {
-
-                        val_log(ctx, LOG_ERR, 
-                            "read_next_val_config_file(): Unknown environment"
-                            "variable in line %d of %s ", 
-                            line_number, dnsval_c->dnsval_conf);
-                        retval = VAL_CONF_PARSE_ERROR;
-                        goto err;
-                    } 
-
-                    /* save the length of the reference */
-                    /* Add 1 for the $ character */
-                    len = strlen(env_token) + 1; 
-                    
-                    /* cp3 will contain the complete expanded file name */
-                    strcpy(env_token, "");
-                    cp3 = env_token;
-
-                    /* 
-                     *  the value of the env variable is in cp1, 
-                     *  env points to the string of length len where it is 
-                     *  referenced.
-                     *  Replace reference with value and store in env_token. 
-                     */
-                    cp2 = token;
-                    while (*cp2 != '\0' && cp2 < env) { 
-                        *cp3 = *cp2;
-                        cp3++; cp2++;
-                    }
-                    while (*cp1 != '\0') {
-                        *cp3 = *cp1;
-                        cp3++; cp1++; 
-                    }
-                    cp2 = env + len;
-                    while (*cp2 != '\0') { 
-                        *cp3 = *cp2;
-                        cp3++; cp2++; 
-                    }
-                    *cp3 = '\0';
-
-                    strcpy(token, env_token);
-                } 
-    
-                /* check if filename already exists in the list */
-                for (dnsval_temp=dlist; dnsval_temp; dnsval_temp=dnsval_temp->next) {
-                    if (!strcmp(dnsval_temp->dnsval_conf, token)) {
-                        val_log(ctx, LOG_ERR, 
-                                "read_next_val_config_file(): File already included, possible loop in line %d of %s ",
-                                line_number, dnsval_c->dnsval_conf);
-                        retval = VAL_CONF_PARSE_ERROR;
-                        goto err;
-                    }
-                } 
-    
-                dnsval_filename = strdup(token);
-                if (dnsval_filename == NULL) {
-                    retval = VAL_OUT_OF_MEMORY;
-                    goto err;
-                }
-                dnsval_temp = (struct dnsval_list *) MALLOC (sizeof(struct dnsval_list));
-                if (dnsval_temp == NULL) {
-                    FREE(dnsval_filename);
-                    retval = VAL_OUT_OF_MEMORY;
+                if (VAL_NO_ERROR != (retval = 
+                        add_included_file(ctx, token, dnsval_c, dlist,
+                                          added_files, &dnsval_l,
+                                          line_number))) {
                     goto err;
                 }
-                dnsval_temp->dnsval_conf = dnsval_filename; 
-                dnsval_temp->next = NULL;
-    
-                if (dnsval_l) {
-                    dnsval_l->next = dnsval_temp;
-                } else {
-                    *added_files = dnsval_temp;
-                }
-                dnsval_l = dnsval_temp;
             } else {
                 /*
                  * Store this fragment as an override, consume pol_frag 
@@ -2124,6 +3424,9 @@ skipfileread:
         }
     }
 
+    if (VAL_NO_ERROR != (retval = build_policy_tries(ctx)))
+        goto err;
+
     /* if there are no global options defined set defaults here */
     if (g_opt == NULL) {
         g_opt = (val_global_opt_t *) MALLOC (sizeof (val_global_opt_t));
@@ -2198,6 +3501,356 @@ err:
     return retval;
 }
 
+struct policy_image_buf {
+    u_char *data;
+    size_t len;
+    size_t size;
+    u_int32_t nrec;
+};
+
+/*
+ * Make room for len more bytes at the end of the image 
+ */
+static u_char *
+policy_image_reserve(struct policy_image_buf *img, size_t len)
+{
+    u_char *p;
+
+    if (img->len + len > img->size) {
+        size_t size = img->size ? img->size : 4096;
+        while (size < img->len + len)
+            size *= 2;
+        p = (u_char *) MALLOC(size);
+        if (p == NULL)
+            return NULL;
+        if (img->data) {
+            memcpy(p, img->data, img->len);
+            FREE(img->data);
+        }
+        img->data = p;
+        img->size = size;
+    }
+    p = img->data + img->len;
+    img->len += len;
+    return p;
+}
+
+static u_char *
+policy_image_add_record(struct policy_image_buf *img, u_char type,
+                        int line_number, size_t len)
+{
+    u_char *cp;
+
+    if (len > 0xffffffff)
+        return NULL;
+    cp = policy_image_reserve(img, POL_IMAGE_REC_HDR_LEN + len);
+    if (cp == NULL)
+        return NULL;
+    *cp++ = type;
+    NS_PUT32(line_number, cp);
+    NS_PUT32(len, cp);
+    img->nrec++;
+    return cp;
+}
+
+static int
+policy_image_add_gopt(struct policy_image_buf *img, int line_number,
+                      val_global_opt_t *g)
+{
+    u_char *cp;
+    size_t slen = g->log_target ? strlen(g->log_target) : 0;
+
+    if (slen > 0xffff)
+        return VAL_CONF_PARSE_ERROR;
+    cp = policy_image_add_record(img, POL_IMAGE_REC_GOPT, line_number,
+                                 10 * NS_INT32SZ + NS_INT16SZ + slen);
+    if (cp == NULL)
+        return VAL_OUT_OF_MEMORY;
+    NS_PUT32(g->local_is_trusted, cp);
+    NS_PUT32(g->edns0_size, cp);
+    NS_PUT32(g->env_policy, cp);
+    NS_PUT32(g->app_policy, cp);
+    NS_PUT32(g->closest_ta_only, cp);
+    NS_PUT32(g->rec_fallback, cp);
+    NS_PUT32(g->max_refresh, cp);
+    NS_PUT32(g->proto, cp);
+    NS_PUT32(g->timeout, cp);
+    NS_PUT32(g->retry, cp);
+    NS_PUT16(slen, cp);
+    if (slen > 0)
+        memcpy(cp, g->log_target, slen);
+    return VAL_NO_ERROR;
+}
+
+static int
+policy_image_add_fragment(struct policy_image_buf *img, int line_number,
+                          struct policy_fragment *pfrag)
+{
+    const char *keyword = conf_elem_array[pfrag->index].keyword;
+    size_t label_len = strlen(pfrag->label);
+    size_t kw_len = strlen(keyword);
+    size_t len, plen;
+    u_int32_t count = 0;
+    policy_entry_t *pe;
+    u_char *cp;
+    int retval;
+
+    if (label_len > 0xffff || kw_len > 0xff)
+        return VAL_CONF_PARSE_ERROR;
+
+    len = NS_INT16SZ + label_len + 1 + kw_len + NS_INT32SZ;
+    for (pe = pfrag->pol; pe; pe = pe->next) {
+        if (VAL_NO_ERROR != 
+                (retval = conf_elem_array[pfrag->index].pack(pe, NULL, &plen)))
+            return retval;
+        if (plen > 0xffff)
+            return VAL_CONF_PARSE_ERROR;
+        len += wire_name_length(pe->zone_n) + NS_INT16SZ + plen;
+        count++;
+    }
+
+    cp = policy_image_add_record(img, POL_IMAGE_REC_FRAGMENT, line_number, len);
+    if (cp == NULL)
+        return VAL_OUT_OF_MEMORY;
+    NS_PUT16(label_len, cp);
+    memcpy(cp, pfrag->label, label_len);
+    cp += label_len;
+    *cp++ = (u_char) kw_len;
+    memcpy(cp, keyword, kw_len);
+    cp += kw_len;
+    NS_PUT32(count, cp);
+    for (pe = pfrag->pol; pe; pe = pe->next) {
+        len = wire_name_length(pe->zone_n);
+        memcpy(cp, pe->zone_n, len);
+        cp += len;
+        conf_elem_array[pfrag->index].pack(pe, NULL, &plen);
+        NS_PUT16(plen, cp);
+        if (VAL_NO_ERROR != 
+                (retval = conf_elem_array[pfrag->index].pack(pe, cp, &plen)))
+            return retval;
+        cp += plen;
+    }
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Compile the validator configuration file dnsval_conf (the 
+ * system dnsval.conf if NULL) into a policy image.  If image is 
+ * NULL the image is written next to dnsval_conf, where 
+ * read_val_config_file() looks for it.  Files named in include
+ * directives are not followed; each one has its own image.
+ */
+int
+val_policy_compile(const char *dnsval_conf, const char *image)
+{
+    char *conf = NULL;
+    char *image_name = NULL;
+    char *tmp_name = NULL;
+    int fd = -1;
+    struct stat sb;
+    char *buf = NULL;
+    char *buf_ptr, *end_ptr;
+    char token[TOKEN_MAX];
+    int endst = 0;
+    int line_number = 1;
+    int g_opt_seen = 0;
+    int include_seen = 0;
+    struct policy_fragment *pol_frag = NULL;
+    struct policy_image_buf img;
+    u_char *cp;
+    size_t off;
+    int retval;
+
+    memset(&img, 0, sizeof(img));
+
+    if (dnsval_conf == NULL) {
+        conf = dnsval_conf_get();
+        if (conf == NULL)
+            return VAL_OUT_OF_MEMORY;
+        dnsval_conf = conf;
+    }
+
+    fd = open(dnsval_conf, O_RDONLY);
+    if (fd < 0) {
+        val_log(NULL, LOG_ERR, 
+                "val_policy_compile(): Could not open validator conf file for reading: %s",
+                dnsval_conf);
+        retval = VAL_CONF_NOT_FOUND;
+        goto err;
+    }
+    if (0 != fstat(fd, &sb)) {
+        retval = VAL_CONF_NOT_FOUND;
+        goto err;
+    }
+    buf = (char *) MALLOC (sb.st_size + 1);
+    if (buf == NULL) {
+        retval = VAL_OUT_OF_MEMORY;
+        goto err;
+    }
+    if (read(fd, buf, sb.st_size) != (int) sb.st_size) {
+        val_log(NULL, LOG_ERR, "val_policy_compile(): Could not read validator conf file: %s",
+                dnsval_conf);
+        retval = VAL_CONF_NOT_FOUND;
+        goto err;
+    }
+    close(fd);
+    fd = -1;
+
+    if (NULL == policy_image_reserve(&img, POL_IMAGE_HDR_LEN)) {
+        retval = VAL_OUT_OF_MEMORY;
+        goto err;
+    }
+
+    /* 
+     * A NULL scope makes every fragment relevant; the scope is
+     * applied when the image is read.
+     */
+    buf_ptr = buf;
+    end_ptr = buf + sb.st_size;
+    while (buf_ptr < end_ptr) {
+        if (VAL_NO_ERROR != (retval =
+                get_next_policy_fragment(&buf_ptr, end_ptr, NULL, &pol_frag, 
+                                         &line_number, &g_opt_seen, 
+                                         &include_seen))) 
+            goto parse_err;
+
+        if (g_opt_seen) {
+            val_global_opt_t *gt_opt = NULL;
+            g_opt_seen = 0;
+            if (VAL_NO_ERROR != (retval =
+                    get_global_options(&buf_ptr, end_ptr, 
+                                       &line_number, &gt_opt)))
+                goto parse_err;
+            retval = policy_image_add_gopt(&img, line_number, gt_opt);
+            free_global_options(gt_opt);
+            FREE(gt_opt);
+            if (retval != VAL_NO_ERROR)
+                goto parse_err;
+        } else if (include_seen) {
+            include_seen = 0;
+            if (VAL_NO_ERROR != (retval = 
+                    val_get_token(&buf_ptr, end_ptr, &line_number, 
+                                  token, sizeof(token), &endst,
+                                  CONF_COMMENT, CONF_END_STMT, 0)))
+                goto parse_err;
+            if ((endst && (strlen(token) == 0)) || (buf_ptr >= end_ptr)) { 
+                retval = VAL_CONF_PARSE_ERROR;
+                goto parse_err;
+            }
+            cp = policy_image_add_record(&img, POL_IMAGE_REC_INCLUDE, 
+                                         line_number, strlen(token));
+            if (cp == NULL) {
+                retval = VAL_OUT_OF_MEMORY;
+                goto err;
+            }
+            memcpy(cp, token, strlen(token));
+        } else if (pol_frag) {
+            retval = policy_image_add_fragment(&img, line_number, pol_frag);
+            FREE(pol_frag->label);
+            free_policy_entry(pol_frag->pol, pol_frag->index);
+            FREE(pol_frag);
+            pol_frag = NULL;
+            if (retval != VAL_NO_ERROR)
+                goto parse_err;
+        }
+    }
+
+    cp = img.data;
+    memcpy(cp, POL_IMAGE_MAGIC, strlen(POL_IMAGE_MAGIC));
+    cp += strlen(POL_IMAGE_MAGIC);
+    NS_PUT16(POL_IMAGE_VERSION, cp);
+    NS_PUT16(0, cp);
+    NS_PUT32((u_int64_t) sb.st_mtime >> 32, cp);
+    NS_PUT32((u_int64_t) sb.st_mtime & 0xffffffff, cp);
+    NS_PUT32((u_int64_t) sb.st_size >> 32, cp);
+    NS_PUT32((u_int64_t) sb.st_size & 0xffffffff, cp);
+    NS_PUT32(img.nrec, cp);
+    NS_PUT32(img.len, cp);
+    NS_PUT32(policy_image_checksum(img.data + POL_IMAGE_HDR_LEN,
+                                   img.len - POL_IMAGE_HDR_LEN), cp);
+
+    /* 
+     * Write to a temporary file and rename it, so that readers
+     * never see a partial image 
+     */
+    image_name = image ? strdup(image) : policy_image_name(dnsval_conf);
+    if (image_name == NULL) {
+        retval = VAL_OUT_OF_MEMORY;
+        goto err;
+    }
+    tmp_name = (char *) MALLOC(strlen(image_name) + sizeof(".tmp"));
+    if (tmp_name == NULL) {
+        retval = VAL_OUT_OF_MEMORY;
+        goto err;
+    }
+    sprintf(tmp_name, "%s.tmp", image_name);
+
+    fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        val_log(NULL, LOG_ERR, 
+                "val_policy_compile(): Could not create policy image: %s",
+                tmp_name);
+        retval = VAL_INTERNAL_ERROR;
+        goto err;
+    }
+    for (off = 0; off < img.len; ) {
+        int n = write(fd, img.data + off, img.len - off);
+        if (n <= 0) {
+            val_log(NULL, LOG_ERR, 
+                    "val_policy_compile(): Could not write policy image: %s",
+                    tmp_name);
+            retval = VAL_INTERNAL_ERROR;
+            goto err;
+        }
+        off += n;
+    }
+    close(fd);
+    fd = -1;
+#ifdef WIN32
+    unlink(image_name);
+#endif
+    if (0 != rename(tmp_name, image_name)) {
+        val_log(NULL, LOG_ERR, 
+                "val_policy_compile(): Could not rename %s to %s",
+                tmp_name, image_name);
+        unlink(tmp_name);
+        retval = VAL_INTERNAL_ERROR;
+        goto err;
+    }
+
+    val_log(NULL, LOG_INFO, 
+            "val_policy_compile(): Compiled %s into %s (%d records)",
+            dnsval_conf, image_name, img.nrec);
+    retval = VAL_NO_ERROR;
+    goto err;
+
+parse_err:
+    val_log(NULL, LOG_ERR, "val_policy_compile(): Error in line %d of %s", 
+            line_number, dnsval_conf);
+err:
+    if (pol_frag) {
+        FREE(pol_frag->label);
+        free_policy_entry(pol_frag->pol, pol_frag->index);
+        FREE(pol_frag);
+    }
+    if (fd != -1) {
+        close(fd);
+        if (tmp_name)
+            unlink(tmp_name);
+    }
+    if (img.data)
+        FREE(img.data);
+    if (buf)
+        FREE(buf);
+    if (tmp_name)
+        FREE(tmp_name);
+    if (image_name)
+        FREE(image_name);
+    if (conf)
+        FREE(conf);
+    return retval;
+}
+
 void
 destroy_respol(val_context_t * ctx)
 {
@@ -3057,6 +4710,7 @@ val_add_valpolicy(val_context_t *context,
     u_char zone_n[NS_MAXCDNAME];
     int line_number;
     int endst = 0;
+    int retval;
     struct timeval  tv;
     long ttl_x;
     char *buf_ptr, *end_ptr;
@@ -3140,6 +4794,25 @@ val_add_valpolicy(val_context_t *context,
 
     /* Merge this policy into the context */
     STORE_POLICY_ENTRY_IN_LIST(pol_entry, ctx->e_pol[index]);
+    pol_entry = (*pol)->pe;
+
+    if (VAL_NO_ERROR != (retval = rebuild_policy_trie(ctx, index, NULL))) {
+        /* take the policy out again */
+        policy_entry_t *p, *prev = NULL;
+        for (p = ctx->e_pol[index]; p && p != pol_entry; p = p->next)
+            prev = p;
+        if (prev)
+            prev->next = pol_entry->next;
+        else
+            ctx->e_pol[index] = pol_entry->next;
+        pol_entry->next = NULL;
+        free_policy_entry(pol_entry, index);
+        FREE(*pol);
+        *pol = NULL;
+        CTX_UNLOCK_ACACHE(ctx);
+        CTX_UNLOCK_POL(ctx);
+        return retval;
+    }
 
     /* Flush queries that match this name */
     for(q=ctx->q_list; q; q=q->qc_next) {
@@ -3193,17 +4866,22 @@ val_remove_valpolicy(val_context_t *context, val_policy_handle_t *pol)
     }
     p->next = NULL;
 
-    /* free the policy */
-    conf_elem_array[pol->index].free(p);
+    /* 
+     * readers may still be looking at the policy, so it is freed
+     * along with the trie it was in
+     */
+    if (VAL_NO_ERROR != (retval = rebuild_policy_trie(ctx, pol->index, p))) {
+        STORE_POLICY_ENTRY_IN_LIST(p, ctx->e_pol[pol->index]);
+        goto err;
+    }
     
     /* Flush queries that match this name */
     for(q=ctx->q_list; q; q=q->qc_next) {
-        if (NULL != namename(q->qc_name_n, p->zone_n)) {
+        if (NULL != namename(q->qc_name_n, pol->pe->zone_n)) {
             q->qc_flags |= VAL_QUERY_MARK_FOR_DELETION;
         }
     }
 
-    FREE(p);
     FREE(pol);
     
     retval = VAL_NO_ERROR;
@@ -19,6 +19,24 @@
 #define POL_GLOBAL_OPTIONS_STR "global-options"
 #define POL_INCLUDE_STR "include"
 
+/*
+ * Compiled policy images, see val_policy_compile().  All integers
+ * are in network byte order.
+ *
+ * header: magic(4) version(2) unused(2) source-mtime(8) 
+ *         source-size(8) record-count(4) image-length(4)
+ *         checksum(4, FNV-1a over the records)
+ * record: type(1) line(4) length(4) data(length)
+ */
+#define POL_IMAGE_SUFFIX        ".bin"
+#define POL_IMAGE_MAGIC         "DVPI"
+#define POL_IMAGE_VERSION       1
+#define POL_IMAGE_HDR_LEN       36
+#define POL_IMAGE_REC_HDR_LEN   9
+#define POL_IMAGE_REC_GOPT      1   /* global-options */
+#define POL_IMAGE_REC_INCLUDE   2   /* include, file name not expanded */
+#define POL_IMAGE_REC_FRAGMENT  3   /* label, keyword, entries */
+
 #define P_TRUST_ANCHOR              0
 #define P_CLOCK_SKEW                1
 #define P_PROV_INSECURE             2
@@ -49,39 +67,29 @@
 #define ZONE_SE_DO_VAL 2
 #define ZONE_SE_UNTRUSTED 3
 
+/*
+ * Expired policies are dropped by expire_policies() when the context
+ * is refreshed, not here.
+ */
 #define RETRIEVE_POLICY(ctx, index, pol) do {\
     pol = (ctx == NULL) ? NULL :\
           (!ctx->e_pol[index])? NULL:(ctx->e_pol[index]);\
-    /* check if policies are still the same */\
-    if (pol) {\
-        policy_entry_t *cur, *next, *prev;\
-        struct timeval  tv;\
-        /* Get current time */\
-        gettimeofday(&tv, NULL);\
-        /* Remove expired policies */\
-        prev = NULL;\
-        cur = pol;\
-        while (cur) {\
-            next = cur->next;\
-            if (cur->exp_ttl > 0 &&\
-                cur->exp_ttl <= tv.tv_sec) {\
-                if (prev) {\
-                    prev->next = next;\
-                } else {\
-                    pol = next;\
-                }\
-                cur->next = NULL;\
-                free_policy_entry(cur, index);\
-                cur = next;\
-            } else {\
-                prev = cur;\
-                cur = cur->next;\
-            }\
-        }\
-    }\
 } while(0)
+
+#define POL_EXPIRED(pe, now) ((pe)->exp_ttl > 0 && (pe)->exp_ttl <= (now))
+#define POLICY_USABLE(pe, now) ((pe)->pol != NULL && !POL_EXPIRED(pe, now))
     
 int             free_policy_entry(policy_entry_t *pol_entry, int index);
+int             rebuild_policy_trie(val_context_t *ctx, int index,
+                                    policy_entry_t *dead);
+int             build_policy_tries(val_context_t *ctx);
+void            destroy_policy_tries(val_context_t *ctx);
+void            expire_policies(val_context_t *ctx);
+policy_entry_t **find_zone_policies(val_context_t *ctx, int index,
+                                    u_char *name_n, u_char **matched,
+                                    long *now);
+policy_entry_t *find_zone_policy(val_context_t *ctx, int index,
+                                 u_char *name_n, u_char **matched);
 int             read_root_hints_file(val_context_t * ctx);
 int             read_res_config_file(val_context_t * ctx);
 int             read_val_config_file(val_context_t * ctx, const char *scope);
@@ -91,19 +99,31 @@ struct hosts   *parse_etc_hosts(const char *name);
 
 int             parse_trust_anchor(char **, char *, policy_entry_t *, int *, int *);
 int             free_trust_anchor(policy_entry_t *);
+int             pack_trust_anchor(policy_entry_t *, u_char *, size_t *);
+int             unpack_trust_anchor(const u_char *, size_t, policy_entry_t *);
 int             parse_clock_skew(char **, char *, policy_entry_t *, int *, int *);
 int             free_clock_skew(policy_entry_t *);
+int             pack_clock_skew(policy_entry_t *, u_char *, size_t *);
+int             unpack_clock_skew(const u_char *, size_t, policy_entry_t *);
 int             parse_prov_insecure_status(char **, char *, policy_entry_t *, int *, int *);
 int             free_prov_insecure_status(policy_entry_t *);
+int             pack_prov_insecure_status(policy_entry_t *, u_char *, size_t *);
+int             unpack_prov_insecure_status(const u_char *, size_t, policy_entry_t *);
 int             parse_zone_security_expectation(char **, char *, policy_entry_t *, int *, int *);
 int             free_zone_security_expectation(policy_entry_t *);
+int             pack_zone_security_expectation(policy_entry_t *, u_char *, size_t *);
+int             unpack_zone_security_expectation(const u_char *, size_t, policy_entry_t *);
 #ifdef LIBVAL_NSEC3
 int             parse_nsec3_max_iter(char **, char *, policy_entry_t * pol_entry, int *line_number, int *);
 int             free_nsec3_max_iter(policy_entry_t * pol_entry);
+int             pack_nsec3_max_iter(policy_entry_t *, u_char *, size_t *);
+int             unpack_nsec3_max_iter(const u_char *, size_t, policy_entry_t *);
 #endif
 #ifdef LIBVAL_DLV
 int             parse_dlv_trust_points(char **, char *, policy_entry_t *, int *, int *);
 int             free_dlv_trust_points(policy_entry_t *);
+int             pack_dlv_trust_points(policy_entry_t *, u_char *, size_t *);
+int             unpack_dlv_trust_points(const u_char *, size_t, policy_entry_t *);
 #endif
 int             check_relevance(const char *label, const char *scope,
                                 int *label_count, int *relevant);
@@ -141,6 +161,8 @@ struct policy_conf_element {
     const char     *keyword;
     int             (*parse) (char **, char *, policy_entry_t *, int *, int *);
     int             (*free) (policy_entry_t *);
+    int             (*pack) (policy_entry_t *, u_char *, size_t *);
+    int             (*unpack) (const u_char *, size_t, policy_entry_t *);
 };
 
 extern const struct policy_conf_element conf_elem_array[];
@@ -148,6 +170,14 @@ extern const struct policy_conf_element conf_elem_array[];
 struct trust_anchor_policy {
     val_dnskey_rdata_t *publickey;
     val_ds_rdata_t *ds;
+    /* 
+     * pre-digested, so that is_trusted_key() can compare DNSKEYs
+     * without parsing them 
+     */
+    u_int16_t       key_tag;
+    u_char          algorithm;
+    u_char         *rdata;      /* wire format of publickey */
+    size_t          rdata_len;
 };
 
 struct clock_skew_policy {
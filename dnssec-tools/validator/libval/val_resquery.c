@@ -821,6 +821,8 @@ done:
         ns->ns_options |= SR_QUERY_VALIDATING_STUB_FLAGS;
         ns->ns_retrans = timeout;
         ns->ns_retry = retry;
+        if (next_q->qc_flags & VAL_QUERY_NO_EDNS0_FALLBACK)
+            ns->ns_options |= SR_QUERY_NO_EDNS0_FALLBACK;
     }
 
     return VAL_NO_ERROR;
@@ -1992,6 +1994,8 @@ digest_response(val_context_t * context,
                 val_log(context, LOG_DEBUG, "digest_response(): {%s %s(%d) %s(%d)} appears to lead to a lame server",
                         query_name_p, p_class(query_class_h), query_class_h,
                         p_type(query_type_h), query_type_h);
+                if (resp_ns && resp_ns->ns_number_of_addresses > 0)
+                    res_caps_set_lame(resp_ns->ns_address[0]);
                 matched_q->qc_state = Q_REFERRAL_ERROR;
                 ret_val = VAL_NO_ERROR;
                 goto done;
@@ -2546,6 +2550,12 @@ val_resquery_async_send(val_context_t * context,
                                             matched_q->qc_ns_list);
     if (!matched_q->qc_ea)
         matched_q->qc_state = Q_QUERY_ERROR;
+    else if (context) {
+        if (context->as_poller)
+            res_async_query_set_poller(matched_q->qc_ea, context->as_poller);
+        if (context->as_timers)
+            res_async_query_set_timers(matched_q->qc_ea, context->as_timers);
+    }
 
     return VAL_NO_ERROR;
 }
@@ -2568,8 +2578,7 @@ val_resquery_async_rcv(val_context_t * context,
     struct val_query_chain *matched_q;
     int             ret_val, handled;
 
-    if ((matched_qfq == NULL) || (response == NULL) || (queries == NULL) ||
-        (pending_desc == NULL))
+    if ((matched_qfq == NULL) || (response == NULL) || (queries == NULL))
         return VAL_BAD_ARGUMENT;
 
     val_log(NULL, LOG_DEBUG, __FUNCTION__);
@@ -2577,7 +2586,7 @@ val_resquery_async_rcv(val_context_t * context,
     matched_q = matched_qfq->qfq_query; /* ! NULL if matched_qfq ! NULL */
     *response = NULL;
 
-    /** check for a response */
+    /** check for a response (pending_desc NULL: use poller state) */
     ret_val = res_async_query_handle(matched_q->qc_ea, &handled, pending_desc);
     if (ret_val == SR_NO_ANSWER_YET)
         return VAL_NO_ERROR;
@@ -2625,7 +2634,8 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
     val_async_status *as;
     struct queries_for_query *qfq;
     val_context_t *context;
-    struct timeval   now, closest, *closest_event = &closest;
+    struct timeval   now, closest, next, *closest_event = &closest;
+    int              use_timers;
 #ifndef VAL_NO_THREADS
     pthread_t                 self = pthread_self();
 #endif
@@ -2658,6 +2668,14 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
 
     CTX_LOCK_ACACHE(context);
 
+    /*
+     * if the caller doesn't need an fd_set, the sockets are already in
+     * the context poller and the closest deadline is at the top of the
+     * deadline queue, so queries don't need to be looked at one by one.
+     */
+    use_timers = (NULL == activefds) && (NULL == nfds) &&
+        (NULL != context->as_timers);
+
     for (as = context->as_list; as; as = as->val_as_next) {
 
         int cache_only = 1;
@@ -2672,9 +2690,24 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
             closest.tv_usec = 0;
             continue;
         }
+        if (closest_event && timerisset(&as->val_as_deadline) &&
+            timercmp(&as->val_as_deadline, closest_event, <))
+            memcpy(closest_event, &as->val_as_deadline,
+                   sizeof(struct timeval));
+        /* the request it waits on has the queries */
+        if (as->val_as_primary)
+            continue;
         for (qfq = as->val_as_queries; qfq; qfq = qfq->qfq_next) {
 
             char         name_p[NS_MAXDNAME];
+            if (use_timers) {
+                if (qfq->qfq_query->qc_ea &&
+                    !(qfq->qfq_query->qc_flags & VAL_QUERY_SKIP_RESOLVER)) {
+                    cache_only = 0;
+                    break;
+                }
+                continue;
+            }
             if (-1 == ns_name_ntop(qfq->qfq_query->qc_name_n, name_p, sizeof(name_p)))
                 snprintf(name_p, sizeof(name_p), "unknown/error");
             if (!qfq->qfq_query->qc_ea || (qfq->qfq_query->qc_flags & VAL_QUERY_SKIP_RESOLVER)) {
@@ -2700,6 +2733,11 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
         }
     }
 
+    if (use_timers && closest_event && timerisset(closest_event) &&
+        (0 == res_timers_next(context->as_timers, &next)) &&
+        timercmp(&next, closest_event, <))
+        memcpy(closest_event, &next, sizeof(next));
+
     CTX_UNLOCK_ACACHE(context);
     CTX_UNLOCK_POL(context);
 
@@ -2721,5 +2759,36 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
     return VAL_NO_ERROR;
 }
 
+/*
+ * fd_set free alternative to val_async_select_info.
+ *
+ * pollfd is set to a descriptor which becomes readable when a response
+ * for any pending async request arrives, or -1 if there is no such
+ * descriptor (in which case val_async_check_poll must be used to wait).
+ * timeout is a relative value, as for val_async_select_info.
+ */
+int
+val_async_poll_info(val_context_t *ctx, int *pollfd, struct timeval *timeout)
+{
+    val_context_t *context;
+    int            retval = VAL_NO_ERROR;
+
+    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
+    if (NULL == context)
+        return VAL_BAD_ARGUMENT;
+
+    if (pollfd) {
+        CTX_LOCK_ACACHE(context);
+        *pollfd = res_poller_fd(context->as_poller);
+        CTX_UNLOCK_ACACHE(context);
+    }
+
+    if (timeout)
+        retval = val_async_select_info(context, NULL, NULL, timeout);
+
+    CTX_UNLOCK_POL(context);
+
+    return retval;
+}
 
 #endif /* VAL_NO_ASYNC */
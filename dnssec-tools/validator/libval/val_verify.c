@@ -28,54 +28,20 @@ get_clock_skew(val_context_t *ctx,
                int *skew,
                u_int32_t *ttl_x)
 {
-    policy_entry_t *cs_pol, *cs_cur;
-    u_char       *p;
-    size_t       name_len;
+    policy_entry_t *cs_pol;
 
     if (ctx == NULL || name_n == NULL || skew == NULL || ttl_x == NULL) {
         val_log(ctx, LOG_DEBUG, "get_clock_skew(): Cannot check for clock skew policy, bad args"); 
         return; 
     }
     
-    RETRIEVE_POLICY(ctx, P_CLOCK_SKEW, cs_pol);
+    cs_pol = find_zone_policy(ctx, P_CLOCK_SKEW, name_n, NULL);
     if (cs_pol) {
-
-        name_len = wire_name_length(name_n);
-
-        for (cs_cur = cs_pol;
-             cs_cur && (wire_name_length(cs_cur->zone_n) > name_len);
-             cs_cur = cs_cur->next);
-        /*
-         * for all zones which are shorter or as long, do a strstr 
-         */
-        /*
-         * Because of the ordering, the longest match is found first 
-         */
-        for (; cs_cur; cs_cur = cs_cur->next) {
-            int             root_zone = 0;
-            if (!namecmp(cs_cur->zone_n, (const u_char *) ""))
-                root_zone = 1;
-            else {
-                /*
-                 * Find the last occurrence of cs_cur->zone_n in name_n 
-                 */
-                p = name_n;
-                while (p && (*p != '\0')) {
-                    if (!namecmp(p, cs_cur->zone_n))
-                        break;
-                    p = p + *p + 1;
-                }
-            }
-            if (root_zone || (!namecmp(p, cs_cur->zone_n))) {
-                val_log(ctx, LOG_DEBUG, "get_clock_skew(): Found clock skew policy"); 
-                if (cs_cur->pol) {
-                    *skew = ((struct clock_skew_policy *)(cs_cur->pol))->clock_skew;
-                    if (cs_cur->exp_ttl > 0)
-                        *ttl_x = cs_cur->exp_ttl;
-                    return;
-                }
-            }
-        }
+        val_log(ctx, LOG_DEBUG, "get_clock_skew(): Found clock skew policy"); 
+        *skew = ((struct clock_skew_policy *)(cs_pol->pol))->clock_skew;
+        if (cs_pol->exp_ttl > 0)
+            *ttl_x = cs_pol->exp_ttl;
+        return;
     }
     val_log(ctx, LOG_DEBUG, "get_clock_skew(): No clock skew policy found"); 
     *skew = 0;
@@ -84,7 +50,7 @@ get_clock_skew(val_context_t *ctx,
 /*
  * Verify a signature, given the data and the dnskey 
  */
-static int 
+int 
 val_sigverify(val_context_t * ctx,
               int is_a_wildcard,
               const u_char *data,
@@ -284,7 +250,7 @@ predict_sigbuflength(struct rrset_rec *rr_set,
 /*
  * Create the buffer over which the signature is to be verified
  */
-static int
+int
 make_sigfield(u_char ** field,
               size_t * field_length,
               struct rrset_rec *rr_set,
@@ -48,6 +48,29 @@ int             ds_hash_is_equal(val_context_t *ctx,
      (key1)->public_key_len == (key2)->public_key_len &&\
      !memcmp((key1)->public_key, (key2)->public_key, (key1)->public_key_len))
 
+/*
+ * Verify a signature, given the data and the dnskey.
+ * A negative clock_skew disables the inception/expiration checks.
+ */
+int             val_sigverify(val_context_t * ctx,
+                              int is_a_wildcard,
+                              const u_char *data,
+                              size_t data_len,
+                              const val_dnskey_rdata_t * dnskey,
+                              const val_rrsig_rdata_t * rrsig,
+                              val_astatus_t * dnskey_status,
+                              val_astatus_t * sig_status,
+                              int clock_skew);
+
+/*
+ * Create the buffer over which the signature is to be verified.
+ * The caller must FREE() *field.
+ */
+int             make_sigfield(u_char ** field,
+                              size_t * field_length,
+                              struct rrset_rec *rr_set,
+                              struct rrset_rr *rr_sig, int is_a_wildcard);
+
 /*
  * The Verifier Function.
  */
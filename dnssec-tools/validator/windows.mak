@@ -36,6 +36,11 @@ LIBSRES_OBJS = $(TMP_LIBSRES_D)\base64.obj \
 	$(TMP_LIBSRES_D)\res_comp.obj \
 	$(TMP_LIBSRES_D)\res_debug.obj \
 	$(TMP_LIBSRES_D)\res_io_manager.obj \
+	$(TMP_LIBSRES_D)\res_io_poll.obj \
+	$(TMP_LIBSRES_D)\res_addr_cache.obj \
+	$(TMP_LIBSRES_D)\res_rtt.obj \
+	$(TMP_LIBSRES_D)\res_caps.obj \
+	$(TMP_LIBSRES_D)\res_timer.obj \
 	$(TMP_LIBSRES_D)\res_mkquery.obj \
 	$(TMP_LIBSRES_D)\res_query.obj \
 	$(TMP_LIBSRES_D)\res_support.obj \
@@ -45,6 +50,7 @@ LIBSRES_DLL = $(OUT_D)\libsres.dll
 
 LIBVAL_OBJS = $(TMP_LIBVAL_D)\dllmain.obj \
 	$(TMP_LIBVAL_D)\val_assertion.obj \
+	$(TMP_LIBVAL_D)\val_async_engine.obj \
 	$(TMP_LIBVAL_D)\val_cache.obj \
 	$(TMP_LIBVAL_D)\val_context.obj \
 	$(TMP_LIBVAL_D)\val_crypto.obj \